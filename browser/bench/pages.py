@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""Benchmark pages for the mthl command line tool.
+
+    pages.py make DIR         writes the generated pages into DIR
+    pages.py feed FILE RATE   copies FILE to stdout at RATE bytes a second
+    pages.py first            reads stdin and reports when the first and
+                              last lines arrived
+
+script.mthl and c1.mthl sit next to this script and are not generated.
+"""
+import sys
+import time
+
+MB = 1024 * 1024
+
+
+def big():
+    """2000 containers, each after a var: a 153 KB static page"""
+    lines = ['page "big" |<']
+    for i in range(2000):
+        lines.append('var v%d = %d; container |< position(%d, y, 50%%, 20); fill(colors[%d]); >|'
+                     % (i % 300, i, i, i % 3))
+    lines.append('>|')
+    return lines
+
+
+def mixed():
+    """2000 containers with a text each; every 100th is sized by the window"""
+    lines = ['page "mixed" |<']
+    for i in range(2000):
+        if i % 100 == 0:
+            position = '0, %d, 50%%, 20%%' % i
+        else:
+            position = '%d, %d, 300, 40' % (i % 7 * 10, i * 40)
+        lines.append('  container |< position(%s); background(#112233); '
+                     'text |< position(4, 4, 90%%, 30); content("item %d"); >| >|' % (position, i))
+    lines.append('>|')
+    return lines
+
+
+def corpus():
+    """64 MB of blocks with comments, properties and names: token dense"""
+    lines = ['page "Corpus" |<', '    /^ generated large page ^\\',
+             '    var colors = ["#112233", "#445566", "#778899"];']
+    i = 0
+    total = 0
+    while total < 64 * MB:
+        block = ('    container |<\n'
+                 '        /^ block %d ^\\\n'
+                 '        position(%d, %d, 50%%, 20%%);\n'
+                 '        background(colors[%d]);\n'
+                 '        text |< content("Item number %d with some descriptive text, long enough '
+                 'to be realistic"); font("Sans", 12, "bold"); color(#%06x); >|\n'
+                 '        var total_%d = %d * 2 + width;\n'
+                 '    >|' % (i, i % 100, i % 37, i % 3, i, i % 0xffffff, i, i))
+        lines.append(block)
+        total += len(block)
+        i += 1
+    lines.append('>|')
+    return lines
+
+
+def text():
+    """64 MB of string literals: text heavy. Lexes, but is not a page."""
+    literal = '"Item number 5 with some descriptive text, long enough to be realistic" '
+    return [literal * (64 * MB // len(literal))]
+
+
+def deep():
+    """200 containers, each nested in the one before: deeper than any fixed stack"""
+    lines = ['page "deep" |<']
+    for i in range(200):
+        lines.append('container |< position(1, 1, 100%% - 2, 100%% - 2); text |< content("level %d"); >|' % i)
+    lines.append('>|' * 200)
+    lines.append('>|')
+    return lines
+
+
+PAGES = {'big': big, 'deep': deep, 'mixed': mixed, 'corpus': corpus, 'text': text}
+
+
+def make(directory):
+    for name, generate in PAGES.items():
+        with open('%s/%s.mthl' % (directory, name), 'w') as page:
+            page.write('\n'.join(generate()) + '\n')
+
+
+def feed(path, rate):
+    data = open(path, 'rb').read()
+    out = sys.stdout.buffer
+    for i in range(0, len(data), 4096):
+        out.write(data[i:i + 4096])
+        out.flush()
+        time.sleep(4096 / rate)
+
+
+def first():
+    start = time.time()
+    first_at = None
+    count = 0
+    for _ in sys.stdin:
+        if first_at is None:
+            first_at = time.time() - start
+        count += 1
+    print('first line %.3fs, last %.3fs, %d lines' % (first_at or -1, time.time() - start, count))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) == 3 and sys.argv[1] == 'make':
+        make(sys.argv[2])
+    elif len(sys.argv) == 4 and sys.argv[1] == 'feed':
+        feed(sys.argv[2], int(sys.argv[3]))
+    elif len(sys.argv) == 2 and sys.argv[1] == 'first':
+        first()
+    else:
+        sys.exit(__doc__)
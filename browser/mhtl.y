@@ -1,44 +1,87 @@
 /* mthl.y - Grammar for MTHL */
 %{
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "mthl_ast.h"  /* AST nodes definitions */
+#include "mthl_runtime.h"
+#include "mthl_image.h"
+#include "mthl_lex.h"
+#include "mthl_edit.h"
+#include "mthl_stream.h"
+#include "mthl_layout.h"
+#include "mthl_display.h"
 
-extern int yylex();
-extern int yyparse();
-extern FILE *yyin;
+/* Root of the AST, or of the block contents parsed after a
+ * FRAGMENT_* start token */
+ast_index_t ast_root = AST_NONE;
+ast_index_t ast_fragment = AST_NONE;
 
-void yyerror(const char *s);
+/* The page being parsed, from the moment its header has been. Its
+ * statements are linked in one by one as they are reduced. */
+ast_index_t ast_page = AST_NONE;
 
-/* Root of the AST */
-ASTNode *ast_root = NULL;
+/* Locations are byte offsets into the source */
+#define YYLLOC_DEFAULT(current, rhs, n)                     \
+    do {                                                    \
+        if (n) {                                            \
+            (current).start = YYRHSLOC(rhs, 1).start;       \
+            (current).end = YYRHSLOC(rhs, n).end;           \
+        } else {                                            \
+            (current).start = (current).end = YYRHSLOC(rhs, 0).end; \
+        }                                                   \
+    } while (0)
 %}
 
+%locations
+%define api.location.type {ast_location_t}
+
+/* yyparse pulls tokens from yylex; a page arriving in pieces is pushed
+ * a token at a time through yypush_parse instead (mthl_stream.c) */
+%define api.pure full
+%define api.push-pull both
+
+/* Semantic values are node indices and symbol ids, so the token
+ * header needs the AST types too */
+%code requires {
+#include "mthl_ast.h"
+}
+
+%code provides {
+int yylex(YYSTYPE *value, YYLTYPE *location);
+void yyerror(YYLTYPE *location, const char *s);
+}
+
 /* Declare types for semantic values */
 %union {
     int ival;
-    char *sval;
-    struct ASTNode *node;
-    struct ASTNodeList *nodelist;
+    uint32_t sval;          /* Interned symbol id */
+    ast_index_t node;
+    ast_index_t nodelist;
+    ast_chain_t chain;
 }
 
 /* Define tokens */
 %token PAGE CONTAINER TEXT RECTANGLE BUTTON
-%token VAR IF ELSE FOR
+%token VAR CONST IF ELSE FOR
 %token POSITION BACKGROUND CONTENT FONT COLOR FILL ALIGN ONCLICK REDRAW
 %token LBRACE RBRACE LPAREN RPAREN LBRACKET RBRACKET
-%token SEMICOLON COMMA ASSIGN DOT
+%token SEMICOLON COMMA ASSIGN DOT COLON
 %token PLUS MINUS MULTIPLY DIVIDE
 %token GT LT GE LE EQ NE AND OR NOT
+%token FRAGMENT_STATEMENTS FRAGMENT_PROPERTIES  /* Never in source; see mthl_edit.c */
 %token <ival> INTEGER PERCENTAGE
 %token <sval> IDENTIFIER STRING_LITERAL COLOR_HEX
 
 /* Define non-terminal types */
-%type <node> program page_def statement statement_list expression
+%type <node> program page_def statement expression
 %type <node> container_def text_def rectangle_def button_def
-%type <node> var_declaration assignment if_statement for_statement
-%type <node> property property_list event_handler
+%type <node> var_declaration const_declaration assignment if_statement for_statement
+%type <node> property event_handler
+%type <chain> statement_list property_list page_statements
 %type <nodelist> expression_list
 
 /* Define precedence */
@@ -54,20 +97,44 @@ ASTNode *ast_root = NULL;
 
 program
     : page_def { ast_root = $1; }
+    | FRAGMENT_STATEMENTS statement_list { ast_fragment = $2.first; }
+    | FRAGMENT_PROPERTIES property_list { ast_fragment = $2.first; }
     ;
 
 page_def
-    : PAGE STRING_LITERAL LBRACE statement_list RBRACE
-        { $$ = create_page_node($2, $4); }
+    : PAGE STRING_LITERAL LBRACE
+        { ast_page = create_page_node($2, AST_NONE); }
+      page_statements RBRACE
+        {
+            $$ = ast_page;
+            ast_set_block(ast_doc, $$, @3, @6);
+            ast_set_span(ast_doc, $$, @$);
+        }
+    ;
+
+/* A statement_list whose items join the page as soon as they are
+ * reduced, so a page still arriving can run the ones it has */
+page_statements
+    : statement
+        {
+            $$ = chain_start($1);
+            ast_node(ast_doc, ast_page)->first_child = $1;
+            ast_set_span(ast_doc, $1, @1);
+        }
+    | page_statements statement
+        { $$ = chain_statements($1, $2); ast_set_span(ast_doc, $2, @2); }
     ;
 
+/* Lists are left recursive, so the parser stack stays as deep as the
+ * nesting, however long a list is */
 statement_list
-    : statement { $$ = $1; }
-    | statement statement_list { $$ = chain_statements($1, $2); }
+    : statement { $$ = chain_start($1); ast_set_span(ast_doc, $1, @1); }
+    | statement_list statement { $$ = chain_statements($1, $2); ast_set_span(ast_doc, $2, @2); }
     ;
 
 statement
     : var_declaration SEMICOLON { $$ = $1; }
+    | const_declaration SEMICOLON { $$ = $1; }
     | assignment SEMICOLON { $$ = $1; }
     | if_statement { $$ = $1; }
     | for_statement { $$ = $1; }
@@ -82,6 +149,10 @@ var_declaration
     : VAR IDENTIFIER ASSIGN expression { $$ = create_var_decl_node($2, $4); }
     ;
 
+const_declaration
+    : IDENTIFIER COLON expression CONST { $$ = create_const_decl_node($1, $3); }
+    ;
+
 assignment
     : IDENTIFIER ASSIGN expression { $$ = create_assignment_node($1, $3); }
     | IDENTIFIER LBRACKET expression RBRACKET ASSIGN expression 
@@ -90,41 +161,51 @@ assignment
 
 if_statement
     : IF LPAREN expression RPAREN LBRACE statement_list RBRACE
-        { $$ = create_if_node($3, $6, NULL); }
+        {
+            $$ = create_if_node($3, $6.first, AST_NONE);
+            ast_set_block(ast_doc, ast_child(ast_doc, $$, 1), @5, @7);
+        }
     | IF LPAREN expression RPAREN LBRACE statement_list RBRACE 
       ELSE LBRACE statement_list RBRACE
-        { $$ = create_if_node($3, $6, $10); }
+        {
+            $$ = create_if_node($3, $6.first, $10.first);
+            ast_set_block(ast_doc, ast_child(ast_doc, $$, 1), @5, @7);
+            ast_set_block(ast_doc, ast_child(ast_doc, $$, 2), @9, @11);
+        }
     ;
 
 for_statement
     : FOR LPAREN var_declaration SEMICOLON expression SEMICOLON assignment RPAREN 
       LBRACE statement_list RBRACE
-        { $$ = create_for_node($3, $5, $7, $10); }
+        {
+            $$ = create_for_node($3, $5, $7, $10.first);
+            ast_set_block(ast_doc, ast_child(ast_doc, $$, 3), @9, @11);
+        }
     ;
 
 container_def
     : CONTAINER LBRACE property_list RBRACE
-        { $$ = create_container_node($3); }
+        { $$ = create_container_node($3.first); ast_set_block(ast_doc, $$, @2, @4); }
     ;
 
 text_def
     : TEXT LBRACE property_list RBRACE
-        { $$ = create_text_node($3); }
+        { $$ = create_text_node($3.first); ast_set_block(ast_doc, $$, @2, @4); }
     ;
 
 rectangle_def
     : RECTANGLE LBRACE property_list RBRACE
-        { $$ = create_rectangle_node($3); }
+        { $$ = create_rectangle_node($3.first); ast_set_block(ast_doc, $$, @2, @4); }
     ;
 
 button_def
     : BUTTON LBRACE property_list RBRACE
-        { $$ = create_button_node($3); }
+        { $$ = create_button_node($3.first); ast_set_block(ast_doc, $$, @2, @4); }
     ;
 
 property_list
-    : property { $$ = $1; }
-    | property property_list { $$ = chain_properties($1, $2); }
+    : property { $$ = chain_start($1); ast_set_span(ast_doc, $1, @1); }
+    | property_list property { $$ = chain_properties($1, $2); ast_set_span(ast_doc, $2, @2); }
     ;
 
 property
@@ -150,7 +231,7 @@ property
 
 event_handler
     : ONCLICK LBRACE statement_list RBRACE
-        { $$ = create_onclick_handler($3); }
+        { $$ = create_onclick_handler($3.first); ast_set_block(ast_doc, $$, @2, @4); }
     ;
 
 expression
@@ -206,30 +287,167 @@ expression_list
     | expression COMMA expression_list
         { $$ = add_to_expression_list($3, $1); }
     | /* empty */
-        { $$ = create_expression_list(NULL); }
+        { $$ = create_expression_list(AST_NONE); }
     ;
 
 %%
 
-void yyerror(const char *s) {
-    fprintf(stderr, "Parse error: %s\n", s);
+void yyerror(YYLTYPE *location, const char *s) {
+    /* A block that does not parse on its own falls back to the page */
+    if (mthl_lexer && mthl_lexer->fragment) return;
+
+    /* Locations are offsets into the source; count lines up to this one */
+    uint32_t line = 1;
+    if (mthl_lexer) {
+        const char *at = mthl_lexer->source;
+        const char *end = at + location->start;
+        while ((at = memchr(at, '\n', (size_t)(end - at))) != NULL) {
+            line++;
+            at++;
+        }
+    }
+    fprintf(stderr, "Parse error on line %u: %s\n", line, s);
+}
+
+/* Shows each element as soon as the statement that records it has
+ * arrived and run, for a page still coming in over a pipe or socket */
+static int stream_page(FILE *file) {
+    mthl_stream_t stream;
+    char buffer[16 * 1024];
+    uint32_t shown = 0;
+    int status = MTHL_STREAM_MORE;
+
+    if (mthl_stream_open(&stream) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    while (status == MTHL_STREAM_MORE) {
+        ssize_t size = read(fileno(file), buffer, sizeof(buffer));
+        if (size < 0 && errno == EINTR) continue;
+        status = mthl_stream_push(&stream, buffer, size > 0 ? (size_t)size : 0);
+
+        if (stream.rt.element_count > shown) {
+            mthl_print_elements(&stream.rt, shown, stdout);
+            fflush(stdout);
+            shown = stream.rt.element_count;
+        }
+    }
+
+    mthl_stream_close(&stream);
+    return status == MTHL_STREAM_ERROR ? 1 : 0;
 }
 
 int main(int argc, char **argv) {
-    if (argc > 1) {
-        FILE *file = fopen(argv[1], "r");
+    ASTDocument document;
+    mthl_lexer_t lexer;
+    FILE *file = stdin;
+    int bench = 0;
+    int reparse = 0;
+    int layout = 0;
+    int display = 0;
+    const char *compile_to = NULL;
+    int arg = 1;
+    
+    /* mthl [--bench iterations | --reparse edits | --layout iterations |
+     *       --display frames | --compile page.mthlc] [file] */
+    if (argc > 2 && strcmp(argv[1], "--bench") == 0) {
+        bench = atoi(argv[2]);
+        arg = 3;
+    } else if (argc > 2 && strcmp(argv[1], "--reparse") == 0) {
+        reparse = atoi(argv[2]);
+        arg = 3;
+    } else if (argc > 2 && strcmp(argv[1], "--layout") == 0) {
+        layout = atoi(argv[2]);
+        arg = 3;
+    } else if (argc > 2 && strcmp(argv[1], "--display") == 0) {
+        display = atoi(argv[2]);
+        arg = 3;
+    } else if (argc > 2 && strcmp(argv[1], "--compile") == 0) {
+        compile_to = argv[2];
+        arg = 3;
+    }
+    
+    /* Precompiled pages are mapped and run without parsing */
+    const char *extension = argc > arg ? strrchr(argv[arg], '.') : NULL;
+    if (extension && strcmp(extension, ".mthlc") == 0) {
+        mthl_image_t image;
+        if (mthl_image_open(argv[arg], &image) < 0) return 1;
+        mthl_image_run(&image);
+        mthl_image_close(&image);
+        return 0;
+    }
+    
+    if (argc > arg) {
+        file = fopen(argv[arg], "r");
         if (!file) {
-            fprintf(stderr, "Cannot open file: %s\n", argv[1]);
+            fprintf(stderr, "Cannot open file: %s\n", argv[arg]);
             return 1;
         }
-        yyin = file;
     }
     
-    yyparse();
+    /* A file on disk is there in full and runs on the VM; anything else
+     * may be arriving slowly, and is shown as it does */
+    struct stat info;
+    if (!bench && !reparse && !layout && !display && !compile_to &&
+        fstat(fileno(file), &info) == 0 && !S_ISREG(info.st_mode)) {
+        int status = stream_page(file);
+        if (file != stdin) fclose(file);
+        return status;
+    }
+    
+    int result = mthl_lexer_read(&lexer, file);
+    if (file != stdin) fclose(file);
+    
+    if (result == 0 && reparse > 0) {
+        mthl_editor_t editor;
+        if (mthl_editor_open(&editor, &lexer) == 0) {
+            mthl_edit_benchmark(&editor, reparse);
+        }
+        mthl_editor_close(&editor);
+        return 0;
+    }
+    
+    /* Sized from the source so the whole page builds without regrowing */
+    if (result < 0 || ast_document_init(&document, mthl_lexer_size(&lexer)) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    ast_doc = &document;
+    mthl_lexer = &lexer;
+    
+    if (bench > 0) {
+        mthl_lex_benchmark(&lexer, bench);
+    }
+    
+    /* A page that does not parse is not run or compiled, as when streamed */
+    if (yyparse() != 0) {
+        ast_document_free(&document);
+        mthl_lexer_free(&lexer);
+        return 1;
+    }
     
     if (ast_root) {
-        interpret_ast(ast_root);  /* Execute the program */
+        mthl_optimize(&document, ast_root);
+    }
+    
+    if (ast_root && compile_to) {
+        if (mthl_image_compile(&document, ast_root, compile_to, 0) < 0) {
+            ast_document_free(&document);
+            mthl_lexer_free(&lexer);
+            return 1;
+        }
+    } else if (ast_root && bench > 0) {
+        mthl_benchmark(&document, ast_root, bench);
+    } else if (ast_root && layout > 0) {
+        mthl_layout_benchmark(&document, ast_root, layout);
+    } else if (ast_root && display > 0) {
+        mthl_display_benchmark(&document, ast_root, display);
+    } else if (ast_root) {
+        interpret_ast(&document, ast_root);  /* Execute the program */
     }
     
+    ast_document_free(&document);
+    mthl_lexer_free(&lexer);
     return 0;
 }
\ No newline at end of file
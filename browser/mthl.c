@@ -1,27 +1,87 @@
 #include <gtk/gtk.h>
+#include "mthl_display.h"
 
-/* gcc -o program program.c `pkg-config --cflags --libs gtk4` */
+/* gcc -o mthl mthl.c mthl_display.c mthl_layout.c mthl_interp.c mthl_ast.c `pkg-config --cflags --libs gtk4` */
+
+/*
+ * What is on screen is kept in a backing surface, and each frame only the
+ * display's damage is painted into it again before it is copied out. A
+ * tick that changes nothing queues no draw at all.
+ */
 
 static gboolean animate = TRUE;
-static int rectangle_x = 50;
-static int rectangle_y = 50;
-static int rectangle_width = 200;
-static int rectangle_height = 100;
+static mthl_display_t display;
+static cairo_surface_t *backing = NULL;
+static mthl_display_item_t rectangle = { .box = { 50, 50, 200, 100 }, .fill = MTHL_OPAQUE | 0xFF0000 };
 static int step = 5;
 
+static void set_color(cairo_t *cr, uint32_t color) {
+    cairo_set_source_rgb(cr, ((color >> 16) & 0xFF) / 255.0, ((color >> 8) & 0xFF) / 255.0,
+                         (color & 0xFF) / 255.0);
+}
+
+/* White, then every item over area, in order */
+static void repaint(cairo_t *cr, mthl_box_t area) {
+    cairo_save(cr);
+    cairo_rectangle(cr, area.x, area.y, area.width, area.height);
+    cairo_clip(cr);
+    cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+    cairo_paint(cr);
+
+    for (uint32_t i = 0; i < display.count; i++) {
+        const mthl_display_item_t *item = &display.items[i];
+        mthl_box_t part;
+
+        if (!mthl_box_intersect(item->box, area, &part)) continue;
+        if (item->fill >> 24) {
+            set_color(cr, item->fill);
+            cairo_rectangle(cr, item->box.x, item->box.y, item->box.width, item->box.height);
+            cairo_fill(cr);
+        }
+        if (item->content.type == VAL_STRING && display.doc) {
+            int size = item->font_size > 0 ? item->font_size : 12;
+
+            /* Text stays in its box, which is all the damage it makes covers */
+            cairo_save(cr);
+            cairo_rectangle(cr, item->box.x, item->box.y, item->box.width, item->box.height);
+            cairo_clip(cr);
+            set_color(cr, item->color);
+            cairo_set_font_size(cr, size);
+            cairo_move_to(cr, item->box.x, item->box.y + size);
+            cairo_show_text(cr, ast_symbol_name(display.doc, item->content.i));
+            cairo_restore(cr);
+        }
+    }
+    cairo_restore(cr);
+}
+
 static void on_draw(GtkDrawingArea* drawing_area, cairo_t* cr, int width, int height, gpointer data) {
-    cairo_set_source_rgb(cr, 1.0, 0.0, 0.0);
-    cairo_rectangle(cr, rectangle_x, rectangle_y, rectangle_width, rectangle_height);
-    cairo_fill(cr);
+    if (!backing || width != display.width || height != display.height) {
+        if (backing) cairo_surface_destroy(backing);
+        backing = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+        mthl_display_resize(&display, width, height);
+    }
+
+    if (display.damage_count > 0) {
+        cairo_t *painter = cairo_create(backing);
+        for (uint32_t i = 0; i < display.damage_count; i++) repaint(painter, display.damage[i]);
+        cairo_destroy(painter);
+        mthl_display_clear_damage(&display);
+    }
+
+    cairo_set_source_surface(cr, backing, 0, 0);
+    cairo_paint(cr);
 }
 
 static gboolean update_animation(gpointer data) {
     GtkDrawingArea *drawing_area = GTK_DRAWING_AREA(data);
-    rectangle_x += step;
-    if( rectangle_x <= 0 || rectangle_x >= gtk_widget_get_allocated_width(GTK_WIDGET(drawing_area)) - rectangle_width)
+    rectangle.box.x += step;
+    if( rectangle.box.x <= 0 || rectangle.box.x >= gtk_widget_get_allocated_width(GTK_WIDGET(drawing_area)) - rectangle.box.width)
         step = -step;
 
-    gtk_widget_queue_draw(GTK_WIDGET(drawing_area));
+    mthl_display_set(&display, 0, &rectangle);
+    if (display.damage_count > 0)
+        gtk_widget_queue_draw(GTK_WIDGET(drawing_area));
     return animate;
 }
 
@@ -30,6 +90,10 @@ static void on_activate(GtkApplication *app, gpointer user_data) {
     gtk_window_set_title(GTK_WINDOW(window), "MTHL");
     gtk_window_set_default_size(GTK_WINDOW(window), 400, 300);
 
+    /* Sized, and so damaged in full, by the first draw */
+    mthl_display_init(&display, NULL, 0, 0);
+    mthl_display_set(&display, 0, &rectangle);
+
     GtkWidget *drawing_area = gtk_drawing_area_new();
     gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(drawing_area), on_draw, NULL, NULL);
     gtk_window_set_child(GTK_WINDOW(window), drawing_area);
@@ -41,6 +105,9 @@ static void on_activate(GtkApplication *app, gpointer user_data) {
 
 static void on_shutdown(GtkApplication *app, gpointer user_data) {
     animate = FALSE;
+    if (backing) cairo_surface_destroy(backing);
+    backing = NULL;
+    mthl_display_free(&display);
 }
 
 int main(int argc, char** argv) {
@@ -50,4 +117,4 @@ int main(int argc, char** argv) {
     int status = g_application_run(G_APPLICATION(app), argc, argv);
     g_object_unref(app);
     return status;
-}
\ No newline at end of file
+}
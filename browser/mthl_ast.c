@@ -0,0 +1,566 @@
+/* mthl_ast.c - AST arena for MTHL */
+#include <stdlib.h>
+#include <string.h>
+#include "mthl_ast.h"
+
+/* Roughly one node per 8 source bytes and half the source in strings */
+#define AST_BYTES_PER_NODE 8
+#define AST_MIN_NODES 64
+#define AST_MIN_STRINGS 256
+#define AST_MIN_SYMBOLS 64
+
+ASTDocument *ast_doc = NULL;
+
+static void ast_out_of_memory(void) {
+    fprintf(stderr, "Out of memory while building the AST\n");
+    exit(1);
+}
+
+int ast_document_init(ASTDocument *doc, size_t size_hint) {
+    memset(doc, 0, sizeof(*doc));
+
+    doc->node_capacity = size_hint / AST_BYTES_PER_NODE;
+    if (doc->node_capacity < AST_MIN_NODES) doc->node_capacity = AST_MIN_NODES;
+    doc->string_capacity = size_hint / 2;
+    if (doc->string_capacity < AST_MIN_STRINGS) doc->string_capacity = AST_MIN_STRINGS;
+
+    doc->symbol_capacity = AST_MIN_SYMBOLS;
+    doc->symbol_slot_mask = AST_MIN_SYMBOLS * 2 - 1;
+
+    doc->nodes = malloc((size_t)doc->node_capacity * sizeof(ASTNode));
+    doc->strings = malloc(doc->string_capacity);
+    doc->symbols = malloc(doc->symbol_capacity * sizeof(ASTSymbol));
+    doc->symbol_slots = calloc(doc->symbol_slot_mask + 1, sizeof(uint32_t));
+    if (!doc->nodes || !doc->strings || !doc->symbols || !doc->symbol_slots) {
+        ast_document_free(doc);
+        return -1;
+    }
+
+    /* Slot 0 is AST_NONE */
+    memset(&doc->nodes[0], 0, sizeof(ASTNode));
+    doc->node_count = 1;
+
+    ast_intern(doc, "", 0);
+    ast_intern(doc, "length", 6);
+    return 0;
+}
+
+void ast_document_free(ASTDocument *doc) {
+    if (!(doc->borrowed & AST_BORROWED_NODES)) free(doc->nodes);
+    free(doc->spans);
+    if (!(doc->borrowed & AST_BORROWED_STRINGS)) free(doc->strings);
+    if (!(doc->borrowed & AST_BORROWED_SYMBOLS)) free(doc->symbols);
+    if (!(doc->borrowed & AST_BORROWED_SLOTS)) free(doc->symbol_slots);
+    memset(doc, 0, sizeof(*doc));
+}
+
+/* realloc for the document's arrays. One borrowed from a mapped image
+ * is copied out the first time it has to grow, and owned from then on. */
+static void *ast_resize(ASTDocument *doc, uint32_t part, void *items, size_t old_size, size_t new_size) {
+    if (!(doc->borrowed & part)) return realloc(items, new_size);
+
+    void *copy = malloc(new_size);
+    if (!copy) return NULL;
+    memcpy(copy, items, old_size);
+    doc->borrowed &= ~part;
+    return copy;
+}
+
+static uint32_t ast_store_string(ASTDocument *doc, const char *s, size_t len) {
+    if (doc->string_size + len + 1 > doc->string_capacity) {
+        size_t capacity = doc->string_capacity * 2;
+        while (capacity < doc->string_size + len + 1) capacity *= 2;
+        if (capacity > UINT32_MAX) ast_out_of_memory();
+
+        char *strings = ast_resize(doc, AST_BORROWED_STRINGS, doc->strings,
+                                   doc->string_size, capacity);
+        if (!strings) ast_out_of_memory();
+        doc->strings = strings;
+        doc->string_capacity = capacity;
+    }
+
+    uint32_t offset = doc->string_size;
+    memcpy(doc->strings + offset, s, len);
+    doc->strings[offset + len] = '\0';
+    doc->string_size += len + 1;
+    return offset;
+}
+
+/* FNV-1a */
+static uint32_t ast_hash(const char *s, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void ast_grow_symbols(ASTDocument *doc) {
+    uint32_t capacity = doc->symbol_capacity * 2;
+    uint32_t mask = capacity * 2 - 1;
+
+    ASTSymbol *symbols = ast_resize(doc, AST_BORROWED_SYMBOLS, doc->symbols,
+                                    doc->symbol_count * sizeof(ASTSymbol),
+                                    capacity * sizeof(ASTSymbol));
+    uint32_t *slots = calloc(mask + 1, sizeof(uint32_t));
+    if (!symbols || !slots) ast_out_of_memory();
+
+    /* The slot table is kept at most half full, so rehash into the new one */
+    for (uint32_t sym = 0; sym < doc->symbol_count; sym++) {
+        uint32_t slot = symbols[sym].hash & mask;
+        while (slots[slot]) slot = (slot + 1) & mask;
+        slots[slot] = sym + 1;
+    }
+
+    if (!(doc->borrowed & AST_BORROWED_SLOTS)) free(doc->symbol_slots);
+    doc->borrowed &= ~AST_BORROWED_SLOTS;
+    doc->symbols = symbols;
+    doc->symbol_capacity = capacity;
+    doc->symbol_slots = slots;
+    doc->symbol_slot_mask = mask;
+}
+
+uint32_t ast_intern(ASTDocument *doc, const char *s, size_t len) {
+    uint32_t hash = ast_hash(s, len);
+    uint32_t slot = hash & doc->symbol_slot_mask;
+
+    while (doc->symbol_slots[slot]) {
+        uint32_t sym = doc->symbol_slots[slot] - 1;
+        ASTSymbol *symbol = &doc->symbols[sym];
+        if (symbol->hash == hash && symbol->length == len &&
+            memcmp(doc->strings + symbol->offset, s, len) == 0) {
+            return sym;
+        }
+        slot = (slot + 1) & doc->symbol_slot_mask;
+    }
+
+    if (doc->symbol_count == doc->symbol_capacity) {
+        ast_grow_symbols(doc);
+        slot = hash & doc->symbol_slot_mask;
+        while (doc->symbol_slots[slot]) slot = (slot + 1) & doc->symbol_slot_mask;
+    }
+
+    uint32_t sym = doc->symbol_count++;
+    doc->symbols[sym].offset = ast_store_string(doc, s, len);
+    doc->symbols[sym].length = len;
+    doc->symbols[sym].hash = hash;
+    doc->symbol_slots[slot] = sym + 1;
+    return sym;
+}
+
+static ast_index_t ast_new_node(int kind) {
+    ASTDocument *doc = ast_doc;
+
+    if (doc->node_count == doc->node_capacity) {
+        size_t capacity = (size_t)doc->node_capacity * 2;
+        if (capacity > UINT32_MAX) ast_out_of_memory();
+
+        ASTNode *nodes = ast_resize(doc, AST_BORROWED_NODES, doc->nodes,
+                                    doc->node_count * sizeof(ASTNode),
+                                    capacity * sizeof(ASTNode));
+        if (!nodes) ast_out_of_memory();
+        doc->nodes = nodes;
+
+        if (doc->spans) {
+            ASTSpan *spans = realloc(doc->spans, capacity * sizeof(ASTSpan));
+            if (!spans) ast_out_of_memory();
+            doc->spans = spans;
+        }
+        doc->node_capacity = capacity;
+    }
+
+    ast_index_t index = doc->node_count++;
+    ASTNode *node = &doc->nodes[index];
+    memset(node, 0, sizeof(*node));
+    node->kind = kind;
+    if (doc->spans) memset(&doc->spans[index], 0, sizeof(ASTSpan));
+    return index;
+}
+
+int ast_track_spans(ASTDocument *doc) {
+    if (doc->spans) return 0;
+    doc->spans = calloc(doc->node_capacity, sizeof(ASTSpan));
+    return doc->spans ? 0 : -1;
+}
+
+void ast_set_span(ASTDocument *doc, ast_index_t index, ast_location_t location) {
+    if (!doc->spans) return;
+    doc->spans[index].start = location.start;
+    doc->spans[index].end = location.end;
+}
+
+void ast_set_block(ASTDocument *doc, ast_index_t index, ast_location_t open, ast_location_t close) {
+    if (!doc->spans) return;
+    doc->spans[index].start = open.start;
+    doc->spans[index].end = close.end;
+    doc->spans[index].content = open.end;
+}
+
+/* Makes the given nodes, in order, the children of parent. Each argument
+ * is a single fresh node; AST_NONE arguments are skipped. Node pointers
+ * do not survive ast_new_node, which may move the array, so everything
+ * here works by index. */
+static void ast_set_children(ast_index_t parent, int count, const ast_index_t *children) {
+    ASTNode *nodes = ast_doc->nodes;
+    ast_index_t last = AST_NONE;
+
+    for (int i = 0; i < count; i++) {
+        if (children[i] == AST_NONE) continue;
+        if (last == AST_NONE) nodes[parent].first_child = children[i];
+        else nodes[last].next_sibling = children[i];
+        last = children[i];
+    }
+}
+
+static ast_index_t ast_new_parent(int kind, ast_index_t first_child) {
+    ast_index_t index = ast_new_node(kind);
+    ast_doc->nodes[index].first_child = first_child;
+    return index;
+}
+
+static ast_index_t ast_new_symbol_node(int kind, uint32_t sym) {
+    ast_index_t index = ast_new_node(kind);
+    ast_doc->nodes[index].value.sym = sym;
+    return index;
+}
+
+ast_index_t ast_child(ASTDocument *doc, ast_index_t parent, int n) {
+    for (AST_EACH_CHILD(doc, parent, child)) {
+        if (n-- == 0) return child;
+    }
+    return AST_NONE;
+}
+
+int ast_child_count(ASTDocument *doc, ast_index_t parent) {
+    int count = 0;
+    for (AST_EACH_CHILD(doc, parent, child)) count++;
+    return count;
+}
+
+static ast_index_t ast_compact_node(ASTDocument *doc, ASTNode *to, ASTSpan *to_spans,
+                                    uint32_t *count, ast_index_t index) {
+    ASTNode *from = doc->nodes;
+    ast_index_t copy = (*count)++;
+    ast_index_t last = AST_NONE;
+
+    to[copy] = from[index];
+    to[copy].first_child = AST_NONE;
+    to[copy].next_sibling = AST_NONE;
+    if (to_spans) to_spans[copy] = doc->spans[index];
+    for (ast_index_t child = from[index].first_child; child != AST_NONE; child = from[child].next_sibling) {
+        ast_index_t child_copy = ast_compact_node(doc, to, to_spans, count, child);
+        if (last == AST_NONE) to[copy].first_child = child_copy;
+        else to[last].next_sibling = child_copy;
+        last = child_copy;
+    }
+    return copy;
+}
+
+ast_index_t ast_compact(ASTDocument *doc, ast_index_t root) {
+    uint32_t capacity = doc->node_count;
+    ASTNode *nodes = malloc((size_t)capacity * sizeof(ASTNode));
+    ASTSpan *spans = doc->spans ? calloc(capacity, sizeof(ASTSpan)) : NULL;
+    if (!nodes || (doc->spans && !spans)) {
+        free(nodes);
+        free(spans);
+        return root;
+    }
+
+    uint32_t count = 1;
+    memset(&nodes[0], 0, sizeof(ASTNode));
+    root = ast_compact_node(doc, nodes, spans, &count, root);
+
+    if (!(doc->borrowed & AST_BORROWED_NODES)) free(doc->nodes);
+    free(doc->spans);
+    doc->borrowed &= ~AST_BORROWED_NODES;
+    doc->nodes = nodes;
+    doc->spans = spans;
+    doc->node_count = count;
+    doc->node_capacity = capacity;
+    return root;
+}
+
+/* Grammar actions */
+
+ast_index_t create_page_node(uint32_t title, ast_index_t statements) {
+    ast_index_t index = ast_new_symbol_node(AST_PAGE, title);
+    ast_doc->nodes[index].first_child = statements;
+    return index;
+}
+
+ast_chain_t chain_start(ast_index_t first) {
+    ast_chain_t chain = { first, first };
+    return chain;
+}
+
+/* Lists are left recursive in the grammar, so next is a single item that
+ * goes after the chain's tail */
+ast_chain_t chain_statements(ast_chain_t chain, ast_index_t next) {
+    ast_doc->nodes[chain.last].next_sibling = next;
+    chain.last = next;
+    return chain;
+}
+
+ast_chain_t chain_properties(ast_chain_t chain, ast_index_t next) {
+    ast_doc->nodes[chain.last].next_sibling = next;
+    chain.last = next;
+    return chain;
+}
+
+ast_index_t create_redraw_node(void) {
+    return ast_new_node(AST_REDRAW);
+}
+
+ast_index_t create_var_decl_node(uint32_t name, ast_index_t value) {
+    ast_index_t index = ast_new_symbol_node(AST_VAR_DECL, name);
+    ast_doc->nodes[index].first_child = value;
+    return index;
+}
+
+ast_index_t create_const_decl_node(uint32_t name, ast_index_t value) {
+    ast_index_t index = create_var_decl_node(name, value);
+    ast_doc->nodes[index].flags |= AST_FLAG_CONST;
+    return index;
+}
+
+ast_index_t create_assignment_node(uint32_t name, ast_index_t value) {
+    ast_index_t index = ast_new_symbol_node(AST_ASSIGN, name);
+    ast_doc->nodes[index].first_child = value;
+    return index;
+}
+
+ast_index_t create_array_assignment_node(uint32_t name, ast_index_t index_expr, ast_index_t value) {
+    ast_index_t index = ast_new_symbol_node(AST_ARRAY_ASSIGN, name);
+    ast_index_t children[] = { index_expr, value };
+    ast_set_children(index, 2, children);
+    return index;
+}
+
+ast_index_t create_if_node(ast_index_t condition, ast_index_t then_list, ast_index_t else_list) {
+    ast_index_t index = ast_new_node(AST_IF);
+    ast_index_t children[] = {
+        condition,
+        ast_new_parent(AST_BLOCK, then_list),
+        else_list != AST_NONE ? ast_new_parent(AST_BLOCK, else_list) : AST_NONE
+    };
+    ast_set_children(index, 3, children);
+    return index;
+}
+
+ast_index_t create_for_node(ast_index_t init, ast_index_t condition, ast_index_t step, ast_index_t body) {
+    ast_index_t index = ast_new_node(AST_FOR);
+    ast_index_t children[] = { init, condition, step, ast_new_parent(AST_BLOCK, body) };
+    ast_set_children(index, 4, children);
+    return index;
+}
+
+ast_index_t create_container_node(ast_index_t properties) {
+    return ast_new_parent(AST_CONTAINER, properties);
+}
+
+ast_index_t create_text_node(ast_index_t properties) {
+    return ast_new_parent(AST_TEXT, properties);
+}
+
+ast_index_t create_rectangle_node(ast_index_t properties) {
+    return ast_new_parent(AST_RECTANGLE, properties);
+}
+
+ast_index_t create_button_node(ast_index_t properties) {
+    return ast_new_parent(AST_BUTTON, properties);
+}
+
+ast_index_t create_position_property(ast_index_t x, ast_index_t y, ast_index_t w, ast_index_t h) {
+    ast_index_t index = ast_new_node(AST_PROP_POSITION);
+    ast_index_t children[] = { x, y, w, h };
+    ast_set_children(index, 4, children);
+    return index;
+}
+
+ast_index_t create_background_property(ast_index_t value) {
+    return ast_new_parent(AST_PROP_BACKGROUND, value);
+}
+
+ast_index_t create_content_property(ast_index_t value) {
+    return ast_new_parent(AST_PROP_CONTENT, value);
+}
+
+ast_index_t create_font_property(ast_index_t family, ast_index_t size, ast_index_t style) {
+    ast_index_t index = ast_new_node(AST_PROP_FONT);
+    ast_index_t children[] = { family, size, style };
+    ast_set_children(index, 3, children);
+    return index;
+}
+
+ast_index_t create_color_property(ast_index_t value) {
+    return ast_new_parent(AST_PROP_COLOR, value);
+}
+
+ast_index_t create_fill_property(ast_index_t value) {
+    return ast_new_parent(AST_PROP_FILL, value);
+}
+
+ast_index_t create_align_property(ast_index_t value) {
+    return ast_new_parent(AST_PROP_ALIGN, value);
+}
+
+ast_index_t create_onclick_handler(ast_index_t statements) {
+    return ast_new_parent(AST_ONCLICK, statements);
+}
+
+ast_index_t create_integer_node(int value) {
+    ast_index_t index = ast_new_node(AST_INTEGER);
+    ast_doc->nodes[index].value.ival = value;
+    return index;
+}
+
+ast_index_t create_percentage_node(int value) {
+    ast_index_t index = ast_new_node(AST_PERCENTAGE);
+    ast_doc->nodes[index].value.ival = value;
+    return index;
+}
+
+ast_index_t create_string_node(uint32_t value) {
+    return ast_new_symbol_node(AST_STRING, value);
+}
+
+ast_index_t create_color_node(uint32_t value) {
+    return ast_new_symbol_node(AST_COLOR, value);
+}
+
+ast_index_t create_variable_node(uint32_t name) {
+    return ast_new_symbol_node(AST_VARIABLE, name);
+}
+
+ast_index_t create_array_access_node(uint32_t name, ast_index_t index_expr) {
+    ast_index_t index = ast_new_symbol_node(AST_ARRAY_ACCESS, name);
+    ast_doc->nodes[index].first_child = index_expr;
+    return index;
+}
+
+ast_index_t create_property_access_node(uint32_t object, uint32_t property) {
+    ast_index_t variable = create_variable_node(object);
+    ast_index_t index = ast_new_symbol_node(AST_PROPERTY_ACCESS, property);
+    ast_doc->nodes[index].first_child = variable;
+    return index;
+}
+
+ast_index_t create_binary_op_node(int op, ast_index_t left, ast_index_t right) {
+    ast_index_t index = ast_new_node(AST_BINARY_OP);
+    ast_index_t children[] = { left, right };
+    ast_doc->nodes[index].op = op;
+    ast_set_children(index, 2, children);
+    return index;
+}
+
+ast_index_t create_unary_op_node(int op, ast_index_t operand) {
+    ast_index_t index = ast_new_parent(AST_UNARY_OP, operand);
+    ast_doc->nodes[index].op = op;
+    return index;
+}
+
+/* The list node becomes the array, keeping its element chain */
+ast_index_t create_array_node(ast_index_t list) {
+    ast_doc->nodes[list].kind = AST_ARRAY;
+    return list;
+}
+
+ast_index_t create_expression_list(ast_index_t first) {
+    return ast_new_parent(AST_LIST, first);
+}
+
+/* Called right to left as the grammar reduces, so prepending keeps the
+ * source order */
+ast_index_t add_to_expression_list(ast_index_t list, ast_index_t expression) {
+    ASTNode *nodes = ast_doc->nodes;
+    nodes[expression].next_sibling = nodes[list].first_child;
+    nodes[list].first_child = expression;
+    return list;
+}
+
+/* Debugging */
+
+static const char *ast_kind_names[AST_KIND_COUNT] = {
+    [AST_INVALID] = "invalid",
+    [AST_PAGE] = "page",
+    [AST_BLOCK] = "block",
+    [AST_LIST] = "list",
+    [AST_VAR_DECL] = "var",
+    [AST_ASSIGN] = "assign",
+    [AST_ARRAY_ASSIGN] = "array-assign",
+    [AST_IF] = "if",
+    [AST_FOR] = "for",
+    [AST_REDRAW] = "redraw",
+    [AST_CONTAINER] = "container",
+    [AST_TEXT] = "text",
+    [AST_RECTANGLE] = "rectangle",
+    [AST_BUTTON] = "button",
+    [AST_PROP_POSITION] = "position",
+    [AST_PROP_BACKGROUND] = "background",
+    [AST_PROP_CONTENT] = "content",
+    [AST_PROP_FONT] = "font",
+    [AST_PROP_COLOR] = "color",
+    [AST_PROP_FILL] = "fill",
+    [AST_PROP_ALIGN] = "align",
+    [AST_ONCLICK] = "onclick",
+    [AST_INTEGER] = "integer",
+    [AST_PERCENTAGE] = "percentage",
+    [AST_STRING] = "string",
+    [AST_COLOR] = "color-hex",
+    [AST_VARIABLE] = "variable",
+    [AST_ARRAY_ACCESS] = "array-access",
+    [AST_PROPERTY_ACCESS] = "property-access",
+    [AST_BINARY_OP] = "binary-op",
+    [AST_UNARY_OP] = "unary-op",
+    [AST_ARRAY] = "array",
+};
+
+static const char *ast_op_names[] = {
+    "", "+", "-", "*", "/", ">", "<", ">=", "<=", "==", "!=", "&&", "||", "!"
+};
+
+const char *ast_kind_name(int kind) {
+    if (kind < 0 || kind >= AST_KIND_COUNT) return "?";
+    return ast_kind_names[kind];
+}
+
+static void ast_dump_node(ASTDocument *doc, ast_index_t index, int depth, FILE *out) {
+    ASTNode *node = &doc->nodes[index];
+
+    fprintf(out, "%*s%s", depth * 2, "", ast_kind_name(node->kind));
+    if (node->flags & AST_FLAG_CONST) fprintf(out, " const");
+    switch (node->kind) {
+        case AST_INTEGER:
+            fprintf(out, " %d", node->value.ival);
+            break;
+        case AST_PERCENTAGE:
+            fprintf(out, " %d%%", node->value.ival);
+            break;
+        case AST_BINARY_OP:
+        case AST_UNARY_OP:
+            fprintf(out, " %s", ast_op_names[node->op]);
+            break;
+        case AST_PAGE:
+        case AST_STRING:
+        case AST_COLOR:
+        case AST_VARIABLE:
+        case AST_VAR_DECL:
+        case AST_ASSIGN:
+        case AST_ARRAY_ASSIGN:
+        case AST_ARRAY_ACCESS:
+        case AST_PROPERTY_ACCESS:
+            fprintf(out, " \"%s\"", ast_symbol_name(doc, node->value.sym));
+            break;
+    }
+    fprintf(out, "\n");
+
+    for (AST_EACH_CHILD(doc, index, child)) {
+        ast_dump_node(doc, child, depth + 1, out);
+    }
+}
+
+void ast_dump(ASTDocument *doc, ast_index_t root, FILE *out) {
+    if (root == AST_NONE) return;
+    ast_dump_node(doc, root, 0, out);
+}
@@ -0,0 +1,249 @@
+/* mthl_ast.h - AST for MTHL */
+#ifndef MTHL_AST_H
+#define MTHL_AST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The whole tree of a page lives in one flat node array owned by an
+ * ASTDocument. Nodes refer to each other by 32-bit index: a node's
+ * children are first_child and then its next_sibling chain. Index 0 is
+ * never a real node and stands for "no node". Strings (identifiers,
+ * literals, colors) are interned: each distinct string is stored once in
+ * the document's character arena and named by a 32-bit symbol id, so
+ * names compare by integer. Freeing the document frees every node and
+ * string of the page.
+ */
+
+typedef uint32_t ast_index_t;
+
+#define AST_NONE 0
+
+typedef enum {
+    AST_INVALID = 0,
+
+    /* Structure */
+    AST_PAGE,               /* sym: title, children: statements */
+    AST_BLOCK,              /* children: statements; also a statement */
+    AST_LIST,               /* children: expressions (before create_array_node) */
+
+    /* Statements */
+    AST_VAR_DECL,           /* sym: name, children: value, AST_FLAG_CONST */
+    AST_ASSIGN,             /* sym: name, children: value */
+    AST_ARRAY_ASSIGN,       /* sym: name, children: index, value */
+    AST_IF,                 /* children: condition, then block, [else block] */
+    AST_FOR,                /* children: init, condition, step, body block */
+    AST_REDRAW,
+
+    /* Elements, children: properties and statements */
+    AST_CONTAINER,
+    AST_TEXT,
+    AST_RECTANGLE,
+    AST_BUTTON,
+
+    /* Properties, children: arguments */
+    AST_PROP_POSITION,
+    AST_PROP_BACKGROUND,
+    AST_PROP_CONTENT,
+    AST_PROP_FONT,
+    AST_PROP_COLOR,
+    AST_PROP_FILL,
+    AST_PROP_ALIGN,
+    AST_ONCLICK,            /* children: statements */
+
+    /* Expressions */
+    AST_INTEGER,            /* ival */
+    AST_PERCENTAGE,         /* ival */
+    AST_STRING,             /* sym */
+    AST_COLOR,              /* sym: "#RRGGBB" */
+    AST_VARIABLE,           /* sym: name */
+    AST_ARRAY_ACCESS,       /* sym: name, children: index */
+    AST_PROPERTY_ACCESS,    /* sym: property, children: object variable */
+    AST_BINARY_OP,          /* op, children: left, right */
+    AST_UNARY_OP,           /* op, children: operand */
+    AST_ARRAY,              /* children: elements */
+
+    AST_KIND_COUNT
+} ast_kind_t;
+
+typedef enum {
+    OP_NONE = 0,
+    OP_PLUS,
+    OP_MINUS,
+    OP_MULTIPLY,
+    OP_DIVIDE,
+    OP_GT,
+    OP_LT,
+    OP_GE,
+    OP_LE,
+    OP_EQ,
+    OP_NE,
+    OP_AND,
+    OP_OR,
+    OP_NOT
+} ast_op_t;
+
+/* Node flags */
+#define AST_FLAG_CONST 0x0001   /* name: value const; */
+
+/* 16 bytes, so four nodes share a cache line */
+typedef struct ASTNode {
+    uint8_t kind;           /* ast_kind_t */
+    uint8_t op;             /* ast_op_t, for operator nodes */
+    uint16_t flags;
+    ast_index_t first_child;
+    ast_index_t next_sibling;
+    union {
+        int32_t ival;
+        uint32_t sym;       /* Interned symbol id */
+    } value;
+} ASTNode;
+
+/* Symbol ids are stable for the life of the document */
+#define AST_SYM_EMPTY 0
+#define AST_SYM_LENGTH 1     /* "length", interned up front for .length */
+
+typedef struct ASTSymbol {
+    uint32_t offset;        /* Into the string arena, NUL terminated */
+    uint32_t length;
+    uint32_t hash;
+} ASTSymbol;
+
+/* Where a node came from in the source, in byte offsets. Statements and
+ * properties span their whole text; nodes with a |< >| block (pages,
+ * elements, onclick and the bodies of if and for) also record where the
+ * block's contents start, and their contents end at end - 2, before >|.
+ * Other nodes have an all-zero span. */
+typedef struct ASTSpan {
+    uint32_t start;
+    uint32_t end;
+    uint32_t content;       /* Just past |<, 0 without a block */
+} ASTSpan;
+
+/* Token and rule locations in the parser */
+typedef struct ast_location {
+    uint32_t start;
+    uint32_t end;
+} ast_location_t;
+
+/* A sibling chain being built by the grammar, which appends to its tail */
+typedef struct ast_chain {
+    ast_index_t first;
+    ast_index_t last;
+} ast_chain_t;
+
+typedef struct ASTDocument {
+    ASTNode *nodes;
+    ASTSpan *spans;         /* Parallel to nodes if tracked, else NULL */
+    uint32_t node_count;
+    uint32_t node_capacity;
+    char *strings;
+    uint32_t string_size;
+    uint32_t string_capacity;
+    ASTSymbol *symbols;
+    uint32_t symbol_count;
+    uint32_t symbol_capacity;
+    uint32_t *symbol_slots; /* Open addressing, symbol id + 1, 0 if free */
+    uint32_t symbol_slot_mask;
+    uint32_t borrowed;      /* AST_BORROWED_* arrays not ours to free */
+} ASTDocument;
+
+/* Arrays that point into a mapped .mthlc image */
+#define AST_BORROWED_NODES   0x01
+#define AST_BORROWED_STRINGS 0x02
+#define AST_BORROWED_SYMBOLS 0x04
+#define AST_BORROWED_SLOTS   0x08
+
+/* Document lifetime. size_hint is the source length in bytes, if known,
+ * and sizes the arenas so that a typical page needs no regrowth. */
+int ast_document_init(ASTDocument *doc, size_t size_hint);
+void ast_document_free(ASTDocument *doc);
+
+/* The document the parser's create_* calls build into */
+extern ASTDocument *ast_doc;
+
+/* Keeps an ASTSpan for every node created from now on, for incremental
+ * reparsing */
+int ast_track_spans(ASTDocument *doc);
+
+/* Called by the grammar; no-ops unless spans are tracked. ast_set_block
+ * records a block's delimiters as the node's span, which a list item's
+ * ast_set_span later widens to the whole statement. */
+void ast_set_span(ASTDocument *doc, ast_index_t index, ast_location_t location);
+void ast_set_block(ASTDocument *doc, ast_index_t index, ast_location_t open, ast_location_t close);
+
+/* Returns the symbol id for len bytes of s, storing them on first sight */
+uint32_t ast_intern(ASTDocument *doc, const char *s, size_t len);
+
+static inline ASTNode *ast_node(ASTDocument *doc, ast_index_t index) {
+    return &doc->nodes[index];
+}
+
+static inline const char *ast_symbol_name(ASTDocument *doc, uint32_t sym) {
+    return doc->strings + doc->symbols[sym].offset;
+}
+
+static inline uint32_t ast_symbol_length(ASTDocument *doc, uint32_t sym) {
+    return doc->symbols[sym].length;
+}
+
+/* The name or text of a node that carries a symbol */
+static inline const char *ast_string(ASTDocument *doc, ast_index_t index) {
+    return ast_symbol_name(doc, doc->nodes[index].value.sym);
+}
+
+/* Walks the children of node parent: for (AST_EACH_CHILD(doc, parent, c)) */
+#define AST_EACH_CHILD(doc, parent, child) \
+    ast_index_t child = (doc)->nodes[(parent)].first_child; \
+    child != AST_NONE; \
+    child = (doc)->nodes[child].next_sibling
+
+ast_index_t ast_child(ASTDocument *doc, ast_index_t parent, int n);
+int ast_child_count(ASTDocument *doc, ast_index_t parent);
+
+/* Rebuilds the node array with only the nodes reachable from root, in
+ * depth-first order, and returns root's new index. Node indices change. */
+ast_index_t ast_compact(ASTDocument *doc, ast_index_t root);
+const char *ast_kind_name(int kind);
+void ast_dump(ASTDocument *doc, ast_index_t root, FILE *out);
+
+/* Node constructors used by the grammar. Strings are symbol ids handed
+ * over by the lexer; lists are sibling chains. */
+ast_index_t create_page_node(uint32_t title, ast_index_t statements);
+ast_chain_t chain_start(ast_index_t first);
+ast_chain_t chain_statements(ast_chain_t chain, ast_index_t next);
+ast_chain_t chain_properties(ast_chain_t chain, ast_index_t next);
+ast_index_t create_redraw_node(void);
+ast_index_t create_var_decl_node(uint32_t name, ast_index_t value);
+ast_index_t create_const_decl_node(uint32_t name, ast_index_t value);
+ast_index_t create_assignment_node(uint32_t name, ast_index_t value);
+ast_index_t create_array_assignment_node(uint32_t name, ast_index_t index, ast_index_t value);
+ast_index_t create_if_node(ast_index_t condition, ast_index_t then_list, ast_index_t else_list);
+ast_index_t create_for_node(ast_index_t init, ast_index_t condition, ast_index_t step, ast_index_t body);
+ast_index_t create_container_node(ast_index_t properties);
+ast_index_t create_text_node(ast_index_t properties);
+ast_index_t create_rectangle_node(ast_index_t properties);
+ast_index_t create_button_node(ast_index_t properties);
+ast_index_t create_position_property(ast_index_t x, ast_index_t y, ast_index_t w, ast_index_t h);
+ast_index_t create_background_property(ast_index_t value);
+ast_index_t create_content_property(ast_index_t value);
+ast_index_t create_font_property(ast_index_t family, ast_index_t size, ast_index_t style);
+ast_index_t create_color_property(ast_index_t value);
+ast_index_t create_fill_property(ast_index_t value);
+ast_index_t create_align_property(ast_index_t value);
+ast_index_t create_onclick_handler(ast_index_t statements);
+ast_index_t create_integer_node(int value);
+ast_index_t create_percentage_node(int value);
+ast_index_t create_string_node(uint32_t value);
+ast_index_t create_color_node(uint32_t value);
+ast_index_t create_variable_node(uint32_t name);
+ast_index_t create_array_access_node(uint32_t name, ast_index_t index);
+ast_index_t create_property_access_node(uint32_t object, uint32_t property);
+ast_index_t create_binary_op_node(int op, ast_index_t left, ast_index_t right);
+ast_index_t create_unary_op_node(int op, ast_index_t operand);
+ast_index_t create_array_node(ast_index_t list);
+ast_index_t create_expression_list(ast_index_t first);
+ast_index_t add_to_expression_list(ast_index_t list, ast_index_t expression);
+
+#endif
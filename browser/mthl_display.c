@@ -0,0 +1,246 @@
+/* mthl_display.c - Retained display list and damage for MTHL pages */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mthl_display.h"
+
+void mthl_display_init(mthl_display_t *display, ASTDocument *doc, int32_t width, int32_t height) {
+    memset(display, 0, sizeof(*display));
+    display->doc = doc;
+    display->width = width;
+    display->height = height;
+}
+
+void mthl_display_free(mthl_display_t *display) {
+    free(display->items);
+    memset(display, 0, sizeof(*display));
+}
+
+void mthl_display_resize(mthl_display_t *display, int32_t width, int32_t height) {
+    mthl_box_t screen = { 0, 0, width, height };
+
+    display->width = width;
+    display->height = height;
+    display->damage_count = 0;
+    mthl_display_damage(display, screen);
+}
+
+static mthl_box_t box_union(mthl_box_t a, mthl_box_t b) {
+    int32_t x0 = a.x < b.x ? a.x : b.x;
+    int32_t y0 = a.y < b.y ? a.y : b.y;
+    int32_t x1 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    int32_t y1 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+    mthl_box_t box = { x0, y0, x1 - x0, y1 - y0 };
+    return box;
+}
+
+static int64_t box_area(mthl_box_t box) {
+    return (int64_t)box.width * box.height;
+}
+
+void mthl_display_damage(mthl_display_t *display, mthl_box_t box) {
+    mthl_box_t screen = { 0, 0, display->width, display->height };
+    mthl_box_t overlap;
+
+    if (!mthl_box_intersect(box, screen, &box)) return;
+
+    /* A merged rectangle can reach others it did not before */
+    for (uint32_t i = 0; i < display->damage_count; ) {
+        if (!mthl_box_intersect(display->damage[i], box, &overlap)) {
+            i++;
+            continue;
+        }
+        box = box_union(display->damage[i], box);
+        display->damage[i] = display->damage[--display->damage_count];
+        i = 0;
+    }
+
+    if (display->damage_count < MTHL_DAMAGE_MAX) {
+        display->damage[display->damage_count++] = box;
+        return;
+    }
+
+    uint32_t best = 0;
+    int64_t best_growth = INT64_MAX;
+    for (uint32_t i = 0; i < display->damage_count; i++) {
+        int64_t growth = box_area(box_union(display->damage[i], box)) - box_area(display->damage[i]);
+        if (growth < best_growth) {
+            best = i;
+            best_growth = growth;
+        }
+    }
+    display->damage[best] = box_union(display->damage[best], box);
+}
+
+static int painted(const mthl_display_item_t *item) {
+    return (item->fill >> 24) != 0 || item->content.type != VAL_NONE;
+}
+
+void mthl_display_set(mthl_display_t *display, uint32_t index, const mthl_display_item_t *item) {
+    if (index >= display->count) {
+        if (index >= display->capacity) {
+            uint32_t capacity = display->capacity ? display->capacity : 64;
+            while (capacity <= index) capacity *= 2;
+            mthl_display_item_t *items = realloc(display->items, capacity * sizeof(mthl_display_item_t));
+            if (!items) {
+                fprintf(stderr, "Out of memory while drawing the page\n");
+                exit(1);
+            }
+            display->items = items;
+            display->capacity = capacity;
+        }
+        memset(&display->items[display->count], 0,
+               (index + 1 - display->count) * sizeof(mthl_display_item_t));
+        display->count = index + 1;
+    }
+
+    mthl_display_item_t *old = &display->items[index];
+    if (memcmp(old, item, sizeof(*item)) == 0) return;
+    if (painted(old)) mthl_display_damage(display, old->box);
+    if (painted(item)) mthl_display_damage(display, item->box);
+    *old = *item;
+}
+
+void mthl_display_truncate(mthl_display_t *display, uint32_t count) {
+    for (uint32_t i = count; i < display->count; i++) {
+        if (painted(&display->items[i])) mthl_display_damage(display, display->items[i].box);
+    }
+    if (count < display->count) display->count = count;
+}
+
+/* "#rrggbb"; anything else is not painted */
+static uint32_t color_of(ASTDocument *doc, mthl_value_t value) {
+    if (value.type != VAL_COLOR || ast_symbol_length(doc, value.i) != 7) return 0;
+    return MTHL_OPAQUE | (uint32_t)strtoul(ast_symbol_name(doc, value.i) + 1, NULL, 16);
+}
+
+void mthl_display_sync(mthl_display_t *display, const mthl_runtime_t *rt, const mthl_layout_t *layout) {
+    uint32_t count = rt->element_count < layout->count ? rt->element_count : layout->count;
+
+    display->doc = rt->doc;
+    for (uint32_t i = 0; i < count; i++) {
+        const mthl_element_t *element = &rt->elements[i];
+        mthl_display_item_t item;
+
+        memset(&item, 0, sizeof(item));
+        item.box = *mthl_layout_box(layout, i);
+        item.fill = color_of(rt->doc, element->fill.type != VAL_NONE ? element->fill : element->background);
+        item.content = element->content;
+        if (item.content.type != VAL_NONE) {
+            item.color = element->color.type != VAL_NONE ? color_of(rt->doc, element->color) : MTHL_OPAQUE;
+            item.font_size = element->font[1].type == VAL_INT ? element->font[1].i : 0;
+        }
+        mthl_display_set(display, i, &item);
+    }
+    mthl_display_truncate(display, count);
+}
+
+static uint64_t fill_box(uint32_t *pixels, int32_t stride, mthl_box_t box, uint32_t color) {
+    for (int32_t y = box.y; y < box.y + box.height; y++) {
+        uint32_t *row = pixels + (size_t)y * stride;
+        for (int32_t x = box.x; x < box.x + box.width; x++) row[x] = color;
+    }
+    return (uint64_t)box.width * box.height;
+}
+
+uint64_t mthl_display_paint(const mthl_display_t *display, uint32_t *pixels, mthl_box_t area) {
+    mthl_box_t screen = { 0, 0, display->width, display->height };
+    mthl_box_t part;
+    uint64_t written;
+
+    if (!mthl_box_intersect(area, screen, &area)) return 0;
+    written = fill_box(pixels, display->width, area, 0xFFFFFFFFu);
+    for (uint32_t i = 0; i < display->count; i++) {
+        const mthl_display_item_t *item = &display->items[i];
+        if ((item->fill >> 24) == 0 || !mthl_box_intersect(item->box, area, &part)) continue;
+        written += fill_box(pixels, display->width, part, item->fill);
+    }
+    return written;
+}
+
+/* Benchmark */
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void mthl_display_benchmark(ASTDocument *doc, ast_index_t root, int iterations) {
+    const int32_t width = 800, height = 600;
+    mthl_box_t screen = { 0, 0, width, height };
+    mthl_runtime_t rt;
+    mthl_layout_t layout;
+    mthl_display_t display;
+    uint64_t full_pixels = 0, damage_pixels = 0;
+    uint32_t moving;
+
+    mthl_runtime_init(&rt, doc);
+    mthl_walk_page(&rt, root);
+
+    uint32_t *frame = malloc((size_t)width * height * sizeof(uint32_t));
+    uint32_t *full = malloc((size_t)width * height * sizeof(uint32_t));
+    if (!frame || !full) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    mthl_layout_init(&layout, &rt, width, height);
+    mthl_layout_update(&layout);
+    mthl_display_init(&display, doc, width, height);
+    mthl_display_sync(&display, &rt, &layout);
+
+    /* The last element drawn on screen with a position of its own is the
+     * one animated, most often a small one near the leaves */
+    mthl_box_t shown;
+    for (moving = display.count; moving > 0; moving--) {
+        if (rt.elements[moving - 1].position[0].type != VAL_NONE && painted(&display.items[moving - 1]) &&
+            mthl_box_intersect(display.items[moving - 1].box, screen, &shown)) break;
+    }
+    if (moving-- == 0) {
+        fprintf(stderr, "No element to move\n");
+        free(frame);
+        free(full);
+        mthl_display_free(&display);
+        mthl_layout_free(&layout);
+        mthl_runtime_free(&rt);
+        return;
+    }
+    mthl_display_paint(&display, frame, screen);
+    mthl_display_clear_damage(&display);
+
+    double start = now_ms();
+    for (int i = 0; i < iterations; i++) full_pixels += mthl_display_paint(&display, full, screen);
+    double full_ms = (now_ms() - start) / iterations;
+
+    /* Back and forth, 5 units a frame */
+    start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        rt.elements[moving].position[0].i += i % 40 < 20 ? 5 : -5;
+        mthl_layout_invalidate(&layout, moving);
+        mthl_layout_update(&layout);
+        mthl_display_sync(&display, &rt, &layout);
+        for (uint32_t d = 0; d < display.damage_count; d++) {
+            damage_pixels += mthl_display_paint(&display, frame, display.damage[d]);
+        }
+        mthl_display_clear_damage(&display);
+    }
+    double damage_ms = (now_ms() - start) / iterations;
+
+    mthl_display_paint(&display, full, screen);
+    int match = memcmp(frame, full, (size_t)width * height * sizeof(uint32_t)) == 0;
+
+    printf("%u elements, moving element %u\n", rt.element_count, moving);
+    printf("full   %10.3f ms per frame, %llu pixels painted\n",
+           full_ms, (unsigned long long)(full_pixels / iterations));
+    printf("damage %10.3f ms per frame, %llu pixels painted\n",
+           damage_ms, (unsigned long long)(damage_pixels / iterations));
+    printf("speedup %.1fx, frames %s\n", damage_ms > 0 ? full_ms / damage_ms : 0.0,
+           match ? "match" : "DIFFER");
+
+    free(frame);
+    free(full);
+    mthl_display_free(&display);
+    mthl_layout_free(&layout);
+    mthl_runtime_free(&rt);
+}
@@ -0,0 +1,93 @@
+/* mthl_display.h - Retained display list and damage for MTHL pages */
+#ifndef MTHL_DISPLAY_H
+#define MTHL_DISPLAY_H
+
+#include <stdint.h>
+#include "mthl_layout.h"
+
+/*
+ * The display list keeps what was last drawn for each element: its box,
+ * its fill and its text. Bringing it up to date compares each element
+ * with its item, and only an item that differs damages the screen, where
+ * it was and where it is now. A frame repaints the damage and nothing
+ * else; a frame without damage does not need to be drawn at all.
+ *
+ * Damage is kept as a few rectangles. A new one that overlaps one already
+ * kept is merged into it, and once MTHL_DAMAGE_MAX are kept, into the one
+ * it grows least.
+ *
+ * Items are painted in element order, parents before children, each
+ * clipped to the damage being repaired. mthl_display_paint is a software
+ * painter for fills, used to check and time damage repaint without a
+ * window; the browser paints the same items with cairo.
+ */
+
+#define MTHL_DAMAGE_MAX 16
+
+/* Colors are 0xAARRGGBB; an alpha of 0 is not painted */
+#define MTHL_OPAQUE 0xFF000000u
+
+typedef struct mthl_display_item {
+    mthl_box_t box;
+    uint32_t fill;
+    uint32_t color;             /* Of the text */
+    mthl_value_t content;       /* VAL_NONE without text */
+    int32_t font_size;
+} mthl_display_item_t;
+
+typedef struct mthl_display {
+    ASTDocument *doc;           /* Symbols of text contents */
+    int32_t width;
+    int32_t height;
+    mthl_display_item_t *items;
+    uint32_t count;
+    uint32_t capacity;
+    mthl_box_t damage[MTHL_DAMAGE_MAX];
+    uint32_t damage_count;
+} mthl_display_t;
+
+void mthl_display_init(mthl_display_t *display, ASTDocument *doc, int32_t width, int32_t height);
+void mthl_display_free(mthl_display_t *display);
+
+/* Damages the whole display */
+void mthl_display_resize(mthl_display_t *display, int32_t width, int32_t height);
+
+/* Replaces item index, damaging both boxes if it changed */
+void mthl_display_set(mthl_display_t *display, uint32_t index, const mthl_display_item_t *item);
+
+/* Drops the items from count on, damaging where they were */
+void mthl_display_truncate(mthl_display_t *display, uint32_t count);
+
+/* Brings the items up to date with the page's elements and their boxes */
+void mthl_display_sync(mthl_display_t *display, const mthl_runtime_t *rt, const mthl_layout_t *layout);
+
+void mthl_display_damage(mthl_display_t *display, mthl_box_t box);
+
+static inline void mthl_display_clear_damage(mthl_display_t *display) {
+    display->damage_count = 0;
+}
+
+/* Sets out to the overlap of a and b; returns 0 if there is none */
+static inline int mthl_box_intersect(mthl_box_t a, mthl_box_t b, mthl_box_t *out) {
+    int32_t x0 = a.x > b.x ? a.x : b.x;
+    int32_t y0 = a.y > b.y ? a.y : b.y;
+    int32_t x1 = a.x + a.width < b.x + b.width ? a.x + a.width : b.x + b.width;
+    int32_t y1 = a.y + a.height < b.y + b.height ? a.y + a.height : b.y + b.height;
+
+    if (x0 >= x1 || y0 >= y1) return 0;
+    out->x = x0;
+    out->y = y0;
+    out->width = x1 - x0;
+    out->height = y1 - y0;
+    return 1;
+}
+
+/* Paints the fills of the items over area of a width x height frame of
+ * 0xAARRGGBB pixels, on white; returns the pixels written */
+uint64_t mthl_display_paint(const mthl_display_t *display, uint32_t *pixels, mthl_box_t area);
+
+/* Times moving one element a frame, repainting its damage, against
+ * repainting the whole frame, and checks the two frames match */
+void mthl_display_benchmark(ASTDocument *doc, ast_index_t root, int iterations);
+
+#endif
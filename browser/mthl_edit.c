@@ -0,0 +1,320 @@
+/* mthl_edit.c - Incremental reparsing of edited MTHL pages */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mthl.tab.h"  /* Bison-generated header, pulls in mthl_ast.h */
+#include "mthl_edit.h"
+
+extern int yyparse();
+extern ast_index_t ast_root;
+extern ast_index_t ast_fragment;
+
+/* Block reparses leave the replaced nodes behind in the arena; past this
+ * many nodes per node of the last full parse, the next edit reparses the
+ * page to start over with a clean one */
+#define EDIT_GARBAGE_RATIO 4
+
+static int parse_page(mthl_editor_t *editor) {
+    mthl_lexer_t *lexer = &editor->lexer;
+
+    editor->root = AST_NONE;
+    ast_document_free(&editor->doc);
+    if (ast_document_init(&editor->doc, mthl_lexer_size(lexer)) < 0) return -1;
+    if (ast_track_spans(&editor->doc) < 0) return -1;
+
+    ast_doc = &editor->doc;
+    mthl_lexer = lexer;
+    lexer->cursor = lexer->source;
+    ast_root = AST_NONE;
+    if (yyparse() == 0) editor->root = ast_root;
+    editor->parsed_nodes = editor->doc.node_count;
+    return 0;
+}
+
+int mthl_editor_open(mthl_editor_t *editor, mthl_lexer_t *lexer) {
+    memset(editor, 0, sizeof(*editor));
+    editor->lexer = *lexer;
+    memset(lexer, 0, sizeof(*lexer));
+    return parse_page(editor);
+}
+
+void mthl_editor_close(mthl_editor_t *editor) {
+    ast_document_free(&editor->doc);
+    mthl_lexer_free(&editor->lexer);
+    memset(editor, 0, sizeof(*editor));
+}
+
+/* The deepest node whose block contents hold all of [from, to), found by
+ * descending through the children whose spans cover it */
+static ast_index_t enclosing_block(ASTDocument *doc, ast_index_t node, uint32_t from, uint32_t to) {
+    ast_index_t block = AST_NONE;
+
+    while (node != AST_NONE) {
+        ASTSpan *span = &doc->spans[node];
+        if (span->content != 0 && span->content <= from && to + 2 <= span->end) block = node;
+
+        ast_index_t inner = AST_NONE;
+        for (AST_EACH_CHILD(doc, node, child)) {
+            ASTSpan *child_span = &doc->spans[child];
+            if (child_span->end != 0 && child_span->start <= from && to <= child_span->end) {
+                inner = child;
+                break;
+            }
+        }
+        node = inner;
+    }
+    return block;
+}
+
+/* The run of items in block that an edit of [from, to) can change: from
+ * the last one starting at or before from to the first one ending at or
+ * after to. Neighbours are included so that text typed between two items
+ * can join either. */
+typedef struct item_run {
+    ast_index_t before;         /* Item ahead of the run, or AST_NONE */
+    ast_index_t first;
+    ast_index_t last;
+    uint32_t start;
+    uint32_t end;
+} item_run_t;
+
+static void affected_items(ASTDocument *doc, ast_index_t block, uint32_t from, uint32_t to, item_run_t *run) {
+    ASTSpan *spans = doc->spans;
+    ast_index_t previous = AST_NONE;
+
+    run->before = AST_NONE;
+    run->first = doc->nodes[block].first_child;
+    run->start = spans[block].content;
+    for (AST_EACH_CHILD(doc, block, item)) {
+        if (spans[item].start > from) break;
+        run->before = previous;
+        run->first = item;
+        run->start = spans[item].start;
+        previous = item;
+    }
+
+    run->last = run->first;
+    run->end = spans[block].end - 2;
+    for (ast_index_t item = run->first; item != AST_NONE; item = doc->nodes[item].next_sibling) {
+        run->last = item;
+        if (spans[item].end >= to) {
+            run->end = spans[item].end;
+            break;
+        }
+    }
+}
+
+/*
+ * Puts the freshly parsed items in place of the run. A fresh item wholly
+ * before the edit, or wholly after it, with the same span as an old one
+ * has the same text and so the same tree, and the old item is kept in its
+ * place. Then every old span past the edit moves by the change in length.
+ */
+static void splice(ASTDocument *doc, ast_index_t block, item_run_t *run, ast_index_t fresh,
+                   uint32_t first_new, uint32_t offset, uint32_t removed, uint32_t length) {
+    ASTNode *nodes = doc->nodes;
+    ASTSpan *spans = doc->spans;
+    uint32_t delta = length - removed;      /* Wraps when the text shrinks */
+    ast_index_t old = run->first;
+    ast_index_t stop = nodes[run->last].next_sibling;
+    ast_index_t last = run->before;
+
+    for (ast_index_t item = fresh; item != AST_NONE; ) {
+        ast_index_t next = nodes[item].next_sibling;
+        ast_index_t keep = item;
+        ASTSpan span = spans[item];
+        int before = span.end <= offset;
+        int after = span.start >= offset + length;
+
+        if (before || after) {
+            uint32_t start = after ? span.start - delta : span.start;
+            uint32_t end = after ? span.end - delta : span.end;
+            while (old != stop && spans[old].start < start) old = nodes[old].next_sibling;
+            if (old != stop && spans[old].start == start && spans[old].end == end &&
+                (before ? end <= offset : start >= offset + removed)) {
+                keep = old;
+                old = nodes[old].next_sibling;
+            }
+        }
+
+        if (last == AST_NONE) nodes[block].first_child = keep;
+        else nodes[last].next_sibling = keep;
+        last = keep;
+        item = next;
+    }
+    nodes[last].next_sibling = stop;
+
+    for (uint32_t i = 1; i < first_new; i++) {
+        ASTSpan *span = &spans[i];
+        if (span->end == 0) continue;
+        if (span->start >= offset + removed) span->start += delta;
+        if (span->end > offset + removed) span->end += delta;
+        if (span->content > offset + removed) span->content += delta;
+    }
+}
+
+/* Parses the edited text of the affected items in block on its own */
+static int parse_items(mthl_editor_t *editor, ast_index_t block,
+                       uint32_t offset, uint32_t removed, uint32_t length) {
+    ASTDocument *doc = &editor->doc;
+    mthl_lexer_t *lexer = &editor->lexer;
+    const char *end = lexer->end;
+    uint32_t first_new = doc->node_count;
+    int kind = doc->nodes[block].kind;
+    int elements = kind == AST_CONTAINER || kind == AST_TEXT ||
+                   kind == AST_RECTANGLE || kind == AST_BUTTON;
+    item_run_t run;
+
+    affected_items(doc, block, offset, offset + removed, &run);
+
+    ast_doc = doc;
+    mthl_lexer = lexer;
+    lexer->cursor = lexer->source + run.start;
+    lexer->end = lexer->source + (run.end - removed + length);
+    lexer->start_token = elements ? FRAGMENT_PROPERTIES : FRAGMENT_STATEMENTS;
+    lexer->fragment = 1;
+    lexer->truncated = 0;
+    ast_fragment = AST_NONE;
+
+    /* A comment, string or name running past the end would have taken
+     * the text after it in with it in the page */
+    int failed = yyparse() != 0 || lexer->truncated || ast_fragment == AST_NONE;
+
+    lexer->end = end;
+    lexer->start_token = 0;
+    lexer->fragment = 0;
+    if (failed) return -1;
+
+    splice(doc, block, &run, ast_fragment, first_new, offset, removed, length);
+    return 0;
+}
+
+int mthl_editor_edit(mthl_editor_t *editor, size_t offset, size_t removed,
+                     const char *text, size_t length) {
+    ast_index_t block = AST_NONE;
+    size_t size = mthl_lexer_size(&editor->lexer);
+
+    if (offset > size || removed > size - offset) return -1;
+    if (size - removed + length > UINT32_MAX) return -1;
+
+    if (editor->root != AST_NONE &&
+        editor->doc.node_count / EDIT_GARBAGE_RATIO < editor->parsed_nodes) {
+        block = enclosing_block(&editor->doc, editor->root, offset, offset + removed);
+    }
+
+    if (mthl_lexer_edit(&editor->lexer, offset, removed, text, length) < 0) return -1;
+
+    if (block != AST_NONE && parse_items(editor, block, offset, removed, length) == 0) {
+        return MTHL_EDIT_BLOCK;
+    }
+    if (parse_page(editor) < 0 || editor->root == AST_NONE) return -1;
+    return MTHL_EDIT_PAGE;
+}
+
+/* Benchmark */
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int symbol_kind(int kind) {
+    switch (kind) {
+        case AST_PAGE:
+        case AST_VAR_DECL:
+        case AST_ASSIGN:
+        case AST_ARRAY_ASSIGN:
+        case AST_STRING:
+        case AST_COLOR:
+        case AST_VARIABLE:
+        case AST_ARRAY_ACCESS:
+        case AST_PROPERTY_ACCESS:
+            return 1;
+    }
+    return 0;
+}
+
+/* Same shape, values and spans; symbol ids differ between documents */
+static int same_tree(ASTDocument *a, ast_index_t x, ASTDocument *b, ast_index_t y) {
+    ASTNode *p = &a->nodes[x], *q = &b->nodes[y];
+
+    if (p->kind != q->kind || p->op != q->op || p->flags != q->flags) return 0;
+    if (memcmp(&a->spans[x], &b->spans[y], sizeof(ASTSpan)) != 0) return 0;
+    if (symbol_kind(p->kind) ? strcmp(ast_string(a, x), ast_string(b, y)) != 0
+                             : p->value.ival != q->value.ival) {
+        return 0;
+    }
+
+    ast_index_t u = p->first_child, v = q->first_child;
+    for (; u != AST_NONE && v != AST_NONE; u = a->nodes[u].next_sibling, v = b->nodes[v].next_sibling) {
+        if (!same_tree(a, u, b, v)) return 0;
+    }
+    return u == v;
+}
+
+/* Each iteration changes one digit, somewhere in the page, to the next
+ * one, which always leaves a page that parses */
+void mthl_edit_benchmark(mthl_editor_t *editor, int iterations) {
+    mthl_lexer_t *lexer = &editor->lexer;
+    size_t size = mthl_lexer_size(lexer);
+    uint32_t *digits = malloc(size * sizeof(uint32_t));
+    uint32_t digit_count = 0;
+    uint32_t seed = 1;
+    int results[2] = { 0, 0 };
+
+    if (!digits || editor->root == AST_NONE) {
+        free(digits);
+        return;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (lexer->source[i] >= '0' && lexer->source[i] <= '9') digits[digit_count++] = i;
+    }
+    if (digit_count == 0) {
+        fprintf(stderr, "No digits to edit\n");
+        free(digits);
+        return;
+    }
+
+    double start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        seed = seed * 1103515245u + 12345u;
+        uint32_t offset = digits[(seed >> 8) % digit_count];
+        char digit = '0' + (lexer->source[offset] - '0' + 1) % 10;
+        int result = mthl_editor_edit(editor, offset, 1, &digit, 1);
+        if (result < 0) break;
+        results[result]++;
+    }
+    double edit_ms = (now_ms() - start) / iterations;
+    free(digits);
+
+    /* The same text parsed from scratch */
+    mthl_editor_t fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    fresh.lexer = *lexer;
+    fresh.lexer.source = malloc(lexer->capacity + MTHL_LEX_PADDING);
+    fresh.lexer.scratch = NULL;
+    fresh.lexer.scratch_capacity = 0;
+    if (!fresh.lexer.source) return;
+    memcpy(fresh.lexer.source, lexer->source, size + MTHL_LEX_PADDING);
+    fresh.lexer.end = fresh.lexer.source + size;
+    fresh.lexer.block = NULL;
+
+    int parses = iterations < 20 ? iterations : 20;
+    start = now_ms();
+    for (int i = 0; i < parses; i++) parse_page(&fresh);
+    double parse_ms = (now_ms() - start) / parses;
+
+    int match = fresh.root != AST_NONE && editor->root != AST_NONE &&
+                same_tree(&editor->doc, editor->root, &fresh.doc, fresh.root);
+
+    printf("%d edits: %d block, %d page reparses, %u nodes (%u after a full parse)\n",
+           iterations, results[MTHL_EDIT_BLOCK], results[MTHL_EDIT_PAGE],
+           editor->doc.node_count, fresh.doc.node_count);
+    printf("edit   %10.3f ms per edit\n", edit_ms);
+    printf("parse  %10.3f ms per page\n", parse_ms);
+    printf("speedup %.1fx, trees %s\n", edit_ms > 0 ? parse_ms / edit_ms : 0.0,
+           match ? "match" : "DIFFER");
+
+    mthl_editor_close(&fresh);
+}
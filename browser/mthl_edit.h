@@ -0,0 +1,47 @@
+/* mthl_edit.h - Incremental reparsing of edited MTHL pages */
+#ifndef MTHL_EDIT_H
+#define MTHL_EDIT_H
+
+#include <stddef.h>
+#include "mthl_ast.h"
+#include "mthl_lex.h"
+
+/*
+ * An editor holds a page's source and its tree with spans. An edit finds
+ * the smallest |< ... >| block around it and reparses only the statements
+ * or properties of that block it touches, splicing the result into the
+ * block's node: everything else keeps its node index, as does any
+ * reparsed statement whose text did not change. Edits that touch no
+ * single block, or whose statements do not parse on their own, reparse
+ * the whole page.
+ *
+ * The tree is the one the parser built: mthl_optimize rewrites nodes in
+ * place, so run it on a copy, never on an editor's document.
+ */
+
+typedef struct mthl_editor {
+    ASTDocument doc;
+    mthl_lexer_t lexer;
+    ast_index_t root;           /* AST_NONE if the page does not parse */
+    uint32_t parsed_nodes;      /* Node count after the last full parse */
+} mthl_editor_t;
+
+/* mthl_editor_edit results */
+#define MTHL_EDIT_PAGE  0       /* Reparsed the whole page */
+#define MTHL_EDIT_BLOCK 1       /* Reparsed within one block */
+
+/* Takes over lexer's source and parses it. Returns -1 if out of memory;
+ * a page that does not parse leaves root AST_NONE. */
+int mthl_editor_open(mthl_editor_t *editor, mthl_lexer_t *lexer);
+void mthl_editor_close(mthl_editor_t *editor);
+
+/* Replaces removed bytes at offset with length bytes of text. Returns an
+ * MTHL_EDIT_* result, or -1 if the page no longer parses. */
+int mthl_editor_edit(mthl_editor_t *editor, size_t offset, size_t removed,
+                     const char *text, size_t length);
+
+/* Times single-character edits against parsing the whole page, and checks
+ * the edited tree matches a fresh parse */
+void mthl_edit_benchmark(mthl_editor_t *editor, int iterations);
+
+#endif
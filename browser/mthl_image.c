@@ -0,0 +1,407 @@
+/* mthl_image.c - Writing and mapping precompiled MTHL pages */
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mthl_image.h"
+
+#define MTHLC_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/* FNV-1a over 64-bit words; sections are padded to whole words */
+static uint64_t mthlc_checksum(const uint8_t *data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash ^= word;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+int mthl_image_write(const char *path, ASTDocument *doc, ast_index_t root,
+                     mthl_program_t *program, int with_tree) {
+    /* Without the tree only the null node and the page node remain */
+    ASTNode page[2] = { { 0 }, doc->nodes[root] };
+    uint32_t node_count = with_tree ? doc->node_count : 2;
+    page[1].first_child = AST_NONE;
+    page[1].next_sibling = AST_NONE;
+
+    const void *data[MTHLC_SECTION_COUNT] = {
+        with_tree ? doc->nodes : page, doc->strings, doc->symbols, doc->symbol_slots,
+        program->code, program->constants
+    };
+    size_t sizes[MTHLC_SECTION_COUNT] = {
+        node_count * sizeof(ASTNode),
+        doc->string_size,
+        doc->symbol_count * sizeof(ASTSymbol),
+        (doc->symbol_slot_mask + 1) * sizeof(uint32_t),
+        program->code_size * sizeof(mthl_insn_t),
+        program->constant_count * sizeof(mthl_value_t)
+    };
+    uint32_t counts[MTHLC_SECTION_COUNT] = {
+        node_count, doc->string_size, doc->symbol_count, doc->symbol_slot_mask + 1,
+        program->code_size, program->constant_count
+    };
+
+    size_t size = MTHLC_ALIGN(sizeof(mthlc_header_t));
+    for (int i = 0; i < MTHLC_SECTION_COUNT; i++) size += MTHLC_ALIGN(sizes[i]);
+    if (size > UINT32_MAX) {
+        fprintf(stderr, "Page too large for an image\n");
+        return -1;
+    }
+
+    uint8_t *buffer = calloc(1, size);
+    if (!buffer) return -1;
+
+    mthlc_header_t *header = (mthlc_header_t *)buffer;
+    memcpy(header->magic, MTHLC_MAGIC, sizeof(header->magic));
+    header->version = MTHLC_VERSION;
+    header->byte_order = MTHLC_BYTE_ORDER;
+    header->file_size = size;
+    header->root = with_tree ? root : 1;
+    header->flags = with_tree ? 0 : MTHLC_FLAG_NO_TREE;
+    header->constant_base = program->constant_base;
+    header->variable_count = program->variable_count;
+    header->register_count = program->register_count;
+
+    size_t offset = MTHLC_ALIGN(sizeof(mthlc_header_t));
+    for (int i = 0; i < MTHLC_SECTION_COUNT; i++) {
+        header->sections[i].offset = offset;
+        header->sections[i].count = counts[i];
+        if (sizes[i] > 0) memcpy(buffer + offset, data[i], sizes[i]);
+        offset += MTHLC_ALIGN(sizes[i]);
+    }
+
+    if (!with_tree) {
+        mthl_insn_t *code = (mthl_insn_t *)(buffer + header->sections[MTHLC_CODE].offset);
+        for (uint32_t pc = 0; pc < program->code_size; pc++) {
+            if (code[pc].op != VM_BEGIN) continue;
+            code[pc].b = 0;
+            code[pc].c = 0;
+        }
+    }
+
+    size_t body = MTHLC_ALIGN(sizeof(mthlc_header_t));
+    header->checksum = mthlc_checksum(buffer + body, size - body);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot create %s\n", path);
+        free(buffer);
+        return -1;
+    }
+    size_t written = fwrite(buffer, 1, size, file);
+    int closed = fclose(file);
+    free(buffer);
+
+    if (written != size || closed != 0) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Validation. A checksum only catches damage, and images come from other
+ * nodes, so every index that will be followed is also bounds checked.
+ * All of it is one linear pass over each section. */
+
+static void *mthlc_section(mthl_image_t *image, int section, size_t element_size) {
+    mthlc_header_t *header = image->base;
+    mthlc_section_t *s = &header->sections[section];
+
+    if (s->offset % 8 != 0 || s->offset < sizeof(mthlc_header_t)) return NULL;
+    if ((uint64_t)s->offset + (uint64_t)s->count * element_size > image->size) return NULL;
+    return (uint8_t *)image->base + s->offset;
+}
+
+static int mthlc_symbol_kind(int kind) {
+    switch (kind) {
+        case AST_PAGE:
+        case AST_VAR_DECL:
+        case AST_ASSIGN:
+        case AST_ARRAY_ASSIGN:
+        case AST_STRING:
+        case AST_COLOR:
+        case AST_VARIABLE:
+        case AST_ARRAY_ACCESS:
+        case AST_PROPERTY_ACCESS:
+            return 1;
+    }
+    return 0;
+}
+
+static int mthlc_check_document(ASTDocument *doc) {
+    if (doc->string_size == 0 || doc->strings[doc->string_size - 1] != '\0') return 0;
+
+    for (uint32_t i = 0; i < doc->symbol_count; i++) {
+        ASTSymbol *symbol = &doc->symbols[i];
+        if ((uint64_t)symbol->offset + symbol->length >= doc->string_size) return 0;
+        if (doc->strings[symbol->offset + symbol->length] != '\0') return 0;
+    }
+    if (doc->symbol_count <= AST_SYM_LENGTH) return 0;
+
+    /* ast_intern probes until it finds the name or a free slot: every
+     * symbol is in the table once, and the rest of it is free */
+    uint64_t slots = (uint64_t)doc->symbol_slot_mask + 1;
+    if (slots < 2 || (slots & (slots - 1)) != 0 || slots < (uint64_t)doc->symbol_count * 2) return 0;
+    uint8_t *seen = calloc(doc->symbol_count, 1);
+    if (!seen) return 0;
+    uint32_t used = 0;
+    for (uint64_t i = 0; i < slots; i++) {
+        uint32_t entry = doc->symbol_slots[i];
+        if (entry == 0) continue;
+        if (entry > doc->symbol_count || seen[entry - 1]) {
+            free(seen);
+            return 0;
+        }
+        seen[entry - 1] = 1;
+        used++;
+    }
+    free(seen);
+    if (used != doc->symbol_count) return 0;
+
+    for (uint32_t i = 1; i < doc->node_count; i++) {
+        ASTNode *node = &doc->nodes[i];
+        if (node->kind == AST_INVALID || node->kind >= AST_KIND_COUNT || node->op > OP_NOT) return 0;
+        if (node->first_child >= doc->node_count || node->next_sibling >= doc->node_count) return 0;
+        if (mthlc_symbol_kind(node->kind) && node->value.sym >= doc->symbol_count) return 0;
+    }
+    return 1;
+}
+
+/* A fused compare keeps its target in the next slot, a HALT that is
+ * never run; 1 if pc is one of those */
+static int mthlc_is_data(const uint8_t *data, uint32_t pc) {
+    return (data[pc / 8] >> (pc % 8)) & 1;
+}
+
+/* First pass: operands and targets in range, marking target slots */
+static int mthlc_check_code(mthl_program_t *program, ASTDocument *doc, uint8_t *data) {
+    uint32_t registers = program->register_count;
+    uint32_t size = program->code_size;
+
+    for (uint32_t pc = 0; pc < size; pc++) {
+        mthl_insn_t *insn = &program->code[pc];
+        uint32_t a = insn->a, b = insn->b, c = insn->c;
+
+        switch (insn->op) {
+            case VM_HALT:
+            case VM_END:
+            case VM_REDRAW:
+            case VM_RET:
+                break;
+            case VM_MOVE:
+            case VM_NOT:
+            case VM_PROP:
+                if (a >= registers || b >= registers) return 0;
+                break;
+            case VM_ADD: case VM_SUB: case VM_MUL: case VM_DIV:
+            case VM_GT: case VM_LT: case VM_GE: case VM_LE: case VM_EQ: case VM_NE:
+            case VM_AND: case VM_OR:
+            case VM_GETIDX:
+            case VM_SETIDX:
+                if (a >= registers || b >= registers || c >= registers) return 0;
+                break;
+            case VM_JMP:
+            case VM_ONCLICK:
+                if (VM_WIDE(insn) >= size) return 0;
+                break;
+            case VM_JMPF:
+            case VM_JMPT:
+                if (a >= registers || VM_WIDE(insn) >= size) return 0;
+                break;
+            case VM_JLT:
+            case VM_JNLT:
+                if (a >= registers || b >= registers) return 0;
+                if (pc + 2 >= size || insn[1].op != VM_HALT || VM_WIDE(insn + 1) >= size) return 0;
+                pc++;
+                data[pc / 8] |= 1 << (pc % 8);
+                break;
+            case VM_NEWARRAY:
+                if (a >= registers || b + c > registers) return 0;
+                break;
+            case VM_BEGIN:
+                if (a < AST_CONTAINER || a > AST_BUTTON || VM_WIDE(insn) >= doc->node_count) return 0;
+                break;
+            case VM_SETPROP: {
+                uint32_t arguments = a == AST_PROP_POSITION ? 4 : a == AST_PROP_FONT ? 3 : 1;
+                if (a < AST_PROP_POSITION || a > AST_PROP_ALIGN || b + arguments > registers) return 0;
+                break;
+            }
+            default:
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* Second pass: no jump, branch or handler may land on a target slot */
+static int mthlc_check_targets(mthl_program_t *program, const uint8_t *data) {
+    for (uint32_t pc = 0; pc < program->code_size; pc++) {
+        mthl_insn_t *insn = &program->code[pc];
+
+        if (mthlc_is_data(data, pc)) continue;
+        switch (insn->op) {
+            case VM_JMP:
+            case VM_ONCLICK:
+            case VM_JMPF:
+            case VM_JMPT:
+                if (mthlc_is_data(data, VM_WIDE(insn))) return 0;
+                break;
+            case VM_JLT:
+            case VM_JNLT:
+                if (mthlc_is_data(data, VM_WIDE(insn + 1))) return 0;
+                break;
+            default:
+                break;
+        }
+    }
+    return 1;
+}
+
+static int mthlc_check_program(mthl_program_t *program, ASTDocument *doc) {
+    uint32_t registers = program->register_count;
+    uint32_t size = program->code_size;
+
+    if (program->constant_base != program->variable_count) return 0;
+    if ((uint64_t)program->constant_base + program->constant_count > registers) return 0;
+    for (uint32_t i = 0; i < program->constant_count; i++) {
+        mthl_value_t *value = &program->constants[i];
+        if (value->type == VAL_NONE || value->type >= VAL_ARRAY) return 0;
+        if ((value->type == VAL_STRING || value->type == VAL_COLOR) &&
+            (uint32_t)value->i >= doc->symbol_count) {
+            return 0;
+        }
+    }
+
+    /* The page and each handler end in HALT or RET */
+    if (size == 0) return 0;
+    if (program->code[size - 1].op != VM_HALT && program->code[size - 1].op != VM_RET) return 0;
+
+    uint8_t *data = calloc(size / 8 + 1, 1);
+    if (!data) return 0;
+    int valid = mthlc_check_code(program, doc, data) && mthlc_check_targets(program, data);
+    free(data);
+    return valid;
+}
+
+int mthl_image_open(const char *path, mthl_image_t *image) {
+    struct stat st;
+
+    memset(image, 0, sizeof(*image));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open file: %s\n", path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(mthlc_header_t)) {
+        fprintf(stderr, "%s: not a page image\n", path);
+        close(fd);
+        return -1;
+    }
+
+    image->size = st.st_size;
+    image->base = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image->base == MAP_FAILED) {
+        image->base = NULL;
+        fprintf(stderr, "%s: cannot map\n", path);
+        return -1;
+    }
+
+    mthlc_header_t *header = image->base;
+    const char *problem = NULL;
+    size_t body = MTHLC_ALIGN(sizeof(mthlc_header_t));
+
+    if (memcmp(header->magic, MTHLC_MAGIC, sizeof(header->magic)) != 0) {
+        problem = "not a page image";
+    } else if (header->version != MTHLC_VERSION || header->byte_order != MTHLC_BYTE_ORDER) {
+        problem = "image from another version or byte order";
+    } else if (header->file_size != image->size || image->size % 8 != 0) {
+        problem = "truncated";
+    } else if (mthlc_checksum((uint8_t *)image->base + body, image->size - body) != header->checksum) {
+        problem = "checksum mismatch";
+    }
+
+    if (!problem) {
+        ASTDocument *doc = &image->doc;
+        mthl_program_t *program = &image->program;
+
+        doc->nodes = mthlc_section(image, MTHLC_NODES, sizeof(ASTNode));
+        doc->strings = mthlc_section(image, MTHLC_STRINGS, 1);
+        doc->symbols = mthlc_section(image, MTHLC_SYMBOLS, sizeof(ASTSymbol));
+        doc->symbol_slots = mthlc_section(image, MTHLC_SYMBOL_SLOTS, sizeof(uint32_t));
+        doc->node_count = doc->node_capacity = header->sections[MTHLC_NODES].count;
+        doc->string_size = doc->string_capacity = header->sections[MTHLC_STRINGS].count;
+        doc->symbol_count = doc->symbol_capacity = header->sections[MTHLC_SYMBOLS].count;
+        doc->symbol_slot_mask = header->sections[MTHLC_SYMBOL_SLOTS].count - 1;
+        doc->borrowed = AST_BORROWED_NODES | AST_BORROWED_STRINGS |
+                        AST_BORROWED_SYMBOLS | AST_BORROWED_SLOTS;
+
+        program->code = mthlc_section(image, MTHLC_CODE, sizeof(mthl_insn_t));
+        program->constants = mthlc_section(image, MTHLC_CONSTANTS, sizeof(mthl_value_t));
+        program->code_size = program->code_capacity = header->sections[MTHLC_CODE].count;
+        program->constant_count = header->sections[MTHLC_CONSTANTS].count;
+        program->constant_base = header->constant_base;
+        program->variable_count = header->variable_count;
+        program->register_count = header->register_count;
+        program->borrowed = 1;
+        image->root = header->root;
+
+        if (!doc->nodes || !doc->strings || !doc->symbols || !doc->symbol_slots ||
+            !program->code || !program->constants ||
+            !mthlc_check_document(doc) || !mthlc_check_program(program, doc) ||
+            image->root == AST_NONE || image->root >= doc->node_count ||
+            doc->nodes[image->root].kind != AST_PAGE) {
+            problem = "corrupt image";
+        }
+    }
+
+    if (problem) {
+        fprintf(stderr, "%s: %s\n", path, problem);
+        munmap(image->base, image->size);
+        memset(image, 0, sizeof(*image));
+        return -1;
+    }
+    return 0;
+}
+
+void mthl_image_close(mthl_image_t *image) {
+    /* Frees whatever grew out of the mapping while the page ran */
+    ast_document_free(&image->doc);
+    mthl_program_free(&image->program);
+    if (image->base) munmap(image->base, image->size);
+    memset(image, 0, sizeof(*image));
+}
+
+int mthl_image_compile(ASTDocument *doc, ast_index_t root, const char *path, int with_tree) {
+    mthl_program_t program;
+
+    root = ast_compact(doc, root);
+    if (mthl_compile(doc, root, &program) < 0) {
+        fprintf(stderr, "Page too large to compile\n");
+        return -1;
+    }
+
+    int result = mthl_image_write(path, doc, root, &program, with_tree);
+    mthl_program_free(&program);
+    return result;
+}
+
+void mthl_image_run(mthl_image_t *image) {
+    mthl_runtime_t rt;
+    mthl_vm_t vm;
+
+    mthl_runtime_init(&rt, &image->doc);
+    if (mthl_vm_init(&vm, &rt, &image->program) == 0) {
+        mthl_vm_run(&vm);
+        mthl_vm_free(&vm);
+    }
+    mthl_print_elements(&rt, 0, stdout);
+    mthl_runtime_free(&rt);
+}
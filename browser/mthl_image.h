@@ -0,0 +1,87 @@
+/* mthl_image.h - Precompiled MTHL pages (.mthlc) */
+#ifndef MTHL_IMAGE_H
+#define MTHL_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mthl_ast.h"
+#include "mthl_runtime.h"
+
+/*
+ * A .mthlc file is a page after parsing, constant folding and compiling:
+ * the interned strings with their symbol table and hash slots, the
+ * bytecode, the constant registers and, optionally, the compacted node
+ * array. Running a page needs only the program; without the tree the node
+ * section holds just the page node and elements carry no node index.
+ *
+ * Every section is stored in the layout it has in memory, 8-byte aligned
+ * and found by offset from the start of the file, so opening one is an
+ * mmap, a checksum and a bounds check, with the document and program
+ * pointing straight into the mapping. Pages are private copy-on-write mappings, so running
+ * a page that interns new strings does not touch the file.
+ *
+ * Layouts are native, little-endian hosts only; any change to ASTNode,
+ * ASTSymbol, mthl_insn_t, mthl_value_t or the opcodes needs a version bump.
+ */
+
+#define MTHLC_MAGIC "MTHLC\r\n\032"
+#define MTHLC_VERSION 1
+#define MTHLC_BYTE_ORDER 0x01020304
+
+/* Header flags */
+#define MTHLC_FLAG_NO_TREE 0x0001
+
+enum {
+    MTHLC_NODES,
+    MTHLC_STRINGS,
+    MTHLC_SYMBOLS,
+    MTHLC_SYMBOL_SLOTS,
+    MTHLC_CODE,
+    MTHLC_CONSTANTS,
+    MTHLC_SECTION_COUNT
+};
+
+typedef struct mthlc_section {
+    uint32_t offset;        /* From the start of the file */
+    uint32_t count;         /* Elements, or bytes for strings */
+} mthlc_section_t;
+
+typedef struct mthlc_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t checksum;      /* Of everything after the header */
+    uint32_t file_size;
+    uint32_t root;
+    uint32_t constant_base;
+    uint32_t variable_count;
+    uint32_t register_count;
+    uint32_t flags;
+    mthlc_section_t sections[MTHLC_SECTION_COUNT];
+} mthlc_header_t;
+
+typedef struct mthl_image {
+    void *base;
+    size_t size;
+    ASTDocument doc;
+    mthl_program_t program;
+    ast_index_t root;
+} mthl_image_t;
+
+/* Writes doc and program to path; mthl_image_compile drops unreachable
+ * nodes first */
+int mthl_image_write(const char *path, ASTDocument *doc, ast_index_t root,
+                     mthl_program_t *program, int with_tree);
+
+/* Maps and checks an image; returns -1 with a message on stderr if the
+ * file is not a valid image of this version */
+int mthl_image_open(const char *path, mthl_image_t *image);
+void mthl_image_close(mthl_image_t *image);
+
+/* Compacts and compiles a parsed, folded page and writes it to path */
+int mthl_image_compile(ASTDocument *doc, ast_index_t root, const char *path, int with_tree);
+
+/* Runs an opened image and prints its elements */
+void mthl_image_run(mthl_image_t *image);
+
+#endif
@@ -0,0 +1,455 @@
+/* mthl_interp.c - MTHL runtime and tree-walking interpreter */
+#include <stdlib.h>
+#include <string.h>
+#include "mthl_runtime.h"
+
+static void *mthl_grow(void *items, uint32_t *capacity, size_t item_size, uint32_t needed) {
+    if (needed <= *capacity) return items;
+
+    uint32_t new_capacity = *capacity ? *capacity : 16;
+    while (new_capacity < needed) new_capacity *= 2;
+
+    void *grown = realloc(items, (size_t)new_capacity * item_size);
+    if (!grown) {
+        fprintf(stderr, "Out of memory while running the page\n");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+void mthl_runtime_init(mthl_runtime_t *rt, ASTDocument *doc) {
+    memset(rt, 0, sizeof(*rt));
+    rt->doc = doc;
+}
+
+void mthl_runtime_reset(mthl_runtime_t *rt) {
+    for (uint32_t i = 0; i < rt->array_count; i++) {
+        free(rt->arrays[i].items);
+    }
+    rt->array_count = 0;
+    rt->var_count = 0;
+    rt->element_count = 0;
+    rt->element_depth = 0;
+    rt->redraw_requested = 0;
+    rt->runs++;
+}
+
+void mthl_runtime_free(mthl_runtime_t *rt) {
+    mthl_runtime_reset(rt);
+    free(rt->var_symbols);
+    free(rt->var_values);
+    free(rt->arrays);
+    free(rt->elements);
+    free(rt->element_stack);
+    memset(rt, 0, sizeof(*rt));
+}
+
+/* Values */
+
+static int mthl_is_number(mthl_value_t value) {
+    return value.type == VAL_INT || value.type == VAL_PERCENT;
+}
+
+static int mthl_is_text(mthl_value_t value) {
+    return value.type == VAL_STRING || value.type == VAL_COLOR;
+}
+
+int mthl_truthy(mthl_runtime_t *rt, mthl_value_t value) {
+    switch (value.type) {
+        case VAL_INT:
+        case VAL_PERCENT:
+            return value.i != 0;
+        case VAL_STRING:
+        case VAL_COLOR:
+            return value.i != AST_SYM_EMPTY;
+        case VAL_ARRAY:
+            return rt->arrays[value.i].count > 0;
+    }
+    return 0;
+}
+
+/* Integer arithmetic wraps rather than trapping, and x / 0 is 0 */
+static int32_t mthl_arith(int op, int32_t x, int32_t y) {
+    switch (op) {
+        case OP_PLUS: return (int32_t)((uint32_t)x + (uint32_t)y);
+        case OP_MINUS: return (int32_t)((uint32_t)x - (uint32_t)y);
+        case OP_MULTIPLY: return (int32_t)((uint32_t)x * (uint32_t)y);
+        case OP_DIVIDE:
+            if (y == 0) return 0;
+            if (y == -1) return (int32_t)(0u - (uint32_t)x);
+            return x / y;
+    }
+    return 0;
+}
+
+void mthl_format_value(mthl_runtime_t *rt, mthl_value_t value, char *buffer, size_t size) {
+    switch (value.type) {
+        case VAL_INT:
+            snprintf(buffer, size, "%d", value.i);
+            break;
+        case VAL_PERCENT:
+            snprintf(buffer, size, "%d%%", value.i);
+            break;
+        case VAL_STRING:
+        case VAL_COLOR:
+            snprintf(buffer, size, "%s", ast_symbol_name(rt->doc, value.i));
+            break;
+        case VAL_ARRAY:
+            snprintf(buffer, size, "[%u items]", rt->arrays[value.i].count);
+            break;
+        default:
+            snprintf(buffer, size, "none");
+            break;
+    }
+}
+
+static mthl_value_t mthl_concat(mthl_runtime_t *rt, mthl_value_t left, mthl_value_t right) {
+    char left_text[32], right_text[32];
+    const char *a = left_text, *b = right_text;
+
+    if (mthl_is_text(left)) a = ast_symbol_name(rt->doc, left.i);
+    else mthl_format_value(rt, left, left_text, sizeof(left_text));
+    if (mthl_is_text(right)) b = ast_symbol_name(rt->doc, right.i);
+    else mthl_format_value(rt, right, right_text, sizeof(right_text));
+
+    size_t a_len = strlen(a), b_len = strlen(b);
+    char *joined = malloc(a_len + b_len + 1);
+    if (!joined) return (mthl_value_t){ VAL_NONE, 0 };
+    memcpy(joined, a, a_len);
+    memcpy(joined + a_len, b, b_len);
+
+    mthl_value_t value = { VAL_STRING, (int32_t)ast_intern(rt->doc, joined, a_len + b_len) };
+    free(joined);
+    return value;
+}
+
+mthl_value_t mthl_binary(mthl_runtime_t *rt, int op, mthl_value_t left, mthl_value_t right) {
+    if (op == OP_AND) return mthl_int(mthl_truthy(rt, left) && mthl_truthy(rt, right));
+    if (op == OP_OR) return mthl_int(mthl_truthy(rt, left) || mthl_truthy(rt, right));
+
+    if (mthl_is_number(left) && mthl_is_number(right)) {
+        int32_t x = left.i, y = right.i;
+        switch (op) {
+            case OP_PLUS:
+            case OP_MINUS:
+            case OP_MULTIPLY:
+            case OP_DIVIDE: {
+                /* A percentage stays relative through arithmetic */
+                mthl_value_t value = { VAL_INT, mthl_arith(op, x, y) };
+                if (left.type == VAL_PERCENT || right.type == VAL_PERCENT) value.type = VAL_PERCENT;
+                return value;
+            }
+            case OP_GT: return mthl_int(x > y);
+            case OP_LT: return mthl_int(x < y);
+            case OP_GE: return mthl_int(x >= y);
+            case OP_LE: return mthl_int(x <= y);
+            case OP_EQ: return mthl_int(x == y);
+            case OP_NE: return mthl_int(x != y);
+        }
+        return (mthl_value_t){ VAL_NONE, 0 };
+    }
+
+    if (op == OP_PLUS && (mthl_is_text(left) || mthl_is_text(right))) {
+        return mthl_concat(rt, left, right);
+    }
+
+    /* Strings are interned, so equal text means equal symbols */
+    if (op == OP_EQ) return mthl_int(left.type == right.type && left.i == right.i);
+    if (op == OP_NE) return mthl_int(left.type != right.type || left.i != right.i);
+
+    if (mthl_is_text(left) && mthl_is_text(right)) {
+        int order = strcmp(ast_symbol_name(rt->doc, left.i), ast_symbol_name(rt->doc, right.i));
+        switch (op) {
+            case OP_GT: return mthl_int(order > 0);
+            case OP_LT: return mthl_int(order < 0);
+            case OP_GE: return mthl_int(order >= 0);
+            case OP_LE: return mthl_int(order <= 0);
+        }
+    }
+    return (mthl_value_t){ VAL_NONE, 0 };
+}
+
+mthl_value_t mthl_new_array(mthl_runtime_t *rt, const mthl_value_t *items, uint32_t count) {
+    rt->arrays = mthl_grow(rt->arrays, &rt->array_capacity, sizeof(mthl_array_t), rt->array_count + 1);
+
+    mthl_array_t *array = &rt->arrays[rt->array_count];
+    array->count = count;
+    array->capacity = count;
+    array->items = NULL;
+    if (count > 0) {
+        array->items = malloc(count * sizeof(mthl_value_t));
+        if (!array->items) return (mthl_value_t){ VAL_NONE, 0 };
+        memcpy(array->items, items, count * sizeof(mthl_value_t));
+    }
+
+    mthl_value_t value = { VAL_ARRAY, (int32_t)rt->array_count++ };
+    return value;
+}
+
+mthl_value_t mthl_index(mthl_runtime_t *rt, mthl_value_t array, mthl_value_t index) {
+    if (array.type != VAL_ARRAY || index.type != VAL_INT) return (mthl_value_t){ VAL_NONE, 0 };
+
+    mthl_array_t *items = &rt->arrays[array.i];
+    if (index.i < 0 || (uint32_t)index.i >= items->count) return (mthl_value_t){ VAL_NONE, 0 };
+    return items->items[index.i];
+}
+
+/* Stores inside the array or appends at its end; other indices are ignored */
+void mthl_set_index(mthl_runtime_t *rt, mthl_value_t array, mthl_value_t index, mthl_value_t value) {
+    if (array.type != VAL_ARRAY || index.type != VAL_INT || index.i < 0) return;
+
+    mthl_array_t *items = &rt->arrays[array.i];
+    if ((uint32_t)index.i > items->count) return;
+    if ((uint32_t)index.i == items->count) {
+        items->items = mthl_grow(items->items, &items->capacity, sizeof(mthl_value_t), items->count + 1);
+        items->count++;
+    }
+    items->items[index.i] = value;
+}
+
+mthl_value_t mthl_property(mthl_runtime_t *rt, mthl_value_t object, uint32_t property) {
+    if (property == AST_SYM_LENGTH) {
+        if (mthl_is_text(object)) return mthl_int(ast_symbol_length(rt->doc, object.i));
+        if (object.type == VAL_ARRAY) return mthl_int(rt->arrays[object.i].count);
+    }
+    return (mthl_value_t){ VAL_NONE, 0 };
+}
+
+/* Elements */
+
+int32_t mthl_begin_element(mthl_runtime_t *rt, int kind, ast_index_t node) {
+    rt->elements = mthl_grow(rt->elements, &rt->element_capacity, sizeof(mthl_element_t),
+                             rt->element_count + 1);
+
+    int32_t index = rt->element_count++;
+    mthl_element_t *element = &rt->elements[index];
+    memset(element, 0, sizeof(*element));
+    element->kind = kind;
+    element->node = node;
+    element->parent = rt->element_depth > 0 ? rt->element_stack[rt->element_depth - 1] : -1;
+    element->onclick = -1;
+
+    rt->element_stack = mthl_grow(rt->element_stack, &rt->element_stack_capacity, sizeof(int32_t),
+                                  rt->element_depth + 1);
+    rt->element_stack[rt->element_depth++] = index;
+    return index;
+}
+
+void mthl_end_element(mthl_runtime_t *rt) {
+    if (rt->element_depth > 0) rt->element_depth--;
+}
+
+static mthl_element_t *mthl_current_element(mthl_runtime_t *rt) {
+    if (rt->element_depth == 0) return NULL;
+    return &rt->elements[rt->element_stack[rt->element_depth - 1]];
+}
+
+void mthl_set_property(mthl_runtime_t *rt, int kind, const mthl_value_t *args) {
+    mthl_element_t *element = mthl_current_element(rt);
+    if (!element) return;
+
+    switch (kind) {
+        case AST_PROP_POSITION:
+            memcpy(element->position, args, sizeof(element->position));
+            break;
+        case AST_PROP_FONT:
+            memcpy(element->font, args, sizeof(element->font));
+            break;
+        case AST_PROP_BACKGROUND: element->background = args[0]; break;
+        case AST_PROP_CONTENT: element->content = args[0]; break;
+        case AST_PROP_COLOR: element->color = args[0]; break;
+        case AST_PROP_FILL: element->fill = args[0]; break;
+        case AST_PROP_ALIGN: element->align = args[0]; break;
+    }
+}
+
+void mthl_set_onclick(mthl_runtime_t *rt, int32_t handler) {
+    mthl_element_t *element = mthl_current_element(rt);
+    if (element) element->onclick = handler;
+}
+
+static void mthl_print_values(mthl_runtime_t *rt, const char *name, const mthl_value_t *values,
+                              int count, FILE *out) {
+    char text[256];
+
+    if (values[0].type == VAL_NONE) return;
+    fprintf(out, " %s(", name);
+    for (int i = 0; i < count; i++) {
+        mthl_format_value(rt, values[i], text, sizeof(text));
+        fprintf(out, "%s%s", i ? ", " : "", text);
+    }
+    fprintf(out, ")");
+}
+
+void mthl_print_elements(mthl_runtime_t *rt, uint32_t first, FILE *out) {
+    for (uint32_t i = first; i < rt->element_count; i++) {
+        mthl_element_t *element = &rt->elements[i];
+        int depth = 0;
+        for (int32_t p = element->parent; p >= 0; p = rt->elements[p].parent) depth++;
+
+        fprintf(out, "%*s%s", depth * 2, "", ast_kind_name(element->kind));
+        mthl_print_values(rt, "position", element->position, 4, out);
+        mthl_print_values(rt, "background", &element->background, 1, out);
+        mthl_print_values(rt, "content", &element->content, 1, out);
+        mthl_print_values(rt, "font", element->font, 3, out);
+        mthl_print_values(rt, "color", &element->color, 1, out);
+        mthl_print_values(rt, "fill", &element->fill, 1, out);
+        mthl_print_values(rt, "align", &element->align, 1, out);
+        if (element->onclick >= 0) fprintf(out, " onclick");
+        fprintf(out, "\n");
+    }
+}
+
+/* Tree walker. Variables live in a flat list searched by symbol, which is
+ * all a walker without a resolution pass can do. */
+
+static mthl_value_t *walk_variable(mthl_runtime_t *rt, uint32_t symbol, int create) {
+    for (uint32_t i = 0; i < rt->var_count; i++) {
+        if (rt->var_symbols[i] == symbol) return &rt->var_values[i];
+    }
+    if (!create) return NULL;
+
+    /* Both lists grow in step from the same capacity */
+    uint32_t capacity = rt->var_capacity;
+    rt->var_symbols = mthl_grow(rt->var_symbols, &capacity, sizeof(uint32_t), rt->var_count + 1);
+    rt->var_values = mthl_grow(rt->var_values, &rt->var_capacity, sizeof(mthl_value_t), rt->var_count + 1);
+
+    rt->var_symbols[rt->var_count] = symbol;
+    rt->var_values[rt->var_count].type = VAL_NONE;
+    return &rt->var_values[rt->var_count++];
+}
+
+static mthl_value_t walk_load(mthl_runtime_t *rt, uint32_t symbol) {
+    mthl_value_t *value = walk_variable(rt, symbol, 0);
+    return value ? *value : (mthl_value_t){ VAL_NONE, 0 };
+}
+
+static mthl_value_t walk_expression(mthl_runtime_t *rt, ast_index_t index) {
+    ASTDocument *doc = rt->doc;
+    ASTNode *node = &doc->nodes[index];
+
+    switch (node->kind) {
+        case AST_INTEGER: return (mthl_value_t){ VAL_INT, node->value.ival };
+        case AST_PERCENTAGE: return (mthl_value_t){ VAL_PERCENT, node->value.ival };
+        case AST_STRING: return (mthl_value_t){ VAL_STRING, (int32_t)node->value.sym };
+        case AST_COLOR: return (mthl_value_t){ VAL_COLOR, (int32_t)node->value.sym };
+        case AST_VARIABLE: return walk_load(rt, node->value.sym);
+        case AST_ARRAY_ACCESS:
+            return mthl_index(rt, walk_load(rt, node->value.sym), walk_expression(rt, node->first_child));
+        case AST_PROPERTY_ACCESS:
+            return mthl_property(rt, walk_expression(rt, node->first_child), node->value.sym);
+        case AST_UNARY_OP:
+            return mthl_int(!mthl_truthy(rt, walk_expression(rt, node->first_child)));
+        case AST_BINARY_OP: {
+            ast_index_t right = doc->nodes[node->first_child].next_sibling;
+            mthl_value_t left_value = walk_expression(rt, node->first_child);
+            return mthl_binary(rt, doc->nodes[index].op, left_value, walk_expression(rt, right));
+        }
+        case AST_ARRAY: {
+            int count = ast_child_count(doc, index);
+            mthl_value_t *items = malloc((count ? count : 1) * sizeof(mthl_value_t));
+            if (!items) return (mthl_value_t){ VAL_NONE, 0 };
+            int i = 0;
+            for (AST_EACH_CHILD(doc, index, child)) items[i++] = walk_expression(rt, child);
+            mthl_value_t array = mthl_new_array(rt, items, count);
+            free(items);
+            return array;
+        }
+    }
+    return (mthl_value_t){ VAL_NONE, 0 };
+}
+
+static void walk_statements(mthl_runtime_t *rt, ast_index_t first);
+
+static void walk_statement(mthl_runtime_t *rt, ast_index_t index) {
+    ASTDocument *doc = rt->doc;
+    ASTNode node = doc->nodes[index];
+
+    switch (node.kind) {
+        case AST_VAR_DECL:
+        case AST_ASSIGN: {
+            mthl_value_t value = walk_expression(rt, node.first_child);
+            *walk_variable(rt, node.value.sym, 1) = value;
+            break;
+        }
+        case AST_ARRAY_ASSIGN: {
+            ast_index_t value_node = doc->nodes[node.first_child].next_sibling;
+            mthl_value_t position = walk_expression(rt, node.first_child);
+            mthl_value_t value = walk_expression(rt, value_node);
+            mthl_set_index(rt, walk_load(rt, node.value.sym), position, value);
+            break;
+        }
+        case AST_IF: {
+            ast_index_t then_block = doc->nodes[node.first_child].next_sibling;
+            ast_index_t else_block = doc->nodes[then_block].next_sibling;
+            if (mthl_truthy(rt, walk_expression(rt, node.first_child))) {
+                walk_statements(rt, doc->nodes[then_block].first_child);
+            } else if (else_block != AST_NONE) {
+                walk_statements(rt, doc->nodes[else_block].first_child);
+            }
+            break;
+        }
+        case AST_FOR: {
+            ast_index_t init = node.first_child;
+            ast_index_t condition = doc->nodes[init].next_sibling;
+            ast_index_t step = doc->nodes[condition].next_sibling;
+            ast_index_t body = doc->nodes[step].next_sibling;
+            for (walk_statement(rt, init);
+                 mthl_truthy(rt, walk_expression(rt, condition));
+                 walk_statement(rt, step)) {
+                walk_statements(rt, doc->nodes[body].first_child);
+            }
+            break;
+        }
+        case AST_REDRAW:
+            rt->redraw_requested = 1;
+            break;
+        case AST_BLOCK:
+            walk_statements(rt, node.first_child);
+            break;
+        case AST_CONTAINER:
+        case AST_TEXT:
+        case AST_RECTANGLE:
+        case AST_BUTTON:
+            mthl_begin_element(rt, node.kind, index);
+            walk_statements(rt, node.first_child);
+            mthl_end_element(rt);
+            break;
+        case AST_PROP_POSITION:
+        case AST_PROP_BACKGROUND:
+        case AST_PROP_CONTENT:
+        case AST_PROP_FONT:
+        case AST_PROP_COLOR:
+        case AST_PROP_FILL:
+        case AST_PROP_ALIGN: {
+            mthl_value_t args[4];
+            int i = 0;
+            for (AST_EACH_CHILD(doc, index, child)) args[i++] = walk_expression(rt, child);
+            mthl_set_property(rt, node.kind, args);
+            break;
+        }
+        case AST_ONCLICK:
+            mthl_set_onclick(rt, index);
+            break;
+    }
+}
+
+static void walk_statements(mthl_runtime_t *rt, ast_index_t first) {
+    for (ast_index_t index = first; index != AST_NONE; index = rt->doc->nodes[index].next_sibling) {
+        walk_statement(rt, index);
+    }
+}
+
+void mthl_walk_page(mthl_runtime_t *rt, ast_index_t root) {
+    walk_statements(rt, rt->doc->nodes[root].first_child);
+}
+
+void mthl_walk_statement(mthl_runtime_t *rt, ast_index_t statement) {
+    walk_statement(rt, statement);
+}
+
+void mthl_walk_click(mthl_runtime_t *rt, uint32_t element) {
+    if (element >= rt->element_count || rt->elements[element].onclick < 0) return;
+    walk_statements(rt, rt->doc->nodes[rt->elements[element].onclick].first_child);
+}
@@ -0,0 +1,283 @@
+/* mthl_layout.c - Boxes for the elements of a running MTHL page */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mthl_layout.h"
+
+/* What a box reads from its parent besides the origin, and which list an
+ * element is on */
+#define LAYOUT_WIDTH  0x01
+#define LAYOUT_HEIGHT 0x02
+#define LAYOUT_DIRTY  0x04
+#define LAYOUT_SIZED  0x08
+
+static void *layout_grow(void *items, uint32_t capacity, size_t item_size) {
+    void *grown = realloc(items, (size_t)capacity * item_size);
+    if (!grown) {
+        fprintf(stderr, "Out of memory while laying out the page\n");
+        exit(1);
+    }
+    return grown;
+}
+
+static void layout_reserve(mthl_layout_t *layout, uint32_t needed) {
+    if (needed <= layout->capacity) return;
+
+    uint32_t capacity = layout->capacity ? layout->capacity : 64;
+    while (capacity < needed) capacity *= 2;
+    layout->boxes = layout_grow(layout->boxes, capacity, sizeof(mthl_box_t));
+    layout->subtree_end = layout_grow(layout->subtree_end, capacity, sizeof(uint32_t));
+    layout->flags = layout_grow(layout->flags, capacity, sizeof(uint8_t));
+    layout->stamps = layout_grow(layout->stamps, capacity, sizeof(uint32_t));
+    layout->dirty = layout_grow(layout->dirty, capacity, sizeof(uint32_t));
+    layout->sized = layout_grow(layout->sized, capacity, sizeof(uint32_t));
+    layout->capacity = capacity;
+}
+
+void mthl_layout_init(mthl_layout_t *layout, mthl_runtime_t *rt, int32_t width, int32_t height) {
+    memset(layout, 0, sizeof(*layout));
+    layout->rt = rt;
+    layout->runs = rt->runs;
+    layout->width = width;
+    layout->height = height;
+}
+
+void mthl_layout_free(mthl_layout_t *layout) {
+    free(layout->boxes);
+    free(layout->subtree_end);
+    free(layout->flags);
+    free(layout->stamps);
+    free(layout->dirty);
+    free(layout->sized);
+    memset(layout, 0, sizeof(*layout));
+}
+
+static uint8_t parent_reads(const mthl_element_t *element) {
+    const mthl_value_t *position = element->position;
+    uint8_t reads = 0;
+
+    if (position[0].type == VAL_NONE) return LAYOUT_WIDTH | LAYOUT_HEIGHT;
+    if (position[0].type == VAL_PERCENT || position[2].type == VAL_PERCENT) reads |= LAYOUT_WIDTH;
+    if (position[1].type == VAL_PERCENT || position[3].type == VAL_PERCENT) reads |= LAYOUT_HEIGHT;
+    return reads;
+}
+
+/* Puts element on the dirty list, and on the sized list if the window's
+ * size is now one of the things its box reads */
+static void mark(mthl_layout_t *layout, uint32_t element) {
+    uint8_t flags = layout->flags[element] & ~(LAYOUT_WIDTH | LAYOUT_HEIGHT);
+
+    flags |= parent_reads(&layout->rt->elements[element]);
+    if (layout->rt->elements[element].parent < 0 && (flags & (LAYOUT_WIDTH | LAYOUT_HEIGHT)) &&
+        !(flags & LAYOUT_SIZED)) {
+        flags |= LAYOUT_SIZED;
+        layout->sized[layout->sized_count++] = element;
+    }
+    if (!(flags & LAYOUT_DIRTY)) {
+        flags |= LAYOUT_DIRTY;
+        layout->dirty[layout->dirty_count++] = element;
+    }
+    layout->flags[element] = flags;
+}
+
+void mthl_layout_invalidate(mthl_layout_t *layout, uint32_t element) {
+    /* Elements the layout has not seen yet are laid out anyway */
+    if (element < layout->count) mark(layout, element);
+}
+
+void mthl_layout_resize(mthl_layout_t *layout, int32_t width, int32_t height) {
+    uint8_t changed = (width != layout->width ? LAYOUT_WIDTH : 0) |
+                      (height != layout->height ? LAYOUT_HEIGHT : 0);
+
+    layout->width = width;
+    layout->height = height;
+    if (!changed) return;
+
+    for (uint32_t i = 0; i < layout->sized_count; ) {
+        uint32_t element = layout->sized[i];
+        uint8_t flags = layout->flags[element];
+
+        /* Its position changed since it was listed */
+        if (!(flags & (LAYOUT_WIDTH | LAYOUT_HEIGHT))) {
+            layout->flags[element] = flags & ~LAYOUT_SIZED;
+            layout->sized[i] = layout->sized[--layout->sized_count];
+            continue;
+        }
+        if (flags & changed) mark(layout, element);
+        i++;
+    }
+}
+
+/* Takes in the elements the page has recorded since the last update */
+static void add_elements(mthl_layout_t *layout) {
+    mthl_runtime_t *rt = layout->rt;
+
+    /* The runtime was reset to run the page again */
+    if (rt->runs != layout->runs) {
+        layout->runs = rt->runs;
+        layout->count = 0;
+        layout->dirty_count = 0;
+        layout->sized_count = 0;
+    }
+
+    layout_reserve(layout, rt->element_count);
+    for (uint32_t i = layout->count; i < rt->element_count; i++) {
+        layout->subtree_end[i] = i + 1;
+        for (int32_t a = rt->elements[i].parent; a >= 0; a = rt->elements[a].parent) {
+            layout->subtree_end[a] = i + 1;
+        }
+        memset(&layout->boxes[i], 0, sizeof(mthl_box_t));
+        layout->flags[i] = 0;
+        layout->stamps[i] = 0;
+        mark(layout, i);
+    }
+    layout->count = rt->element_count;
+}
+
+static int32_t resolve(mthl_value_t value, int32_t extent) {
+    switch (value.type) {
+        case VAL_INT: return value.i;
+        case VAL_PERCENT: return (int32_t)((int64_t)extent * value.i / 100);
+    }
+    return 0;
+}
+
+static mthl_box_t compute_box(mthl_layout_t *layout, uint32_t element) {
+    const mthl_element_t *e = &layout->rt->elements[element];
+    const mthl_value_t *position = e->position;
+    mthl_box_t parent = { 0, 0, layout->width, layout->height };
+
+    if (e->parent >= 0) parent = layout->boxes[e->parent];
+    if (position[0].type == VAL_NONE) return parent;
+
+    mthl_box_t box = {
+        parent.x + resolve(position[0], parent.width),
+        parent.y + resolve(position[1], parent.height),
+        resolve(position[2], parent.width),
+        resolve(position[3], parent.height)
+    };
+    return box;
+}
+
+/* Computes element's box, then those of its children the change reaches.
+ * Children follow their parent in the element list, and each child's
+ * subtree ends where the next child starts. */
+static uint32_t layout_element(mthl_layout_t *layout, uint32_t element) {
+    mthl_box_t old = layout->boxes[element];
+    mthl_box_t box = compute_box(layout, element);
+    uint32_t computed = 1;
+
+    layout->boxes[element] = box;
+    layout->stamps[element] = layout->generation;
+
+    int moved = box.x != old.x || box.y != old.y;
+    uint8_t resized = (box.width != old.width ? LAYOUT_WIDTH : 0) |
+                      (box.height != old.height ? LAYOUT_HEIGHT : 0);
+    if (!moved && !resized) return computed;
+
+    for (uint32_t child = element + 1; child < layout->subtree_end[element];
+         child = layout->subtree_end[child]) {
+        if (moved || (layout->flags[child] & resized)) computed += layout_element(layout, child);
+    }
+    return computed;
+}
+
+static int compare_elements(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint32_t mthl_layout_update(mthl_layout_t *layout) {
+    uint32_t computed = 0;
+
+    add_elements(layout);
+    if (layout->dirty_count == 0) return 0;
+
+    /* Parents before children, so a child dirty in its own right but also
+     * reached from its parent is computed once, after the parent */
+    for (uint32_t i = 1; i < layout->dirty_count; i++) {
+        if (layout->dirty[i - 1] > layout->dirty[i]) {
+            qsort(layout->dirty, layout->dirty_count, sizeof(uint32_t), compare_elements);
+            break;
+        }
+    }
+
+    layout->generation++;
+    for (uint32_t i = 0; i < layout->dirty_count; i++) {
+        uint32_t element = layout->dirty[i];
+        layout->flags[element] &= ~LAYOUT_DIRTY;
+        if (layout->stamps[element] != layout->generation) computed += layout_element(layout, element);
+    }
+    layout->dirty_count = 0;
+    return computed;
+}
+
+/* Benchmark */
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void mthl_layout_benchmark(ASTDocument *doc, ast_index_t root, int iterations) {
+    mthl_runtime_t rt;
+    mthl_layout_t layout, fresh;
+    uint64_t resized = 0, changed = 0;
+    uint32_t seed = 1;
+
+    mthl_runtime_init(&rt, doc);
+    mthl_walk_page(&rt, root);
+    if (rt.element_count == 0) {
+        fprintf(stderr, "No elements to lay out\n");
+        mthl_runtime_free(&rt);
+        return;
+    }
+
+    double start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        mthl_layout_init(&fresh, &rt, 800, 600);
+        mthl_layout_update(&fresh);
+        mthl_layout_free(&fresh);
+    }
+    double full_ms = (now_ms() - start) / iterations;
+
+    /* Dragging the window's corner: the width changes every time, the
+     * height every other time */
+    mthl_layout_init(&layout, &rt, 800, 600);
+    mthl_layout_update(&layout);
+    start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        mthl_layout_resize(&layout, 800 + i % 7, 600 + i / 2 % 5);
+        resized += mthl_layout_update(&layout);
+    }
+    double resize_ms = (now_ms() - start) / iterations;
+
+    /* Nudging the x of one element at a time */
+    start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        seed = seed * 1103515245u + 12345u;
+        uint32_t element = (seed >> 8) % rt.element_count;
+        if (rt.elements[element].position[0].type == VAL_NONE) continue;
+        rt.elements[element].position[0].i ^= 1;
+        mthl_layout_invalidate(&layout, element);
+        changed += mthl_layout_update(&layout);
+    }
+    double change_ms = (now_ms() - start) / iterations;
+
+    mthl_layout_init(&fresh, &rt, layout.width, layout.height);
+    mthl_layout_update(&fresh);
+    int match = memcmp(layout.boxes, fresh.boxes, rt.element_count * sizeof(mthl_box_t)) == 0;
+
+    printf("%u elements\n", rt.element_count);
+    printf("layout %10.3f ms per full layout\n", full_ms);
+    printf("resize %10.3f ms per resize, %.1f boxes recomputed\n",
+           resize_ms, (double)resized / iterations);
+    printf("change %10.3f ms per change, %.1f boxes recomputed\n",
+           change_ms, (double)changed / iterations);
+    printf("boxes %s\n", match ? "match" : "DIFFER");
+
+    mthl_layout_free(&fresh);
+    mthl_layout_free(&layout);
+    mthl_runtime_free(&rt);
+}
@@ -0,0 +1,67 @@
+/* mthl_layout.h - Boxes for the elements of a running MTHL page */
+#ifndef MTHL_LAYOUT_H
+#define MTHL_LAYOUT_H
+
+#include <stdint.h>
+#include "mthl_runtime.h"
+
+/*
+ * position(x, y, w, h) is relative to the parent element, or to the
+ * window at the top. Integers are pixels; percentages of x and w are of
+ * the parent's width, of y and h of its height. An element without a
+ * position fills its parent.
+ *
+ * The layout keeps an absolute box per element and only recomputes those
+ * that can have changed: elements marked with mthl_layout_invalidate, new
+ * elements, and, after a resize, top-level elements sized by the window.
+ * A recomputed box that moved is followed into every child, one that only
+ * changed size into the children with a percentage in that dimension;
+ * one that did not change stops there. An update costs what changed.
+ */
+
+typedef struct mthl_box {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+} mthl_box_t;
+
+typedef struct mthl_layout {
+    mthl_runtime_t *rt;
+    int32_t width;              /* Window */
+    int32_t height;
+    uint32_t count;             /* Elements of rt known to the layout */
+    uint32_t capacity;
+    mthl_box_t *boxes;          /* Absolute, parallel to rt->elements */
+    uint32_t *subtree_end;      /* One past the element's last descendant */
+    uint8_t *flags;             /* LAYOUT_* */
+    uint32_t *stamps;           /* Update that last computed the box */
+    uint32_t *dirty;            /* Elements to recompute, each once */
+    uint32_t dirty_count;
+    uint32_t *sized;            /* Top-level elements sized by the window */
+    uint32_t sized_count;
+    uint32_t generation;
+    uint32_t runs;              /* rt->runs the boxes are for */
+} mthl_layout_t;
+
+void mthl_layout_init(mthl_layout_t *layout, mthl_runtime_t *rt, int32_t width, int32_t height);
+void mthl_layout_free(mthl_layout_t *layout);
+
+void mthl_layout_resize(mthl_layout_t *layout, int32_t width, int32_t height);
+
+/* After element's position has changed */
+void mthl_layout_invalidate(mthl_layout_t *layout, uint32_t element);
+
+/* Takes in elements added to the runtime since the last update, and
+ * recomputes every box that can have changed. Returns how many were. */
+uint32_t mthl_layout_update(mthl_layout_t *layout);
+
+static inline const mthl_box_t *mthl_layout_box(const mthl_layout_t *layout, uint32_t element) {
+    return &layout->boxes[element];
+}
+
+/* Times a full layout of a page against resizes and single-element
+ * changes, checking the cached boxes against fresh ones */
+void mthl_layout_benchmark(ASTDocument *doc, ast_index_t root, int iterations);
+
+#endif
@@ -0,0 +1,467 @@
+/* mthl_lex.c - Lexical analyzer for MTHL */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mthl.tab.h"  /* Bison-generated header, pulls in mthl_ast.h */
+#include "mthl_lex.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VEC_SIZE 32
+#define VEC_ALL 0xFFFFFFFFu
+typedef __m256i vec_t;
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_set(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm256_cmpgt_epi8(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_and(a, b) _mm256_and_si256(a, b)
+#define vec_mask(v) ((uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC_SIZE 16
+#define VEC_ALL 0xFFFFu
+typedef __m128i vec_t;
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_set(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm_cmpgt_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_mask(v) ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+mthl_lexer_t *mthl_lexer = NULL;
+
+/* Character classes */
+
+#define CHAR_SPACE  0x01
+#define CHAR_NAME   0x02    /* Starts a name */
+#define CHAR_DIGIT  0x04
+#define CHAR_HEX    0x08
+#define CHAR_QUOTE  0x10    /* Ends a string body run */
+
+static const uint8_t char_class[256] = {
+    [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+    ['\n'] = CHAR_SPACE,
+    ['"'] = CHAR_QUOTE, ['\\'] = CHAR_QUOTE,
+    ['_'] = CHAR_NAME,
+    ['0' ... '9'] = CHAR_DIGIT | CHAR_HEX,
+    ['a' ... 'f'] = CHAR_NAME | CHAR_HEX,
+    ['g' ... 'z'] = CHAR_NAME,
+    ['A' ... 'F'] = CHAR_NAME | CHAR_HEX,
+    ['G' ... 'Z'] = CHAR_NAME,
+};
+
+#define IS(c, classes) (char_class[(unsigned char)(c)] & (classes))
+
+/*
+ * Whitespace and names, which every token starts or ends with, are
+ * classified 64 bytes at a time into one bit per byte, so the end of a
+ * run is a shift and a count of trailing zeros; tokens average a few
+ * bytes and a block serves many of them. Only the current block is kept.
+ * String bodies and comments run long and are searched a vector at a
+ * time instead. The zero padding after the source ends every run.
+ */
+
+#ifdef VEC_SIZE
+static inline vec_t vec_in(vec_t v, char low, char high) {
+    return vec_and(vec_gt(v, vec_set(low - 1)), vec_gt(vec_set(high + 1), v));
+}
+#endif
+
+static void classify(mthl_lexer_t *lexer, const char *block) {
+    uint64_t space = 0, name = 0;
+
+#ifdef VEC_SIZE
+    for (int i = 0; i < 64; i += VEC_SIZE) {
+        vec_t v = vec_load(block + i);
+        vec_t spaces = vec_or(vec_or(vec_eq(v, vec_set(' ')), vec_eq(v, vec_set('\t'))),
+                              vec_or(vec_eq(v, vec_set('\n')), vec_eq(v, vec_set('\r'))));
+        vec_t names = vec_or(vec_or(vec_in(vec_or(v, vec_set(0x20)), 'a', 'z'), vec_in(v, '0', '9')),
+                             vec_eq(v, vec_set('_')));
+        space |= (uint64_t)vec_mask(spaces) << i;
+        name |= (uint64_t)vec_mask(names) << i;
+    }
+#else
+    for (int i = 0; i < 64; i++) {
+        uint8_t classes = char_class[(unsigned char)block[i]];
+        space |= (uint64_t)((classes & CHAR_SPACE) != 0) << i;
+        name |= (uint64_t)((classes & (CHAR_NAME | CHAR_DIGIT)) != 0) << i;
+    }
+#endif
+
+    lexer->block = block;
+    lexer->space = space;
+    lexer->name = name;
+}
+
+/* End of the run of bytes set in the block mask field, starting at p */
+#define SKIP_RUN(lexer, p, field)                                       \
+    for (;;) {                                                          \
+        size_t offset_ = (size_t)(p - (lexer)->source) & 63;            \
+        const char *block_ = p - offset_;                               \
+        if (block_ != (lexer)->block) classify(lexer, block_);          \
+        uint64_t stops_ = ~(lexer)->field >> offset_;                   \
+        if (stops_) {                                                   \
+            p += __builtin_ctzll(stops_);                               \
+            break;                                                      \
+        }                                                               \
+        p = block_ + 64;                                                \
+    }
+
+/* First " or \ at or after p, or end */
+static const char *find_quote(const char *p, const char *end) {
+#ifdef VEC_SIZE
+    for (; p < end; p += VEC_SIZE) {
+        vec_t v = vec_load(p);
+        uint32_t stops = vec_mask(vec_or(vec_eq(v, vec_set('"')), vec_eq(v, vec_set('\\'))));
+        if (stops) {
+            p += __builtin_ctz(stops);
+            break;
+        }
+    }
+    return p < end ? p : end;
+#else
+    while (p < end && !IS(*p, CHAR_QUOTE)) p++;
+    return p;
+#endif
+}
+
+/* Tokens */
+
+static int keyword(const char *s, size_t length) {
+#define KEYWORD(word, token) \
+    if (length == sizeof(word) - 1 && memcmp(s, word, sizeof(word) - 1) == 0) return token
+
+    switch (s[0]) {
+        case 'a': KEYWORD("align", ALIGN); break;
+        case 'b': KEYWORD("button", BUTTON); KEYWORD("background", BACKGROUND); break;
+        case 'c':
+            KEYWORD("container", CONTAINER); KEYWORD("const", CONST);
+            KEYWORD("content", CONTENT); KEYWORD("color", COLOR);
+            break;
+        case 'e': KEYWORD("else", ELSE); break;
+        case 'f': KEYWORD("for", FOR); KEYWORD("font", FONT); KEYWORD("fill", FILL); break;
+        case 'i': KEYWORD("if", IF); break;
+        case 'o': KEYWORD("onclick", ONCLICK); break;
+        case 'p': KEYWORD("page", PAGE); KEYWORD("position", POSITION); break;
+        case 'r': KEYWORD("rectangle", RECTANGLE); KEYWORD("redraw", REDRAW); break;
+        case 't': KEYWORD("text", TEXT); break;
+        case 'v': KEYWORD("var", VAR); break;
+    }
+    return IDENTIFIER;
+#undef KEYWORD
+}
+
+static int scratch_append(mthl_lexer_t *lexer, size_t *length, const char *s, size_t n) {
+    if (*length + n > lexer->scratch_capacity) {
+        size_t capacity = lexer->scratch_capacity ? lexer->scratch_capacity : 256;
+        while (capacity < *length + n) capacity *= 2;
+        char *scratch = realloc(lexer->scratch, capacity);
+        if (!scratch) return -1;
+        lexer->scratch = scratch;
+        lexer->scratch_capacity = capacity;
+    }
+    memcpy(lexer->scratch + *length, s, n);
+    *length += n;
+    return 0;
+}
+
+/* p is just past the opening quote. Escapes are \n, \t and \"; any other
+ * backslash stands for itself. */
+static int lex_string(mthl_lexer_t *lexer, const char *p, YYSTYPE *value) {
+    const char *end = lexer->end;
+    const char *body = p;
+    size_t length = 0;
+    int escaped = 0;
+
+    for (;;) {
+        const char *stop = find_quote(p, end);
+        if (escaped && scratch_append(lexer, &length, p, stop - p) < 0) break;
+        if (stop == end) {
+            if (!lexer->fragment && !lexer->streaming) fprintf(stderr, "Unterminated string\n");
+            lexer->truncated = 1;
+            break;
+        }
+
+        if (*stop == '"') {
+            value->sval = escaped ? ast_intern(ast_doc, lexer->scratch, length)
+                                  : ast_intern(ast_doc, body, stop - body);
+            lexer->cursor = stop + 1;
+            return STRING_LITERAL;
+        }
+
+        if (!escaped && scratch_append(lexer, &length, body, stop - body) < 0) break;
+        escaped = 1;
+
+        char next = stop + 1 < end ? stop[1] : 0;
+        char decoded = next == 'n' ? '\n' : next == 't' ? '\t' : next == '"' ? '"' : '\\';
+        if (scratch_append(lexer, &length, &decoded, 1) < 0) break;
+        p = decoded == '\\' ? stop + 1 : stop + 2;
+    }
+
+    lexer->cursor = end;
+    return 0;
+}
+
+/* Returns -1 after reporting a character that starts no token. While
+ * streaming, a token or comment that may go on past end is left for the
+ * next call, after more source has arrived, and MTHL_LEX_MORE returned. */
+static int scan_token(mthl_lexer_t *lexer, YYSTYPE *value) {
+    const char *p = lexer->cursor;
+    const char *end = lexer->end;
+
+    for (;;) {
+        if (IS(*p, CHAR_SPACE)) SKIP_RUN(lexer, p, space);
+        if (p >= end) {
+            lexer->cursor = end;
+            return lexer->streaming ? MTHL_LEX_MORE : 0;
+        }
+        if (p[0] != '/' || end - p < 2 || p[1] != '^') break;
+        const char *newline = memchr(p + 2, '\n', end - p - 2);
+        if (!newline) {
+            if (lexer->streaming) {
+                lexer->cursor = p;
+                return MTHL_LEX_MORE;
+            }
+            lexer->truncated = 1;
+            newline = end;
+        }
+        p = newline;
+    }
+
+    /* Enough to tell every fixed-length token from its neighbours */
+    if (lexer->streaming && end - p < 8) {
+        lexer->cursor = p;
+        return MTHL_LEX_MORE;
+    }
+
+    const char *start = p;
+    char c = *p++;
+    lexer->token_start = (uint32_t)(start - lexer->source);
+    char next = p < end ? *p : 0;
+    int token;
+
+    if (IS(c, CHAR_NAME)) {
+        if (IS(*p, CHAR_NAME | CHAR_DIGIT)) SKIP_RUN(lexer, p, name);
+        if (lexer->streaming && p >= end) {
+            lexer->cursor = start;
+            return MTHL_LEX_MORE;
+        }
+        token = keyword(start, p - start);
+        if (token == IDENTIFIER) value->sval = ast_intern(ast_doc, start, p - start);
+    } else if (IS(c, CHAR_DIGIT)) {
+        uint32_t number = 0;
+        for (p = start; IS(*p, CHAR_DIGIT); p++) number = number * 10 + (uint32_t)(*p - '0');
+        value->ival = (int)number;
+        token = INTEGER;
+        if (p < end && *p == '%') {
+            p++;
+            token = PERCENTAGE;
+        }
+    } else {
+        switch (c) {
+            case '"':
+                token = lex_string(lexer, p, value);
+                p = lexer->cursor;
+                break;
+            case '#':
+                if (end - start >= 7 && IS(start[1], CHAR_HEX) && IS(start[2], CHAR_HEX) &&
+                    IS(start[3], CHAR_HEX) && IS(start[4], CHAR_HEX) &&
+                    IS(start[5], CHAR_HEX) && IS(start[6], CHAR_HEX)) {
+                    p = start + 7;
+                    value->sval = ast_intern(ast_doc, start, 7);
+                    token = COLOR_HEX;
+                } else {
+                    token = -1;
+                }
+                break;
+            case '|':
+                token = next == '<' ? LBRACE : next == '|' ? OR : -1;
+                if (token != -1) p++;
+                break;
+            case '&':
+                token = next == '&' ? AND : -1;
+                if (token != -1) p++;
+                break;
+            case '>':
+                token = next == '|' ? RBRACE : next == '=' ? GE : GT;
+                if (token != GT) p++;
+                break;
+            case '<':
+                token = next == '=' ? LE : LT;
+                if (token != LT) p++;
+                break;
+            case '=':
+                token = next == '=' ? EQ : ASSIGN;
+                if (token != ASSIGN) p++;
+                break;
+            case '!':
+                token = next == '=' ? NE : NOT;
+                if (token != NOT) p++;
+                break;
+            case '(': token = LPAREN; break;
+            case ')': token = RPAREN; break;
+            case '[': token = LBRACKET; break;
+            case ']': token = RBRACKET; break;
+            case ';': token = SEMICOLON; break;
+            case ',': token = COMMA; break;
+            case '+': token = PLUS; break;
+            case '-': token = MINUS; break;
+            case '*': token = MULTIPLY; break;
+            case '/': token = DIVIDE; break;
+            case '.': token = DOT; break;
+            case ':': token = COLON; break;
+            default: token = -1; break;
+        }
+    }
+
+    /* Numbers and strings that reach end */
+    if (lexer->streaming && p >= end) {
+        lexer->cursor = start;
+        return MTHL_LEX_MORE;
+    }
+    if (p > end) lexer->truncated = 1;
+    lexer->cursor = p;
+    if (token == -1 && !lexer->fragment) fprintf(stderr, "Unrecognized character: %.1s\n", start);
+    return token;
+}
+
+static int next_token(mthl_lexer_t *lexer, YYSTYPE *value) {
+    int token;
+    while ((token = scan_token(lexer, value)) == -1) continue;
+    return token;
+}
+
+int yylex(YYSTYPE *value, YYLTYPE *location) {
+    mthl_lexer_t *lexer = mthl_lexer;
+    int token = lexer->start_token;
+
+    if (token) {
+        lexer->start_token = 0;
+        lexer->token_start = (uint32_t)(lexer->cursor - lexer->source);
+    } else {
+        token = next_token(lexer, value);
+        if (token == MTHL_LEX_MORE) return token;
+        if (token == 0) lexer->token_start = (uint32_t)(lexer->cursor - lexer->source);
+    }
+    location->start = lexer->token_start;
+    location->end = (uint32_t)(lexer->cursor - lexer->source);
+    return token;
+}
+
+/* Source */
+
+int mthl_lexer_read(mthl_lexer_t *lexer, FILE *file) {
+    size_t size = 0;
+    size_t capacity = 64 * 1024;
+
+    memset(lexer, 0, sizeof(*lexer));
+    char *source = malloc(capacity + MTHL_LEX_PADDING);
+    if (!source) return -1;
+
+    for (;;) {
+        size += fread(source + size, 1, capacity - size, file);
+        if (size < capacity) break;
+        char *grown = realloc(source, capacity * 2 + MTHL_LEX_PADDING);
+        if (!grown) {
+            free(source);
+            return -1;
+        }
+        source = grown;
+        capacity *= 2;
+    }
+
+    memset(source + size, 0, MTHL_LEX_PADDING);
+    lexer->source = source;
+    lexer->capacity = capacity;
+    lexer->cursor = source;
+    lexer->end = source + size;
+    return 0;
+}
+
+/* Makes room for size bytes of source, keeping cursor and end in place */
+static int lexer_reserve(mthl_lexer_t *lexer, size_t size) {
+    if (lexer->source && size <= lexer->capacity) return 0;
+
+    size_t capacity = lexer->capacity ? lexer->capacity * 2 : 64 * 1024;
+    while (capacity < size) capacity *= 2;
+    char *source = realloc(lexer->source, capacity + MTHL_LEX_PADDING);
+    if (!source) return -1;
+
+    lexer->cursor = source + (lexer->cursor - lexer->source);
+    lexer->end = source + (lexer->end - lexer->source);
+    lexer->source = source;
+    lexer->capacity = capacity;
+    lexer->block = NULL;
+    return 0;
+}
+
+int mthl_lexer_edit(mthl_lexer_t *lexer, size_t offset, size_t removed,
+                    const char *text, size_t length) {
+    size_t size = mthl_lexer_size(lexer);
+    size_t new_size = size - removed + length;
+
+    if (lexer_reserve(lexer, new_size) < 0) return -1;
+
+    char *at = lexer->source + offset;
+    memmove(at + length, at + removed, size - offset - removed);
+    memcpy(at, text, length);
+    memset(lexer->source + new_size, 0, MTHL_LEX_PADDING);
+
+    lexer->cursor = lexer->source;
+    lexer->end = lexer->source + new_size;
+    lexer->block = NULL;
+    return 0;
+}
+
+int mthl_lexer_append(mthl_lexer_t *lexer, const char *data, size_t size) {
+    size_t old_size = mthl_lexer_size(lexer);
+
+    if (lexer_reserve(lexer, old_size + size) < 0) return -1;
+    memcpy(lexer->source + old_size, data, size);
+    memset(lexer->source + old_size + size, 0, MTHL_LEX_PADDING);
+    lexer->end = lexer->source + old_size + size;
+
+    /* The masks of the last block were taken over the padding */
+    lexer->block = NULL;
+    return 0;
+}
+
+void mthl_lexer_free(mthl_lexer_t *lexer) {
+    free(lexer->source);
+    free(lexer->scratch);
+    memset(lexer, 0, sizeof(*lexer));
+}
+
+/* Benchmark */
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void mthl_lex_benchmark(mthl_lexer_t *lexer, int iterations) {
+    YYSTYPE value;
+    uint64_t tokens = 0;
+
+    double start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        lexer->cursor = lexer->source;
+        while (next_token(lexer, &value) != 0) tokens++;
+    }
+    double lex_ms = (now_ms() - start) / iterations;
+    lexer->cursor = lexer->source;
+
+    printf("lexer  %10.3f ms per run, %llu tokens, %.2f GB/s (%d-byte vectors)\n",
+           lex_ms, (unsigned long long)(tokens / iterations),
+           lex_ms > 0 ? mthl_lexer_size(lexer) / lex_ms / 1e6 : 0.0,
+#ifdef VEC_SIZE
+           VEC_SIZE
+#else
+           1
+#endif
+           );
+}
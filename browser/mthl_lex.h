@@ -0,0 +1,73 @@
+/* mthl_lex.h - Lexical analyzer for MTHL */
+#ifndef MTHL_LEX_H
+#define MTHL_LEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The lexer works on the whole page in memory and scans it with AVX2 or
+ * SSE2 where the compiler targets them: whitespace and names through
+ * per-block bit masks, string bodies a vector at a time. The source
+ * buffer is followed by MTHL_LEX_PADDING zero bytes that loads may run
+ * into and that end every run.
+ *
+ * String literals without escapes are interned straight from the source;
+ * those with escapes are decoded into a scratch buffer that grows as
+ * needed.
+ *
+ * "/^" starts a comment that runs to the end of the line, and a
+ * character that starts no token is reported and skipped.
+ *
+ * A page can also arrive in pieces: while streaming is set, more source
+ * may follow end, and yylex returns MTHL_LEX_MORE rather than a token
+ * that could still grow, or run on, once it does.
+ */
+
+#define MTHL_LEX_PADDING 64
+
+/* yylex while streaming: wait for mthl_lexer_append */
+#define MTHL_LEX_MORE (-2)
+
+typedef struct mthl_lexer {
+    char *source;           /* Owned, padded */
+    size_t capacity;        /* Source bytes that fit before the padding */
+    const char *cursor;
+    const char *end;
+    uint32_t token_start;   /* Offset of the last token */
+    int start_token;        /* Returned once before the source, if set */
+    int fragment;           /* Lexing one block: quiet, end is not the page's */
+    int truncated;          /* A comment, string or token ran into end */
+    int streaming;          /* More source may follow end */
+    const char *block;      /* 64-byte block the masks describe */
+    uint64_t space;         /* Bit per byte of block */
+    uint64_t name;          /* Letters, digits and _ */
+    char *scratch;          /* Decoded string literals */
+    size_t scratch_capacity;
+} mthl_lexer_t;
+
+/* Lexer yylex reads from */
+extern mthl_lexer_t *mthl_lexer;
+
+/* Reads all of file; returns -1 if out of memory */
+int mthl_lexer_read(mthl_lexer_t *lexer, FILE *file);
+void mthl_lexer_free(mthl_lexer_t *lexer);
+
+/* Adds size bytes of data after end; returns -1 if out of memory. An
+ * empty lexer (all zero) starts a stream. */
+int mthl_lexer_append(mthl_lexer_t *lexer, const char *data, size_t size);
+
+/* Replaces removed bytes at offset with length bytes of text and rewinds;
+ * returns -1 if out of memory */
+int mthl_lexer_edit(mthl_lexer_t *lexer, size_t offset, size_t removed,
+                    const char *text, size_t length);
+
+static inline size_t mthl_lexer_size(const mthl_lexer_t *lexer) {
+    return (size_t)(lexer->end - lexer->source);
+}
+
+/* Times lexing the whole source, interning into ast_doc, and rewinds */
+void mthl_lex_benchmark(mthl_lexer_t *lexer, int iterations);
+
+#endif
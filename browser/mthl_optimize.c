@@ -0,0 +1,290 @@
+/* mthl_optimize.c - Constant folding and const propagation for MTHL */
+#include <stdlib.h>
+#include <string.h>
+#include "mthl_runtime.h"
+
+/*
+ * Rewrites the tree in place before it runs, so neither engine evaluates
+ * what is known from the source alone:
+ *
+ *  - name: value const; declarations that run unconditionally (not under
+ *    if, for or onclick) and are never assigned again are propagated:
+ *    later uses of a const string or number become the literal, and
+ *    name[literal] and name.length on a const array become the element or
+ *    the count, as long as the array is never used bare (where an alias
+ *    could change it).
+ *  - Operators whose operands are literals are evaluated with the same
+ *    mthl_binary the engines use, so folding cannot change a result.
+ *  - if with a literal condition becomes a block of the branch taken.
+ *  - A const declaration left with no uses becomes an empty block.
+ *
+ * Replaced nodes keep their index and sibling link; whatever they pointed
+ * to is left unreachable in the arena.
+ */
+
+typedef struct const_info {
+    uint32_t writes;        /* Declarations and assignments of the symbol */
+    uint32_t bare_uses;     /* Reads not under [] or .length */
+    ast_index_t decl;       /* Const declaration usable for propagation */
+    int ready;              /* decl has run on every path to here */
+} const_info_t;
+
+typedef struct optimizer {
+    ASTDocument *doc;
+    mthl_runtime_t rt;
+    const_info_t *symbols;
+    uint32_t folds;
+} optimizer_t;
+
+static int is_literal(ASTNode *node) {
+    return node->kind == AST_INTEGER || node->kind == AST_PERCENTAGE ||
+           node->kind == AST_STRING || node->kind == AST_COLOR;
+}
+
+static mthl_value_t literal_of(ASTNode *node) {
+    switch (node->kind) {
+        case AST_INTEGER: return (mthl_value_t){ VAL_INT, node->value.ival };
+        case AST_PERCENTAGE: return (mthl_value_t){ VAL_PERCENT, node->value.ival };
+        case AST_STRING: return (mthl_value_t){ VAL_STRING, (int32_t)node->value.sym };
+        case AST_COLOR: return (mthl_value_t){ VAL_COLOR, (int32_t)node->value.sym };
+    }
+    return (mthl_value_t){ VAL_NONE, 0 };
+}
+
+/* Turns node into a literal, keeping its place among its siblings */
+static int make_literal(optimizer_t *o, ast_index_t index, mthl_value_t value) {
+    static const uint8_t kinds[] = {
+        [VAL_INT] = AST_INTEGER, [VAL_PERCENT] = AST_PERCENTAGE,
+        [VAL_STRING] = AST_STRING, [VAL_COLOR] = AST_COLOR
+    };
+    ASTNode *node = &o->doc->nodes[index];
+
+    if (value.type == VAL_NONE || value.type == VAL_ARRAY) return 0;
+    node->kind = kinds[value.type];
+    node->op = OP_NONE;
+    node->flags = 0;
+    node->first_child = AST_NONE;
+    node->value.ival = value.i;
+    o->folds++;
+    return 1;
+}
+
+static void copy_literal(optimizer_t *o, ast_index_t index, ast_index_t literal) {
+    make_literal(o, index, literal_of(&o->doc->nodes[literal]));
+}
+
+/* The const array behind symbol, if its elements can be read at compile time */
+static ast_index_t const_array(optimizer_t *o, uint32_t symbol) {
+    const_info_t *info = &o->symbols[symbol];
+    if (!info->ready || info->bare_uses > 0) return AST_NONE;
+
+    ast_index_t value = o->doc->nodes[info->decl].first_child;
+    if (o->doc->nodes[value].kind != AST_ARRAY) return AST_NONE;
+    for (AST_EACH_CHILD(o->doc, value, element)) {
+        if (!is_literal(&o->doc->nodes[element])) return AST_NONE;
+    }
+    return value;
+}
+
+static ast_index_t const_scalar(optimizer_t *o, uint32_t symbol) {
+    const_info_t *info = &o->symbols[symbol];
+    if (!info->ready) return AST_NONE;
+
+    ast_index_t value = o->doc->nodes[info->decl].first_child;
+    return is_literal(&o->doc->nodes[value]) ? value : AST_NONE;
+}
+
+static void fold_expression(optimizer_t *o, ast_index_t index) {
+    ASTDocument *doc = o->doc;
+
+    for (AST_EACH_CHILD(doc, index, child)) fold_expression(o, child);
+
+    ASTNode node = doc->nodes[index];
+    switch (node.kind) {
+        case AST_VARIABLE: {
+            ast_index_t literal = const_scalar(o, node.value.sym);
+            if (literal != AST_NONE) copy_literal(o, index, literal);
+            break;
+        }
+        case AST_ARRAY_ACCESS: {
+            ast_index_t array = const_array(o, node.value.sym);
+            ASTNode *position = &doc->nodes[node.first_child];
+            if (array == AST_NONE || position->kind != AST_INTEGER || position->value.ival < 0) break;
+            ast_index_t element = ast_child(doc, array, position->value.ival);
+            if (element != AST_NONE) copy_literal(o, index, element);
+            break;
+        }
+        case AST_PROPERTY_ACCESS: {
+            ASTNode *object = &doc->nodes[node.first_child];
+            if (node.value.sym != AST_SYM_LENGTH) break;
+            if (object->kind == AST_STRING || object->kind == AST_COLOR) {
+                make_literal(o, index, mthl_property(&o->rt, literal_of(object), AST_SYM_LENGTH));
+            } else if (object->kind == AST_VARIABLE) {
+                ast_index_t array = const_array(o, object->value.sym);
+                if (array != AST_NONE) make_literal(o, index, mthl_int(ast_child_count(doc, array)));
+            }
+            break;
+        }
+        case AST_UNARY_OP: {
+            ASTNode *operand = &doc->nodes[node.first_child];
+            if (is_literal(operand)) {
+                make_literal(o, index, mthl_int(!mthl_truthy(&o->rt, literal_of(operand))));
+            }
+            break;
+        }
+        case AST_BINARY_OP: {
+            ASTNode *left = &doc->nodes[node.first_child];
+            ASTNode *right = &doc->nodes[left->next_sibling];
+            if (is_literal(left) && is_literal(right)) {
+                make_literal(o, index, mthl_binary(&o->rt, node.op, literal_of(left), literal_of(right)));
+            }
+            break;
+        }
+    }
+}
+
+static void fold_statements(optimizer_t *o, ast_index_t first, int conditional);
+
+static void fold_statement(optimizer_t *o, ast_index_t index, int conditional) {
+    ASTDocument *doc = o->doc;
+    ASTNode node = doc->nodes[index];
+
+    switch (node.kind) {
+        case AST_VAR_DECL: {
+            const_info_t *info = &o->symbols[node.value.sym];
+            fold_expression(o, node.first_child);
+            if ((node.flags & AST_FLAG_CONST) && info->writes == 1 && !conditional) {
+                info->decl = index;
+                info->ready = 1;
+            }
+            break;
+        }
+        case AST_ASSIGN:
+        case AST_ARRAY_ASSIGN:
+            for (AST_EACH_CHILD(doc, index, child)) fold_expression(o, child);
+            break;
+        case AST_IF: {
+            ast_index_t then_block = doc->nodes[node.first_child].next_sibling;
+            ast_index_t else_block = doc->nodes[then_block].next_sibling;
+            fold_expression(o, node.first_child);
+
+            ASTNode *condition = &doc->nodes[node.first_child];
+            if (is_literal(condition)) {
+                ast_index_t taken = mthl_truthy(&o->rt, literal_of(condition)) ? then_block : else_block;
+                doc->nodes[index].kind = AST_BLOCK;
+                doc->nodes[index].first_child = taken != AST_NONE ? doc->nodes[taken].first_child : AST_NONE;
+                o->folds++;
+                fold_statements(o, doc->nodes[index].first_child, conditional);
+                break;
+            }
+            fold_statements(o, doc->nodes[then_block].first_child, 1);
+            if (else_block != AST_NONE) fold_statements(o, doc->nodes[else_block].first_child, 1);
+            break;
+        }
+        case AST_FOR: {
+            ast_index_t init = node.first_child;
+            ast_index_t condition = doc->nodes[init].next_sibling;
+            ast_index_t step = doc->nodes[condition].next_sibling;
+            ast_index_t body = doc->nodes[step].next_sibling;
+            fold_statement(o, init, conditional);
+            fold_expression(o, condition);
+            fold_statements(o, doc->nodes[body].first_child, 1);
+            fold_statement(o, step, 1);
+            break;
+        }
+        case AST_ONCLICK:
+            fold_statements(o, node.first_child, 1);
+            break;
+        case AST_BLOCK:
+        case AST_CONTAINER:
+        case AST_TEXT:
+        case AST_RECTANGLE:
+        case AST_BUTTON:
+            fold_statements(o, node.first_child, conditional);
+            break;
+        case AST_PROP_POSITION:
+        case AST_PROP_BACKGROUND:
+        case AST_PROP_CONTENT:
+        case AST_PROP_FONT:
+        case AST_PROP_COLOR:
+        case AST_PROP_FILL:
+        case AST_PROP_ALIGN:
+            for (AST_EACH_CHILD(doc, index, child)) fold_expression(o, child);
+            break;
+    }
+}
+
+static void fold_statements(optimizer_t *o, ast_index_t first, int conditional) {
+    for (ast_index_t index = first; index != AST_NONE; index = o->doc->nodes[index].next_sibling) {
+        fold_statement(o, index, conditional);
+    }
+}
+
+/* Counts writes and bare reads per symbol over the reachable tree */
+static void count_uses(optimizer_t *o, ast_index_t index, ast_index_t parent) {
+    ASTDocument *doc = o->doc;
+    ASTNode *node = &doc->nodes[index];
+
+    switch (node->kind) {
+        case AST_VAR_DECL:
+        case AST_ASSIGN:
+        case AST_ARRAY_ASSIGN:
+            o->symbols[node->value.sym].writes++;
+            break;
+        case AST_VARIABLE:
+            if (doc->nodes[parent].kind != AST_PROPERTY_ACCESS) o->symbols[node->value.sym].bare_uses++;
+            break;
+    }
+
+    for (AST_EACH_CHILD(doc, index, child)) count_uses(o, child, index);
+}
+
+/* Counts any remaining read of symbol in the reachable tree */
+static int still_used(optimizer_t *o, ast_index_t index, uint32_t symbol) {
+    ASTNode *node = &o->doc->nodes[index];
+
+    if ((node->kind == AST_VARIABLE || node->kind == AST_ARRAY_ACCESS) && node->value.sym == symbol) {
+        return 1;
+    }
+    for (AST_EACH_CHILD(o->doc, index, child)) {
+        if (still_used(o, child, symbol)) return 1;
+    }
+    return 0;
+}
+
+uint32_t mthl_optimize(ASTDocument *doc, ast_index_t root) {
+    optimizer_t o;
+
+    memset(&o, 0, sizeof(o));
+    o.doc = doc;
+    mthl_runtime_init(&o.rt, doc);
+    o.symbols = calloc(doc->symbol_count, sizeof(const_info_t));
+    if (!o.symbols) return 0;
+
+    count_uses(&o, root, AST_NONE);
+
+    for (ast_index_t i = 1; i < doc->node_count; i++) {
+        ASTNode *node = &doc->nodes[i];
+        if (node->kind != AST_VAR_DECL || !(node->flags & AST_FLAG_CONST)) continue;
+        if (o.symbols[node->value.sym].writes > 1) {
+            fprintf(stderr, "Warning: const '%s' is assigned more than once\n",
+                    ast_symbol_name(doc, node->value.sym));
+        }
+    }
+
+    fold_statements(&o, doc->nodes[root].first_child, 0);
+
+    /* Consts whose every use was folded need not run at all */
+    for (uint32_t sym = 0; sym < doc->symbol_count; sym++) {
+        ast_index_t decl = o.symbols[sym].decl;
+        if (decl == AST_NONE || still_used(&o, root, sym)) continue;
+        doc->nodes[decl].kind = AST_BLOCK;
+        doc->nodes[decl].flags = 0;
+        doc->nodes[decl].first_child = AST_NONE;
+        o.folds++;
+    }
+
+    free(o.symbols);
+    mthl_runtime_free(&o.rt);
+    return o.folds;
+}
@@ -0,0 +1,197 @@
+/* mthl_runtime.h - Values, elements and execution of MTHL pages */
+#ifndef MTHL_RUNTIME_H
+#define MTHL_RUNTIME_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "mthl_ast.h"
+
+/*
+ * A page runs in two stages. The script (var, if, for, assignments) runs
+ * and, as it runs into elements, records each one with its evaluated
+ * properties in the runtime's element list, parents before children.
+ * onclick handlers run later against the same variables. The element list
+ * is what layout and drawing consume.
+ *
+ * There are two engines over the same runtime: a tree walker over the AST
+ * (mthl_interp.c), and a bytecode compiler and register VM (mthl_vm.c).
+ * Pages run on the VM; the walker is kept as the reference the VM is
+ * checked and benchmarked against.
+ */
+
+typedef enum {
+    VAL_NONE = 0,
+    VAL_INT,
+    VAL_PERCENT,
+    VAL_STRING,
+    VAL_COLOR,
+    VAL_ARRAY
+} mthl_value_type_t;
+
+typedef struct mthl_value {
+    uint32_t type;
+    int32_t i;              /* Number, symbol id, or array id */
+} mthl_value_t;
+
+typedef struct mthl_array {
+    mthl_value_t *items;
+    uint32_t count;
+    uint32_t capacity;
+} mthl_array_t;
+
+typedef struct mthl_element {
+    uint8_t kind;           /* AST_CONTAINER, AST_TEXT, AST_RECTANGLE, AST_BUTTON */
+    int32_t parent;         /* Element index, -1 at the top */
+    ast_index_t node;
+    mthl_value_t position[4];
+    mthl_value_t background;
+    mthl_value_t content;
+    mthl_value_t font[3];
+    mthl_value_t color;
+    mthl_value_t fill;
+    mthl_value_t align;
+    int32_t onclick;        /* Engine's handler id, -1 if none */
+} mthl_element_t;
+
+typedef struct mthl_runtime {
+    ASTDocument *doc;
+
+    /* Tree walker variables, searched by symbol */
+    uint32_t *var_symbols;
+    mthl_value_t *var_values;
+    uint32_t var_count;
+    uint32_t var_capacity;
+
+    mthl_array_t *arrays;
+    uint32_t array_count;
+    uint32_t array_capacity;
+
+    mthl_element_t *elements;
+    uint32_t element_count;
+    uint32_t element_capacity;
+    int32_t *element_stack;     /* Open elements, innermost last */
+    uint32_t element_depth;
+    uint32_t element_stack_capacity;
+
+    int redraw_requested;
+    uint32_t runs;          /* Resets so far, so a rerun can be told apart */
+} mthl_runtime_t;
+
+void mthl_runtime_init(mthl_runtime_t *rt, ASTDocument *doc);
+void mthl_runtime_free(mthl_runtime_t *rt);
+/* Drops variables, arrays and elements so the page can run again */
+void mthl_runtime_reset(mthl_runtime_t *rt);
+
+static inline mthl_value_t mthl_int(int32_t i) {
+    mthl_value_t value = { VAL_INT, i };
+    return value;
+}
+
+/* Operations shared by both engines */
+int mthl_truthy(mthl_runtime_t *rt, mthl_value_t value);
+mthl_value_t mthl_binary(mthl_runtime_t *rt, int op, mthl_value_t left, mthl_value_t right);
+mthl_value_t mthl_new_array(mthl_runtime_t *rt, const mthl_value_t *items, uint32_t count);
+mthl_value_t mthl_index(mthl_runtime_t *rt, mthl_value_t array, mthl_value_t index);
+void mthl_set_index(mthl_runtime_t *rt, mthl_value_t array, mthl_value_t index, mthl_value_t value);
+mthl_value_t mthl_property(mthl_runtime_t *rt, mthl_value_t object, uint32_t property);
+void mthl_format_value(mthl_runtime_t *rt, mthl_value_t value, char *buffer, size_t size);
+
+/* Element recording, called as the script reaches elements */
+int32_t mthl_begin_element(mthl_runtime_t *rt, int kind, ast_index_t node);
+void mthl_end_element(mthl_runtime_t *rt);
+void mthl_set_property(mthl_runtime_t *rt, int kind, const mthl_value_t *args);
+void mthl_set_onclick(mthl_runtime_t *rt, int32_t handler);
+/* Prints elements first onwards, indented by depth */
+void mthl_print_elements(mthl_runtime_t *rt, uint32_t first, FILE *out);
+
+/* Tree walker */
+void mthl_walk_page(mthl_runtime_t *rt, ast_index_t root);
+/* One statement of a page, for running a page as it arrives */
+void mthl_walk_statement(mthl_runtime_t *rt, ast_index_t statement);
+void mthl_walk_click(mthl_runtime_t *rt, uint32_t element);
+
+/* Folds constants and propagates consts in place, returning the number of
+ * rewrites. Runs once after parsing, before either engine. */
+uint32_t mthl_optimize(ASTDocument *doc, ast_index_t root);
+
+/* Bytecode. Every operand is a register: variables get fixed registers
+ * when the page is compiled, constants are preloaded into registers of
+ * their own, and temporaries follow. */
+typedef enum {
+    VM_HALT = 0,
+    VM_MOVE,                /* a = b */
+    VM_ADD,                 /* a = b op c */
+    VM_SUB,
+    VM_MUL,
+    VM_DIV,
+    VM_GT,
+    VM_LT,
+    VM_GE,
+    VM_LE,
+    VM_EQ,
+    VM_NE,
+    VM_AND,
+    VM_OR,
+    VM_NOT,                 /* a = !b */
+    VM_JMP,                 /* goto target */
+    VM_JMPF,                /* if !a goto target */
+    VM_JMPT,                /* if a goto target */
+    VM_JLT,                 /* if a < b goto target, target in the next slot */
+    VM_JNLT,                /* if !(a < b) goto target, target in the next slot */
+    VM_NEWARRAY,            /* a = [b .. b+c-1] */
+    VM_GETIDX,              /* a = b[c] */
+    VM_SETIDX,              /* a[b] = c */
+    VM_PROP,                /* a = b.symbol(c) */
+    VM_BEGIN,               /* element kind a, node b|c<<16 */
+    VM_END,
+    VM_SETPROP,             /* property kind a, arguments from register b */
+    VM_ONCLICK,             /* handler at target */
+    VM_REDRAW,
+    VM_RET,
+    VM_OP_COUNT
+} mthl_opcode_t;
+
+typedef struct mthl_insn {
+    uint16_t op;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+} mthl_insn_t;
+
+/* Jump targets and node indices span b and c */
+#define VM_WIDE(insn) ((uint32_t)(insn)->b | ((uint32_t)(insn)->c << 16))
+
+typedef struct mthl_program {
+    mthl_insn_t *code;
+    uint32_t code_size;
+    uint32_t code_capacity;
+    mthl_value_t *constants;    /* Initial values of the constant registers */
+    uint32_t constant_count;
+    uint32_t constant_base;     /* First constant register */
+    uint32_t variable_count;    /* Registers 0 .. variable_count-1 */
+    uint32_t register_count;
+    int borrowed;               /* code and constants live in a mapped image */
+} mthl_program_t;
+
+typedef struct mthl_vm {
+    mthl_runtime_t *rt;
+    mthl_program_t *program;
+    mthl_value_t *registers;
+} mthl_vm_t;
+
+int mthl_compile(ASTDocument *doc, ast_index_t root, mthl_program_t *program);
+void mthl_program_free(mthl_program_t *program);
+void mthl_program_dump(mthl_program_t *program, FILE *out);
+
+int mthl_vm_init(mthl_vm_t *vm, mthl_runtime_t *rt, mthl_program_t *program);
+void mthl_vm_free(mthl_vm_t *vm);
+void mthl_vm_run(mthl_vm_t *vm);
+void mthl_vm_click(mthl_vm_t *vm, uint32_t element);
+
+/* Runs a parsed page and prints its elements */
+void interpret_ast(ASTDocument *doc, ast_index_t root);
+
+/* Times the walker against the VM on a page, iterations runs each */
+void mthl_benchmark(ASTDocument *doc, ast_index_t root, int iterations);
+
+#endif
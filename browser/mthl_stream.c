@@ -0,0 +1,77 @@
+/* mthl_stream.c - Parsing and running MTHL pages as they arrive */
+#include <stdlib.h>
+#include <string.h>
+#include "mthl.tab.h"  /* Bison-generated header, pulls in mthl_ast.h */
+#include "mthl_stream.h"
+
+extern ast_index_t ast_page;
+
+int mthl_stream_open(mthl_stream_t *stream) {
+    memset(stream, 0, sizeof(*stream));
+    if (ast_document_init(&stream->doc, 0) < 0) return -1;
+
+    /* An empty, padded source to lex before anything has arrived */
+    stream->parser = yypstate_new();
+    if (!stream->parser || mthl_lexer_append(&stream->lexer, "", 0) < 0) {
+        mthl_stream_close(stream);
+        return -1;
+    }
+    stream->lexer.streaming = 1;
+    mthl_runtime_init(&stream->rt, &stream->doc);
+    return 0;
+}
+
+void mthl_stream_close(mthl_stream_t *stream) {
+    if (stream->parser) yypstate_delete(stream->parser);
+    mthl_runtime_free(&stream->rt);
+    ast_document_free(&stream->doc);
+    mthl_lexer_free(&stream->lexer);
+    memset(stream, 0, sizeof(*stream));
+}
+
+/* Runs the statements the parser has linked into the page since the
+ * last call. A statement is only linked once reduced, so it is whole. */
+static void run_statements(mthl_stream_t *stream) {
+    ASTNode *nodes = stream->doc.nodes;
+    ast_index_t next;
+
+    if (stream->page == AST_NONE) return;
+    next = stream->last_run == AST_NONE ? nodes[stream->page].first_child
+                                        : nodes[stream->last_run].next_sibling;
+    for (; next != AST_NONE; next = nodes[next].next_sibling) {
+        mthl_walk_statement(&stream->rt, next);
+        stream->last_run = next;
+    }
+}
+
+int mthl_stream_push(mthl_stream_t *stream, const char *data, size_t size) {
+    mthl_lexer_t *lexer = &stream->lexer;
+
+    if (stream->status != MTHL_STREAM_MORE) return stream->status;
+
+    if (size == 0) {
+        lexer->streaming = 0;
+    } else if (mthl_lexer_append(lexer, data, size) < 0) {
+        return stream->status = MTHL_STREAM_ERROR;
+    }
+
+    ast_doc = &stream->doc;
+    mthl_lexer = lexer;
+    ast_page = stream->page;
+
+    for (;;) {
+        YYSTYPE value;
+        YYLTYPE location;
+        int token = yylex(&value, &location);
+        if (token == MTHL_LEX_MORE) break;
+
+        int result = yypush_parse(stream->parser, token, &value, &location);
+        stream->page = ast_page;
+        run_statements(stream);
+        if (result != YYPUSH_MORE) {
+            stream->status = result == 0 ? MTHL_STREAM_DONE : MTHL_STREAM_ERROR;
+            break;
+        }
+    }
+    return stream->status;
+}
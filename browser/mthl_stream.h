@@ -0,0 +1,48 @@
+/* mthl_stream.h - Parsing and running MTHL pages as they arrive */
+#ifndef MTHL_STREAM_H
+#define MTHL_STREAM_H
+
+#include <stddef.h>
+#include "mthl_ast.h"
+#include "mthl_lex.h"
+#include "mthl_runtime.h"
+
+/*
+ * A stream takes a page in whatever pieces the network delivers it and
+ * pushes each token to the parser as soon as the token is known to be
+ * complete. Every statement of the page itself is run on the tree walker
+ * the moment it has been reduced, so the elements it records can be drawn
+ * while the rest of the page is still on its way: the first paint waits
+ * for the first element, not for the last byte.
+ *
+ * Elements are only ever added to rt, in order, so a caller draws
+ * rt.elements from where it stopped last time. Running statement by
+ * statement gives the elements running the finished page would, as a page
+ * runs top to bottom.
+ */
+
+typedef struct mthl_stream {
+    ASTDocument doc;
+    mthl_lexer_t lexer;
+    struct yypstate *parser;
+    mthl_runtime_t rt;
+    ast_index_t page;           /* From its header on; whole once DONE */
+    ast_index_t last_run;       /* Last statement of the page run so far */
+    int status;                 /* MTHL_STREAM_* */
+} mthl_stream_t;
+
+/* mthl_stream_push results */
+#define MTHL_STREAM_ERROR (-1)  /* Does not parse, or out of memory */
+#define MTHL_STREAM_MORE  0     /* Waiting for the rest of the page */
+#define MTHL_STREAM_DONE  1     /* Parsed and run */
+
+/* The stream must stay where it is until closed; rt refers to doc */
+int mthl_stream_open(mthl_stream_t *stream);
+void mthl_stream_close(mthl_stream_t *stream);
+
+/* Parses and runs as much of the page as size more bytes of data make
+ * complete. A size of 0 marks the end of the page. Returns an
+ * MTHL_STREAM_* status, which stays put once it is not MORE. */
+int mthl_stream_push(mthl_stream_t *stream, const char *data, size_t size);
+
+#endif
@@ -0,0 +1,777 @@
+/* mthl_vm.c - MTHL bytecode compiler and register VM */
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include "mthl_runtime.h"
+
+#define VM_MAX_REGISTERS 0xFFFF
+
+typedef struct compiler {
+    ASTDocument *doc;
+    mthl_program_t *program;
+    int32_t *symbol_slots;      /* Variable register per symbol, -1 if none */
+    uint32_t *constant_slots;   /* Hash of constant index + 1, 0 if free */
+    uint32_t constant_mask;
+    uint32_t next_temp;
+    ast_index_t *handlers;      /* onclick bodies waiting to be compiled */
+    uint32_t *handler_fixups;
+    uint32_t handler_count;
+    uint32_t handler_capacity;
+    int failed;
+} compiler_t;
+
+static void compile_statements(compiler_t *c, ast_index_t first);
+
+static uint32_t emit(compiler_t *c, int op, uint32_t a, uint32_t b, uint32_t cc) {
+    mthl_program_t *program = c->program;
+
+    if (program->code_size == program->code_capacity) {
+        uint32_t capacity = program->code_capacity ? program->code_capacity * 2 : 256;
+        mthl_insn_t *code = realloc(program->code, capacity * sizeof(mthl_insn_t));
+        if (!code) {
+            c->failed = 1;
+            return 0;
+        }
+        program->code = code;
+        program->code_capacity = capacity;
+    }
+
+    mthl_insn_t *insn = &program->code[program->code_size];
+    insn->op = op;
+    insn->a = a;
+    insn->b = b;
+    insn->c = cc;
+    return program->code_size++;
+}
+
+static uint32_t emit_wide(compiler_t *c, int op, uint32_t a, uint32_t wide) {
+    return emit(c, op, a, wide & 0xFFFF, wide >> 16);
+}
+
+static void patch_wide(compiler_t *c, uint32_t at, uint32_t target) {
+    if (c->failed) return;
+    c->program->code[at].b = target & 0xFFFF;
+    c->program->code[at].c = target >> 16;
+}
+
+static uint32_t here(compiler_t *c) {
+    return c->program->code_size;
+}
+
+/* Registers */
+
+static uint32_t alloc_temps(compiler_t *c, uint32_t count) {
+    uint32_t first = c->next_temp;
+
+    if (first + count > VM_MAX_REGISTERS) {
+        c->failed = 1;
+        return 0;
+    }
+    c->next_temp += count;
+    if (c->next_temp > c->program->register_count) c->program->register_count = c->next_temp;
+    return first;
+}
+
+static uint32_t constant_hash(mthl_value_t value) {
+    return (value.type * 0x9E3779B1u) ^ ((uint32_t)value.i * 0x85EBCA77u);
+}
+
+/* Finds value's constant register, adding it when add is set */
+static int32_t constant_register(compiler_t *c, mthl_value_t value, int add) {
+    mthl_program_t *program = c->program;
+    uint32_t slot = constant_hash(value) & c->constant_mask;
+
+    while (c->constant_slots[slot]) {
+        uint32_t index = c->constant_slots[slot] - 1;
+        mthl_value_t *known = &program->constants[index];
+        if (known->type == value.type && known->i == value.i) {
+            return program->constant_base + index;
+        }
+        slot = (slot + 1) & c->constant_mask;
+    }
+    if (!add) return -1;
+
+    uint32_t index = program->constant_count++;
+    program->constants[index] = value;
+    c->constant_slots[slot] = index + 1;
+    return program->constant_base + index;
+}
+
+static mthl_value_t literal_value(ASTNode *node) {
+    mthl_value_t value = { VAL_NONE, 0 };
+
+    switch (node->kind) {
+        case AST_INTEGER: value.type = VAL_INT; value.i = node->value.ival; break;
+        case AST_PERCENTAGE: value.type = VAL_PERCENT; value.i = node->value.ival; break;
+        case AST_STRING: value.type = VAL_STRING; value.i = node->value.sym; break;
+        case AST_COLOR: value.type = VAL_COLOR; value.i = node->value.sym; break;
+    }
+    return value;
+}
+
+static int is_property(int kind) {
+    return kind >= AST_PROP_POSITION && kind <= AST_PROP_ALIGN;
+}
+
+/* A property whose arguments are all literals, as every property of a
+ * static page is once constants are folded */
+static int literal_arguments(ASTDocument *doc, ast_index_t index) {
+    for (AST_EACH_CHILD(doc, index, child)) {
+        if (literal_value(&doc->nodes[child]).type == VAL_NONE) return 0;
+    }
+    return 1;
+}
+
+/* Gives every variable a register and every distinct literal a constant
+ * register. One pass over the flat node array finds them all. Multi
+ * argument properties with literal arguments also get a run of constant
+ * registers holding their arguments in order, so they are set straight
+ * from preloaded registers. */
+static int assign_registers(compiler_t *c) {
+    ASTDocument *doc = c->doc;
+    mthl_program_t *program = c->program;
+    uint32_t literals = 0;
+    uint32_t tuples = 0;
+
+    for (uint32_t sym = 0; sym < doc->symbol_count; sym++) c->symbol_slots[sym] = -1;
+
+    for (ast_index_t i = 1; i < doc->node_count; i++) {
+        ASTNode *node = &doc->nodes[i];
+        switch (node->kind) {
+            case AST_VAR_DECL:
+            case AST_ASSIGN:
+            case AST_ARRAY_ASSIGN:
+            case AST_VARIABLE:
+            case AST_ARRAY_ACCESS:
+                if (c->symbol_slots[node->value.sym] < 0) {
+                    c->symbol_slots[node->value.sym] = program->variable_count++;
+                }
+                break;
+            case AST_INTEGER:
+            case AST_PERCENTAGE:
+            case AST_STRING:
+            case AST_COLOR:
+                literals++;
+                break;
+        }
+        if (is_property(node->kind) && literal_arguments(doc, i)) {
+            uint32_t count = ast_child_count(doc, i);
+            if (count > 1) tuples += count;
+        }
+    }
+
+    uint32_t table = 16;
+    while (table < literals * 2) table *= 2;
+    c->constant_mask = table - 1;
+    c->constant_slots = calloc(table, sizeof(uint32_t));
+    program->constants = malloc((literals + tuples + 1) * sizeof(mthl_value_t));
+    if (!c->constant_slots || !program->constants) return -1;
+
+    program->constant_base = program->variable_count;
+    for (ast_index_t i = 1; i < doc->node_count; i++) {
+        mthl_value_t value = literal_value(&doc->nodes[i]);
+        if (value.type != VAL_NONE) constant_register(c, value, 1);
+    }
+
+    c->next_temp = program->constant_base + program->constant_count + tuples;
+    program->register_count = c->next_temp;
+    return c->next_temp > VM_MAX_REGISTERS ? -1 : 0;
+}
+
+/* Expressions. Returns the register holding the value: target if one is
+ * given, otherwise a variable or constant register when the expression is
+ * just that, or a fresh temporary. Only the last instruction writes the
+ * target, so target may also be an operand. */
+static uint32_t compile_expression(compiler_t *c, ast_index_t index, int32_t target) {
+    ASTDocument *doc = c->doc;
+    ASTNode node = doc->nodes[index];
+    int32_t source = -1;
+
+    switch (node.kind) {
+        case AST_INTEGER:
+        case AST_PERCENTAGE:
+        case AST_STRING:
+        case AST_COLOR:
+            source = constant_register(c, literal_value(&node), 0);
+            break;
+        case AST_VARIABLE:
+            source = c->symbol_slots[node.value.sym];
+            break;
+    }
+    if (source >= 0) {
+        if (target >= 0 && target != source) emit(c, VM_MOVE, target, source, 0);
+        return target >= 0 ? (uint32_t)target : (uint32_t)source;
+    }
+
+    uint32_t mark = c->next_temp;
+    uint32_t dst = target >= 0 ? (uint32_t)target : alloc_temps(c, 1);
+
+    switch (node.kind) {
+        case AST_BINARY_OP: {
+            static const int binary_ops[] = {
+                [OP_PLUS] = VM_ADD, [OP_MINUS] = VM_SUB, [OP_MULTIPLY] = VM_MUL,
+                [OP_DIVIDE] = VM_DIV, [OP_GT] = VM_GT, [OP_LT] = VM_LT, [OP_GE] = VM_GE,
+                [OP_LE] = VM_LE, [OP_EQ] = VM_EQ, [OP_NE] = VM_NE, [OP_AND] = VM_AND,
+                [OP_OR] = VM_OR
+            };
+            ast_index_t right = doc->nodes[node.first_child].next_sibling;
+            uint32_t left_reg = compile_expression(c, node.first_child, -1);
+            uint32_t right_reg = compile_expression(c, right, -1);
+            emit(c, binary_ops[node.op], dst, left_reg, right_reg);
+            break;
+        }
+        case AST_UNARY_OP:
+            emit(c, VM_NOT, dst, compile_expression(c, node.first_child, -1), 0);
+            break;
+        case AST_ARRAY_ACCESS: {
+            uint32_t position = compile_expression(c, node.first_child, -1);
+            emit(c, VM_GETIDX, dst, c->symbol_slots[node.value.sym], position);
+            break;
+        }
+        case AST_PROPERTY_ACCESS: {
+            /* Only length means anything; other names read as none */
+            uint32_t property = node.value.sym <= 0xFFFF ? node.value.sym : AST_SYM_EMPTY;
+            emit(c, VM_PROP, dst, compile_expression(c, node.first_child, -1), property);
+            break;
+        }
+        case AST_ARRAY: {
+            uint32_t count = ast_child_count(doc, index);
+            uint32_t first = alloc_temps(c, count);
+            uint32_t i = 0;
+            if (count > 0xFFFF) c->failed = 1;
+            for (AST_EACH_CHILD(doc, index, child)) compile_expression(c, child, first + i++);
+            emit(c, VM_NEWARRAY, dst, first, count);
+            break;
+        }
+        default:
+            c->failed = 1;
+            break;
+    }
+
+    c->next_temp = (target >= 0) ? mark : dst + 1;
+    return dst;
+}
+
+/* Emits a jump taken when condition's truth equals when, and returns the
+ * slot to patch with its target. a < b and a > b compile to one fused
+ * compare-and-branch. */
+static uint32_t compile_branch(compiler_t *c, ast_index_t condition, int when) {
+    ASTDocument *doc = c->doc;
+    ASTNode *node = &doc->nodes[condition];
+    uint32_t mark = c->next_temp;
+    uint32_t at;
+
+    if (node->kind == AST_BINARY_OP && (node->op == OP_LT || node->op == OP_GT)) {
+        int swap = node->op == OP_GT;
+        ast_index_t right = doc->nodes[node->first_child].next_sibling;
+        uint32_t left_reg = compile_expression(c, doc->nodes[condition].first_child, -1);
+        uint32_t right_reg = compile_expression(c, right, -1);
+        emit(c, when ? VM_JLT : VM_JNLT, swap ? right_reg : left_reg, swap ? left_reg : right_reg, 0);
+        at = emit(c, VM_HALT, 0, 0, 0);
+    } else {
+        uint32_t reg = compile_expression(c, condition, -1);
+        at = emit_wide(c, when ? VM_JMPT : VM_JMPF, reg, 0);
+    }
+
+    c->next_temp = mark;
+    return at;
+}
+
+static void compile_statement(compiler_t *c, ast_index_t index) {
+    ASTDocument *doc = c->doc;
+    ASTNode node = doc->nodes[index];
+    uint32_t mark = c->next_temp;
+
+    switch (node.kind) {
+        case AST_VAR_DECL:
+        case AST_ASSIGN:
+            compile_expression(c, node.first_child, c->symbol_slots[node.value.sym]);
+            break;
+        case AST_ARRAY_ASSIGN: {
+            ast_index_t value_node = doc->nodes[node.first_child].next_sibling;
+            uint32_t position = compile_expression(c, node.first_child, -1);
+            uint32_t value = compile_expression(c, value_node, -1);
+            emit(c, VM_SETIDX, c->symbol_slots[node.value.sym], position, value);
+            break;
+        }
+        case AST_IF: {
+            ast_index_t then_block = doc->nodes[node.first_child].next_sibling;
+            ast_index_t else_block = doc->nodes[then_block].next_sibling;
+            uint32_t skip_then = compile_branch(c, node.first_child, 0);
+            compile_statements(c, doc->nodes[then_block].first_child);
+            if (else_block != AST_NONE) {
+                uint32_t skip_else = emit_wide(c, VM_JMP, 0, 0);
+                patch_wide(c, skip_then, here(c));
+                compile_statements(c, doc->nodes[else_block].first_child);
+                patch_wide(c, skip_else, here(c));
+            } else {
+                patch_wide(c, skip_then, here(c));
+            }
+            break;
+        }
+        case AST_FOR: {
+            /* init; goto test; body: body; step; test: if condition goto body */
+            ast_index_t init = node.first_child;
+            ast_index_t condition = doc->nodes[init].next_sibling;
+            ast_index_t step = doc->nodes[condition].next_sibling;
+            ast_index_t body = doc->nodes[step].next_sibling;
+            compile_statement(c, init);
+            uint32_t to_test = emit_wide(c, VM_JMP, 0, 0);
+            uint32_t body_start = here(c);
+            compile_statements(c, doc->nodes[body].first_child);
+            compile_statement(c, step);
+            patch_wide(c, to_test, here(c));
+            patch_wide(c, compile_branch(c, condition, 1), body_start);
+            break;
+        }
+        case AST_REDRAW:
+            emit(c, VM_REDRAW, 0, 0, 0);
+            break;
+        case AST_BLOCK:
+            compile_statements(c, node.first_child);
+            break;
+        case AST_CONTAINER:
+        case AST_TEXT:
+        case AST_RECTANGLE:
+        case AST_BUTTON:
+            emit_wide(c, VM_BEGIN, node.kind, index);
+            compile_statements(c, node.first_child);
+            emit(c, VM_END, 0, 0, 0);
+            break;
+        case AST_PROP_POSITION:
+        case AST_PROP_BACKGROUND:
+        case AST_PROP_CONTENT:
+        case AST_PROP_FONT:
+        case AST_PROP_COLOR:
+        case AST_PROP_FILL:
+        case AST_PROP_ALIGN: {
+            mthl_program_t *program = c->program;
+            uint32_t count = ast_child_count(doc, index);
+            uint32_t first;
+
+            if (literal_arguments(doc, index) && count == 1) {
+                first = constant_register(c, literal_value(&doc->nodes[node.first_child]), 0);
+            } else if (literal_arguments(doc, index)) {
+                /* Fill the run reserved by assign_registers */
+                first = program->constant_base + program->constant_count;
+                for (AST_EACH_CHILD(doc, index, child)) {
+                    program->constants[program->constant_count++] = literal_value(&doc->nodes[child]);
+                }
+            } else {
+                uint32_t i = 0;
+                first = alloc_temps(c, count);
+                for (AST_EACH_CHILD(doc, index, child)) compile_expression(c, child, first + i++);
+            }
+            emit(c, VM_SETPROP, node.kind, first, 0);
+            break;
+        }
+        case AST_ONCLICK: {
+            if (c->handler_count == c->handler_capacity) {
+                uint32_t capacity = c->handler_capacity ? c->handler_capacity * 2 : 16;
+                ast_index_t *handlers = realloc(c->handlers, capacity * sizeof(ast_index_t));
+                if (handlers) c->handlers = handlers;
+                uint32_t *fixups = realloc(c->handler_fixups, capacity * sizeof(uint32_t));
+                if (fixups) c->handler_fixups = fixups;
+                if (!handlers || !fixups) {
+                    c->failed = 1;
+                    break;
+                }
+                c->handler_capacity = capacity;
+            }
+            c->handlers[c->handler_count] = index;
+            c->handler_fixups[c->handler_count++] = emit_wide(c, VM_ONCLICK, 0, 0);
+            break;
+        }
+    }
+
+    c->next_temp = mark;
+}
+
+static void compile_statements(compiler_t *c, ast_index_t first) {
+    for (ast_index_t index = first; index != AST_NONE && !c->failed;
+         index = c->doc->nodes[index].next_sibling) {
+        compile_statement(c, index);
+    }
+}
+
+int mthl_compile(ASTDocument *doc, ast_index_t root, mthl_program_t *program) {
+    compiler_t c;
+
+    memset(program, 0, sizeof(*program));
+    memset(&c, 0, sizeof(c));
+    c.doc = doc;
+    c.program = program;
+    c.symbol_slots = malloc(doc->symbol_count * sizeof(int32_t));
+
+    if (!c.symbol_slots || assign_registers(&c) < 0) {
+        c.failed = 1;
+    } else {
+        compile_statements(&c, doc->nodes[root].first_child);
+        emit(&c, VM_HALT, 0, 0, 0);
+
+        /* Handlers follow the page, each ending in RET. Compiling one can
+         * queue more from elements inside it. */
+        for (uint32_t i = 0; i < c.handler_count && !c.failed; i++) {
+            patch_wide(&c, c.handler_fixups[i], here(&c));
+            compile_statements(&c, doc->nodes[c.handlers[i]].first_child);
+            emit(&c, VM_RET, 0, 0, 0);
+        }
+    }
+
+    free(c.symbol_slots);
+    free(c.constant_slots);
+    free(c.handlers);
+    free(c.handler_fixups);
+
+    if (c.failed) {
+        mthl_program_free(program);
+        return -1;
+    }
+    return 0;
+}
+
+void mthl_program_free(mthl_program_t *program) {
+    if (!program->borrowed) {
+        free(program->code);
+        free(program->constants);
+    }
+    memset(program, 0, sizeof(*program));
+}
+
+static const char *vm_op_names[VM_OP_COUNT] = {
+    "halt", "move", "add", "sub", "mul", "div", "gt", "lt", "ge", "le", "eq", "ne",
+    "and", "or", "not", "jmp", "jmpf", "jmpt", "jlt", "jnlt", "newarray", "getidx",
+    "setidx", "prop", "begin", "end", "setprop", "onclick", "redraw", "ret"
+};
+
+void mthl_program_dump(mthl_program_t *program, FILE *out) {
+    fprintf(out, "%u variables, %u constants, %u registers, %u instructions\n",
+            program->variable_count, program->constant_count, program->register_count,
+            program->code_size);
+
+    for (uint32_t pc = 0; pc < program->code_size; pc++) {
+        mthl_insn_t *insn = &program->code[pc];
+        fprintf(out, "%5u  %-9s", pc, vm_op_names[insn->op]);
+        switch (insn->op) {
+            case VM_JMP:
+            case VM_ONCLICK:
+                fprintf(out, "-> %u\n", VM_WIDE(insn));
+                break;
+            case VM_JMPF:
+            case VM_JMPT:
+                fprintf(out, "r%u -> %u\n", insn->a, VM_WIDE(insn));
+                break;
+            case VM_JLT:
+            case VM_JNLT:
+                fprintf(out, "r%u r%u -> %u\n", insn->a, insn->b, VM_WIDE(insn + 1));
+                pc++;
+                break;
+            case VM_BEGIN:
+                fprintf(out, "%s\n", ast_kind_name(insn->a));
+                break;
+            case VM_SETPROP:
+                fprintf(out, "%s r%u\n", ast_kind_name(insn->a), insn->b);
+                break;
+            default:
+                fprintf(out, "%u %u %u\n", insn->a, insn->b, insn->c);
+                break;
+        }
+    }
+}
+
+/* VM */
+
+int mthl_vm_init(mthl_vm_t *vm, mthl_runtime_t *rt, mthl_program_t *program) {
+    vm->rt = rt;
+    vm->program = program;
+    vm->registers = calloc(program->register_count ? program->register_count : 1,
+                           sizeof(mthl_value_t));
+    return vm->registers ? 0 : -1;
+}
+
+void mthl_vm_free(mthl_vm_t *vm) {
+    free(vm->registers);
+    vm->registers = NULL;
+}
+
+/* Threaded dispatch: each instruction jumps straight to the next one's
+ * handler through a table of label addresses (a GNU C extension), so there
+ * is no central switch and each handler gets its own branch history. */
+static void vm_execute(mthl_vm_t *vm, uint32_t start) {
+    static const void *dispatch[VM_OP_COUNT] = {
+        [VM_HALT] = &&op_halt, [VM_MOVE] = &&op_move, [VM_ADD] = &&op_add,
+        [VM_SUB] = &&op_sub, [VM_MUL] = &&op_mul, [VM_DIV] = &&op_div,
+        [VM_GT] = &&op_gt, [VM_LT] = &&op_lt, [VM_GE] = &&op_ge, [VM_LE] = &&op_le,
+        [VM_EQ] = &&op_eq, [VM_NE] = &&op_ne, [VM_AND] = &&op_and, [VM_OR] = &&op_or,
+        [VM_NOT] = &&op_not, [VM_JMP] = &&op_jmp, [VM_JMPF] = &&op_jmpf,
+        [VM_JMPT] = &&op_jmpt, [VM_JLT] = &&op_jlt, [VM_JNLT] = &&op_jnlt,
+        [VM_NEWARRAY] = &&op_newarray, [VM_GETIDX] = &&op_getidx,
+        [VM_SETIDX] = &&op_setidx, [VM_PROP] = &&op_prop, [VM_BEGIN] = &&op_begin,
+        [VM_END] = &&op_end, [VM_SETPROP] = &&op_setprop, [VM_ONCLICK] = &&op_onclick,
+        [VM_REDRAW] = &&op_redraw, [VM_RET] = &&op_halt
+    };
+    mthl_runtime_t *rt = vm->rt;
+    const mthl_insn_t *code = vm->program->code;
+    const mthl_insn_t *pc = code + start;
+    const mthl_insn_t *insn;
+    mthl_value_t *r = vm->registers;
+
+#define DISPATCH() do { insn = pc++; goto *dispatch[insn->op]; } while (0)
+#define A r[insn->a]
+#define B r[insn->b]
+#define C r[insn->c]
+#define BOTH_INT(x, y) (((x).type == VAL_INT) & ((y).type == VAL_INT))
+
+/* Integers take the inline path; anything else goes through mthl_binary */
+#define ARITH(label, op, expr) \
+label: \
+    if (BOTH_INT(B, C)) { \
+        uint32_t x = B.i, y = C.i; \
+        A = mthl_int((int32_t)(expr)); \
+    } else { \
+        A = mthl_binary(rt, op, B, C); \
+    } \
+    DISPATCH();
+
+#define COMPARE(label, op, expr) \
+label: \
+    if (BOTH_INT(B, C)) { \
+        int32_t x = B.i, y = C.i; \
+        A = mthl_int(expr); \
+    } else { \
+        A = mthl_binary(rt, op, B, C); \
+    } \
+    DISPATCH();
+
+    DISPATCH();
+
+op_move:
+    A = B;
+    DISPATCH();
+
+    ARITH(op_add, OP_PLUS, x + y)
+    ARITH(op_sub, OP_MINUS, x - y)
+    ARITH(op_mul, OP_MULTIPLY, x * y)
+
+op_div:
+    if (BOTH_INT(B, C) && C.i > 0) {
+        A = mthl_int(B.i / C.i);
+    } else {
+        A = mthl_binary(rt, OP_DIVIDE, B, C);
+    }
+    DISPATCH();
+
+    COMPARE(op_gt, OP_GT, x > y)
+    COMPARE(op_lt, OP_LT, x < y)
+    COMPARE(op_ge, OP_GE, x >= y)
+    COMPARE(op_le, OP_LE, x <= y)
+    COMPARE(op_eq, OP_EQ, x == y)
+    COMPARE(op_ne, OP_NE, x != y)
+
+op_and:
+    A = mthl_int(mthl_truthy(rt, B) && mthl_truthy(rt, C));
+    DISPATCH();
+
+op_or:
+    A = mthl_int(mthl_truthy(rt, B) || mthl_truthy(rt, C));
+    DISPATCH();
+
+op_not:
+    A = mthl_int(!mthl_truthy(rt, B));
+    DISPATCH();
+
+op_jmp:
+    pc = code + VM_WIDE(insn);
+    DISPATCH();
+
+op_jmpf:
+    if (!mthl_truthy(rt, A)) pc = code + VM_WIDE(insn);
+    DISPATCH();
+
+op_jmpt:
+    if (mthl_truthy(rt, A)) pc = code + VM_WIDE(insn);
+    DISPATCH();
+
+op_jlt:
+    if (BOTH_INT(A, B) ? A.i < B.i : mthl_truthy(rt, mthl_binary(rt, OP_LT, A, B))) {
+        pc = code + VM_WIDE(pc);
+    } else {
+        pc++;
+    }
+    DISPATCH();
+
+op_jnlt:
+    if (BOTH_INT(A, B) ? A.i < B.i : mthl_truthy(rt, mthl_binary(rt, OP_LT, A, B))) {
+        pc++;
+    } else {
+        pc = code + VM_WIDE(pc);
+    }
+    DISPATCH();
+
+op_newarray:
+    A = mthl_new_array(rt, &B, insn->c);
+    DISPATCH();
+
+op_getidx:
+    if (B.type == VAL_ARRAY && C.type == VAL_INT &&
+        (uint32_t)C.i < rt->arrays[B.i].count) {
+        A = rt->arrays[B.i].items[C.i];
+    } else {
+        A = mthl_index(rt, B, C);
+    }
+    DISPATCH();
+
+op_setidx:
+    if (A.type == VAL_ARRAY && B.type == VAL_INT &&
+        (uint32_t)B.i < rt->arrays[A.i].count) {
+        rt->arrays[A.i].items[B.i] = C;
+    } else {
+        mthl_set_index(rt, A, B, C);
+    }
+    DISPATCH();
+
+op_prop:
+    A = mthl_property(rt, B, insn->c);
+    DISPATCH();
+
+op_begin:
+    mthl_begin_element(rt, insn->a, VM_WIDE(insn));
+    DISPATCH();
+
+op_end:
+    mthl_end_element(rt);
+    DISPATCH();
+
+op_setprop:
+    mthl_set_property(rt, insn->a, &B);
+    DISPATCH();
+
+op_onclick:
+    mthl_set_onclick(rt, VM_WIDE(insn));
+    DISPATCH();
+
+op_redraw:
+    rt->redraw_requested = 1;
+    DISPATCH();
+
+op_halt:
+    return;
+
+#undef COMPARE
+#undef ARITH
+#undef BOTH_INT
+#undef C
+#undef B
+#undef A
+#undef DISPATCH
+}
+
+void mthl_vm_run(mthl_vm_t *vm) {
+    mthl_program_t *program = vm->program;
+
+    memset(vm->registers, 0, program->constant_base * sizeof(mthl_value_t));
+    memcpy(vm->registers + program->constant_base, program->constants,
+           program->constant_count * sizeof(mthl_value_t));
+    vm_execute(vm, 0);
+}
+
+void mthl_vm_click(mthl_vm_t *vm, uint32_t element) {
+    mthl_runtime_t *rt = vm->rt;
+
+    if (element >= rt->element_count || rt->elements[element].onclick < 0) return;
+    vm_execute(vm, rt->elements[element].onclick);
+}
+
+void interpret_ast(ASTDocument *doc, ast_index_t root) {
+    mthl_runtime_t rt;
+    mthl_program_t program;
+    mthl_vm_t vm;
+
+    mthl_runtime_init(&rt, doc);
+    if (mthl_compile(doc, root, &program) == 0 && mthl_vm_init(&vm, &rt, &program) == 0) {
+        mthl_vm_run(&vm);
+        mthl_vm_free(&vm);
+        mthl_program_free(&program);
+    } else {
+        /* Past the VM's register space; the walker has no such limit */
+        fprintf(stderr, "Page too large to compile, interpreting\n");
+        mthl_program_free(&program);
+        mthl_walk_page(&rt, root);
+    }
+
+    mthl_print_elements(&rt, 0, stdout);
+    mthl_runtime_free(&rt);
+}
+
+/* Benchmark */
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int elements_match(mthl_runtime_t *a, mthl_runtime_t *b) {
+    size_t values = offsetof(mthl_element_t, align) + sizeof(mthl_value_t)
+                    - offsetof(mthl_element_t, position);
+
+    if (a->element_count != b->element_count) return 0;
+    for (uint32_t i = 0; i < a->element_count; i++) {
+        mthl_element_t *x = &a->elements[i], *y = &b->elements[i];
+        if (x->kind != y->kind || x->parent != y->parent || x->node != y->node) return 0;
+        if ((x->onclick < 0) != (y->onclick < 0)) return 0;
+        if (memcmp(x->position, y->position, values) != 0) return 0;
+    }
+    return a->redraw_requested == b->redraw_requested;
+}
+
+/* Each iteration runs the page and then clicks every element that has a
+ * handler, once, so both script and handlers are measured */
+void mthl_benchmark(ASTDocument *doc, ast_index_t root, int iterations) {
+    mthl_runtime_t walker_rt, vm_rt;
+    mthl_program_t program;
+    mthl_vm_t vm;
+
+    double start = now_ms();
+    if (mthl_compile(doc, root, &program) < 0) {
+        fprintf(stderr, "Page too large to compile\n");
+        return;
+    }
+    double compile_ms = now_ms() - start;
+
+    mthl_runtime_init(&walker_rt, doc);
+    mthl_runtime_init(&vm_rt, doc);
+    if (mthl_vm_init(&vm, &vm_rt, &program) < 0) {
+        mthl_program_free(&program);
+        return;
+    }
+
+    start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        mthl_runtime_reset(&walker_rt);
+        mthl_walk_page(&walker_rt, root);
+        for (uint32_t e = 0; e < walker_rt.element_count; e++) mthl_walk_click(&walker_rt, e);
+    }
+    double walker_ms = (now_ms() - start) / iterations;
+
+    start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        mthl_runtime_reset(&vm_rt);
+        mthl_vm_run(&vm);
+        for (uint32_t e = 0; e < vm_rt.element_count; e++) mthl_vm_click(&vm, e);
+    }
+    double vm_ms = (now_ms() - start) / iterations;
+
+    printf("%u nodes, %u instructions, compiled in %.3f ms\n",
+           doc->node_count, program.code_size, compile_ms);
+    printf("walker %10.3f ms per run\n", walker_ms);
+    printf("vm     %10.3f ms per run\n", vm_ms);
+    printf("speedup %.1fx, results %s\n", vm_ms > 0 ? walker_ms / vm_ms : 0.0,
+           elements_match(&walker_rt, &vm_rt) ? "match" : "DIFFER");
+
+    mthl_vm_free(&vm);
+    mthl_program_free(&program);
+    mthl_runtime_free(&walker_rt);
+    mthl_runtime_free(&vm_rt);
+}
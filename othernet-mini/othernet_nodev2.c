@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,12 +9,83 @@
 #include <signal.h>
 #include <time.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MAX_PEERS 50
 #define MAX_HELD_MESSAGES 1000
-#define BUFFER_SIZE 2048
+#define MAX_HOLD_SHARDS 16       // Store partitions, one thread and core each
+#define MAX_PAYLOAD 65535         // Longest held payload in bytes
+#define PROTOCOL_DATA_SIZE (MAX_PAYLOAD + 257)   // Payload plus dlv:/hold: header
+#define BUFFER_SIZE (PROTOCOL_DATA_SIZE + 128)   // Longest wire frame
+#define PAYLOAD_MIN_SHIFT 6       // Smallest payload arena block is 64 bytes
+#define PAYLOAD_CLASSES 11        // 64 B .. 64 KB blocks
+#define PAYLOAD_SLAB_SIZE (256 * 1024)
 #define PORT 8080
 #define MAX_RETRIES 5
+#define DELIVERY_WINDOW_SIZE 64   // In flight per target, one per bit of the selective ack
+#define DELIVERY_FRAMES_MAX DELIVERY_WINDOW_SIZE  // Largest configurable delivery batch
+#define MAX_DELIVERY_WINDOWS 64
+#define MAX_RECEIVE_WINDOWS 64
+#define ACK_TIMEOUT 10            // Seconds before an unacknowledged delivery is resent
+#define DELIVERY_WORKERS 4
+#define DELIVERY_BATCH 8          // Jobs a worker takes from the queue at once
+#define REPLICATION_FACTOR 2      // Extra holders for each held message
+#define RING_VNODES 16            // Points per holding node on the hash ring
+#define HANDOFF_BATCH 32          // HOLD frames sent over one connection
+#define PEER_TIMEOUT 95           // Silence before a peer is treated as failed
+#define RECENT_DELIVERY_IDS 256
+#define DELIVERED_HOLD_IDS 256    // Delivered ids a shard refuses to hold again
+#define ERASURE_MAX_SHARDS 16     // k + m limit for Reed-Solomon fragments
+#define ERASURE_MAX_SHARD ((MAX_PAYLOAD + 1) / 2)    // Bytes per fragment, as k is at least 2
+#define ERASURE_MIN_PAYLOAD 256   // Smaller payloads are cheaper to replicate
+#define FRAGMENT_ASSEMBLIES 8     // Messages being rebuilt at once on a target
+#define COMPLETED_ASSEMBLIES 64   // Rebuilt messages whose late fragments are dropped
+#define LOAD_EWMA_ALPHA 0.3f      // Weight of a new load sample
+#define HOLDING_HEAP_LEVELS 3     // Candidate heaps per peer: cluster, realm, all
+#define HOLDING_HEAP_TOP 7        // Power-of-two-choices samples from this many
+#define MAX_HOLDING_HEAPS (2 * MAX_PEERS + 1)
+#define SEEN_CACHE_BUCKETS 256    // Announcement ids remembered for flooding
+#define SEEN_CACHE_WAYS 4
+#define SEEN_ID_TTL 120           // Seconds an announcement id stays known
+#define DISCOVERY_HOPS 4          // Default reach of a scoped announcement
+#define STANDBY_TIMEOUT 3         // Seconds of silence before a standby checks on its primary
+#define STANDBY_PROBE_TIMEOUT 2   // Seconds to wait for a silent primary to accept a connection
+#define STANDBY_LAG_RING 4096     // Send times kept to measure standby lag
+#define GOSSIP_CACHE 128          // Broadcasts kept to answer GRAFTs
+#define GOSSIP_MISSING 64         // Announced broadcasts we are waiting for
+#define GOSSIP_ANNOUNCERS 4       // Lazy peers remembered per missing broadcast
+#define GOSSIP_ACTIVE_VIEW 5      // Peers the broadcast tree uses at most
+#define GOSSIP_VIEW_RETRY_MS 10000 // Before asking a peer that refused us again
+#define GOSSIP_GRAFT_TIMEOUT_MS 1000
+#define MAX_TOPICS 32              // Topics this node subscribes to
+#define TOPIC_LEN 32
+#define TOPIC_FILTER_BITS 256     // Bloom filter advertised for our topics
+#define TOPIC_FILTER_WORDS (TOPIC_FILTER_BITS / 64)
+#define TOPIC_FILTER_HASHES 4
+#define PUBLISH_HOPS 4            // How far a published message travels
+#define TOPIC_FILTER_HEX (PUBLISH_HOPS * TOPIC_FILTER_WORDS * 16 + 1)  // topics: field, a filter per hop
+#define ROUTE_CACHE_BUCKETS 256   // Learned routes, a set-associative table
+#define ROUTE_CACHE_WAYS 4
+#define ROUTE_TTL 60              // Seconds a route is trusted without traffic
+#define ROUTE_NEGATIVE_TTL 2      // Seconds an unreachable address stays so
+#define FASTLANE_PENDING 64       // CRASH messages awaiting a fast lane ack
+#define FASTLANE_ACK_TIMEOUT_US 200000   // Then the store takes the message over
+#define FASTLANE_SPIN_US 200      // Busy-poll this long after activity
+#define FASTLANE_BUSY_POLL_US 50  // SO_BUSY_POLL budget on fast lane sockets
+#define FASTLANE_RX_SIZE 4096
+#define LATENCY_SAMPLES 1024      // Fast lane round trips kept for percentiles
 
 // Othernet addressing structure
 typedef struct {
@@ -37,26 +109,115 @@ typedef enum {
     MSG_STATUS_HELD,
     MSG_STATUS_DELIVERED,
     MSG_STATUS_EXPIRED,
-    MSG_STATUS_FAILED
+    MSG_STATUS_FAILED,
+    MSG_STATUS_FREE         // Record on its shard's free list
 } message_status_t;
 
-// Held message structure
+// Held message structure. The payload lives in the payload arena; what the
+// scheduler scans on every pass is packed into the first cache line.
 typedef struct {
     uint64_t message_id;
     othernet_address_t target_address;
-    othernet_address_t sender_address;
-    message_priority_t priority;
-    char payload[1024];
+    uint8_t status;         // message_status_t
+    uint8_t priority;       // message_priority_t
+    uint8_t role;
+    uint8_t handoff_flags;
+    uint16_t attempt_count;
+    uint8_t replication_pending;
+    uint8_t is_fragment;
+    uint32_t seq;           // Per-target sequence number, 0 until first sent
+    uint32_t payload;       // Payload arena handle, 0 once released
+    time_t next_attempt;
+    time_t ack_deadline;    // Resend if no DELIVERY_CONFIRM by this time
+    uint16_t payload_len;
     
+    othernet_address_t sender_address;
     time_t created_time;
     time_t last_attempt;
-    time_t next_attempt;
-    uint16_t attempt_count;
     time_t expires_at;
     
-    message_status_t status;
+    // Replication: a primary copy delivers and tracks its replicas; a
+    // replica only waits for a release or for its primary to fail.
     char holding_node_ip[16];
-} held_message_t;
+    uint16_t holding_node_port;             // primary of a replica copy
+    int16_t replicas[REPLICATION_FACTOR];   // peer index, -1 if unplaced
+    
+    // Erasure coding: a fragment is delivered like any message and rebuilt
+    // by the target. The primary drops its payload once all k+m fragments
+    // are placed; after that up to m of them may be lost with their holders.
+    uint16_t fragments_placed;              // bit per fragment index
+    uint16_t fragments_delivered;
+    uint8_t erasure_k;                      // coding the fragments were made with
+    uint8_t erasure_m;
+    int16_t fragment_holders[ERASURE_MAX_SHARDS];   // peer index, valid if placed
+} __attribute__((aligned(64))) held_message_t;
+
+// One size class of the payload arena: equal blocks carved from slabs,
+// freed blocks linked through their first bytes. A block is shared by every
+// held message of a multi-target send and freed when its last one lets go.
+typedef struct {
+    char** slabs;
+    uint32_t* refs;         // reference count per block
+    int slab_count;
+    uint32_t next_block;    // blocks carved so far
+    uint32_t free_head;     // first free block + 1, or 0
+    uint32_t in_use;
+} payload_class_t;
+
+typedef enum {
+    HOLD_ROLE_PRIMARY,
+    HOLD_ROLE_REPLICA,
+    HOLD_ROLE_DISPERSED
+} hold_role_t;
+
+// Hand-off work the scheduler still owes for a message
+typedef enum {
+    HANDOFF_RELEASE = 0x01,   // tell replicas to drop their copies
+    HANDOFF_PROMOTE = 0x02,   // pass this replica to the new primary
+    HANDOFF_FRAGMENT_DONE = 0x04  // tell the dispersing primary our fragment arrived
+} handoff_flag_t;
+
+// A sequenced message still owed to a window's target
+typedef struct {
+    int slot;
+    uint32_t seq;
+} window_entry_t;
+
+// Sender side of the delivery window for one target address.
+// Sequence numbers are assigned on first transmission; everything at or
+// below cum_acked has been confirmed by the target.
+typedef struct {
+    othernet_address_t target;
+    uint32_t next_seq;
+    uint32_t cum_acked;
+    int in_flight;
+    int sending;            // a batch for this target is with a worker
+    long linger_start;      // ms when a short batch started waiting, or 0
+    time_t last_used;
+    int active;
+    
+    // Sequenced messages in sequence order, so the base is the first live
+    // one. Finished ones are dropped from the front or when the run fills.
+    window_entry_t* pending;    // 2 * message_capacity entries
+    int pending_head;
+    int pending_count;
+} delivery_window_t;
+
+// Receiver side: which sequence numbers we have seen from one sender node.
+// Bit i of sack_mask means cum_received + 1 + i has arrived out of order.
+typedef struct {
+    char ip[16];
+    int port;
+    uint32_t epoch;
+    uint32_t cum_received;
+    uint64_t sack_mask;
+    time_t last_seen;
+    int active;
+    
+    // Acks are sent once per batch, for the last message in it
+    int ack_pending;
+    uint64_t ack_message_id;
+} receive_window_t;
 
 // Node capability flags
 typedef enum {
@@ -71,9 +232,21 @@ typedef struct {
     int port;
     othernet_address_t address;
     uint32_t capabilities;
-    float load_factor;
+    float load_factor;      // EWMA of the load reported in capability updates
+    long uptime;
     time_t last_seen;
     int active;
+    
+    // Position in the holding candidate heaps, -1 when not a candidate
+    int16_t heap_index[HOLDING_HEAP_LEVELS];
+    int16_t heap_pos[HOLDING_HEAP_LEVELS];
+    
+    // Bloom filters of the topics the peer reaches, level n in n + 1 hops
+    uint64_t topic_filter[PUBLISH_HOPS][TOPIC_FILTER_WORDS];
+    
+    int in_view;            // broadcast tree: in our active view
+    int lazy;               // broadcast tree: gets IHAVEs instead of messages
+    long view_retry_ms;     // not asked into the view again before this
 } peer_t;
 
 // Discovery scope (like AppleTalk zones)
@@ -83,6 +256,12 @@ typedef struct {
     uint8_t max_hops;
 } discovery_scope_t;
 
+// An announcement id we already handled; stale after SEEN_ID_TTL
+typedef struct {
+    uint64_t id;
+    time_t seen;
+} seen_entry_t;
+
 // Protocol message types
 typedef enum {
     MSG_TYPE_HELLO,
@@ -105,57 +284,533 @@ typedef struct {
     discovery_scope_t scope;
     uint8_t ttl;
     time_t timestamp;
-    char data[1024];
+    uint32_t body_len;      // Binary bytes stored after data's NUL, sent after the newline
+    char data[PROTOCOL_DATA_SIZE];
 } protocol_message_t;
 
+typedef enum {
+    JOB_DELIVERY,
+    JOB_HANDOFF
+} delivery_job_kind_t;
+
+// Which held message a frame in a delivery or hand-off batch was about
+typedef struct {
+    int slot;                 // -1 when nothing needs updating afterwards
+    uint64_t message_id;
+    uint16_t attempt;         // attempt_count when queued, to ignore stale results
+    int peer_index;           // replica placed by this frame, or -1
+    int fragment;             // erasure fragment index, or -1
+} batch_entry_t;
+
+// One network send handed from a shard to a delivery worker. The worker
+// never touches held messages; it reports back through the shard's
+// completion stack and the shard matches slot + message_id.
+typedef struct delivery_job {
+    struct delivery_job* next;
+    delivery_job_kind_t kind;
+    struct hold_shard* shard;   // owner of the messages in this job
+    othernet_address_t target;  // JOB_DELIVERY: whose window the batch is in
+    char ip[16];
+    int port;
+    
+    // Wire frames sent over one connection: due messages for one target,
+    // or up to HANDOFF_BATCH HOLD frames for one holding node
+    int frame_count;
+    char* wire;
+    size_t wire_len;
+    size_t wire_size;
+    batch_entry_t* entries;
+    
+    int result;               // send_protocol_wire() return value
+} delivery_job_t;
+
+// Work posted to a hold shard by other threads. A shard's messages,
+// windows and arena are only ever touched by its own thread; everything
+// else reaches them through its inbox.
+typedef enum {
+    WORK_QUEUE,         // new messages from this node
+    WORK_CONFIRM,       // DELIVERY_CONFIRM from a target
+    WORK_HOLD,          // HOLD_REQUEST from another holder
+    WORK_RELEASE,       // HOLD_RESPONSE: the primary is done with a message
+    WORK_FRAGMENT_DONE, // HOLD_RESPONSE: a holder delivered one of our fragments
+    WORK_WAKE,          // a target (re)appeared
+    WORK_PEER_FAILED,   // a holding node is gone
+    WORK_DUMP,          // print what the shard holds
+    WORK_SNAPSHOT       // stream everything we hold to a new standby
+} shard_work_kind_t;
+
+// A payload on its way into one or more shards. The last shard to store
+// it frees it.
+typedef struct {
+    atomic_int refs;
+    size_t len;
+    char data[];
+} shared_payload_t;
+
+typedef struct shard_work {
+    struct shard_work* next;
+    shard_work_kind_t kind;
+    othernet_address_t target;      // confirm: the target that acked
+    othernet_address_t sender;      // hold: original sender
+    uint64_t message_id;
+    uint32_t cum;                   // confirm: cumulative ack
+    unsigned long sack;             // confirm: selective ack bits
+    char role;                      // hold: 'p', 'r' or 'f'
+    int priority;
+    long expires_at;
+    char ip[16];                    // hold: sending holder; failed node
+    int port;
+    int count;                      // queue: number of targets
+    othernet_address_t* targets;    // queue
+    shared_payload_t* payload;      // queue, hold
+} shard_work_t;
+
+// One partition of the held-message store, owned by a thread pinned to
+// its own core. Messages go to the shard picked by hashing their target,
+// so a target's messages, delivery window and sequence space stay
+// together and shards never need each other's state. Each shard holds its
+// share of MAX_HELD_MESSAGES, allocated when the shards start.
+typedef struct hold_shard {
+    int index;
+    pthread_t tid;
+    
+    held_message_t* messages;
+    int message_count;              // records used so far, free ones included
+    int message_capacity;
+    int* free_slots;                // finished records, reused before the rest
+    int free_count;
+    uint64_t delivered_ids[DELIVERED_HOLD_IDS];  // ring of freed delivered records
+    int delivered_pos;
+    payload_class_t payload_classes[PAYLOAD_CLASSES];
+    delivery_window_t delivery_windows[MAX_DELIVERY_WINDOWS];
+    uint32_t seq_high;              // highest sequence number handed out so far
+    int* due;                       // scratch for schedule_due_deliveries()
+    window_entry_t* window_entries; // pending runs of the delivery windows
+    protocol_message_t* frame;      // scratch for frames built on the shard thread
+    uint8_t (*fragments)[ERASURE_MAX_SHARD];  // encode scratch, allocated on first use
+    
+    // Filled by any thread, emptied by the shard thread in one exchange
+    _Atomic(shard_work_t*) inbox;
+    _Atomic(struct delivery_job*) completions;
+    
+    int kicked;
+    pthread_mutex_t wake_mutex;
+    pthread_cond_t wake_cond;
+} hold_shard_t;
+
+// Fragments of one erasure-coded message collected on the target
+typedef struct {
+    uint64_t message_id;      // the original message, not the fragment
+    othernet_address_t sender;
+    int k, m, len;
+    size_t shard_size;
+    uint32_t present;
+    uint8_t shards[ERASURE_MAX_SHARDS][ERASURE_MAX_SHARD];
+    time_t started;
+    int active;
+} fragment_assembly_t;
+
+// Holding-capable peers of one scope as a binary min-heap on load_factor.
+// There is one heap per cluster, one per realm and one for everything, so
+// the least loaded holder at each distance is always at a heap root.
+typedef struct {
+    uint16_t realm;
+    uint16_t cluster;         // HOLDING_SCOPE_ANY for realm and global heaps
+    uint8_t level;
+    int size;
+    int16_t peer[MAX_PEERS];
+} holding_heap_t;
+
+#define HOLDING_SCOPE_ANY 0xffff
+
+// Consistent hash ring of holding-capable nodes, ourselves included
+// (owner -1). Rebuilt under peers_mutex whenever the peer set changes.
+typedef struct {
+    uint64_t hash;
+    int owner;
+} ring_point_t;
+
+// A held-message change on its way to the standby
+typedef struct standby_event {
+    struct standby_event* next;
+    char text[];
+} standby_event_t;
+
+// A message the primary we stand by for is holding
+typedef struct {
+    uint64_t message_id;
+    othernet_address_t target;
+    othernet_address_t sender;
+    int priority;
+    long expires_at;
+    unsigned int attempts;
+    char* payload;
+} standby_record_t;
+
+// A broadcast we delivered, kept for peers that graft onto it
+typedef struct {
+    uint64_t id;
+    othernet_address_t origin;
+    char* text;
+} gossip_entry_t;
+
+// A broadcast lazy peers announced that has not reached us yet
+typedef struct {
+    int active;
+    uint64_t id;
+    long deadline_ms;
+    int announcers[GOSSIP_ANNOUNCERS];  // peer indices, tried in order
+    int announcer_count;
+} gossip_missing_t;
+
+// Cached next hop for a destination; peer_index -1 marks it unreachable.
+// A direct entry's next hop is dest itself; otherwise it is the peer that
+// last forwarded traffic from dest. Free or stale once expires_ms has passed.
+typedef struct {
+    othernet_address_t dest;
+    int peer_index;
+    int direct;
+    char ip[16];
+    int port;
+    long expires_ms;
+} route_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    route_entry_t ways[ROUTE_CACHE_WAYS];
+} route_bucket_t;
+
+// A CRASH message posted to the fast lane thread
+typedef struct fast_send {
+    struct fast_send* next;
+    othernet_address_t target;
+    char payload[];
+} fast_send_t;
+
+// A fast lane message written to its target and not yet acknowledged;
+// free while payload is NULL
+typedef struct {
+    uint64_t message_id;
+    othernet_address_t target;
+    long sent_us;
+    char* payload;
+} fast_pending_t;
+
 // Global state
 peer_t peers[MAX_PEERS];
-held_message_t held_messages[MAX_HELD_MESSAGES];
 int peer_count = 0;
-int held_message_count = 0;
+atomic_int held_message_count = 0;  // records in use across all shards
 int server_socket = -1;
 int running = 1;
-othernet_address_t my_address;
+othernet_address_t my_address;  // changes if we take over as a standby; see local_address()
 char my_ip[16];
 int my_port = PORT;
 uint32_t my_capabilities = CAPABILITY_HOLDING | CAPABILITY_ROUTING;
 pthread_mutex_t peers_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t messages_mutex = PTHREAD_MUTEX_INITIALIZER;
+receive_window_t receive_windows[MAX_RECEIVE_WINDOWS];
+pthread_mutex_t receive_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t address_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint32_t my_epoch;  // Distinguishes our sequence space across restarts
+
+// Delivery batching, set with the "batch" command
+int delivery_batch_size = 64;   // Frames per delivery connection
+int delivery_linger_ms = 20;    // How long a short batch waits for company
+
+// Held messages, partitioned by target
+hold_shard_t hold_shards[MAX_HOLD_SHARDS];
+int hold_shard_count = 1;
+
+// Delivery workers: jobs go in through a mutex-protected FIFO, results go
+// back on the owning shard's lock-free stack so workers never contend
+// with the shards.
+delivery_job_t* job_queue_head = NULL;
+delivery_job_t* job_queue_tail = NULL;
+pthread_mutex_t job_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_queue_cond = PTHREAD_COND_INITIALIZER;
+pthread_t delivery_worker_tids[DELIVERY_WORKERS];
+
+ring_point_t holding_ring[(MAX_PEERS + 1) * RING_VNODES];
+int holding_ring_size = 0;
+
+// Holding candidates by scope, kept under peers_mutex
+holding_heap_t holding_heaps[MAX_HOLDING_HEAPS];
+int holding_heap_count = 0;
+unsigned int holding_choice_seed;
+time_t node_start_time;
+
+// Flooded announcements seen recently, a small set-associative table
+seen_entry_t seen_cache[SEEN_CACHE_BUCKETS][SEEN_CACHE_WAYS];
+pthread_mutex_t seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint32_t announce_seq = 0;
+
+// Hot standby: the stream we send as a primary (set with "standby"),
+// and the primary we follow as a standby
+char standby_ip[16];
+int standby_port = 0;               // 0: no standby
+char standby_connected_ip[16];      // stream thread only
+int standby_connected_port = 0;
+atomic_int standby_streaming = 0;
+_Atomic(standby_event_t*) standby_inbox = NULL;
+int standby_event_fd = -1;
+uint64_t standby_seq_sent = 0;
+uint64_t standby_seq_acked = 0;
+long standby_sent_us[STANDBY_LAG_RING];
+long standby_lag_us = 0;
+long standby_lag_max_us = 0;
+othernet_address_t standby_primary;
+char standby_primary_ip[16];
+int standby_primary_port = 0;
+int standby_following = 0;
+time_t standby_last_heard = 0;
+uint64_t standby_applied_seq = 0;
+standby_record_t standby_records[MAX_HELD_MESSAGES];
+int standby_record_count = 0;
+pthread_mutex_t standby_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Broadcast tree state; lock after peers_mutex when both are needed
+gossip_entry_t gossip_cache[GOSSIP_CACHE];
+int gossip_cache_pos = 0;
+gossip_missing_t gossip_missing[GOSSIP_MISSING];
+pthread_mutex_t gossip_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Our topic subscriptions and the filter we advertise for them
+char my_topics[MAX_TOPICS][TOPIC_LEN];
+int my_topic_count = 0;
+uint64_t my_topic_filter[TOPIC_FILTER_WORDS];
+pthread_mutex_t topics_mutex = PTHREAD_MUTEX_INITIALIZER;
+atomic_uint publish_seq = 0;
+
+// Routes learned from lookups and incoming traffic
+route_bucket_t route_cache[ROUTE_CACHE_BUCKETS];
+atomic_ulong route_hits = 0;
+atomic_ulong route_misses = 0;
+
+// Message ids recently shown, so a promoted holder resending a message
+// that the old primary already delivered is not shown twice
+uint64_t recent_delivery_ids[RECENT_DELIVERY_IDS];
+int recent_delivery_pos = 0;
+
+// Erasure coding as k << 8 | m, 0 disables it. Set with the "erasure"
+// command; one word, so a shard thread never pairs a new k with an old m.
+atomic_int erasure_code = 0;
+fragment_assembly_t fragment_assemblies[FRAGMENT_ASSEMBLIES];
+uint64_t completed_assemblies[COMPLETED_ASSEMBLIES];
+int completed_assembly_pos = 0;
+
+// CRASH fast lane, off until the "fastlane" command turns it on. Only the
+// fast lane thread touches the connections and pending table; other
+// threads post to its inbox and bump the eventfd.
+atomic_int fastlane_enabled = 0;
+int fastlane_event_fd = -1;
+_Atomic(fast_send_t*) fastlane_inbox = NULL;
+int fastlane_fds[MAX_PEERS];        // by peer index, -1 when not connected
+int fastlane_connecting[MAX_PEERS]; // connect still in progress on fastlane_fds[i]
+char fastlane_rx[MAX_PEERS][FASTLANE_RX_SIZE];
+size_t fastlane_buffered[MAX_PEERS];
+fast_pending_t fastlane_pending[FASTLANE_PENDING];
+long fastlane_latency_us[LATENCY_SAMPLES];
+int fastlane_latency_count = 0;
+int fastlane_fallbacks = 0;
+pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// GF(2^8) tables and the region kernel picked for this CPU in gf_init()
+uint8_t gf_exp[512];
+uint8_t gf_log[256];
+void (*gf_mul_region_xor)(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len);
 
 // Function prototypes
 void* server_thread(void* arg);
 void* maintenance_thread(void* arg);
 void* peer_listener(void* arg);
+void* delivery_worker(void* arg);
 void handle_protocol_message(protocol_message_t* msg, const char* from_ip);
-void send_protocol_message(const char* ip, int port, protocol_message_t* msg);
+int send_protocol_message(const char* ip, int port, protocol_message_t* msg);
+int send_protocol_wire(const char* ip, int port, const char* wire, size_t len);
+int append_job_frame(delivery_job_t* job, protocol_message_t* frame);
+int format_protocol_message(char* buffer, size_t size, protocol_message_t* msg);
+int parse_protocol_message(char* line, protocol_message_t* msg);
+void append_frame_payload(protocol_message_t* frame, const char* payload, size_t len);
+const char* frame_body(protocol_message_t* frame);
 void broadcast_protocol_message(protocol_message_t* msg);
+const char* protocol_type_to_string(protocol_message_type_t type);
+int protocol_type_from_string(const char* str, protocol_message_type_t* type);
 
 // Peer management
-void add_peer(const char* ip, int port, othernet_address_t* addr, uint32_t capabilities);
+int add_peer(const char* ip, int port, othernet_address_t* addr, uint32_t capabilities);
 void remove_peer(const char* ip, int port);
+void touch_peer(const char* ip, int port, othernet_address_t* sender);
+void detect_failed_peers();
 peer_t* find_peer_by_address(othernet_address_t* addr);
 peer_t* find_best_holding_node(othernet_address_t* target);
+holding_heap_t* get_holding_heap(int level, othernet_address_t* addr, int create);
+void update_holding_candidate(int index);
+void handle_capability_update(protocol_message_t* msg, const char* from_ip);
+
+// Route cache
+void route_cache_init();
+int route_lookup(othernet_address_t* dest, char* ip, int* port);
+int route_next_hop(othernet_address_t* dest, char* ip, int* port, int* direct);
+void route_cache_learn(othernet_address_t* source, int peer_index);
+void route_cache_invalidate(int peer_index, othernet_address_t* dest);
+void print_routes();
 
 // Message holding system
 void queue_message_for_holding(othernet_address_t* target, const char* payload, message_priority_t priority);
-void attempt_message_delivery(held_message_t* msg);
-void cleanup_expired_messages();
-void redistribute_held_messages(const char* failed_node_ip);
+int queue_message_for_targets(othernet_address_t* targets, int count, const char* payload,
+                              message_priority_t priority);
+int hand_off_message(hold_shard_t* shard, othernet_address_t* target, const char* payload,
+                     message_priority_t priority);
+int parse_target_list(const char* spec, othernet_address_t* targets, int max);
+void format_delivery_frame(hold_shard_t* shard, held_message_t* msg, delivery_window_t* window,
+                           uint32_t base, protocol_message_t* delivery);
+void defer_message_delivery(hold_shard_t* shard, held_message_t* msg);
+delivery_job_t* build_delivery_batch(hold_shard_t* shard, int* slots, int count, long now_ms,
+                                     int* wait_ms);
+void cleanup_expired_messages(hold_shard_t* shard);
+void wake_held_messages_for(othernet_address_t* target);
+void redistribute_held_messages(const char* failed_node_ip, int failed_node_port);
+void redistribute_shard_messages(hold_shard_t* shard, const char* failed_node_ip, int failed_node_port);
+void wake_shard_messages(hold_shard_t* shard, othernet_address_t* target);
+
+// Hold shards
+void start_hold_shards();
+int init_hold_shard(hold_shard_t* shard, int index, int capacity);
+void* shard_thread(void* arg);
+hold_shard_t* shard_for(othernet_address_t* target);
+shard_work_t* new_shard_work(shard_work_kind_t kind);
+void post_shard_work(hold_shard_t* shard, shard_work_t* work);
+void post_all_shards(shard_work_t* work);
+void drain_shard_inbox(hold_shard_t* shard);
+void free_shard_work(shard_work_t* work);
+void shard_queue_messages(hold_shard_t* shard, shard_work_t* work);
+held_message_t* claim_held_message(hold_shard_t* shard);
+void free_held_message(hold_shard_t* shard, held_message_t* msg);
+void print_shard_messages(hold_shard_t* shard);
+void kick_shard(hold_shard_t* shard);
+void wait_for_shard(hold_shard_t* shard, int ms);
+
+// Payload arena, one per shard
+uint32_t payload_store(hold_shard_t* shard, const char* data, size_t len);
+const char* payload_data(hold_shard_t* shard, uint32_t handle);
+uint32_t payload_retain(hold_shard_t* shard, uint32_t handle);
+void payload_release(hold_shard_t* shard, uint32_t handle);
+void release_shared_payload(shared_payload_t* payload);
+
+// Replication across holding nodes
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed);
+uint64_t hash_address(othernet_address_t* addr);
+void rebuild_holding_ring();
+int holding_ring_successors(othernet_address_t* key, int* owners, int max,
+                            const char* skip_ip, int skip_port);
+delivery_job_t* schedule_handoffs(hold_shard_t* shard);
+void format_hold_frame(protocol_message_t* frame, held_message_t* msg, char role,
+                       const char* payload, size_t len);
+void handle_hold_request(protocol_message_t* msg, const char* from_ip);
+void apply_hold_request(hold_shard_t* shard, shard_work_t* work);
+void handle_hold_response(protocol_message_t* msg);
+void apply_hold_release(hold_shard_t* shard, shard_work_t* work);
+void apply_fragment_done(hold_shard_t* shard, shard_work_t* work);
+void drain_handoff_completion(hold_shard_t* shard, delivery_job_t* job);
+void free_delivery_job(delivery_job_t* job);
+
+// Reed-Solomon erasure coding over GF(2^8)
+void gf_init();
+uint8_t gf_mul(uint8_t a, uint8_t b);
+uint8_t gf_inv(uint8_t a);
+uint8_t rs_coefficient(int row, int col, int k);
+void rs_encode(const uint8_t* data, size_t len, int k, int m,
+               uint8_t shards[][ERASURE_MAX_SHARD], size_t shard_size);
+int rs_decode(uint8_t shards[][ERASURE_MAX_SHARD], uint32_t present, int k, int m,
+              size_t shard_size, uint8_t* out, size_t len);
+int erasure_shard_size(held_message_t* msg);
+int format_fragment_frame(protocol_message_t* frame, held_message_t* msg, int index,
+                           const uint8_t* shard, size_t shard_size);
+uint64_t fragment_message_id(uint64_t message_id, int index);
+int assemble_fragment(protocol_message_t* msg, const char* header, char* out, size_t out_size,
+                      uint64_t* message_id);
+
+// Delivery acknowledgements
+delivery_window_t* get_delivery_window(hold_shard_t* shard, othernet_address_t* target);
+uint32_t delivery_window_base(hold_shard_t* shard, delivery_window_t* window);
+void window_add_pending(hold_shard_t* shard, delivery_window_t* window, int slot);
+void handle_delivery_message(protocol_message_t* msg, const char* from_ip);
+void handle_delivery_confirm(protocol_message_t* msg);
+void apply_delivery_confirm(hold_shard_t* shard, shard_work_t* work);
+void check_ack_timeouts(hold_shard_t* shard);
+void flush_delivery_acks();
+
+// Asynchronous delivery
+int schedule_due_deliveries(hold_shard_t* shard);
+void submit_delivery_jobs(delivery_job_t* jobs);
+void push_delivery_completion(delivery_job_t* job);
+void drain_delivery_completions(hold_shard_t* shard);
 
 // Discovery and capabilities
-void announce_presence();
+void announce_presence(uint16_t realm, uint16_t cluster, uint8_t hops);
 void send_capability_update();
 void handle_hello_message(protocol_message_t* msg, const char* from_ip);
+int in_discovery_scope(discovery_scope_t* scope, othernet_address_t* addr);
+int announcement_seen(uint64_t id);
+int announcement_known(uint64_t id);
+void send_to_scope(protocol_message_t* msg, othernet_address_t* skip);
+void forward_announcement(protocol_message_t* msg, const char* origin_ip);
 void handle_peer_list_message(protocol_message_t* msg);
 
+// Hot standby
+void* standby_thread(void* arg);
+void standby_note(hold_shard_t* shard, held_message_t* msg, int full);
+void post_standby_event(standby_event_t* event);
+void snapshot_shard_messages(hold_shard_t* shard);
+void handle_standby_frame(protocol_message_t* msg, const char* from_ip);
+void send_standby_ack(int client_socket);
+void check_standby_failover();
+void standby_take_over(const char* why);
+void print_standby_status();
+
+// Broadcast tree
+void gossip_broadcast(const char* text);
+void handle_gossip(protocol_message_t* msg, const char* from_ip);
+void handle_ihave(protocol_message_t* msg, const char* from_ip);
+void handle_graft(protocol_message_t* msg, const char* from_ip);
+void handle_prune(protocol_message_t* msg, const char* from_ip);
+void handle_neighbor(protocol_message_t* msg, const char* from_ip);
+void handle_disconnect(protocol_message_t* msg, const char* from_ip);
+void gossip_tick();
+
+// Topic publish/subscribe
+int topic_filter_match(const uint64_t* filter, const char* topic);
+void format_topic_filter(char* out);
+int parse_topic_filter(const char* data, uint64_t (*filter)[TOPIC_FILTER_WORDS]);
+void update_peer_topics(const char* ip, int port, const char* data);
+int is_subscribed(const char* topic);
+int set_subscription(const char* topic, int subscribe);
+int send_to_topic_peers(protocol_message_t* frame, const char* topic,
+                        const char* skip_ip, int skip_port);
+int publish_message(const char* topic, const char* text);
+void handle_publication(protocol_message_t* msg, const char* from_ip);
+void print_topics();
+
+// CRASH fast lane
+void* fastlane_thread(void* arg);
+void send_crash_message(othernet_address_t* target, const char* payload);
+void fastlane_fall_back(othernet_address_t* target, uint64_t message_id, const char* payload);
+void fastlane_sync_connections();
+void handle_fast_message(protocol_message_t* msg, int client_socket);
+void print_fastlane_latency();
+
 // Utility functions
 uint64_t generate_message_id();
+int addresses_equal(const othernet_address_t* a, const othernet_address_t* b);
+othernet_address_t local_address();
 time_t calculate_next_retry(held_message_t* msg);
+long current_time_ms();
+long current_time_us();
 void print_othernet_address(othernet_address_t* addr);
 void print_peers();
 void print_held_messages();
 void cleanup();
 void signal_handler(int sig);
+int run_self_check();
 
 int main(int argc, char* argv[]) {
     printf("Starting Othernet Node...\n");
@@ -167,6 +822,14 @@ int main(int argc, char* argv[]) {
     my_address.realm = 1;
     my_address.cluster = 1;
     my_address.node_id = (uint32_t)time(NULL) % 10000; // Simple ID generation
+    my_epoch = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    node_start_time = time(NULL);
+    holding_choice_seed = my_epoch;
+    gf_init();
+    
+    if (argc == 2 && strcmp(argv[1], "--check") == 0) {
+        return run_self_check();
+    }
     
     strcpy(my_ip, "0.0.0.0");
     
@@ -178,8 +841,9 @@ int main(int argc, char* argv[]) {
         printf("Bootstrapping from %s:%s\n", argv[1], argv[2]);
         
         protocol_message_t hello;
+        memset(&hello, 0, offsetof(protocol_message_t, data));
         hello.type = MSG_TYPE_HELLO;
-        hello.sender = my_address;
+        hello.sender = local_address();
         strcpy(hello.sender_ip, my_ip);
         hello.sender_port = my_port;
         hello.scope.realm = 0;  // Announce to all realms initially
@@ -187,11 +851,18 @@ int main(int argc, char* argv[]) {
         hello.scope.max_hops = 8;
         hello.ttl = 8;
         hello.timestamp = time(NULL);
-        snprintf(hello.data, sizeof(hello.data), "capabilities:%d", my_capabilities);
+        char topics[TOPIC_FILTER_HEX];
+        format_topic_filter(topics);
+        snprintf(hello.data, sizeof(hello.data), "capabilities:%d topics:%s", my_capabilities, topics);
         
         send_protocol_message(argv[1], atoi(argv[2]), &hello);
     }
     
+    route_cache_init();
+    
+    // Start the hold shards before anything can post work to them
+    start_hold_shards();
+    
     // Start server thread
     pthread_t server_tid;
     pthread_create(&server_tid, NULL, server_thread, NULL);
@@ -200,15 +871,51 @@ int main(int argc, char* argv[]) {
     pthread_t maintenance_tid;
     pthread_create(&maintenance_tid, NULL, maintenance_thread, NULL);
     
+    // Start delivery workers
+    for (int i = 0; i < DELIVERY_WORKERS; i++) {
+        pthread_create(&delivery_worker_tids[i], NULL, delivery_worker, NULL);
+    }
+    
+    // Start the CRASH fast lane; it idles until turned on
+    pthread_t fastlane_tid;
+    fastlane_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fastlane_event_fd < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    pthread_create(&fastlane_tid, NULL, fastlane_thread, NULL);
+    
+    // Start the standby stream; it idles until a standby is configured
+    pthread_t standby_tid;
+    standby_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (standby_event_fd < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    pthread_create(&standby_tid, NULL, standby_thread, NULL);
+    
     // Main interactive loop
-    char input[256];
+    static char input[MAX_PAYLOAD + 64];
     printf("\nOthernet Node Ready! Commands:\n");
     printf("  connect <ip> <port>         - Connect to a peer\n");
     printf("  send <realm.cluster.node> <msg> - Send message to othernet address\n");
-    printf("  broadcast <message>         - Broadcast to all peers\n");
+    printf("  send <r.c.*|addr,addr,...> <msg> - Send one message to many addresses\n");
+    printf("  broadcast <message>         - Broadcast to the whole network\n");
+    printf("  subscribe|unsubscribe <topic> - Follow or stop following a topic\n");
+    printf("  publish <topic> <message>   - Send to the topic's subscribers\n");
+    printf("  topics                      - Show my subscriptions\n");
     printf("  peers                       - Show connected peers\n");
+    printf("  routes                      - Show cached routes\n");
     printf("  held                        - Show held messages\n");
     printf("  capabilities                - Show my capabilities\n");
+    printf("  erasure <k> <m> | off       - Erasure-code large held payloads\n");
+    printf("  discover <realm> <cluster> [hops] - Announce us in a scope (0 = all)\n");
+    printf("  batch <size> <linger_ms>    - Messages per delivery connection\n");
+    printf("  crash <realm.cluster.node> <msg> - Send at CRASH priority\n");
+    printf("  fastlane on|off             - Send CRASH messages to peers directly\n");
+    printf("  latency                     - Show fast lane round trips\n");
+    printf("  standby [<ip> <port> | off] - Stream held messages to a hot standby\n");
+    printf("  standby takeover            - Take over a primary known to be down\n");
     printf("  quit                        - Exit\n\n");
     
     while (running) {
@@ -226,40 +933,75 @@ int main(int argc, char* argv[]) {
             int port;
             if (sscanf(input + 8, "%s %d", ip, &port) == 2) {
                 protocol_message_t hello;
+                memset(&hello, 0, offsetof(protocol_message_t, data));
                 hello.type = MSG_TYPE_HELLO;
-                hello.sender = my_address;
+                hello.sender = local_address();
                 strcpy(hello.sender_ip, my_ip);
                 hello.sender_port = my_port;
                 hello.timestamp = time(NULL);
-                snprintf(hello.data, sizeof(hello.data), "capabilities:%d", my_capabilities);
+                char topics[TOPIC_FILTER_HEX];
+                format_topic_filter(topics);
+                snprintf(hello.data, sizeof(hello.data), "capabilities:%d topics:%s",
+                         my_capabilities, topics);
                 send_protocol_message(ip, port, &hello);
             }
         }
         else if (strncmp(input, "send ", 5) == 0) {
-            char addr_str[32], message[512];
-            if (sscanf(input + 5, "%s %[^\n]", addr_str, message) == 2) {
-                othernet_address_t target;
-                if (sscanf(addr_str, "%hu.%hu.%u", &target.realm, &target.cluster, &target.node_id) == 3) {
-                    queue_message_for_holding(&target, message, PRIORITY_NORMAL);
-                    printf("Message queued for delivery to ");
-                    print_othernet_address(&target);
-                    printf("\n");
+            static othernet_address_t targets[MAX_HELD_MESSAGES];
+            char addr_str[4096];
+            int message_offset = 0;
+            if (sscanf(input + 5, "%4095s %n", addr_str, &message_offset) == 1 && message_offset > 0 &&
+                input[5 + message_offset] != '\0') {
+                const char* message = input + 5 + message_offset;
+                int count = parse_target_list(addr_str, targets, MAX_HELD_MESSAGES);
+                if (count == 1 && !strchr(addr_str, '*')) {
+                    if (queue_message_for_targets(targets, 1, message, PRIORITY_NORMAL) == 1) {
+                        printf("Message queued for delivery to ");
+                        print_othernet_address(&targets[0]);
+                        printf("\n");
+                    }
+                } else if (count > 0) {
+                    int posted = queue_message_for_targets(targets, count, message, PRIORITY_NORMAL);
+                    printf("Message passed on for delivery to %d of %d addresses\n", posted, count);
+                } else {
+                    printf("No addresses to send to in %s\n", addr_str);
                 }
             }
         }
         else if (strncmp(input, "broadcast ", 10) == 0) {
-            protocol_message_t msg;
-            msg.type = MSG_TYPE_OTHERNET_MESSAGE;
-            msg.sender = my_address;
-            strcpy(msg.sender_ip, my_ip);
-            msg.sender_port = my_port;
-            msg.timestamp = time(NULL);
-            strcpy(msg.data, input + 10);
-            broadcast_protocol_message(&msg);
+            gossip_broadcast(input + 10);
+        }
+        else if (strncmp(input, "subscribe ", 10) == 0 || strncmp(input, "unsubscribe ", 12) == 0) {
+            int subscribe = input[0] == 's';
+            char topic[TOPIC_LEN];
+            if (sscanf(input + (subscribe ? 10 : 12), "%31s", topic) == 1) {
+                if (set_subscription(topic, subscribe)) {
+                    printf("%s %s\n", subscribe ? "Subscribed to" : "Unsubscribed from", topic);
+                } else if (subscribe && !is_subscribed(topic)) {
+                    printf("Already following %d topics\n", MAX_TOPICS);
+                }
+            }
+        }
+        else if (strncmp(input, "publish ", 8) == 0) {
+            char topic[TOPIC_LEN];
+            int message_offset = 0;
+            if (sscanf(input + 8, "%31s %n", topic, &message_offset) == 1 && message_offset > 0 &&
+                input[8 + message_offset] != '\0') {
+                int sent = publish_message(topic, input + 8 + message_offset);
+                printf("Published to %s via %d peers\n", topic, sent);
+            } else {
+                printf("Usage: publish <topic> <message>\n");
+            }
+        }
+        else if (strcmp(input, "topics") == 0) {
+            print_topics();
         }
         else if (strcmp(input, "peers") == 0) {
             print_peers();
         }
+        else if (strcmp(input, "routes") == 0) {
+            print_routes();
+        }
         else if (strcmp(input, "held") == 0) {
             print_held_messages();
         }
@@ -270,6 +1012,98 @@ int main(int argc, char* argv[]) {
             if (my_capabilities & CAPABILITY_GATEWAY) printf("GATEWAY ");
             printf("\n");
         }
+        else if (strncmp(input, "erasure ", 8) == 0) {
+            int k, m;
+            if (strcmp(input + 8, "off") == 0) {
+                atomic_store(&erasure_code, 0);
+                printf("Erasure coding off, held messages are replicated\n");
+            } else if (sscanf(input + 8, "%d %d", &k, &m) == 2 &&
+                       k >= 2 && m >= 1 && k + m <= ERASURE_MAX_SHARDS) {
+                atomic_store(&erasure_code, k << 8 | m);
+                printf("Payloads of %d+ bytes split into %d+%d fragments\n",
+                       ERASURE_MIN_PAYLOAD, k, m);
+            } else {
+                printf("Usage: erasure <k> <m> (k >= 2, m >= 1, k + m <= %d) | off\n",
+                       ERASURE_MAX_SHARDS);
+            }
+        }
+        else if (strncmp(input, "discover ", 9) == 0) {
+            unsigned int realm, cluster, hops = DISCOVERY_HOPS;
+            if (sscanf(input + 9, "%u %u %u", &realm, &cluster, &hops) >= 2 &&
+                realm <= 0xffff && cluster <= 0xffff && hops >= 1 && hops <= 255) {
+                announce_presence(realm, cluster, hops);
+                printf("Announced in realm %u cluster %u, up to %u hops\n", realm, cluster, hops);
+            } else {
+                printf("Usage: discover <realm> <cluster> [hops]\n");
+            }
+        }
+        else if (strncmp(input, "batch ", 6) == 0) {
+            int size, linger;
+            if (sscanf(input + 6, "%d %d", &size, &linger) == 2 &&
+                size >= 1 && size <= DELIVERY_FRAMES_MAX && linger >= 0 && linger <= 1000) {
+                delivery_batch_size = size;
+                delivery_linger_ms = linger;
+                printf("Deliveries sent %d per connection, short batches wait %d ms\n",
+                       size, linger);
+            } else {
+                printf("Usage: batch <1-%d> <0-1000 ms>\n", DELIVERY_FRAMES_MAX);
+            }
+        }
+        else if (strncmp(input, "crash ", 6) == 0) {
+            othernet_address_t target;
+            int message_offset = 0;
+            if (sscanf(input + 6, "%hu.%hu.%u %n", &target.realm, &target.cluster,
+                       &target.node_id, &message_offset) == 3 && message_offset > 0 &&
+                input[6 + message_offset] != '\0') {
+                send_crash_message(&target, input + 6 + message_offset);
+            } else {
+                printf("Usage: crash <realm.cluster.node> <msg>\n");
+            }
+        }
+        else if (strcmp(input, "fastlane on") == 0 || strcmp(input, "fastlane off") == 0) {
+            int on = strcmp(input + 9, "on") == 0;
+            atomic_store(&fastlane_enabled, on);
+            uint64_t one = 1;
+            if (write(fastlane_event_fd, &one, sizeof(one)) < 0) {
+                perror("fast lane wakeup");
+            }
+            printf("CRASH fast lane %s\n", on ? "on" : "off");
+        }
+        else if (strcmp(input, "standby") == 0) {
+            print_standby_status();
+        }
+        else if (strncmp(input, "standby ", 8) == 0) {
+            char ip[16];
+            int port;
+            if (strcmp(input + 8, "off") == 0) {
+                pthread_mutex_lock(&standby_mutex);
+                standby_port = 0;
+                pthread_mutex_unlock(&standby_mutex);
+                printf("Standby stream off\n");
+            } else if (strcmp(input + 8, "takeover") == 0) {
+                pthread_mutex_lock(&standby_mutex);
+                int following = standby_following;
+                pthread_mutex_unlock(&standby_mutex);
+                if (following) standby_take_over("is fenced");
+                else printf("Not standing by for any node\n");
+            } else if (sscanf(input + 8, "%15s %d", ip, &port) == 2 && port > 0 && port < 65536) {
+                pthread_mutex_lock(&standby_mutex);
+                strcpy(standby_ip, ip);
+                standby_port = port;
+                standby_lag_max_us = 0;
+                pthread_mutex_unlock(&standby_mutex);
+                printf("Held messages will be streamed to %s:%d\n", ip, port);
+            } else {
+                printf("Usage: standby [<ip> <port> | off | takeover]\n");
+            }
+            uint64_t one = 1;
+            if (write(standby_event_fd, &one, sizeof(one)) < 0) {
+                perror("standby wakeup");
+            }
+        }
+        else if (strcmp(input, "latency") == 0) {
+            print_fastlane_latency();
+        }
         else if (strcmp(input, "quit") == 0) {
             running = 0;
         }
@@ -281,6 +1115,14 @@ int main(int argc, char* argv[]) {
     cleanup();
     pthread_join(server_tid, NULL);
     pthread_join(maintenance_tid, NULL);
+    pthread_join(fastlane_tid, NULL);
+    pthread_join(standby_tid, NULL);
+    for (int i = 0; i < DELIVERY_WORKERS; i++) {
+        pthread_join(delivery_worker_tids[i], NULL);
+    }
+    for (int i = 0; i < hold_shard_count; i++) {
+        pthread_join(hold_shards[i].tid, NULL);
+    }
     return 0;
 }
 
@@ -340,26 +1182,29 @@ void* server_thread(void* arg) {
 }
 
 void* maintenance_thread(void* arg) {
+    unsigned long tick = 0;
+    
+    // Held messages are scheduled by their shards; this thread looks
+    // after peers and what we tell them
     while (running) {
-        sleep(30); // Run maintenance every 30 seconds
+        sleep(1);
+        tick++;
         
-        // Clean up expired messages
-        cleanup_expired_messages();
+        gossip_tick();
+        check_standby_failover();
         
-        // Attempt delivery of held messages
-        pthread_mutex_lock(&messages_mutex);
-        time_t now = time(NULL);
+        if (tick % 5 == 0) {
+            detect_failed_peers();
+        }
         
-        for (int i = 0; i < held_message_count; i++) {
-            held_message_t* msg = &held_messages[i];
-            if (msg->status == MSG_STATUS_HELD && now >= msg->next_attempt) {
-                attempt_message_delivery(msg);
-            }
+        // Let the rest of our cluster find us, without flooding the network
+        if (tick % 60 == 0 && peer_count > 0) {
+            othernet_address_t self = local_address();
+            announce_presence(self.realm, self.cluster, DISCOVERY_HOPS);
         }
-        pthread_mutex_unlock(&messages_mutex);
         
         // Send periodic capability updates
-        if (peer_count > 0) {
+        if (tick % 30 == 0 && peer_count > 0) {
             send_capability_update();
         }
     }
@@ -371,44 +1216,149 @@ void* peer_listener(void* arg) {
     int client_socket = *(int*)arg;
     free(arg);
     
-    char buffer[BUFFER_SIZE];
+    size_t capacity = 4096;
+    char* buffer = malloc(capacity);
+    protocol_message_t* msg = malloc(sizeof(protocol_message_t));
+    if (!buffer || !msg) {
+        free(buffer);
+        free(msg);
+        close(client_socket);
+        return NULL;
+    }
     struct sockaddr_in client_addr;
     socklen_t addr_len = sizeof(client_addr);
     getpeername(client_socket, (struct sockaddr*)&client_addr, &addr_len);
     char client_ip[16];
     strcpy(client_ip, inet_ntoa(client_addr.sin_addr));
     
+    // A connection may carry a batch of newline-terminated frames
+    size_t buffered = 0;
+    int fast_connection = 0;
+    int standby_connection = 0;
     ssize_t bytes_received;
-    while ((bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0';
-        
-        // Parse protocol message
-        protocol_message_t msg;
-        char type_str[16], scope_str[32];
-        
-        int parsed = sscanf(buffer, "%s %hu.%hu.%u %s %d %s %ld %[^\n]",
-                           type_str, &msg.sender.realm, &msg.sender.cluster, &msg.sender.node_id,
-                           msg.sender_ip, &msg.sender_port, scope_str, &msg.timestamp, msg.data);
-        
-        if (parsed >= 7) {
-            // Convert type string to enum
-            if (strcmp(type_str, "HELLO") == 0) msg.type = MSG_TYPE_HELLO;
-            else if (strcmp(type_str, "PEER_LIST") == 0) msg.type = MSG_TYPE_PEER_LIST;
-            else if (strcmp(type_str, "OTHERNET_MESSAGE") == 0) msg.type = MSG_TYPE_OTHERNET_MESSAGE;
-            else if (strcmp(type_str, "GOODBYE") == 0) msg.type = MSG_TYPE_GOODBYE;
-            else continue; // Unknown message type
+    while ((bytes_received = recv(client_socket, buffer + buffered,
+                                  capacity - 1 - buffered, 0)) > 0) {
+        buffered += bytes_received;
+        buffer[buffered] = '\0';
+        
+        char* line = buffer;
+        char* end;
+        while ((end = memchr(line, '\n', buffer + buffered - line)) != NULL) {
+            *end = '\0';
+            
+            // A frame with a body is taken once all of it has arrived
+            int parsed = parse_protocol_message(line, msg);
+            if (parsed && msg->body_len > (size_t)(buffer + buffered - end - 1)) {
+                *end = '\n';
+                break;
+            }
+            line = end + 1;
             
-            handle_protocol_message(&msg, client_ip);
+            if (parsed) {
+                memcpy(msg->data + strlen(msg->data) + 1, line, msg->body_len);
+                line += msg->body_len;
+                touch_peer(client_ip, msg->sender_port, &msg->sender);
+                if (msg->type == MSG_TYPE_OTHERNET_MESSAGE && strncmp(msg->data, "fast:", 5) == 0) {
+                    // A fast lane connection: ack without delay from now on
+                    if (!fast_connection) {
+                        int one = 1;
+                        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                        fast_connection = 1;
+                    }
+                    handle_fast_message(msg, client_socket);
+                } else if (msg->type == MSG_TYPE_HOLD_REQUEST && strncmp(msg->data, "stb:", 4) == 0) {
+                    handle_standby_frame(msg, client_ip);
+                    standby_connection = 1;
+                } else {
+                    handle_protocol_message(msg, client_ip);
+                }
+            }
+        }
+        
+        // Confirm deliveries once the sender has nothing more queued for
+        // us, so a whole batch costs one ack
+        int queued = 0;
+        if (ioctl(client_socket, FIONREAD, &queued) != 0 || queued == 0) {
+            flush_delivery_acks();
+            if (standby_connection) send_standby_ack(client_socket);
+        }
+        
+        // Keep a partial frame for the next recv, growing the buffer for a
+        // long one; drop one that can never fit
+        buffered = buffer + buffered - line;
+        memmove(buffer, line, buffered);
+        if (buffered >= capacity - 1) {
+            char* grown = capacity < BUFFER_SIZE ? realloc(buffer, capacity * 2) : NULL;
+            if (grown) {
+                buffer = grown;
+                capacity *= 2;
+            } else {
+                buffered = 0;
+            }
         }
     }
     
+    flush_delivery_acks();
+    free(msg);
+    free(buffer);
     close(client_socket);
     return NULL;
 }
 
-void send_protocol_message(const char* ip, int port, protocol_message_t* msg) {
+// Parses one wire frame (without its newline). Returns 0 for malformed
+// frames and unknown message types.
+int parse_protocol_message(char* line, protocol_message_t* msg) {
+    char type_str[32], scope_str[32];
+    int data_offset = 0;
+    
+    int parsed = sscanf(line, "%31s %hu.%hu.%u %15s %d %31s %ld %n",
+                       type_str, &msg->sender.realm, &msg->sender.cluster, &msg->sender.node_id,
+                       msg->sender_ip, &msg->sender_port, scope_str, &msg->timestamp, &data_offset);
+    
+    // A frame followed by a binary body is typed TYPE+length
+    char* plus = strchr(type_str, '+');
+    msg->body_len = 0;
+    if (plus) {
+        *plus = '\0';
+        msg->body_len = strtoul(plus + 1, NULL, 10);
+    }
+    
+    // Convert type string to enum, skipping unknown message types
+    if (parsed < 7 || !protocol_type_from_string(type_str, &msg->type)) {
+        return 0;
+    }
+    
+    msg->data[0] = '\0';
+    if (parsed == 8 && data_offset > 0) {
+        snprintf(msg->data, sizeof(msg->data), "%s", line + data_offset);
+    }
+    if (msg->body_len > sizeof(msg->data) - strlen(msg->data) - 1) {
+        return 0;
+    }
+    
+    // Frames without a scope or TTL are never forwarded
+    memset(&msg->scope, 0, sizeof(msg->scope));
+    msg->ttl = 0;
+    sscanf(scope_str, "scope:%hu.%hu.%hhu/%hhu", &msg->scope.realm,
+           &msg->scope.cluster, &msg->scope.max_hops, &msg->ttl);
+    return 1;
+}
+
+// Returns 0 once the message has been handed to the peer's socket, -1 if
+// the peer could not be reached.
+int send_protocol_message(const char* ip, int port, protocol_message_t* msg) {
+    char* buffer = malloc(BUFFER_SIZE);
+    if (!buffer) return -1;
+    int len = format_protocol_message(buffer, BUFFER_SIZE, msg);
+    int result = send_protocol_wire(ip, port, buffer, len);
+    free(buffer);
+    return result;
+}
+
+// Sends already formatted frames back to back over a single connection
+int send_protocol_wire(const char* ip, int port, const char* wire, size_t len) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return;
+    if (sock < 0) return -1;
     
     struct sockaddr_in peer_addr;
     memset(&peer_addr, 0, sizeof(peer_addr));
@@ -416,28 +1366,108 @@ void send_protocol_message(const char* ip, int port, protocol_message_t* msg) {
     peer_addr.sin_port = htons(port);
     inet_pton(AF_INET, ip, &peer_addr.sin_addr);
     
+    int result = -1;
     if (connect(sock, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) == 0) {
-        char buffer[BUFFER_SIZE];
-        const char* type_str = "UNKNOWN";
-        
-        switch (msg->type) {
-            case MSG_TYPE_HELLO: type_str = "HELLO"; break;
-            case MSG_TYPE_PEER_LIST: type_str = "PEER_LIST"; break;
-            case MSG_TYPE_OTHERNET_MESSAGE: type_str = "OTHERNET_MESSAGE"; break;
-            case MSG_TYPE_GOODBYE: type_str = "GOODBYE"; break;
-            default: break;
+        size_t sent = 0;
+        while (sent < len) {
+            ssize_t n = send(sock, wire + sent, len - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
         }
-        
-        snprintf(buffer, sizeof(buffer), "%s %hu.%hu.%u %s %d scope:%hu.%hu.%hhu %ld %s\n",
-                type_str, msg->sender.realm, msg->sender.cluster, msg->sender.node_id,
-                msg->sender_ip, msg->sender_port,
-                msg->scope.realm, msg->scope.cluster, msg->scope.max_hops,
-                msg->timestamp, msg->data);
-        
-        send(sock, buffer, strlen(buffer), 0);
+        if (sent == len) result = 0;
     }
     
     close(sock);
+    return result;
+}
+
+// Formats frame onto the end of the job's wire buffer
+int append_job_frame(delivery_job_t* job, protocol_message_t* frame) {
+    size_t needed = job->wire_len + strlen(frame->data) + frame->body_len + 256;
+    if (needed > job->wire_size) {
+        size_t size = job->wire_size ? job->wire_size : 4096;
+        while (size < needed) size *= 2;
+        char* grown = realloc(job->wire, size);
+        if (!grown) return -1;
+        job->wire = grown;
+        job->wire_size = size;
+    }
+    
+    job->wire_len += format_protocol_message(job->wire + job->wire_len,
+                                             job->wire_size - job->wire_len, frame);
+    job->frame_count++;
+    return 0;
+}
+
+// Writes one newline-terminated wire frame and its body, returns the length
+int format_protocol_message(char* buffer, size_t size, protocol_message_t* msg) {
+    char type[32];
+    snprintf(type, sizeof(type), "%s", protocol_type_to_string(msg->type));
+    if (msg->body_len) {
+        snprintf(type + strlen(type), sizeof(type) - strlen(type), "+%u", msg->body_len);
+    }
+    
+    int len = snprintf(buffer, size, "%s %hu.%hu.%u %s %d scope:%hu.%hu.%hhu/%hhu %ld %s\n",
+            type,
+            msg->sender.realm, msg->sender.cluster, msg->sender.node_id,
+            msg->sender_ip, msg->sender_port,
+            msg->scope.realm, msg->scope.cluster, msg->scope.max_hops, msg->ttl,
+            msg->timestamp, msg->data);
+    if (len >= (int)size) {
+        len = size - 1;
+        buffer[len - 1] = '\n';
+    } else if (msg->body_len && len + msg->body_len < size) {
+        memcpy(buffer + len, frame_body(msg), msg->body_len);
+        len += msg->body_len;
+    }
+    return len;
+}
+
+// Puts a held payload after the text already in frame->data. A payload is
+// text, optionally followed by a NUL and binary bytes that become the body.
+void append_frame_payload(protocol_message_t* frame, const char* payload, size_t len) {
+    size_t used = strlen(frame->data);
+    size_t text = strnlen(payload, len);
+    
+    snprintf(frame->data + used, sizeof(frame->data) - used, "%.*s", (int)text, payload);
+    frame->body_len = 0;
+    if (text < len && used + len < sizeof(frame->data)) {
+        memcpy(frame->data + used + text + 1, payload + text + 1, len - text - 1);
+        frame->body_len = len - text - 1;
+    }
+}
+
+// The binary body of a frame, after the NUL that ends its text
+const char* frame_body(protocol_message_t* frame) {
+    return frame->data + strlen(frame->data) + 1;
+}
+
+const char* protocol_type_to_string(protocol_message_type_t type) {
+    switch (type) {
+        case MSG_TYPE_HELLO: return "HELLO";
+        case MSG_TYPE_PEER_LIST: return "PEER_LIST";
+        case MSG_TYPE_OTHERNET_MESSAGE: return "OTHERNET_MESSAGE";
+        case MSG_TYPE_HOLD_REQUEST: return "HOLD_REQUEST";
+        case MSG_TYPE_HOLD_RESPONSE: return "HOLD_RESPONSE";
+        case MSG_TYPE_DELIVERY_CONFIRM: return "DELIVERY_CONFIRM";
+        case MSG_TYPE_CAPABILITY_UPDATE: return "CAPABILITY_UPDATE";
+        case MSG_TYPE_GOODBYE: return "GOODBYE";
+        default: return "UNKNOWN";
+    }
+}
+
+// Returns 1 and fills *type if the string names a message type we handle
+int protocol_type_from_string(const char* str, protocol_message_type_t* type) {
+    if (strcmp(str, "HELLO") == 0) *type = MSG_TYPE_HELLO;
+    else if (strcmp(str, "PEER_LIST") == 0) *type = MSG_TYPE_PEER_LIST;
+    else if (strcmp(str, "OTHERNET_MESSAGE") == 0) *type = MSG_TYPE_OTHERNET_MESSAGE;
+    else if (strcmp(str, "HOLD_REQUEST") == 0) *type = MSG_TYPE_HOLD_REQUEST;
+    else if (strcmp(str, "HOLD_RESPONSE") == 0) *type = MSG_TYPE_HOLD_RESPONSE;
+    else if (strcmp(str, "DELIVERY_CONFIRM") == 0) *type = MSG_TYPE_DELIVERY_CONFIRM;
+    else if (strcmp(str, "CAPABILITY_UPDATE") == 0) *type = MSG_TYPE_CAPABILITY_UPDATE;
+    else if (strcmp(str, "GOODBYE") == 0) *type = MSG_TYPE_GOODBYE;
+    else return 0;
+    return 1;
 }
 
 void handle_protocol_message(protocol_message_t* msg, const char* from_ip) {
@@ -447,12 +1477,60 @@ void handle_protocol_message(protocol_message_t* msg, const char* from_ip) {
             break;
             
         case MSG_TYPE_OTHERNET_MESSAGE:
+            if (strncmp(msg->data, "dlv:", 4) == 0) {
+                handle_delivery_message(msg, from_ip);
+                break;
+            }
+            if (strncmp(msg->data, "pub:", 4) == 0) {
+                handle_publication(msg, from_ip);
+                break;
+            }
+            if (strncmp(msg->data, "gsp:", 4) == 0) {
+                handle_gossip(msg, from_ip);
+                break;
+            }
+            if (strncmp(msg->data, "ihave:", 6) == 0) {
+                handle_ihave(msg, from_ip);
+                break;
+            }
+            if (strncmp(msg->data, "graft:", 6) == 0) {
+                handle_graft(msg, from_ip);
+                break;
+            }
+            if (strcmp(msg->data, "prune:") == 0) {
+                handle_prune(msg, from_ip);
+                break;
+            }
+            if (strncmp(msg->data, "neighbor:", 9) == 0) {
+                handle_neighbor(msg, from_ip);
+                break;
+            }
+            if (strcmp(msg->data, "disconnect:") == 0) {
+                handle_disconnect(msg, from_ip);
+                break;
+            }
             printf("\n[MESSAGE from ");
             print_othernet_address(&msg->sender);
             printf("] %s\n> ", msg->data);
             fflush(stdout);
             break;
             
+        case MSG_TYPE_DELIVERY_CONFIRM:
+            handle_delivery_confirm(msg);
+            break;
+            
+        case MSG_TYPE_HOLD_REQUEST:
+            handle_hold_request(msg, from_ip);
+            break;
+            
+        case MSG_TYPE_HOLD_RESPONSE:
+            handle_hold_response(msg);
+            break;
+            
+        case MSG_TYPE_CAPABILITY_UPDATE:
+            handle_capability_update(msg, from_ip);
+            break;
+            
         case MSG_TYPE_GOODBYE:
             remove_peer(msg->sender_ip, msg->sender_port);
             break;
@@ -464,307 +1542,4535 @@ void handle_protocol_message(protocol_message_t* msg, const char* from_ip) {
 
 void handle_hello_message(protocol_message_t* msg, const char* from_ip) {
     uint32_t capabilities = 0;
+    unsigned long long announce_id = 0;
+    const char* origin_ip = from_ip;
     sscanf(msg->data, "capabilities:%u", &capabilities);
     
-    add_peer(from_ip, msg->sender_port, &msg->sender, capabilities);
+    // A flooded announcement: drop it outside its scope or if we have had
+    // it before, otherwise pass it on before learning the node ourselves
+    char* ann = strstr(msg->data, " ann:");
+    if (ann && sscanf(ann, " ann:%llx", &announce_id) == 1) {
+        othernet_address_t self = local_address();
+        if (addresses_equal(&msg->sender, &self) ||
+            !in_discovery_scope(&msg->scope, &self) ||
+            announcement_seen(announce_id)) {
+            return;
+        }
+        
+        // Past the first hop the forwarder has written in the origin's ip;
+        // the origin itself usually only knows 0.0.0.0
+        if (msg->ttl < msg->scope.max_hops) origin_ip = msg->sender_ip;
+        forward_announcement(msg, origin_ip);
+    }
+    
+    // Only answer peers we did not know yet, otherwise two nodes would
+    // keep answering each other's HELLO forever
+    int is_new = add_peer(origin_ip, msg->sender_port, &msg->sender, capabilities);
+    update_peer_topics(origin_ip, msg->sender_port, msg->data);
+    if (!is_new) {
+        return;
+    }
+    
+    // Anything we hold for this node can go out now
+    wake_held_messages_for(&msg->sender);
     
     // Send back our capabilities
-    protocol_message_t response;
-    response.type = MSG_TYPE_HELLO;
-    response.sender = my_address;
-    strcpy(response.sender_ip, my_ip);
-    response.sender_port = my_port;
-    response.timestamp = time(NULL);
-    snprintf(response.data, sizeof(response.data), "capabilities:%u", my_capabilities);
+    protocol_message_t* response = malloc(sizeof(protocol_message_t));
+    if (!response) return;
+    memset(response, 0, offsetof(protocol_message_t, data));
+    response->type = MSG_TYPE_HELLO;
+    response->sender = local_address();
+    strcpy(response->sender_ip, my_ip);
+    response->sender_port = my_port;
+    response->timestamp = time(NULL);
+    char topics[TOPIC_FILTER_HEX];
+    format_topic_filter(topics);
+    snprintf(response->data, sizeof(response->data), "capabilities:%u topics:%s",
+             my_capabilities, topics);
     
-    send_protocol_message(from_ip, msg->sender_port, &response);
+    send_protocol_message(origin_ip, msg->sender_port, response);
+    free(response);
 }
 
-void queue_message_for_holding(othernet_address_t* target, const char* payload, message_priority_t priority) {
-    pthread_mutex_lock(&messages_mutex);
-    
-    if (held_message_count < MAX_HELD_MESSAGES) {
-        held_message_t* msg = &held_messages[held_message_count++];
-        
-        msg->message_id = generate_message_id();
-        msg->target_address = *target;
-        msg->sender_address = my_address;
-        msg->priority = priority;
-        strcpy(msg->payload, payload);
-        
-        time_t now = time(NULL);
-        msg->created_time = now;
-        msg->last_attempt = 0;
-        msg->next_attempt = now;
-        msg->attempt_count = 0;
-        msg->expires_at = now + 86400; // 24 hours
-        msg->status = MSG_STATUS_QUEUED;
-        
-        // Try immediate delivery
-        attempt_message_delivery(msg);
-    }
-    
-    pthread_mutex_unlock(&messages_mutex);
+// Realm or cluster 0 in a scope matches everything
+int in_discovery_scope(discovery_scope_t* scope, othernet_address_t* addr) {
+    return (scope->realm == 0 || scope->realm == addr->realm) &&
+           (scope->cluster == 0 || scope->cluster == addr->cluster);
 }
 
-void attempt_message_delivery(held_message_t* msg) {
-    peer_t* target_peer = find_peer_by_address(&msg->target_address);
+// Reports whether id is in the seen cache, adding it if record is set.
+// Each id maps to one small bucket; an expired or the oldest entry makes
+// room for it.
+static int seen_cache_check(uint64_t id, int record) {
+    seen_entry_t* bucket = seen_cache[hash_bytes(&id, sizeof(id), 0) % SEEN_CACHE_BUCKETS];
+    time_t now = time(NULL);
+    int victim = 0;
     
-    if (target_peer && target_peer->active) {
-        // Direct delivery attempt
-        protocol_message_t delivery;
-        delivery.type = MSG_TYPE_OTHERNET_MESSAGE;
-        delivery.sender = msg->sender_address;
-        delivery.timestamp = time(NULL);
-        strcpy(delivery.data, msg->payload);
-        
-        send_protocol_message(target_peer->ip, target_peer->port, &delivery);
-        
-        msg->status = MSG_STATUS_DELIVERED;
-        printf("Message %lu delivered to ", msg->message_id);
-        print_othernet_address(&msg->target_address);
-        printf("\n");
-    } else {
-        // Target not online, update retry schedule
-        msg->status = MSG_STATUS_HELD;
-        msg->attempt_count++;
-        msg->last_attempt = time(NULL);
-        msg->next_attempt = calculate_next_retry(msg);
-        
-        if (msg->attempt_count >= MAX_RETRIES) {
-            msg->status = MSG_STATUS_FAILED;
-            printf("Message %lu failed after %d attempts\n", msg->message_id, msg->attempt_count);
+    pthread_mutex_lock(&seen_mutex);
+    for (int i = 0; i < SEEN_CACHE_WAYS; i++) {
+        if (bucket[i].id == id && now - bucket[i].seen < SEEN_ID_TTL) {
+            pthread_mutex_unlock(&seen_mutex);
+            return 1;
         }
+        if (bucket[i].seen < bucket[victim].seen) victim = i;
+    }
+    if (record) {
+        bucket[victim].id = id;
+        bucket[victim].seen = now;
     }
+    pthread_mutex_unlock(&seen_mutex);
+    return 0;
 }
 
-void add_peer(const char* ip, int port, othernet_address_t* addr, uint32_t capabilities) {
-    pthread_mutex_lock(&peers_mutex);
+// Records id and reports whether it was already there
+int announcement_seen(uint64_t id) {
+    return seen_cache_check(id, 1);
+}
+
+int announcement_known(uint64_t id) {
+    return seen_cache_check(id, 0);
+}
+
+// Sends an announcement to the active peers inside its scope, leaving out
+// skip if given, so its cost grows with the scope and not with the whole
+// network
+void send_to_scope(protocol_message_t* msg, othernet_address_t* skip) {
+    char ips[MAX_PEERS][16];
+    int ports[MAX_PEERS];
+    int count = 0;
     
-    // Check if peer already exists
+    pthread_mutex_lock(&peers_mutex);
     for (int i = 0; i < peer_count; i++) {
-        if (strcmp(peers[i].ip, ip) == 0 && peers[i].port == port) {
-            peers[i].active = 1;
+        peer_t* peer = &peers[i];
+        if (!peer->active || !in_discovery_scope(&msg->scope, &peer->address)) continue;
+        if (skip && addresses_equal(&peer->address, skip)) continue;
+        strcpy(ips[count], peer->ip);
+        ports[count] = peer->port;
+        count++;
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    for (int i = 0; i < count; i++) {
+        send_protocol_message(ips[i], ports[i], msg);
+    }
+}
+
+// Passes an announcement one hop further
+void forward_announcement(protocol_message_t* msg, const char* origin_ip) {
+    if (msg->ttl <= 1) return;
+    
+    protocol_message_t* forward = malloc(sizeof(protocol_message_t));
+    if (!forward) return;
+    *forward = *msg;
+    forward->ttl--;
+    snprintf(forward->sender_ip, sizeof(forward->sender_ip), "%s", origin_ip);
+    
+    // The forwarder may get the frame back, we do not know its port; its
+    // seen cache drops it
+    send_to_scope(forward, &msg->sender);
+    free(forward);
+}
+
+// Payload arena. A handle is the size class in the top byte and the block
+// number + 1 below it, so 0 never names a block. Blocks are never returned
+// to the system; a freed block goes on its class's free list for reuse.
+// Each shard has its own arena, used only by the shard's thread.
+static int payload_class_for(size_t size) {
+    int cls = 0;
+    while (cls < PAYLOAD_CLASSES - 1 && ((size_t)1 << (PAYLOAD_MIN_SHIFT + cls)) < size) cls++;
+    return cls;
+}
+
+static char* payload_block(hold_shard_t* shard, int cls, uint32_t block) {
+    size_t block_size = (size_t)1 << (PAYLOAD_MIN_SHIFT + cls);
+    uint32_t per_slab = PAYLOAD_SLAB_SIZE / block_size;
+    return shard->payload_classes[cls].slabs[block / per_slab] + (size_t)(block % per_slab) * block_size;
+}
+
+uint32_t payload_store(hold_shard_t* shard, const char* data, size_t len) {
+    if (len > MAX_PAYLOAD) return 0;
+    
+    int cls = payload_class_for(len + 1);
+    payload_class_t* pc = &shard->payload_classes[cls];
+    size_t block_size = (size_t)1 << (PAYLOAD_MIN_SHIFT + cls);
+    uint32_t per_slab = PAYLOAD_SLAB_SIZE / block_size;
+    uint32_t block;
+    
+    if (pc->free_head) {
+        block = pc->free_head - 1;
+        memcpy(&pc->free_head, payload_block(shard, cls, block), sizeof(uint32_t));
+    } else {
+        if (pc->next_block == (uint32_t)pc->slab_count * per_slab) {
+            char** slabs = realloc(pc->slabs, (pc->slab_count + 1) * sizeof(char*));
+            if (!slabs) return 0;
+            pc->slabs = slabs;
+            uint32_t* refs = realloc(pc->refs, (pc->slab_count + 1) * per_slab * sizeof(uint32_t));
+            if (!refs) return 0;
+            pc->refs = refs;
+            pc->slabs[pc->slab_count] = malloc(PAYLOAD_SLAB_SIZE);
+            if (!pc->slabs[pc->slab_count]) return 0;
+            pc->slab_count++;
+        }
+        block = pc->next_block++;
+    }
+    
+    char* dest = payload_block(shard, cls, block);
+    memcpy(dest, data, len);
+    dest[len] = '\0';
+    pc->refs[block] = 1;
+    pc->in_use++;
+    return ((uint32_t)cls << 24) | (block + 1);
+}
+
+const char* payload_data(hold_shard_t* shard, uint32_t handle) {
+    if (!handle) return "";
+    return payload_block(shard, handle >> 24, (handle & 0xFFFFFF) - 1);
+}
+
+// Takes another reference to a stored payload, returning the same handle
+uint32_t payload_retain(hold_shard_t* shard, uint32_t handle) {
+    if (handle) shard->payload_classes[handle >> 24].refs[(handle & 0xFFFFFF) - 1]++;
+    return handle;
+}
+
+void payload_release(hold_shard_t* shard, uint32_t handle) {
+    if (!handle) return;
+    
+    int cls = handle >> 24;
+    payload_class_t* pc = &shard->payload_classes[cls];
+    if (--pc->refs[(handle & 0xFFFFFF) - 1] > 0) return;
+    
+    memcpy(payload_block(shard, cls, (handle & 0xFFFFFF) - 1), &pc->free_head, sizeof(uint32_t));
+    pc->free_head = handle & 0xFFFFFF;
+    pc->in_use--;
+}
+
+void release_shared_payload(shared_payload_t* payload) {
+    if (payload && atomic_fetch_sub(&payload->refs, 1) == 1) free(payload);
+}
+
+static shared_payload_t* new_shared_payload(const char* data, size_t len, int refs) {
+    shared_payload_t* payload = malloc(sizeof(shared_payload_t) + len + 1);
+    if (!payload) return NULL;
+    atomic_init(&payload->refs, refs);
+    payload->len = len;
+    memcpy(payload->data, data, len);
+    payload->data[len] = '\0';
+    return payload;
+}
+
+// Allocates a shard's records and scratch space. The thread is started
+// separately, so --check can use a shard on its own.
+int init_hold_shard(hold_shard_t* shard, int index, int capacity) {
+    shard->index = index;
+    shard->messages = calloc(capacity, sizeof(held_message_t));
+    shard->due = malloc(capacity * sizeof(int));
+    shard->free_slots = malloc(capacity * sizeof(int));
+    shard->window_entries = malloc((size_t)MAX_DELIVERY_WINDOWS * 2 * capacity *
+                                   sizeof(window_entry_t));
+    shard->frame = malloc(sizeof(protocol_message_t));
+    if (!shard->messages || !shard->due || !shard->free_slots || !shard->window_entries ||
+        !shard->frame) {
+        return -1;
+    }
+    shard->message_capacity = capacity;
+    pthread_mutex_init(&shard->wake_mutex, NULL);
+    pthread_cond_init(&shard->wake_cond, NULL);
+    return 0;
+}
+
+// Hold shards. Other threads never lock a shard: they post work to its
+// inbox (a lock-free stack, reversed on the way out to keep posting order)
+// and kick it. The shard thread also drains its own completion stack, so
+// the delivery workers do not share one either.
+void start_hold_shards() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    hold_shard_count = cpus < 1 ? 1 : (cpus > MAX_HOLD_SHARDS ? MAX_HOLD_SHARDS : cpus);
+    int capacity = (MAX_HELD_MESSAGES + hold_shard_count - 1) / hold_shard_count;
+    
+    for (int i = 0; i < hold_shard_count; i++) {
+        if (init_hold_shard(&hold_shards[i], i, capacity) != 0) {
+            fprintf(stderr, "No memory for hold shards\n");
+            exit(1);
+        }
+    }
+    
+    for (int i = 0; i < hold_shard_count; i++) {
+        hold_shard_t* shard = &hold_shards[i];
+        pthread_create(&shard->tid, NULL, shard_thread, shard);
+        
+        cpu_set_t cpus_allowed;
+        CPU_ZERO(&cpus_allowed);
+        CPU_SET(i, &cpus_allowed);
+        pthread_setaffinity_np(shard->tid, sizeof(cpus_allowed), &cpus_allowed);
+    }
+}
+
+void* shard_thread(void* arg) {
+    hold_shard_t* shard = arg;
+    time_t last_cleanup = time(NULL);
+    int wait_ms = 1000;
+    
+    while (running) {
+        // Sleep up to a second, or until a lingering batch is due; posted
+        // work and finished sends wake us early
+        wait_for_shard(shard, wait_ms);
+        
+        // Apply what other threads sent us, then what the workers reported
+        drain_shard_inbox(shard);
+        drain_delivery_completions(shard);
+        
+        // Resend deliveries whose acknowledgement is overdue
+        check_ack_timeouts(shard);
+        
+        // Hand due held messages to the delivery workers
+        wait_ms = schedule_due_deliveries(shard);
+        
+        time_t now = time(NULL);
+        if (now - last_cleanup >= 30) {
+            cleanup_expired_messages(shard);
+            last_cleanup = now;
+        }
+    }
+    
+    return NULL;
+}
+
+hold_shard_t* shard_for(othernet_address_t* target) {
+    return &hold_shards[hash_address(target) % hold_shard_count];
+}
+
+shard_work_t* new_shard_work(shard_work_kind_t kind) {
+    shard_work_t* work = calloc(1, sizeof(shard_work_t));
+    if (work) work->kind = kind;
+    return work;
+}
+
+void post_shard_work(hold_shard_t* shard, shard_work_t* work) {
+    shard_work_t* head = atomic_load_explicit(&shard->inbox, memory_order_relaxed);
+    do {
+        work->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&shard->inbox, &head, work,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    kick_shard(shard);
+}
+
+// Posts a copy of work to every shard and frees the original. Only used
+// for kinds that carry no payload or target list.
+void post_all_shards(shard_work_t* work) {
+    for (int i = 0; i < hold_shard_count; i++) {
+        shard_work_t* copy = malloc(sizeof(shard_work_t));
+        if (!copy) continue;
+        *copy = *work;
+        post_shard_work(&hold_shards[i], copy);
+    }
+    free(work);
+}
+
+void free_shard_work(shard_work_t* work) {
+    release_shared_payload(work->payload);
+    free(work->targets);
+    free(work);
+}
+
+void drain_shard_inbox(hold_shard_t* shard) {
+    shard_work_t* stack = atomic_exchange_explicit(&shard->inbox, NULL, memory_order_acquire);
+    shard_work_t* work = NULL;
+    
+    while (stack) {
+        shard_work_t* next = stack->next;
+        stack->next = work;
+        work = stack;
+        stack = next;
+    }
+    
+    while (work) {
+        shard_work_t* next = work->next;
+        switch (work->kind) {
+            case WORK_QUEUE: shard_queue_messages(shard, work); break;
+            case WORK_CONFIRM: apply_delivery_confirm(shard, work); break;
+            case WORK_HOLD: apply_hold_request(shard, work); break;
+            case WORK_RELEASE: apply_hold_release(shard, work); break;
+            case WORK_FRAGMENT_DONE: apply_fragment_done(shard, work); break;
+            case WORK_WAKE: wake_shard_messages(shard, &work->target); break;
+            case WORK_PEER_FAILED: redistribute_shard_messages(shard, work->ip, work->port); break;
+            case WORK_DUMP: print_shard_messages(shard); break;
+            case WORK_SNAPSHOT: snapshot_shard_messages(shard); break;
+        }
+        free_shard_work(work);
+        work = next;
+    }
+}
+
+void kick_shard(hold_shard_t* shard) {
+    pthread_mutex_lock(&shard->wake_mutex);
+    shard->kicked = 1;
+    pthread_cond_signal(&shard->wake_cond);
+    pthread_mutex_unlock(&shard->wake_mutex);
+}
+
+void wait_for_shard(hold_shard_t* shard, int ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    
+    pthread_mutex_lock(&shard->wake_mutex);
+    while (running && !shard->kicked) {
+        if (pthread_cond_timedwait(&shard->wake_cond, &shard->wake_mutex, &deadline) != 0) {
+            break;
+        }
+    }
+    shard->kicked = 0;
+    pthread_mutex_unlock(&shard->wake_mutex);
+}
+
+
+void queue_message_for_holding(othernet_address_t* target, const char* payload, message_priority_t priority) {
+    queue_message_for_targets(target, 1, payload, priority);
+}
+
+// Queues one message for each of count targets. Targets are grouped by
+// shard and each shard gets one work item; all of them share a single
+// copy of the payload until the shards have stored it. Returns the number
+// of targets posted to a shard. Shards work asynchronously, so this is not
+// yet a count of messages held: a shard without room hands its targets
+// off to a holding peer instead.
+int queue_message_for_targets(othernet_address_t* targets, int count, const char* payload,
+                              message_priority_t priority) {
+    shard_work_t* work[MAX_HOLD_SHARDS] = { NULL };
+    int shards_used = 0;
+    size_t payload_len = strlen(payload);
+    
+    if (payload_len > MAX_PAYLOAD) {
+        printf("Message too long (%zu bytes, at most %d)\n", payload_len, MAX_PAYLOAD);
+        return 0;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        hold_shard_t* shard = shard_for(&targets[i]);
+        shard_work_t* w = work[shard->index];
+        if (!w) {
+            w = work[shard->index] = new_shard_work(WORK_QUEUE);
+            if (!w) continue;
+            w->targets = malloc(count * sizeof(othernet_address_t));
+            w->priority = priority;
+            shards_used++;
+        }
+        if (w->targets) w->targets[w->count++] = targets[i];
+    }
+    
+    shared_payload_t* shared = new_shared_payload(payload, payload_len, shards_used);
+    int posted = 0;
+    for (int s = 0; s < hold_shard_count; s++) {
+        if (!work[s]) continue;
+        if (!shared || !work[s]->targets) {
+            free_shard_work(work[s]);
+            release_shared_payload(shared);
+            continue;
+        }
+        work[s]->payload = shared;
+        posted += work[s]->count;
+        post_shard_work(&hold_shards[s], work[s]);
+    }
+    
+    if (posted < count) printf("No memory to hold message\n");
+    return posted;
+}
+
+// A record for a new held message, reusing a finished one before taking
+// one from the unused tail. NULL when the shard is full.
+held_message_t* claim_held_message(hold_shard_t* shard) {
+    held_message_t* msg;
+    if (shard->free_count > 0) {
+        msg = &shard->messages[shard->free_slots[--shard->free_count]];
+    } else if (shard->message_count < shard->message_capacity) {
+        msg = &shard->messages[shard->message_count++];
+    } else {
+        return NULL;
+    }
+    
+    memset(msg, 0, sizeof(*msg));
+    atomic_fetch_add(&held_message_count, 1);
+    return msg;
+}
+
+// Gives a record and its payload back. A delivered id is remembered for a
+// while, so a late copy from another holder is not held all over again.
+void free_held_message(hold_shard_t* shard, held_message_t* msg) {
+    payload_release(shard, msg->payload);
+    if (msg->status == MSG_STATUS_DELIVERED) {
+        shard->delivered_ids[shard->delivered_pos] = msg->message_id;
+        shard->delivered_pos = (shard->delivered_pos + 1) % DELIVERED_HOLD_IDS;
+    }
+    
+    memset(msg, 0, sizeof(*msg));
+    msg->status = MSG_STATUS_FREE;
+    shard->free_slots[shard->free_count++] = msg - shard->messages;
+    atomic_fetch_sub(&held_message_count, 1);
+}
+
+// Shard side of queue_message_for_targets(). The payload is stored once
+// and every held copy shares it; only the delivery state is per target.
+// Targets we have no room for go to holding peers one by one.
+void shard_queue_messages(hold_shard_t* shard, shard_work_t* work) {
+    const char* payload = work->payload->data;
+    size_t payload_len = work->payload->len;
+    int queued = 0;
+    
+    uint32_t handle = 0;
+    if (my_capabilities & CAPABILITY_HOLDING) {
+        handle = payload_store(shard, payload, payload_len);
+        if (!handle) printf("No memory to hold message\n");
+    }
+    
+    time_t now = time(NULL);
+    for (; handle && queued < work->count; queued++) {
+        held_message_t* msg = claim_held_message(shard);
+        if (!msg) break;
+        
+        // Fast lane fallbacks keep the id the target may already have seen
+        msg->message_id = work->message_id ? work->message_id : generate_message_id();
+        msg->target_address = work->targets[queued];
+        msg->sender_address = local_address();
+        msg->priority = work->priority;
+        msg->payload = payload_retain(shard, handle);
+        msg->payload_len = payload_len;
+        
+        msg->created_time = now;
+        msg->last_attempt = 0;
+        msg->next_attempt = now;
+        msg->attempt_count = 0;
+        msg->expires_at = now + 86400; // 24 hours
+        msg->status = MSG_STATUS_QUEUED;
+        msg->seq = 0;
+        msg->ack_deadline = 0;
+        msg->role = HOLD_ROLE_PRIMARY;
+        msg->handoff_flags = 0;
+        msg->replication_pending = 0;
+        for (int r = 0; r < REPLICATION_FACTOR; r++) msg->replicas[r] = -1;
+        standby_note(shard, msg, 1);
+    }
+    
+    // Drop the reference payload_store() gave us; the held copies keep theirs
+    payload_release(shard, handle);
+    
+    // We cannot hold the rest ourselves: make the best holding peer their primary
+    for (int i = queued; i < work->count; i++) {
+        hand_off_message(shard, &work->targets[i], payload, work->priority);
+    }
+}
+
+// Sends a message we cannot hold to a holding peer, which becomes its
+// primary holder. A holder on the reverse path to target is nearer to it
+// than we are; otherwise the best holding peer for target is used.
+int hand_off_message(hold_shard_t* shard, othernet_address_t* target, const char* payload,
+                     message_priority_t priority) {
+    char ip[16];
+    int port = 0;
+    int direct = 1;
+    int hop = route_next_hop(target, ip, &port, &direct);
+    
+    int holds = 0;
+    if (hop >= 0 && !direct) {
+        pthread_mutex_lock(&peers_mutex);
+        holds = hop < peer_count && peers[hop].active && peers[hop].port == port &&
+                strcmp(peers[hop].ip, ip) == 0 && (peers[hop].capabilities & CAPABILITY_HOLDING);
+        pthread_mutex_unlock(&peers_mutex);
+    }
+    if (!holds) {
+        peer_t* holder = find_best_holding_node(target);
+        if (!holder) {
+            printf("No holding node available for message\n");
+            return -1;
+        }
+        strcpy(ip, holder->ip);
+        port = holder->port;
+    }
+    
+    held_message_t handoff;
+    memset(&handoff, 0, sizeof(handoff));
+    handoff.message_id = generate_message_id();
+    handoff.target_address = *target;
+    handoff.sender_address = local_address();
+    handoff.priority = priority;
+    handoff.expires_at = time(NULL) + 86400;
+    
+    delivery_job_t* job = calloc(1, sizeof(delivery_job_t));
+    if (!job) return -1;
+    job->kind = JOB_HANDOFF;
+    job->shard = shard;
+    strcpy(job->ip, ip);
+    job->port = port;
+    job->entries = calloc(1, sizeof(batch_entry_t));
+    
+    format_hold_frame(shard->frame, &handoff, 'p', payload, strlen(payload));
+    if (!job->entries || append_job_frame(job, shard->frame) != 0) {
+        free_delivery_job(job);
+        return -1;
+    }
+    job->entries[0].slot = -1;
+    job->entries[0].peer_index = -1;
+    submit_delivery_jobs(job);
+    return 0;
+}
+
+// Runs on the shard thread. Fills the delivery frame for msg and counts
+// it as in flight; it stays ATTEMPTING until the target returns a
+// DELIVERY_CONFIRM covering it or ACK_TIMEOUT passes.
+void format_delivery_frame(hold_shard_t* shard, held_message_t* msg, delivery_window_t* window,
+                           uint32_t base, protocol_message_t* delivery) {
+    if (msg->seq == 0) {
+        msg->seq = ++window->next_seq;
+        if (msg->seq > shard->seq_high) shard->seq_high = msg->seq;
+        window_add_pending(shard, window, msg - shard->messages);
+    }
+    
+    delivery->type = MSG_TYPE_OTHERNET_MESSAGE;
+    delivery->sender = msg->sender_address;
+    strcpy(delivery->sender_ip, my_ip);
+    delivery->sender_port = my_port;
+    delivery->timestamp = time(NULL);
+    snprintf(delivery->data, sizeof(delivery->data), "dlv:%lu:%u:%u:%u ",
+             msg->message_id, my_epoch, msg->seq, base);
+    append_frame_payload(delivery, payload_data(shard, msg->payload), msg->payload_len);
+    
+    time_t now = time(NULL);
+    msg->status = MSG_STATUS_ATTEMPTING;
+    msg->last_attempt = now;
+    msg->ack_deadline = now + ACK_TIMEOUT;
+    window->in_flight++;
+    window->last_used = now;
+}
+
+// Runs on the shard thread. The target is not reachable: back off.
+void defer_message_delivery(hold_shard_t* shard, held_message_t* msg) {
+    msg->status = MSG_STATUS_HELD;
+    msg->attempt_count++;
+    msg->last_attempt = time(NULL);
+    msg->next_attempt = calculate_next_retry(msg);
+    
+    if (msg->attempt_count >= MAX_RETRIES) {
+        msg->status = MSG_STATUS_FAILED;
+        printf("Message %lu failed after %d attempts\n", msg->message_id, msg->attempt_count);
+    }
+    standby_note(shard, msg, 0);
+}
+
+// Runs on the shard thread. slots holds every due message for one
+// target, most urgent first. Packs as many as the window and the batch
+// size allow into one job, sent over a single connection. A short batch
+// of non-CRASH messages lingers briefly so later sends can join it; the
+// time left is folded into wait_ms.
+delivery_job_t* build_delivery_batch(hold_shard_t* shard, int* slots, int count, long now_ms,
+                                     int* wait_ms) {
+    held_message_t* first = &shard->messages[slots[0]];
+    char ip[16];
+    int port;
+    int route = route_lookup(&first->target_address, ip, &port);
+    delivery_window_t* window = get_delivery_window(shard, &first->target_address);
+    
+    if (route < 0) {
+        for (int i = 0; i < count; i++) {
+            defer_message_delivery(shard, &shard->messages[slots[i]]);
+        }
+        return NULL;
+    }
+    
+    // Every window is busy with another target. That says nothing about
+    // this one, so wait for a window without counting an attempt.
+    if (!window) {
+        time_t retry = time(NULL) + 1;
+        for (int i = 0; i < count; i++) shard->messages[slots[i]].next_attempt = retry;
+        return NULL;
+    }
+    
+    // One batch per target at a time keeps its frames in sequence order
+    if (window->sending) return NULL;
+    
+    int n = DELIVERY_WINDOW_SIZE - window->in_flight;
+    if (n > delivery_batch_size) n = delivery_batch_size;
+    if (n > count) n = count;
+    if (n <= 0) return NULL;
+    
+    if (n == count && n < delivery_batch_size && first->priority != PRIORITY_CRASH &&
+        delivery_linger_ms > 0) {
+        if (window->linger_start == 0) window->linger_start = now_ms;
+        long left = window->linger_start + delivery_linger_ms - now_ms;
+        if (left > 0) {
+            if (left < *wait_ms) *wait_ms = left;
+            return NULL;
+        }
+    }
+    window->linger_start = 0;
+    
+    delivery_job_t* job = calloc(1, sizeof(delivery_job_t));
+    if (!job) return NULL;
+    job->entries = calloc(n, sizeof(batch_entry_t));
+    if (!job->entries) {
+        free_delivery_job(job);
+        return NULL;
+    }
+    
+    job->kind = JOB_DELIVERY;
+    job->shard = shard;
+    job->target = first->target_address;
+    strcpy(job->ip, ip);
+    job->port = port;
+    
+    // New sequence numbers are all above the base, so one base serves the batch
+    protocol_message_t* frame = shard->frame;
+    uint32_t base = delivery_window_base(shard, window);
+    for (int i = 0; i < n; i++) {
+        held_message_t* msg = &shard->messages[slots[i]];
+        format_delivery_frame(shard, msg, window, base, frame);
+        if (append_job_frame(job, frame) != 0) {
+            // Out of memory: the rest stays ATTEMPTING and times out
+            break;
+        }
+        job->entries[i].slot = slots[i];
+        job->entries[i].message_id = msg->message_id;
+        job->entries[i].attempt = msg->attempt_count;
+        job->entries[i].peer_index = -1;
+        job->entries[i].fragment = -1;
+    }
+    window->sending = 1;
+    return job;
+}
+
+// Due messages sort by target, then priority, then age
+static int compare_due_messages(const void* a, const void* b, void* arg) {
+    hold_shard_t* shard = arg;
+    const held_message_t* x = &shard->messages[*(const int*)a];
+    const held_message_t* y = &shard->messages[*(const int*)b];
+    
+    if (x->target_address.realm != y->target_address.realm) {
+        return x->target_address.realm < y->target_address.realm ? -1 : 1;
+    }
+    if (x->target_address.cluster != y->target_address.cluster) {
+        return x->target_address.cluster < y->target_address.cluster ? -1 : 1;
+    }
+    if (x->target_address.node_id != y->target_address.node_id) {
+        return x->target_address.node_id < y->target_address.node_id ? -1 : 1;
+    }
+    if (x->priority != y->priority) return x->priority < y->priority ? -1 : 1;
+    if (x->created_time != y->created_time) return x->created_time < y->created_time ? -1 : 1;
+    return *(const int*)a - *(const int*)b;
+}
+
+// Collect every due message in the shard, group them by target into
+// batches and queue the sends. Returns how many milliseconds the shard
+// may sleep before a lingering batch is due.
+int schedule_due_deliveries(hold_shard_t* shard) {
+    int* due = shard->due;
+    delivery_job_t* jobs = NULL;
+    delivery_job_t** tail = &jobs;
+    int wait_ms = 1000;
+    int due_count = 0;
+    
+    time_t now = time(NULL);
+    
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* msg = &shard->messages[i];
+        
+        // Finished messages give their payload back at once and their
+        // record once no release or hand-off frame is still owed for them
+        if (msg->status == MSG_STATUS_DELIVERED || msg->status == MSG_STATUS_EXPIRED ||
+            msg->status == MSG_STATUS_FAILED) {
+            if (!msg->handoff_flags && !msg->replication_pending) {
+                free_held_message(shard, msg);
+            } else if (msg->payload) {
+                payload_release(shard, msg->payload);
+                msg->payload = 0;
+            }
+            continue;
+        }
+        
+        if (msg->role == HOLD_ROLE_PRIMARY &&
+            (msg->status == MSG_STATUS_HELD || msg->status == MSG_STATUS_QUEUED) &&
+            now >= msg->next_attempt) {
+            due[due_count++] = i;
+        }
+    }
+    qsort_r(due, due_count, sizeof(int), compare_due_messages, shard);
+    
+    long now_ms = current_time_ms();
+    for (int start = 0; start < due_count; ) {
+        othernet_address_t* target = &shard->messages[due[start]].target_address;
+        int end = start + 1;
+        while (end < due_count && addresses_equal(&shard->messages[due[end]].target_address, target)) {
+            end++;
+        }
+        
+        delivery_job_t* job = build_delivery_batch(shard, due + start, end - start, now_ms, &wait_ms);
+        if (job) {
+            *tail = job;
+            tail = &job->next;
+        }
+        start = end;
+    }
+    
+    // Replicate, release and promote copies on other holding nodes
+    *tail = schedule_handoffs(shard);
+    
+    if (jobs) submit_delivery_jobs(jobs);
+    return wait_ms;
+}
+
+void submit_delivery_jobs(delivery_job_t* jobs) {
+    delivery_job_t* last = jobs;
+    while (last->next) last = last->next;
+    
+    pthread_mutex_lock(&job_queue_mutex);
+    if (job_queue_tail) {
+        job_queue_tail->next = jobs;
+    } else {
+        job_queue_head = jobs;
+    }
+    job_queue_tail = last;
+    pthread_cond_broadcast(&job_queue_cond);
+    pthread_mutex_unlock(&job_queue_mutex);
+}
+
+void* delivery_worker(void* arg) {
+    (void)arg;
+
+    while (1) {
+        // Take up to DELIVERY_BATCH jobs in one trip to the queue
+        pthread_mutex_lock(&job_queue_mutex);
+        while (running && !job_queue_head) {
+            pthread_cond_wait(&job_queue_cond, &job_queue_mutex);
+        }
+        if (!job_queue_head) {
+            pthread_mutex_unlock(&job_queue_mutex);
+            break;
+        }
+        
+        delivery_job_t* batch = job_queue_head;
+        delivery_job_t* last = batch;
+        for (int n = 1; n < DELIVERY_BATCH && last->next; n++) {
+            last = last->next;
+        }
+        job_queue_head = last->next;
+        if (!job_queue_head) job_queue_tail = NULL;
+        last->next = NULL;
+        pthread_mutex_unlock(&job_queue_mutex);
+        
+        while (batch) {
+            delivery_job_t* job = batch;
+            batch = batch->next;
+            job->result = send_protocol_wire(job->ip, job->port, job->wire, job->wire_len);
+            push_delivery_completion(job);
+        }
+    }
+    
+    return NULL;
+}
+
+// Lock-free push onto the owning shard's completion stack (any number of
+// workers), then wake the shard
+void push_delivery_completion(delivery_job_t* job) {
+    hold_shard_t* shard = job->shard;
+    delivery_job_t* head = atomic_load_explicit(&shard->completions, memory_order_relaxed);
+    do {
+        job->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&shard->completions, &head, job,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    kick_shard(shard);
+}
+
+// Shard side: take the whole stack in one exchange and apply the
+// results. Sends that succeeded are already ATTEMPTING and simply wait for
+// their ack; failed connects go back on the retry schedule.
+void drain_delivery_completions(hold_shard_t* shard) {
+    delivery_job_t* done = atomic_exchange_explicit(&shard->completions, NULL, memory_order_acquire);
+    
+    while (done) {
+        delivery_job_t* job = done;
+        done = done->next;
+        
+        if (job->kind == JOB_HANDOFF) {
+            drain_handoff_completion(shard, job);
+            free_delivery_job(job);
+            continue;
+        }
+        
+        delivery_window_t* window = get_delivery_window(shard, &job->target);
+        if (window) window->sending = 0;
+        
+        for (int f = 0; f < job->frame_count && job->result != 0; f++) {
+            batch_entry_t* entry = &job->entries[f];
+            held_message_t* msg = &shard->messages[entry->slot];
+            if (msg->message_id != entry->message_id || msg->attempt_count != entry->attempt ||
+                msg->status != MSG_STATUS_ATTEMPTING) {
+                continue;
+            }
+            
+            if (window && window->in_flight > 0) {
+                window->in_flight--;
+            }
+            
+            msg->status = MSG_STATUS_HELD;
+            msg->attempt_count++;
+            msg->next_attempt = calculate_next_retry(msg);
+            
+            if (msg->attempt_count >= MAX_RETRIES) {
+                msg->status = MSG_STATUS_FAILED;
+                printf("Message %lu failed after %d attempts\n", msg->message_id, msg->attempt_count);
+            }
+            standby_note(shard, msg, 0);
+        }
+        
+        free_delivery_job(job);
+    }
+}
+
+void free_delivery_job(delivery_job_t* job) {
+    free(job->wire);
+    free(job->entries);
+    free(job);
+}
+
+static int compare_window_entries(const void* a, const void* b) {
+    uint32_t x = ((const window_entry_t*)a)->seq;
+    uint32_t y = ((const window_entry_t*)b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+// The entry's message still has that number and is owed to the target
+static int window_entry_live(hold_shard_t* shard, delivery_window_t* window, window_entry_t* entry) {
+    held_message_t* msg = &shard->messages[entry->slot];
+    return msg->seq == entry->seq &&
+           (msg->status == MSG_STATUS_ATTEMPTING || msg->status == MSG_STATUS_HELD ||
+            msg->status == MSG_STATUS_QUEUED) &&
+           addresses_equal(&msg->target_address, &window->target);
+}
+
+// Runs on the shard thread. Returns NULL only if every window is busy.
+delivery_window_t* get_delivery_window(hold_shard_t* shard, othernet_address_t* target) {
+    delivery_window_t* free_slot = NULL;
+    delivery_window_t* idle_slot = NULL;
+    
+    for (int i = 0; i < MAX_DELIVERY_WINDOWS; i++) {
+        delivery_window_t* w = &shard->delivery_windows[i];
+        if (w->active && addresses_equal(&w->target, target)) {
+            return w;
+        }
+        if (!w->active) {
+            if (!free_slot) free_slot = w;
+        } else if (w->in_flight == 0 &&
+                   (!idle_slot || w->last_used < idle_slot->last_used)) {
+            idle_slot = w;
+        }
+    }
+    
+    // Reuse the least recently used idle window if the table is full.
+    // New windows start above every sequence number already used so a
+    // target that had an evicted window never mistakes new data for old.
+    delivery_window_t* w = free_slot ? free_slot : idle_slot;
+    if (!w) return NULL;
+    
+    memset(w, 0, sizeof(*w));
+    w->target = *target;
+    w->next_seq = shard->seq_high;
+    w->cum_acked = shard->seq_high;
+    w->last_used = time(NULL);
+    w->active = 1;
+    
+    // Messages still carrying numbers from an evicted window of this
+    // target keep them, so they start the new window's pending run
+    w->pending = shard->window_entries +
+                 (size_t)(w - shard->delivery_windows) * 2 * shard->message_capacity;
+    for (int i = 0; i < shard->message_count; i++) {
+        window_entry_t entry = { i, shard->messages[i].seq };
+        if (entry.seq != 0 && window_entry_live(shard, w, &entry)) {
+            w->pending[w->pending_count++] = entry;
+        }
+    }
+    qsort(w->pending, w->pending_count, sizeof(window_entry_t), compare_window_entries);
+    return w;
+}
+
+// Runs when the message in slot gets its sequence number. A full run is
+// compacted to its live entries first; those are at most one per record,
+// so there is always room again.
+void window_add_pending(hold_shard_t* shard, delivery_window_t* window, int slot) {
+    if (window->pending_head + window->pending_count == 2 * shard->message_capacity) {
+        int live = 0;
+        for (int i = 0; i < window->pending_count; i++) {
+            window_entry_t* entry = &window->pending[window->pending_head + i];
+            if (window_entry_live(shard, window, entry)) window->pending[live++] = *entry;
+        }
+        window->pending_head = 0;
+        window->pending_count = live;
+    }
+    
+    window_entry_t* entry = &window->pending[window->pending_head + window->pending_count++];
+    entry->slot = slot;
+    entry->seq = shard->messages[slot].seq;
+}
+
+// Lowest sequence number we may still send to this target. The receiver
+// treats everything below it as settled, so abandoned messages never leave
+// a permanent hole in its cumulative ack.
+uint32_t delivery_window_base(hold_shard_t* shard, delivery_window_t* window) {
+    while (window->pending_count > 0 &&
+           !window_entry_live(shard, window, &window->pending[window->pending_head])) {
+        window->pending_head++;
+        window->pending_count--;
+    }
+    
+    if (window->pending_count == 0) return window->next_seq + 1;
+    return window->pending[window->pending_head].seq;
+}
+
+// Target side: show the message once, and always answer with our
+// cumulative/selective ack so lost confirms are repaired by the resend.
+void handle_delivery_message(protocol_message_t* msg, const char* from_ip) {
+    uint64_t message_id;
+    uint32_t epoch, seq, base;
+    int offset = 0;
+    
+    if (sscanf(msg->data, "dlv:%lu:%u:%u:%u %n", &message_id, &epoch, &seq, &base, &offset) != 4 ||
+        offset == 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&receive_mutex);
+    
+    receive_window_t* rw = NULL;
+    receive_window_t* oldest = &receive_windows[0];
+    for (int i = 0; i < MAX_RECEIVE_WINDOWS; i++) {
+        receive_window_t* w = &receive_windows[i];
+        if (w->active && strcmp(w->ip, from_ip) == 0 && w->port == msg->sender_port) {
+            rw = w;
+            break;
+        }
+        if (!w->active || (oldest->active && w->last_seen < oldest->last_seen)) {
+            oldest = w;
+        }
+    }
+    if (!rw || rw->epoch != epoch) {
+        if (!rw) rw = oldest;
+        memset(rw, 0, sizeof(*rw));
+        strncpy(rw->ip, from_ip, sizeof(rw->ip) - 1);
+        rw->port = msg->sender_port;
+        rw->epoch = epoch;
+        rw->active = 1;
+    }
+    rw->last_seen = time(NULL);
+    
+    // Sender will never resend anything below base
+    while (rw->cum_received + 1 < base) {
+        rw->cum_received++;
+        rw->sack_mask >>= 1;
+    }
+    
+    int duplicate = 1;
+    if (seq > rw->cum_received) {
+        uint32_t offset_bit = seq - rw->cum_received - 1;
+        if (offset_bit >= 64 || !(rw->sack_mask & (1ULL << offset_bit))) {
+            duplicate = 0;
+            if (offset_bit < 64) rw->sack_mask |= 1ULL << offset_bit;
+        }
+        while (rw->sack_mask & 1) {
+            rw->cum_received++;
+            rw->sack_mask >>= 1;
+        }
+    }
+    
+    // Another holder may already have delivered this message to us
+    if (!duplicate) {
+        for (int i = 0; i < RECENT_DELIVERY_IDS; i++) {
+            if (recent_delivery_ids[i] == message_id) {
+                duplicate = 1;
+                break;
+            }
+        }
+        if (!duplicate) {
+            recent_delivery_ids[recent_delivery_pos] = message_id;
+            recent_delivery_pos = (recent_delivery_pos + 1) % RECENT_DELIVERY_IDS;
+        }
+    }
+    
+    // Fragments are only shown once enough of them rebuild the message
+    char* rebuilt = NULL;
+    const char* text = msg->data + offset;
+    othernet_address_t* author = &msg->sender;
+    if (!duplicate && strncmp(text, "frag:", 5) == 0) {
+        uint64_t original_id;
+        duplicate = 1;
+        rebuilt = malloc(MAX_PAYLOAD + 1);
+        if (rebuilt && assemble_fragment(msg, text, rebuilt, MAX_PAYLOAD + 1, &original_id)) {
+            duplicate = 0;
+            for (int i = 0; i < RECENT_DELIVERY_IDS; i++) {
+                if (recent_delivery_ids[i] == original_id) duplicate = 1;
+            }
+            recent_delivery_ids[recent_delivery_pos] = original_id;
+            recent_delivery_pos = (recent_delivery_pos + 1) % RECENT_DELIVERY_IDS;
+            text = rebuilt;
+        }
+    }
+    
+    // Acknowledged by flush_delivery_acks() once the batch is in
+    rw->ack_pending = 1;
+    rw->ack_message_id = message_id;
+    
+    pthread_mutex_unlock(&receive_mutex);
+    
+    if (!duplicate) {
+        printf("\n[MESSAGE from ");
+        print_othernet_address(author);
+        printf("] %s\n> ", text);
+        fflush(stdout);
+    }
+    free(rebuilt);
+}
+
+// Sends one DELIVERY_CONFIRM per sender that has unacknowledged deliveries.
+// The cumulative and selective parts cover the rest of its batch.
+void flush_delivery_acks() {
+    char acks[MAX_RECEIVE_WINDOWS][96];
+    char ips[MAX_RECEIVE_WINDOWS][16];
+    int ports[MAX_RECEIVE_WINDOWS];
+    int count = 0;
+    
+    pthread_mutex_lock(&receive_mutex);
+    for (int i = 0; i < MAX_RECEIVE_WINDOWS; i++) {
+        receive_window_t* rw = &receive_windows[i];
+        if (!rw->active || !rw->ack_pending) continue;
+        
+        snprintf(acks[count], sizeof(acks[count]), "ack:%lu:%u:%u:%lx",
+                 rw->ack_message_id, rw->epoch, rw->cum_received, (unsigned long)rw->sack_mask);
+        strcpy(ips[count], rw->ip);
+        ports[count] = rw->port;
+        count++;
+        rw->ack_pending = 0;
+    }
+    pthread_mutex_unlock(&receive_mutex);
+    
+    if (count == 0) return;
+    
+    protocol_message_t* confirm = malloc(sizeof(protocol_message_t));
+    if (!confirm) return;
+    memset(confirm, 0, offsetof(protocol_message_t, data));
+    confirm->type = MSG_TYPE_DELIVERY_CONFIRM;
+    confirm->sender = local_address();
+    strcpy(confirm->sender_ip, my_ip);
+    confirm->sender_port = my_port;
+    confirm->timestamp = time(NULL);
+    for (int i = 0; i < count; i++) {
+        strcpy(confirm->data, acks[i]);
+        send_protocol_message(ips[i], ports[i], confirm);
+    }
+    free(confirm);
+}
+
+// Sender side: settle the acked message_id plus everything the
+// cumulative and selective parts of the ack cover for that target. The
+// target's messages all live in one shard, so the ack goes there.
+void handle_delivery_confirm(protocol_message_t* msg) {
+    uint64_t message_id;
+    uint32_t epoch, cum;
+    unsigned long sack;
+    
+    if (sscanf(msg->data, "ack:%lu:%u:%u:%lx", &message_id, &epoch, &cum, &sack) != 4 ||
+        epoch != my_epoch) {
+        return;
+    }
+    
+    shard_work_t* work = new_shard_work(WORK_CONFIRM);
+    if (!work) return;
+    work->target = msg->sender;
+    work->message_id = message_id;
+    work->cum = cum;
+    work->sack = sack;
+    post_shard_work(shard_for(&msg->sender), work);
+}
+
+void apply_delivery_confirm(hold_shard_t* shard, shard_work_t* work) {
+    delivery_window_t* window = NULL;
+    for (int i = 0; i < MAX_DELIVERY_WINDOWS; i++) {
+        if (shard->delivery_windows[i].active &&
+            addresses_equal(&shard->delivery_windows[i].target, &work->target)) {
+            window = &shard->delivery_windows[i];
+            break;
+        }
+    }
+    if (window && work->cum > window->cum_acked && work->cum <= window->next_seq) {
+        window->cum_acked = work->cum;
+    }
+    
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* held = &shard->messages[i];
+        if (held->status == MSG_STATUS_DELIVERED || held->seq == 0 ||
+            !addresses_equal(&held->target_address, &work->target)) {
+            continue;
+        }
+        
+        int acked = held->message_id == work->message_id || held->seq <= work->cum;
+        if (!acked && held->seq > work->cum && held->seq - work->cum - 1 < 64) {
+            acked = (work->sack >> (held->seq - work->cum - 1)) & 1;
+        }
+        if (!acked) continue;
+        
+        if (held->status == MSG_STATUS_ATTEMPTING && window && window->in_flight > 0) {
+            window->in_flight--;
+        }
+        held->status = MSG_STATUS_DELIVERED;
+        held->handoff_flags |= HANDOFF_RELEASE;
+        if (held->is_fragment && held->holding_node_port) {
+            held->handoff_flags |= HANDOFF_FRAGMENT_DONE;
+        }
+        standby_note(shard, held, 0);
+        printf("Message %lu delivered to ", held->message_id);
+        print_othernet_address(&held->target_address);
+        printf("\n");
+    }
+}
+
+// Deliveries whose confirm never came back go back to the retry path.
+// This is the only place a sent message gets retransmitted.
+void check_ack_timeouts(hold_shard_t* shard) {
+    time_t now = time(NULL);
+    
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* msg = &shard->messages[i];
+        if (msg->status != MSG_STATUS_ATTEMPTING || now < msg->ack_deadline) {
+            continue;
+        }
+        
+        delivery_window_t* window = get_delivery_window(shard, &msg->target_address);
+        if (window && window->in_flight > 0) {
+            window->in_flight--;
+        }
+        
+        msg->attempt_count++;
+        msg->status = MSG_STATUS_HELD;
+        msg->next_attempt = now;
+        
+        if (msg->attempt_count >= MAX_RETRIES) {
+            msg->status = MSG_STATUS_FAILED;
+            printf("Message %lu unacknowledged after %d attempts\n",
+                   msg->message_id, msg->attempt_count);
+        }
+        standby_note(shard, msg, 0);
+    }
+}
+
+// Caller holds peers_mutex. Finds another active peer with the address of
+// peer index, which a standby has taken over from it.
+static int find_moved_address(int index, char* ip, int* port) {
+    for (int i = 0; i < peer_count; i++) {
+        if (i != index && peers[i].active && addresses_equal(&peers[i].address, &peers[index].address)) {
+            strcpy(ip, peers[i].ip);
+            *port = peers[i].port;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 if the peer was new or had been marked inactive
+int add_peer(const char* ip, int port, othernet_address_t* addr, uint32_t capabilities) {
+    int is_new = 0;
+    int moved = 0;
+    char moved_ip[16];
+    int moved_port = 0;
+    
+    pthread_mutex_lock(&peers_mutex);
+    
+    // Check if peer already exists
+    for (int i = 0; i < peer_count; i++) {
+        if (strcmp(peers[i].ip, ip) == 0 && peers[i].port == port) {
+            is_new = !peers[i].active;
+            
+            // A standby that took over another node's address speaks for it now
+            if (!addresses_equal(&peers[i].address, addr)) {
+                route_cache_invalidate(i, NULL);
+                peers[i].address = *addr;
+                is_new = 1;
+            }
+            int ring_changed = is_new || peers[i].capabilities != capabilities;
+            peers[i].active = 1;
+            peers[i].last_seen = time(NULL);
+            peers[i].capabilities = capabilities;
+            if (is_new) {
+                route_cache_invalidate(-1, &peers[i].address);
+                peers[i].in_view = 0;
+                peers[i].lazy = 0;
+                peers[i].view_retry_ms = 0;
+            }
+            if (ring_changed) rebuild_holding_ring();
+            update_holding_candidate(i);
+            moved = find_moved_address(i, moved_ip, &moved_port);
+            pthread_mutex_unlock(&peers_mutex);
+            if (moved) remove_peer(moved_ip, moved_port);
+            return is_new;
+        }
+    }
+    
+    // Add new peer
+    if (peer_count < MAX_PEERS) {
+        peer_t* peer = &peers[peer_count++];
+        strcpy(peer->ip, ip);
+        peer->port = port;
+        peer->address = *addr;
+        peer->capabilities = capabilities;
+        peer->load_factor = 0.0;
+        peer->uptime = 0;
+        memset(peer->topic_filter, 0, sizeof(peer->topic_filter));
+        peer->in_view = 0;
+        peer->lazy = 0;
+        peer->view_retry_ms = 0;
+        peer->last_seen = time(NULL);
+        peer->active = 1;
+        for (int level = 0; level < HOLDING_HEAP_LEVELS; level++) {
+            peer->heap_index[level] = -1;
+            peer->heap_pos[level] = -1;
+        }
+        is_new = 1;
+        route_cache_invalidate(-1, addr);
+        rebuild_holding_ring();
+        update_holding_candidate(peer_count - 1);
+        
+        printf("Added peer: ");
+        print_othernet_address(addr);
+        printf(" at %s:%d\n", ip, port);
+        moved = find_moved_address(peer_count - 1, moved_ip, &moved_port);
+    }
+    
+    pthread_mutex_unlock(&peers_mutex);
+    if (moved) remove_peer(moved_ip, moved_port);
+    return is_new;
+}
+
+peer_t* find_peer_by_address(othernet_address_t* addr) {
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].active &&
+            peers[i].address.realm == addr->realm &&
+            peers[i].address.cluster == addr->cluster &&
+            peers[i].address.node_id == addr->node_id) {
+            return &peers[i];
+        }
+    }
+    return NULL;
+}
+
+// Epidemic broadcast tree (Plumtree) over a HyParView-style active view.
+// Only up to GOSSIP_ACTIVE_VIEW peers take part in broadcasts; the rest
+// are passive, and the view is topped up from them when a member leaves
+// or refuses us. A peer asked in with "neighbor:" accepts when it has
+// room, or evicts one of its own when we have no view at all, so nobody
+// is left out. A broadcast is pushed in full to eager view members and
+// announced by id to lazy ones in an IHAVE sent at the same time. Every
+// link starts eager; a node that gets a message twice prunes the later
+// sender to lazy, so the eager links settle into a spanning tree. An
+// IHAVE for a message that does not arrive within GOSSIP_GRAFT_TIMEOUT_MS
+// grafts its announcer back to eager and pulls the message, which repairs
+// the tree when an eager peer goes away.
+
+// Caller holds peers_mutex
+static int find_peer_index(const char* ip, int port) {
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].port == port && strcmp(peers[i].ip, ip) == 0) return i;
+    }
+    return -1;
+}
+
+static void send_gossip_control(const char* ip, int port, const char* data) {
+    protocol_message_t* frame = malloc(sizeof(protocol_message_t));
+    if (!frame) return;
+    
+    memset(frame, 0, offsetof(protocol_message_t, data));
+    frame->type = MSG_TYPE_OTHERNET_MESSAGE;
+    frame->sender = local_address();
+    strcpy(frame->sender_ip, my_ip);
+    frame->sender_port = my_port;
+    frame->timestamp = time(NULL);
+    snprintf(frame->data, sizeof(frame->data), "%s", data);
+    send_protocol_message(ip, port, frame);
+    free(frame);
+}
+
+// Caller holds gossip_mutex
+static gossip_entry_t* find_gossip(uint64_t id) {
+    for (int i = 0; i < GOSSIP_CACHE; i++) {
+        if (gossip_cache[i].text && gossip_cache[i].id == id) return &gossip_cache[i];
+    }
+    return NULL;
+}
+
+// Keeps a delivered broadcast so GRAFTs can pull it, and stops waiting for it
+static void remember_gossip(uint64_t id, othernet_address_t* origin, const char* text) {
+    char* copy = strdup(text);
+    if (!copy) return;
+    
+    pthread_mutex_lock(&gossip_mutex);
+    gossip_entry_t* entry = &gossip_cache[gossip_cache_pos];
+    gossip_cache_pos = (gossip_cache_pos + 1) % GOSSIP_CACHE;
+    free(entry->text);
+    entry->id = id;
+    entry->origin = *origin;
+    entry->text = copy;
+    
+    for (int i = 0; i < GOSSIP_MISSING; i++) {
+        if (gossip_missing[i].active && gossip_missing[i].id == id) gossip_missing[i].active = 0;
+    }
+    pthread_mutex_unlock(&gossip_mutex);
+}
+
+// Sends the frame in full to the eager members of the active view and an
+// IHAVE for it to the lazy ones, skipping the peer it came from and its
+// origin. However many peers we know, this is at most GOSSIP_ACTIVE_VIEW
+// frames.
+static void gossip_push(protocol_message_t* frame, uint64_t id, int from) {
+    char ips[MAX_PEERS][16];
+    int ports[MAX_PEERS];
+    int lazy[MAX_PEERS];
+    int count = 0;
+    
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < peer_count; i++) {
+        peer_t* peer = &peers[i];
+        if (!peer->active || !peer->in_view || i == from ||
+            addresses_equal(&peer->address, &frame->sender)) continue;
+        strcpy(ips[count], peer->ip);
+        ports[count] = peer->port;
+        lazy[count] = peer->lazy;
+        count++;
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    char ihave[32];
+    snprintf(ihave, sizeof(ihave), "ihave:%lx", id);
+    for (int i = 0; i < count; i++) {
+        if (lazy[i]) send_gossip_control(ips[i], ports[i], ihave);
+        else send_protocol_message(ips[i], ports[i], frame);
+    }
+}
+
+// Caller holds peers_mutex
+static int gossip_view_size() {
+    int size = 0;
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].active && peers[i].in_view) size++;
+    }
+    return size;
+}
+
+// Caller holds peers_mutex. A peer that refused or left our view is not
+// asked back for GOSSIP_VIEW_RETRY_MS.
+static void gossip_view_drop(int index) {
+    peers[index].in_view = 0;
+    peers[index].lazy = 0;
+    peers[index].view_retry_ms = current_time_ms() + GOSSIP_VIEW_RETRY_MS;
+}
+
+// Marks the peer at ip:port lazy, or eager. A peer outside the view is
+// only made eager, and so taken into the view, while there is room.
+static void set_peer_lazy(const char* ip, int port, int lazy) {
+    pthread_mutex_lock(&peers_mutex);
+    int index = find_peer_index(ip, port);
+    if (index >= 0 && !peers[index].in_view && !lazy && gossip_view_size() < GOSSIP_ACTIVE_VIEW) {
+        peers[index].in_view = 1;
+    }
+    if (index >= 0 && peers[index].in_view) peers[index].lazy = lazy;
+    pthread_mutex_unlock(&peers_mutex);
+}
+
+void gossip_broadcast(const char* text) {
+    protocol_message_t* frame = malloc(sizeof(protocol_message_t));
+    if (!frame) return;
+    
+    memset(frame, 0, offsetof(protocol_message_t, data));
+    frame->type = MSG_TYPE_OTHERNET_MESSAGE;
+    frame->sender = local_address();
+    strcpy(frame->sender_ip, my_ip);
+    frame->sender_port = my_port;
+    frame->timestamp = time(NULL);
+    
+    struct { othernet_address_t addr; uint32_t epoch; uint32_t seq; } key;
+    memset(&key, 0, sizeof(key));
+    key.addr = local_address();
+    key.epoch = my_epoch;
+    key.seq = atomic_fetch_add(&publish_seq, 1) | 0x40000000u;
+    uint64_t id = hash_bytes(&key, sizeof(key), 0) | 1;
+    announcement_seen(id);
+    remember_gossip(id, &key.addr, text);
+    
+    snprintf(frame->data, sizeof(frame->data), "gsp:%llx %s", (unsigned long long)id, text);
+    gossip_push(frame, id, -1);
+    free(frame);
+}
+
+// A broadcast in full. The first copy is shown and pushed on; a later copy
+// means the link it came over is redundant, so we prune it.
+void handle_gossip(protocol_message_t* msg, const char* from_ip) {
+    unsigned long long id;
+    int offset = 0;
+    
+    if (sscanf(msg->data, "gsp:%llx %n", &id, &offset) != 1 || offset == 0) return;
+    
+    int from_port = msg->sender_port;
+    pthread_mutex_lock(&peers_mutex);
+    int from = find_peer_index(from_ip, from_port);
+    pthread_mutex_unlock(&peers_mutex);
+    
+    othernet_address_t self = local_address();
+    if (addresses_equal(&msg->sender, &self) || announcement_seen(id)) {
+        set_peer_lazy(from_ip, from_port, 1);
+        send_gossip_control(from_ip, from_port, "prune:");
+        return;
+    }
+    
+    // Whoever delivered it first is on the tree
+    set_peer_lazy(from_ip, from_port, 0);
+    remember_gossip(id, &msg->sender, msg->data + offset);
+    
+    printf("\n[MESSAGE from ");
+    print_othernet_address(&msg->sender);
+    printf("] %s\n> ", msg->data + offset);
+    fflush(stdout);
+    
+    // Forwarders put themselves in sender_ip/port; sender stays the origin
+    strcpy(msg->sender_ip, my_ip);
+    msg->sender_port = my_port;
+    gossip_push(msg, id, from);
+}
+
+// Ids a lazy peer has: start a graft timer for each one we are missing
+void handle_ihave(protocol_message_t* msg, const char* from_ip) {
+    pthread_mutex_lock(&peers_mutex);
+    int from = find_peer_index(from_ip, msg->sender_port);
+    pthread_mutex_unlock(&peers_mutex);
+    if (from < 0) return;
+    
+    long now_ms = current_time_ms();
+    const char* p = msg->data + 6;
+    unsigned long long id;
+    int used;
+    
+    while (sscanf(p, "%llx%n", &id, &used) == 1) {
+        p += used;
+        if (*p == ',') p++;
+        if (announcement_known(id)) continue;
+        
+        pthread_mutex_lock(&gossip_mutex);
+        gossip_missing_t* missing = NULL;
+        gossip_missing_t* free_slot = NULL;
+        for (int i = 0; i < GOSSIP_MISSING; i++) {
+            if (gossip_missing[i].active && gossip_missing[i].id == id) missing = &gossip_missing[i];
+            else if (!gossip_missing[i].active && !free_slot) free_slot = &gossip_missing[i];
+        }
+        if (!missing && free_slot) {
+            missing = free_slot;
+            missing->active = 1;
+            missing->id = id;
+            missing->announcer_count = 0;
+            missing->deadline_ms = now_ms + GOSSIP_GRAFT_TIMEOUT_MS;
+        }
+        if (missing && missing->announcer_count < GOSSIP_ANNOUNCERS) {
+            missing->announcers[missing->announcer_count++] = from;
+        }
+        pthread_mutex_unlock(&gossip_mutex);
+    }
+}
+
+// A peer wants a broadcast we announced: it joins our eager set and gets
+// the message if we still have it
+void handle_graft(protocol_message_t* msg, const char* from_ip) {
+    unsigned long long id;
+    if (sscanf(msg->data, "graft:%llx", &id) != 1) return;
+    
+    set_peer_lazy(from_ip, msg->sender_port, 0);
+    
+    protocol_message_t* frame = malloc(sizeof(protocol_message_t));
+    if (!frame) return;
+    
+    pthread_mutex_lock(&gossip_mutex);
+    gossip_entry_t* entry = find_gossip(id);
+    if (entry) {
+        memset(frame, 0, offsetof(protocol_message_t, data));
+        frame->type = MSG_TYPE_OTHERNET_MESSAGE;
+        frame->sender = entry->origin;
+        snprintf(frame->data, sizeof(frame->data), "gsp:%llx %s", id, entry->text);
+    }
+    pthread_mutex_unlock(&gossip_mutex);
+    
+    if (entry) {
+        strcpy(frame->sender_ip, my_ip);
+        frame->sender_port = my_port;
+        frame->timestamp = time(NULL);
+        send_protocol_message(from_ip, msg->sender_port, frame);
+    }
+    free(frame);
+}
+
+// The sender already gets our broadcasts another way
+void handle_prune(protocol_message_t* msg, const char* from_ip) {
+    set_peer_lazy(from_ip, msg->sender_port, 1);
+}
+
+// A peer asks into our active view; "neighbor:1" when its view is empty
+void handle_neighbor(protocol_message_t* msg, const char* from_ip) {
+    int priority = 0;
+    char evict_ip[16];
+    int evict_port = 0;
+    int accepted = 0;
+    sscanf(msg->data, "neighbor:%d", &priority);
+    
+    pthread_mutex_lock(&peers_mutex);
+    int from = find_peer_index(from_ip, msg->sender_port);
+    if (from >= 0 && peers[from].active) {
+        int size = gossip_view_size();
+        if (!peers[from].in_view && size >= GOSSIP_ACTIVE_VIEW && priority) {
+            // Make room: one random member goes back to the passive peers
+            int pick = rand_r(&holding_choice_seed) % size;
+            for (int i = 0; i < peer_count; i++) {
+                if (!peers[i].active || !peers[i].in_view || pick-- > 0) continue;
+                strcpy(evict_ip, peers[i].ip);
+                evict_port = peers[i].port;
+                gossip_view_drop(i);
+                size--;
+                break;
+            }
+        }
+        if (peers[from].in_view || size < GOSSIP_ACTIVE_VIEW) {
+            if (!peers[from].in_view) peers[from].lazy = 0;
+            peers[from].in_view = 1;
+            accepted = 1;
+        }
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    if (evict_port) send_gossip_control(evict_ip, evict_port, "disconnect:");
+    if (!accepted) send_gossip_control(from_ip, msg->sender_port, "disconnect:");
+}
+
+// The sender refused us or dropped us from its view; we drop it from ours
+void handle_disconnect(protocol_message_t* msg, const char* from_ip) {
+    pthread_mutex_lock(&peers_mutex);
+    int index = find_peer_index(from_ip, msg->sender_port);
+    if (index >= 0) gossip_view_drop(index);
+    pthread_mutex_unlock(&peers_mutex);
+}
+
+// Runs once a second on the maintenance thread: asks one passive peer
+// into the active view while it has room, and grafts towards announcers
+// of messages that never came
+void gossip_tick() {
+    char neighbor_ip[16];
+    int neighbor_port = 0;
+    int neighbor_priority = 0;
+    char graft_ips[GOSSIP_MISSING][16];
+    int graft_ports[GOSSIP_MISSING];
+    uint64_t graft_ids[GOSSIP_MISSING];
+    int grafts = 0;
+    long now_ms = current_time_ms();
+    
+    pthread_mutex_lock(&peers_mutex);
+    int size = gossip_view_size();
+    if (size < GOSSIP_ACTIVE_VIEW) {
+        int candidates = 0;
+        for (int i = 0; i < peer_count; i++) {
+            if (peers[i].active && !peers[i].in_view && peers[i].view_retry_ms <= now_ms) candidates++;
+        }
+        int pick = candidates ? rand_r(&holding_choice_seed) % candidates : -1;
+        for (int i = 0; pick >= 0 && i < peer_count; i++) {
+            if (!peers[i].active || peers[i].in_view || peers[i].view_retry_ms > now_ms) continue;
+            if (pick-- > 0) continue;
+            
+            // Counted in right away; a refusal takes it out again
+            peers[i].in_view = 1;
+            peers[i].lazy = 0;
+            strcpy(neighbor_ip, peers[i].ip);
+            neighbor_port = peers[i].port;
+            neighbor_priority = size == 0;
+            break;
+        }
+    }
+    
+    pthread_mutex_lock(&gossip_mutex);
+
+    for (int m = 0; m < GOSSIP_MISSING; m++) {
+        gossip_missing_t* missing = &gossip_missing[m];
+        if (!missing->active || missing->deadline_ms > now_ms) continue;
+        
+        // Try the announcers in turn until one of them delivers
+        if (missing->announcer_count == 0) {
+            missing->active = 0;
+            continue;
+        }
+        int peer = missing->announcers[0];
+        missing->announcer_count--;
+        memmove(missing->announcers, missing->announcers + 1,
+                missing->announcer_count * sizeof(int));
+        missing->deadline_ms = now_ms + GOSSIP_GRAFT_TIMEOUT_MS;
+        if (!peers[peer].active) continue;
+        
+        if (!peers[peer].in_view && gossip_view_size() < GOSSIP_ACTIVE_VIEW) peers[peer].in_view = 1;
+        if (peers[peer].in_view) peers[peer].lazy = 0;
+        strcpy(graft_ips[grafts], peers[peer].ip);
+        graft_ports[grafts] = peers[peer].port;
+        graft_ids[grafts] = missing->id;
+        grafts++;
+    }
+    pthread_mutex_unlock(&gossip_mutex);
+    pthread_mutex_unlock(&peers_mutex);
+    
+    if (neighbor_port) {
+        char neighbor[32];
+        snprintf(neighbor, sizeof(neighbor), "neighbor:%d", neighbor_priority);
+        send_gossip_control(neighbor_ip, neighbor_port, neighbor);
+    }
+    for (int i = 0; i < grafts; i++) {
+        char graft[32];
+        snprintf(graft, sizeof(graft), "graft:%lx", graft_ids[i]);
+        send_gossip_control(graft_ips[i], graft_ports[i], graft);
+    }
+}
+
+// Topic subscriptions. Each node advertises the topics it subscribes to
+// as a small Bloom filter in its HELLO and capability updates, followed by
+// one filter per further hop with the topics its peers reach one hop less
+// far. A published message only goes to peers whose filters show interest
+// within the hops it has left, and each of those passes it on the same
+// way, so a node's traffic follows the interest around it rather than the
+// size of the network. A false positive costs one unwanted frame that the
+// receiver forwards but does not show.
+static void topic_filter_bits(const char* topic, uint32_t bits[TOPIC_FILTER_HASHES]) {
+    uint64_t h = hash_bytes(topic, strlen(topic), 0);
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    for (int i = 0; i < TOPIC_FILTER_HASHES; i++) {
+        bits[i] = (h1 + i * h2) % TOPIC_FILTER_BITS;
+    }
+}
+
+int topic_filter_match(const uint64_t* filter, const char* topic) {
+    uint32_t bits[TOPIC_FILTER_HASHES];
+    topic_filter_bits(topic, bits);
+    for (int i = 0; i < TOPIC_FILTER_HASHES; i++) {
+        if (!(filter[bits[i] / 64] & (1ULL << (bits[i] % 64)))) return 0;
+    }
+    return 1;
+}
+
+// Caller holds topics_mutex. Bloom filters cannot forget a topic, so the
+// filter is rebuilt from the list after every change.
+static void rebuild_topic_filter() {
+    memset(my_topic_filter, 0, sizeof(my_topic_filter));
+    for (int t = 0; t < my_topic_count; t++) {
+        uint32_t bits[TOPIC_FILTER_HASHES];
+        topic_filter_bits(my_topics[t], bits);
+        for (int i = 0; i < TOPIC_FILTER_HASHES; i++) {
+            my_topic_filter[bits[i] / 64] |= 1ULL << (bits[i] % 64);
+        }
+    }
+}
+
+// Writes the topics: field of HELLO and capability updates as hex: our
+// own filter, then for each further hop the union of what our peers reach
+// one hop less far. A level is only ever built from the level below it,
+// so interest that goes away drains out within PUBLISH_HOPS updates
+// instead of circling between peers. out needs TOPIC_FILTER_HEX bytes.
+void format_topic_filter(char* out) {
+    uint64_t filter[PUBLISH_HOPS][TOPIC_FILTER_WORDS];
+    memset(filter, 0, sizeof(filter));
+    
+    pthread_mutex_lock(&topics_mutex);
+    memcpy(filter[0], my_topic_filter, sizeof(my_topic_filter));
+    pthread_mutex_unlock(&topics_mutex);
+    
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < peer_count; i++) {
+        if (!peers[i].active) continue;
+        for (int level = 1; level < PUBLISH_HOPS; level++) {
+            for (int w = 0; w < TOPIC_FILTER_WORDS; w++) {
+                filter[level][w] |= peers[i].topic_filter[level - 1][w];
+            }
+        }
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    for (int level = 0; level < PUBLISH_HOPS; level++) {
+        for (int w = 0; w < TOPIC_FILTER_WORDS; w++) {
+            sprintf(out + (level * TOPIC_FILTER_WORDS + w) * 16, "%016lx", filter[level][w]);
+        }
+    }
+}
+
+// Reads the topics: field of a HELLO or capability update into filter,
+// one filter per hop; hops a node does not advertise are left empty.
+// Returns 0 and leaves filter alone if the frame has no valid field, as
+// from nodes without subscriptions.
+int parse_topic_filter(const char* data, uint64_t (*filter)[TOPIC_FILTER_WORDS]) {
+    uint64_t parsed[PUBLISH_HOPS][TOPIC_FILTER_WORDS];
+    const char* field = strstr(data, " topics:");
+    if (!field) return 0;
+    field += 8;
+    
+    int levels = strspn(field, "0123456789abcdefABCDEF") / (TOPIC_FILTER_WORDS * 16);
+    if (levels < 1) return 0;
+    if (levels > PUBLISH_HOPS) levels = PUBLISH_HOPS;
+    
+    memset(parsed, 0, sizeof(parsed));
+    for (int level = 0; level < levels; level++) {
+        for (int w = 0; w < TOPIC_FILTER_WORDS; w++) {
+            char word[17];
+            memcpy(word, field, 16);
+            word[16] = '\0';
+            parsed[level][w] = strtoull(word, NULL, 16);
+            field += 16;
+        }
+    }
+    memcpy(filter, parsed, sizeof(parsed));
+    return 1;
+}
+
+// Stores the filters a HELLO or capability update from ip:port carried.
+// What a peer reaches feeds what we advertise, so a change there goes out
+// to our own peers at once rather than with the next update round.
+void update_peer_topics(const char* ip, int port, const char* data) {
+    uint64_t filter[PUBLISH_HOPS][TOPIC_FILTER_WORDS];
+    if (!parse_topic_filter(data, filter)) return;
+    
+    int changed = 0;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].port == port && strcmp(peers[i].ip, ip) == 0) {
+            // Its last level is beyond what we advertise
+            changed = memcmp(peers[i].topic_filter, filter,
+                             (PUBLISH_HOPS - 1) * sizeof(filter[0])) != 0;
+            memcpy(peers[i].topic_filter, filter, sizeof(filter));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    if (changed) send_capability_update();
+}
+
+int is_subscribed(const char* topic) {
+    int subscribed = 0;
+    pthread_mutex_lock(&topics_mutex);
+    for (int t = 0; t < my_topic_count && !subscribed; t++) {
+        subscribed = strcmp(my_topics[t], topic) == 0;
+    }
+    pthread_mutex_unlock(&topics_mutex);
+    return subscribed;
+}
+
+// Adds (subscribe = 1) or drops a topic and tells our peers right away
+int set_subscription(const char* topic, int subscribe) {
+    int changed = 0;
+    
+    pthread_mutex_lock(&topics_mutex);
+    int found = -1;
+    for (int t = 0; t < my_topic_count; t++) {
+        if (strcmp(my_topics[t], topic) == 0) found = t;
+    }
+    if (subscribe && found < 0 && my_topic_count < MAX_TOPICS) {
+        snprintf(my_topics[my_topic_count++], TOPIC_LEN, "%s", topic);
+        changed = 1;
+    } else if (!subscribe && found >= 0) {
+        if (found != --my_topic_count) memcpy(my_topics[found], my_topics[my_topic_count], TOPIC_LEN);
+        changed = 1;
+    }
+    if (changed) rebuild_topic_filter();
+    pthread_mutex_unlock(&topics_mutex);
+    
+    if (changed) send_capability_update();
+    return changed;
+}
+
+// Caller holds peers_mutex. Whether peer reaches a subscriber to topic
+// within hops hops, itself being the first.
+static int peer_reaches_topic(peer_t* peer, const char* topic, int hops) {
+    if (hops > PUBLISH_HOPS) hops = PUBLISH_HOPS;
+    for (int level = 0; level < hops; level++) {
+        if (topic_filter_match(peer->topic_filter[level], topic)) return 1;
+    }
+    return 0;
+}
+
+// Sends frame to every active peer that reaches the topic's subscribers in
+// the hops frame has left, except the one it came from and its publisher.
+// Returns the number of peers.
+int send_to_topic_peers(protocol_message_t* frame, const char* topic,
+                        const char* skip_ip, int skip_port) {
+    char ips[MAX_PEERS][16];
+    int ports[MAX_PEERS];
+    int count = 0;
+    
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < peer_count; i++) {
+        peer_t* peer = &peers[i];
+        if (!peer->active || !peer_reaches_topic(peer, topic, frame->ttl)) continue;
+        if (addresses_equal(&peer->address, &frame->sender)) continue;
+        if (skip_ip && peer->port == skip_port && strcmp(peer->ip, skip_ip) == 0) continue;
+        strcpy(ips[count], peer->ip);
+        ports[count] = peer->port;
+        count++;
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    for (int i = 0; i < count; i++) {
+        send_protocol_message(ips[i], ports[i], frame);
+    }
+    return count;
+}
+
+int publish_message(const char* topic, const char* text) {
+    protocol_message_t* frame = malloc(sizeof(protocol_message_t));
+    if (!frame) return 0;
+    
+    memset(frame, 0, offsetof(protocol_message_t, data));
+    frame->type = MSG_TYPE_OTHERNET_MESSAGE;
+    frame->sender = local_address();
+    strcpy(frame->sender_ip, my_ip);
+    frame->sender_port = my_port;
+    frame->ttl = PUBLISH_HOPS;
+    frame->timestamp = time(NULL);
+    
+    // Same id scheme as announcements; the seen cache drops copies that
+    // reach a node along a second path
+    struct { othernet_address_t addr; uint32_t epoch; uint32_t seq; } key;
+    memset(&key, 0, sizeof(key));
+    key.addr = local_address();
+    key.epoch = my_epoch;
+    key.seq = atomic_fetch_add(&publish_seq, 1) | 0x80000000u;
+    uint64_t id = hash_bytes(&key, sizeof(key), 0) | 1;
+    announcement_seen(id);
+    
+    snprintf(frame->data, sizeof(frame->data), "pub:%llx:%s %s",
+             (unsigned long long)id, topic, text);
+    int sent = send_to_topic_peers(frame, topic, NULL, 0);
+    free(frame);
+    return sent;
+}
+
+// A published message: show it if we subscribe to its topic and pass it
+// on to matching peers while it has hops left
+void handle_publication(protocol_message_t* msg, const char* from_ip) {
+    unsigned long long id;
+    char topic[TOPIC_LEN];
+    int offset = 0;
+    
+    if (sscanf(msg->data, "pub:%llx:%31s %n", &id, topic, &offset) != 2 || offset == 0) {
+        return;
+    }
+    othernet_address_t self = local_address();
+    if (addresses_equal(&msg->sender, &self) || announcement_seen(id)) return;
+    
+    if (is_subscribed(topic)) {
+        printf("\n[%s from ", topic);
+        print_othernet_address(&msg->sender);
+        printf("] %s\n> ", msg->data + offset);
+        fflush(stdout);
+    }
+    
+    if (msg->ttl <= 1) return;
+    
+    // Forwarders put themselves in sender_ip/port so the next hop can
+    // skip them; sender stays the publisher
+    int from_port = msg->sender_port;
+    msg->ttl--;
+    strcpy(msg->sender_ip, my_ip);
+    msg->sender_port = my_port;
+    send_to_topic_peers(msg, topic, from_ip, from_port);
+}
+
+void print_topics() {
+    pthread_mutex_lock(&topics_mutex);
+    printf("Subscribed topics (%d):\n", my_topic_count);
+    for (int t = 0; t < my_topic_count; t++) {
+        printf("  %s\n", my_topics[t]);
+    }
+    pthread_mutex_unlock(&topics_mutex);
+}
+
+// Route cache. Each destination maps to one small bucket with its own
+// lock, so shards looking up different targets rarely meet. A positive
+// entry remembers the peer that reaches a destination for ROUTE_TTL and
+// is refreshed by every frame that destination sends us; a negative one
+// remembers for ROUTE_NEGATIVE_TTL that nobody does, so a burst of
+// retries to an absent node does not scan the peer table each time.
+// Frames forwarded to us from nodes we have no link to leave reverse path
+// entries: the peer that last brought us traffic from such a node.
+void route_cache_init() {
+    for (int b = 0; b < ROUTE_CACHE_BUCKETS; b++) {
+        pthread_mutex_init(&route_cache[b].lock, NULL);
+    }
+}
+
+// Caller holds peers_mutex, so removal cannot slip in between computing
+// a route and caching it. peer_index -1 records that dest is unreachable.
+static void route_cache_store(othernet_address_t* dest, int peer_index, int direct, long now_ms) {
+    route_bucket_t* bucket = &route_cache[hash_address(dest) % ROUTE_CACHE_BUCKETS];
+    int victim = 0;
+    
+    pthread_mutex_lock(&bucket->lock);
+    for (int i = 0; i < ROUTE_CACHE_WAYS; i++) {
+        if (bucket->ways[i].expires_ms && addresses_equal(&bucket->ways[i].dest, dest)) {
+            victim = i;
+            break;
+        }
+        if (bucket->ways[i].expires_ms < bucket->ways[victim].expires_ms) victim = i;
+    }
+    route_entry_t* entry = &bucket->ways[victim];
+    entry->dest = *dest;
+    entry->peer_index = peer_index;
+    entry->direct = direct;
+    if (peer_index >= 0) {
+        strcpy(entry->ip, peers[peer_index].ip);
+        entry->port = peers[peer_index].port;
+        entry->expires_ms = now_ms + ROUTE_TTL * 1000L;
+    } else {
+        entry->expires_ms = now_ms + ROUTE_NEGATIVE_TTL * 1000L;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+// Finds the next hop toward dest, filling ip, port and direct (any may be
+// NULL). Returns its peer index, or -1 if we know no way to dest.
+int route_next_hop(othernet_address_t* dest, char* ip, int* port, int* direct) {
+    route_bucket_t* bucket = &route_cache[hash_address(dest) % ROUTE_CACHE_BUCKETS];
+    long now_ms = current_time_ms();
+    
+    pthread_mutex_lock(&bucket->lock);
+    for (int i = 0; i < ROUTE_CACHE_WAYS; i++) {
+        route_entry_t* entry = &bucket->ways[i];
+        if (entry->expires_ms > now_ms && addresses_equal(&entry->dest, dest)) {
+            int index = entry->peer_index;
+            if (index >= 0) {
+                if (ip) strcpy(ip, entry->ip);
+                if (port) *port = entry->port;
+                if (direct) *direct = entry->direct;
+            }
+            pthread_mutex_unlock(&bucket->lock);
+            atomic_fetch_add(&route_hits, 1);
+            return index;
+        }
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    atomic_fetch_add(&route_misses, 1);
+    
+    pthread_mutex_lock(&peers_mutex);
+    peer_t* peer = find_peer_by_address(dest);
+    int index = peer ? peer - peers : -1;
+    if (peer) {
+        if (ip) strcpy(ip, peer->ip);
+        if (port) *port = peer->port;
+        if (direct) *direct = 1;
+    }
+    route_cache_store(dest, index, 1, now_ms);
+    pthread_mutex_unlock(&peers_mutex);
+    return index;
+}
+
+// Finds the peer that is dest, filling ip and port (either may be NULL).
+// Returns its peer index, or -1 if dest is not a peer. Deliveries carry
+// no target, so only a direct route will do for them.
+int route_lookup(othernet_address_t* dest, char* ip, int* port) {
+    char hop_ip[16];
+    int hop_port = 0;
+    int direct = 0;
+    int index = route_next_hop(dest, hop_ip, &hop_port, &direct);
+    
+    if (index < 0 || !direct) return -1;
+    if (ip) strcpy(ip, hop_ip);
+    if (port) *port = hop_port;
+    return index;
+}
+
+// Caller holds peers_mutex. A frame a peer sends about itself proves the
+// direct route; the route stays warm while it keeps talking to us. One it
+// forwards from a node we have no link to is the reverse path to that
+// node, and the latest forwarder wins. A direct route is never replaced.
+void route_cache_learn(othernet_address_t* source, int peer_index) {
+    othernet_address_t self = local_address();
+    if (addresses_equal(source, &peers[peer_index].address)) {
+        route_cache_store(source, peer_index, 1, current_time_ms());
+    } else if (!addresses_equal(source, &self) && !find_peer_by_address(source)) {
+        route_cache_store(source, peer_index, 0, current_time_ms());
+    }
+}
+
+// Caller holds peers_mutex. Drops every route through peer_index, or when
+// dest is given, any entry for dest: a peer that just (re)appeared must
+// not stay hidden behind a negative entry.
+void route_cache_invalidate(int peer_index, othernet_address_t* dest) {
+    for (int b = 0; b < ROUTE_CACHE_BUCKETS; b++) {
+        route_bucket_t* bucket = &route_cache[b];
+        pthread_mutex_lock(&bucket->lock);
+        for (int i = 0; i < ROUTE_CACHE_WAYS; i++) {
+            route_entry_t* entry = &bucket->ways[i];
+            if (!entry->expires_ms) continue;
+            if ((peer_index >= 0 && entry->peer_index == peer_index) ||
+                (dest && addresses_equal(&entry->dest, dest))) {
+                entry->expires_ms = 0;
+            }
+        }
+        pthread_mutex_unlock(&bucket->lock);
+    }
+}
+
+void print_routes() {
+    long now_ms = current_time_ms();
+    int shown = 0;
+    
+    printf("Route cache (%lu hits, %lu misses):\n",
+           (unsigned long)atomic_load(&route_hits), (unsigned long)atomic_load(&route_misses));
+    for (int b = 0; b < ROUTE_CACHE_BUCKETS; b++) {
+        route_bucket_t* bucket = &route_cache[b];
+        pthread_mutex_lock(&bucket->lock);
+        for (int i = 0; i < ROUTE_CACHE_WAYS; i++) {
+            route_entry_t* entry = &bucket->ways[i];
+            if (entry->expires_ms <= now_ms) continue;
+            printf("  ");
+            print_othernet_address(&entry->dest);
+            if (entry->peer_index >= 0) {
+                printf(" via %s:%d%s", entry->ip, entry->port, entry->direct ? "" : " (reverse path)");
+            } else {
+                printf(" unreachable");
+            }
+            printf(" (%ld s left)\n", (entry->expires_ms - now_ms + 999) / 1000);
+            shown++;
+        }
+        pthread_mutex_unlock(&bucket->lock);
+    }
+    if (!shown) printf("  (empty)\n");
+}
+
+static int add_target(othernet_address_t* targets, int count, othernet_address_t* addr) {
+    othernet_address_t self = local_address();
+    if (addresses_equal(addr, &self)) return count;
+    for (int t = 0; t < count; t++) {
+        if (addresses_equal(&targets[t], addr)) return count;
+    }
+    targets[count] = *addr;
+    return count + 1;
+}
+
+// Parses a comma-separated list of addresses into targets. A node of '*'
+// stands for every active peer we know in that realm and cluster. Repeats
+// and our own address are dropped. Returns the number of targets.
+int parse_target_list(const char* spec, othernet_address_t* targets, int max) {
+    char list[4096];
+    int count = 0;
+    
+    snprintf(list, sizeof(list), "%s", spec);
+    
+    pthread_mutex_lock(&peers_mutex);
+    for (char* save = NULL, *item = strtok_r(list, ",", &save); item && count < max;
+         item = strtok_r(NULL, ",", &save)) {
+        othernet_address_t addr;
+        char star;
+        
+        if (sscanf(item, "%hu.%hu.%c", &addr.realm, &addr.cluster, &star) == 3 && star == '*') {
+            for (int i = 0; i < peer_count && count < max; i++) {
+                if (peers[i].active && peers[i].address.realm == addr.realm &&
+                    peers[i].address.cluster == addr.cluster) {
+                    count = add_target(targets, count, &peers[i].address);
+                }
+            }
+        } else if (sscanf(item, "%hu.%hu.%u", &addr.realm, &addr.cluster, &addr.node_id) == 3) {
+            count = add_target(targets, count, &addr);
+        } else {
+            printf("Bad address %s\n", item);
+        }
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    return count;
+}
+
+int addresses_equal(const othernet_address_t* a, const othernet_address_t* b) {
+    return a->realm == b->realm && a->cluster == b->cluster && a->node_id == b->node_id;
+}
+
+// Our address as of now. A standby that takes over its primary becomes
+// that node for good, so everything but startup reads it through here.
+othernet_address_t local_address() {
+    pthread_mutex_lock(&address_mutex);
+    othernet_address_t addr = my_address;
+    pthread_mutex_unlock(&address_mutex);
+    return addr;
+}
+
+long current_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+long current_time_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+uint64_t generate_message_id() {
+    static atomic_uint_fast64_t counter = 0;
+    return ((uint64_t)time(NULL) << 32) | (atomic_fetch_add(&counter, 1) + 1);
+}
+
+time_t calculate_next_retry(held_message_t* msg) {
+    // Exponential backoff: 1min, 2min, 4min, 8min, 16min
+    int delay = 60 * (1 << (msg->attempt_count - 1));
+    if (delay > 960) delay = 960; // Cap at 16 minutes
+    return msg->last_attempt + delay;
+}
+
+void print_othernet_address(othernet_address_t* addr) {
+    printf("%u.%u.%u", addr->realm, addr->cluster, addr->node_id);
+}
+
+void print_peers() {
+    pthread_mutex_lock(&peers_mutex);
+    
+    printf("Connected peers (%d):\n", peer_count);
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].active) {
+            printf("  ");
+            print_othernet_address(&peers[i].address);
+            printf(" at %s:%d (capabilities: ", peers[i].ip, peers[i].port);
+            
+            if (peers[i].capabilities & CAPABILITY_HOLDING) printf("H");
+            if (peers[i].capabilities & CAPABILITY_ROUTING) printf("R");
+            if (peers[i].capabilities & CAPABILITY_GATEWAY) printf("G");
+            printf(", load: %.2f, %s)\n", peers[i].load_factor,
+                   !peers[i].in_view ? "passive" : peers[i].lazy ? "lazy" : "eager");
+        }
+    }
+    
+    pthread_mutex_unlock(&peers_mutex);
+}
+
+void print_held_messages() {
+    printf("Held messages (%d in %d shards):\n", atomic_load(&held_message_count), hold_shard_count);
+    
+    // Each shard prints its own part from its thread
+    shard_work_t* work = new_shard_work(WORK_DUMP);
+    if (work) post_all_shards(work);
+}
+
+void print_shard_messages(hold_shard_t* shard) {
+    uint32_t blocks = 0;
+    size_t reserved = 0;
+    for (int c = 0; c < PAYLOAD_CLASSES; c++) {
+        blocks += shard->payload_classes[c].in_use;
+        reserved += (size_t)shard->payload_classes[c].slab_count * PAYLOAD_SLAB_SIZE;
+    }
+    
+    flockfile(stdout);
+    printf(" Shard %d (%d, payload arena %u blocks in %zu KB):\n",
+           shard->index, shard->message_count - shard->free_count, blocks, reserved / 1024);
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* msg = &shard->messages[i];
+        if (msg->status != MSG_STATUS_DELIVERED && msg->status != MSG_STATUS_FREE) {
+            printf("  ID:%lu Target:", msg->message_id);
+            print_othernet_address(&msg->target_address);
+            printf(" Status:");
+            
+            switch (msg->status) {
+                case MSG_STATUS_QUEUED: printf("QUEUED"); break;
+                case MSG_STATUS_ATTEMPTING: printf("ATTEMPTING"); break;
+                case MSG_STATUS_HELD: printf("HELD"); break;
+                case MSG_STATUS_EXPIRED: printf("EXPIRED"); break;
+                case MSG_STATUS_FAILED: printf("FAILED"); break;
+                default: printf("UNKNOWN"); break;
+            }
+            
+            printf(" Attempts:%d Priority:%d\n", 
+                   msg->attempt_count, msg->priority);
+            if (msg->role == HOLD_ROLE_REPLICA) {
+                printf("    Replica for %s:%d\n", msg->holding_node_ip, msg->holding_node_port);
+            } else if (msg->role == HOLD_ROLE_DISPERSED) {
+                printf("    Dispersed as %d erasure-coded fragments\n",
+                       __builtin_popcount(msg->fragments_placed));
+                continue;
+            }
+            printf("    Payload: %.50s%s (%u bytes)\n", 
+                   payload_data(shard, msg->payload), msg->payload_len > 50 ? "..." : "",
+                   msg->payload_len);
+        }
+    }
+    fflush(stdout);
+    funlockfile(stdout);
+}
+
+void remove_peer(const char* ip, int port) {
+    int removed = 0;
+    
+    pthread_mutex_lock(&peers_mutex);
+    
+    for (int i = 0; i < peer_count; i++) {
+        if (strcmp(peers[i].ip, ip) == 0 && peers[i].port == port && peers[i].active) {
+            peers[i].active = 0;
+            rebuild_holding_ring();
+            update_holding_candidate(i);
+            route_cache_invalidate(i, NULL);
+            removed = 1;
+            printf("Peer disconnected: ");
+            print_othernet_address(&peers[i].address);
+            printf(" at %s:%d\n", ip, port);
+            break;
+        }
+    }
+    
+    pthread_mutex_unlock(&peers_mutex);
+    
+    // Redistribute any messages held by this node. The shards take
+    // peers_mutex themselves, so this happens after unlocking.
+    if (removed) {
+        redistribute_held_messages(ip, port);
+    }
+}
+
+// Any frame from a peer counts as a sign of life, and one it sent about
+// itself keeps its route cached
+void touch_peer(const char* ip, int port, othernet_address_t* sender) {
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].port == port && strcmp(peers[i].ip, ip) == 0) {
             peers[i].last_seen = time(NULL);
-            peers[i].capabilities = capabilities;
-            pthread_mutex_unlock(&peers_mutex);
+            if (peers[i].active) route_cache_learn(sender, i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&peers_mutex);
+}
+
+// Failure detector: peers that stayed silent through several capability
+// update rounds are removed just as if they had said GOODBYE
+void detect_failed_peers() {
+    char failed_ip[MAX_PEERS][16];
+    int failed_port[MAX_PEERS];
+    int failed = 0;
+    time_t now = time(NULL);
+    
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].active && now - peers[i].last_seen > PEER_TIMEOUT) {
+            strcpy(failed_ip[failed], peers[i].ip);
+            failed_port[failed] = peers[i].port;
+            failed++;
+        }
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    for (int i = 0; i < failed; i++) {
+        printf("Peer %s:%d timed out\n", failed_ip[i], failed_port[i]);
+        remove_peer(failed_ip[i], failed_port[i]);
+    }
+}
+
+void cleanup_expired_messages(hold_shard_t* shard) {
+    time_t now = time(NULL);
+    int cleaned = 0;
+    
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* msg = &shard->messages[i];
+        if (now > msg->expires_at && msg->status != MSG_STATUS_DELIVERED &&
+            msg->status != MSG_STATUS_EXPIRED && msg->status != MSG_STATUS_FREE) {
+            msg->status = MSG_STATUS_EXPIRED;
+            msg->handoff_flags |= HANDOFF_RELEASE;
+            standby_note(shard, msg, 0);
+            cleaned++;
+        }
+    }
+    
+    if (cleaned > 0) {
+        printf("Cleaned up %d expired messages\n", cleaned);
+    }
+}
+
+// A node just (re)appeared: skip the rest of its retry backoff
+void wake_held_messages_for(othernet_address_t* target) {
+    shard_work_t* work = new_shard_work(WORK_WAKE);
+    if (!work) return;
+    work->target = *target;
+    post_shard_work(shard_for(target), work);
+}
+
+void wake_shard_messages(hold_shard_t* shard, othernet_address_t* target) {
+    time_t now = time(NULL);
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* msg = &shard->messages[i];
+        if (msg->role == HOLD_ROLE_PRIMARY && msg->status == MSG_STATUS_HELD &&
+            addresses_equal(&msg->target_address, target)) {
+            msg->next_attempt = now;
+        }
+    }
+}
+
+// A holding node is gone. Our primaries that used it as a replica get a
+// new one on the next scheduler pass. Replicas it was primary for are
+// taken over by the first live node after the target on the hash ring:
+// either we promote our copy, or we pass it to that node.
+void redistribute_held_messages(const char* failed_node_ip, int failed_node_port) {
+    shard_work_t* work = new_shard_work(WORK_PEER_FAILED);
+    if (!work) return;
+    strncpy(work->ip, failed_node_ip, sizeof(work->ip) - 1);
+    work->port = failed_node_port;
+    post_all_shards(work);
+}
+
+void redistribute_shard_messages(hold_shard_t* shard, const char* failed_node_ip, int failed_node_port) {
+    int failed_index = -1;
+    int promoted = 0, passed_on = 0, lost_replicas = 0;
+    
+    pthread_mutex_lock(&peers_mutex);
+    
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].port == failed_node_port && strcmp(peers[i].ip, failed_node_ip) == 0) {
+            failed_index = i;
+            break;
+        }
+    }
+    
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* msg = &shard->messages[i];
+        if (msg->status == MSG_STATUS_DELIVERED || msg->status == MSG_STATUS_EXPIRED ||
+            msg->status == MSG_STATUS_FAILED || msg->status == MSG_STATUS_FREE) {
+            continue;
+        }
+        
+        if (msg->role == HOLD_ROLE_PRIMARY || msg->role == HOLD_ROLE_DISPERSED) {
+            for (int r = 0; r < REPLICATION_FACTOR; r++) {
+                if (failed_index >= 0 && msg->replicas[r] == failed_index) {
+                    msg->replicas[r] = -1;
+                    lost_replicas++;
+                }
+            }
+            // Undelivered fragments it held are encoded and placed again,
+            // unless every fragment was out and the payload is gone
+            for (int f = 0; f < ERASURE_MAX_SHARDS; f++) {
+                if (failed_index >= 0 && (msg->fragments_placed & (1u << f)) &&
+                    !(msg->fragments_delivered & (1u << f)) &&
+                    msg->fragment_holders[f] == failed_index) {
+                    msg->fragments_placed &= ~(1u << f);
+                    lost_replicas++;
+                }
+            }
+            continue;
+        }
+        
+        if (msg->holding_node_port != failed_node_port ||
+            strcmp(msg->holding_node_ip, failed_node_ip) != 0) {
+            continue;
+        }
+        
+        int owner;
+        if (holding_ring_successors(&msg->target_address, &owner, 1,
+                                    failed_node_ip, failed_node_port) < 1) {
+            continue;
+        }
+        
+        if (owner < 0) {
+            msg->role = HOLD_ROLE_PRIMARY;
+            msg->status = MSG_STATUS_HELD;
+            msg->next_attempt = time(NULL);
+            msg->seq = 0;
+            for (int r = 0; r < REPLICATION_FACTOR; r++) msg->replicas[r] = -1;
+            standby_note(shard, msg, 1);
+            promoted++;
+        } else {
+            strcpy(msg->holding_node_ip, peers[owner].ip);
+            msg->holding_node_port = peers[owner].port;
+            msg->handoff_flags |= HANDOFF_PROMOTE;
+            passed_on++;
+        }
+    }
+    
+    pthread_mutex_unlock(&peers_mutex);
+    
+    if (promoted || passed_on || lost_replicas) {
+        printf("Redistributed messages from failed node %s:%d "
+               "(%d promoted here, %d passed on, %d replicas to replace)\n",
+               failed_node_ip, failed_node_port, promoted, passed_on, lost_replicas);
+    }
+}
+
+// FNV-1a, good enough to spread ring points and message targets
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed) {
+    const unsigned char* p = data;
+    uint64_t h = 14695981039346656037ULL ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    // Final avalanche so nearby inputs land far apart on the ring
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t hash_address(othernet_address_t* addr) {
+    uint32_t key[2] = { ((uint32_t)addr->realm << 16) | addr->cluster, addr->node_id };
+    return hash_bytes(key, sizeof(key), 0);
+}
+
+static int compare_ring_points(const void* a, const void* b) {
+    uint64_t ha = ((const ring_point_t*)a)->hash;
+    uint64_t hb = ((const ring_point_t*)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// Caller holds peers_mutex
+void rebuild_holding_ring() {
+    othernet_address_t self = local_address();
+    char key[32];
+    holding_ring_size = 0;
+    
+    for (int i = -1; i < peer_count; i++) {
+        uint32_t capabilities = (i < 0) ? my_capabilities : peers[i].capabilities;
+        if (!(capabilities & CAPABILITY_HOLDING) || (i >= 0 && !peers[i].active)) {
+            continue;
+        }
+        
+        // Peers are placed by their address; we use ours too, since our
+        // listening ip is usually 0.0.0.0 and unknown to the others
+        othernet_address_t* addr = (i < 0) ? &self : &peers[i].address;
+        for (int v = 0; v < RING_VNODES; v++) {
+            int len = snprintf(key, sizeof(key), "%u.%u.%u#%d",
+                               addr->realm, addr->cluster, addr->node_id, v);
+            holding_ring[holding_ring_size].hash = hash_bytes(key, len, 0);
+            holding_ring[holding_ring_size].owner = i;
+            holding_ring_size++;
+        }
+    }
+    
+    qsort(holding_ring, holding_ring_size, sizeof(ring_point_t), compare_ring_points);
+}
+
+// Caller holds peers_mutex. Walks the ring clockwise from the key's hash
+// and fills owners with up to max distinct holders (-1 means us). The
+// target itself and the skipped endpoint are never returned.
+int holding_ring_successors(othernet_address_t* key, int* owners, int max,
+                            const char* skip_ip, int skip_port) {
+    if (holding_ring_size == 0 || max <= 0) return 0;
+    
+    uint64_t h = hash_address(key);
+    int lo = 0, hi = holding_ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (holding_ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    othernet_address_t self = local_address();
+    int found = 0;
+    for (int step = 0; step < holding_ring_size && found < max; step++) {
+        int owner = holding_ring[(lo + step) % holding_ring_size].owner;
+        
+        if (owner >= 0) {
+            if (addresses_equal(&peers[owner].address, key)) continue;
+            if (skip_ip && peers[owner].port == skip_port &&
+                strcmp(peers[owner].ip, skip_ip) == 0) continue;
+        } else if (addresses_equal(&self, key)) {
+            continue;
+        }
+        
+        int seen = 0;
+        for (int j = 0; j < found; j++) {
+            if (owners[j] == owner) seen = 1;
+        }
+        if (!seen) owners[found++] = owner;
+    }
+    
+    return found;
+}
+
+// Runs on the shard thread. Builds HOLD_REQUEST/HOLD_RESPONSE batches,
+// one job per destination node and at most HANDOFF_BATCH frames each, and
+// returns them as a job list.
+delivery_job_t* schedule_handoffs(hold_shard_t* shard) {
+    protocol_message_t* frame = shard->frame;
+    delivery_job_t* open_jobs[MAX_PEERS + 1];
+    int open_count = 0;
+    delivery_job_t* jobs = NULL;
+    
+    pthread_mutex_lock(&peers_mutex);
+    
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* msg = &shard->messages[i];
+        
+        // Frames this message needs, each for its own node
+        struct { const char* ip; int port; int peer_index; char kind; int fragment; }
+            out[ERASURE_MAX_SHARDS + REPLICATION_FACTOR];
+        int out_count = 0;
+        int shard_size = 0;
+        
+        for (int k = 0; k < ERASURE_MAX_SHARDS + REPLICATION_FACTOR; k++) out[k].fragment = -1;
+        
+        if (msg->handoff_flags & HANDOFF_RELEASE) {
+            for (int r = 0; r < REPLICATION_FACTOR; r++) {
+                int p = msg->replicas[r];
+                if (p >= 0 && peers[p].active) {
+                    out[out_count].ip = peers[p].ip;
+                    out[out_count].port = peers[p].port;
+                    out[out_count].peer_index = -1;
+                    out[out_count].kind = 'x';
+                    out_count++;
+                }
+                msg->replicas[r] = -1;
+            }
+            // Holders still waiting to deliver a fragment can drop it
+            for (int f = 0; f < ERASURE_MAX_SHARDS; f++) {
+                int p = msg->fragment_holders[f];
+                if (!(msg->fragments_placed & (1u << f)) || (msg->fragments_delivered & (1u << f)) ||
+                    !peers[p].active) {
+                    continue;
+                }
+                out[out_count].ip = peers[p].ip;
+                out[out_count].port = peers[p].port;
+                out[out_count].peer_index = -1;
+                out[out_count].kind = 'x';
+                out[out_count].fragment = f;
+                out_count++;
+            }
+            msg->fragments_placed = 0;
+            msg->handoff_flags &= ~HANDOFF_RELEASE;
+        } else if (msg->handoff_flags & HANDOFF_FRAGMENT_DONE) {
+            out[out_count].ip = msg->holding_node_ip;
+            out[out_count].port = msg->holding_node_port;
+            out[out_count].peer_index = -1;
+            out[out_count].kind = 'd';
+            out_count++;
+            msg->handoff_flags &= ~HANDOFF_FRAGMENT_DONE;
+        } else if (msg->handoff_flags & HANDOFF_PROMOTE) {
+            out[out_count].ip = msg->holding_node_ip;
+            out[out_count].port = msg->holding_node_port;
+            out[out_count].peer_index = -1;
+            out[out_count].kind = 'p';
+            out_count++;
+            msg->handoff_flags &= ~HANDOFF_PROMOTE;
+        } else if ((msg->role == HOLD_ROLE_PRIMARY || msg->role == HOLD_ROLE_DISPERSED) &&
+                   msg->status == MSG_STATUS_HELD && !msg->replication_pending &&
+                   !msg->is_fragment && msg->payload && (shard_size = erasure_shard_size(msg)) > 0 &&
+                   (shard->fragments ||
+                    (shard->fragments = malloc(ERASURE_MAX_SHARDS * sizeof(*shard->fragments))))) {
+            // Spread k+m fragments over the first k+m other holders, or
+            // replicate below if the ring is too small for that. A fragment
+            // placed again after its holder failed goes to a holder that
+            // has none of the others if there is one.
+            int owners[ERASURE_MAX_SHARDS + 1];
+            int total = msg->erasure_k + msg->erasure_m;
+            int n = holding_ring_successors(&msg->target_address, owners, total + 1, NULL, 0);
+            int holders = 0;
+            for (int k = 0; k < n; k++) {
+                if (owners[k] >= 0) owners[holders++] = owners[k];
+            }
+            
+            if (holders >= total && msg->fragments_placed != (1u << total) - 1) {
+                uint32_t used = 0;
+                for (int f = 0; f < total; f++) {
+                    if (!(msg->fragments_placed & (1u << f))) continue;
+                    for (int k = 0; k < holders; k++) {
+                        if (owners[k] == msg->fragment_holders[f]) used |= 1u << k;
+                    }
+                }
+                
+                rs_encode((const uint8_t*)payload_data(shard, msg->payload), msg->payload_len,
+                          msg->erasure_k, msg->erasure_m, shard->fragments, shard_size);
+                for (int f = 0; f < total; f++) {
+                    if (msg->fragments_placed & (1u << f)) continue;
+                    int owner = owners[f];
+                    for (int k = 0; k < holders; k++) {
+                        if (!(used & (1u << k))) {
+                            owner = owners[k];
+                            used |= 1u << k;
+                            break;
+                        }
+                    }
+                    out[out_count].ip = peers[owner].ip;
+                    out[out_count].port = peers[owner].port;
+                    out[out_count].peer_index = owner;
+                    out[out_count].kind = 'f';
+                    out[out_count].fragment = f;
+                    out_count++;
+                }
+            } else if (holders < total) {
+                shard_size = 0;
+            }
+        }
+        
+        if (out_count == 0 && msg->role == HOLD_ROLE_PRIMARY && msg->status == MSG_STATUS_HELD &&
+            !msg->replication_pending && !msg->is_fragment && shard_size == 0 &&
+            !(msg->handoff_flags & (HANDOFF_RELEASE | HANDOFF_PROMOTE))) {
+            // Top up replicas on the first R holders after the target
+            int owners[REPLICATION_FACTOR + 1];
+            int n = holding_ring_successors(&msg->target_address, owners,
+                                            REPLICATION_FACTOR + 1, NULL, 0);
+            int wanted = 0;
+            for (int k = 0; k < n && wanted < REPLICATION_FACTOR; k++) {
+                if (owners[k] < 0) continue;
+                wanted++;
+                
+                int placed = 0;
+                for (int r = 0; r < REPLICATION_FACTOR; r++) {
+                    if (msg->replicas[r] == owners[k]) placed = 1;
+                }
+                if (placed) continue;
+                
+                out[out_count].ip = peers[owners[k]].ip;
+                out[out_count].port = peers[owners[k]].port;
+                out[out_count].peer_index = owners[k];
+                out[out_count].kind = 'r';
+                out_count++;
+            }
+        }
+        
+        for (int k = 0; k < out_count; k++) {
+            delivery_job_t* job = NULL;
+            for (int j = 0; j < open_count; j++) {
+                if (open_jobs[j]->port == out[k].port && strcmp(open_jobs[j]->ip, out[k].ip) == 0) {
+                    job = open_jobs[j];
+                    break;
+                }
+            }
+            
+            if (!job && open_count < MAX_PEERS + 1) {
+                job = calloc(1, sizeof(delivery_job_t));
+                if (job) {
+                    job->entries = calloc(HANDOFF_BATCH, sizeof(batch_entry_t));
+                    if (!job->entries) {
+                        free_delivery_job(job);
+                        job = NULL;
+                    }
+                }
+                if (!job) continue;
+                job->kind = JOB_HANDOFF;
+                job->shard = shard;
+                strcpy(job->ip, out[k].ip);
+                job->port = out[k].port;
+                open_jobs[open_count++] = job;
+            }
+            if (!job) continue;
+            
+            batch_entry_t* entry = &job->entries[job->frame_count];
+            
+            if (out[k].kind == 'f') {
+                if (format_fragment_frame(frame, msg, out[k].fragment,
+                                          shard->fragments[out[k].fragment], shard_size) != 0) {
+                    continue;
+                }
+                entry->slot = i;
+            } else if (out[k].kind == 'x') {
+                memset(frame, 0, offsetof(protocol_message_t, data));
+                frame->type = MSG_TYPE_HOLD_RESPONSE;
+                frame->sender = local_address();
+                strcpy(frame->sender_ip, my_ip);
+                frame->sender_port = my_port;
+                frame->timestamp = time(NULL);
+                snprintf(frame->data, sizeof(frame->data), "release:%lu t:%hu.%hu.%u",
+                         out[k].fragment >= 0 ? fragment_message_id(msg->message_id, out[k].fragment)
+                                              : msg->message_id,
+                         msg->target_address.realm, msg->target_address.cluster,
+                         msg->target_address.node_id);
+                entry->slot = -1;
+            } else if (out[k].kind == 'd') {
+                memset(frame, 0, offsetof(protocol_message_t, data));
+                frame->type = MSG_TYPE_HOLD_RESPONSE;
+                frame->sender = local_address();
+                strcpy(frame->sender_ip, my_ip);
+                frame->sender_port = my_port;
+                frame->timestamp = time(NULL);
+                snprintf(frame->data, sizeof(frame->data), "fragdone:%lu t:%hu.%hu.%u", msg->message_id,
+                         msg->target_address.realm, msg->target_address.cluster,
+                         msg->target_address.node_id);
+                entry->slot = -1;
+            } else {
+                format_hold_frame(frame, msg, out[k].kind, payload_data(shard, msg->payload),
+                                  msg->payload_len);
+                entry->slot = i;
+            }
+            if (append_job_frame(job, frame) != 0) continue;
+            if (out[k].kind == 'f' || out[k].kind == 'r') msg->replication_pending++;
+            entry->message_id = msg->message_id;
+            entry->peer_index = out[k].peer_index;
+            entry->fragment = out[k].fragment;
+            
+            // Full batch: hand it to the workers and start a new one
+            if (job->frame_count == HANDOFF_BATCH) {
+                job->next = jobs;
+                jobs = job;
+                for (int j = 0; j < open_count; j++) {
+                    if (open_jobs[j] == job) {
+                        open_jobs[j] = open_jobs[--open_count];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    
+    pthread_mutex_unlock(&peers_mutex);
+    
+    for (int j = 0; j < open_count; j++) {
+        open_jobs[j]->next = jobs;
+        jobs = open_jobs[j];
+    }
+    return jobs;
+}
+
+// role is 'p' to make the receiver the primary holder, 'r' for a replica
+void format_hold_frame(protocol_message_t* frame, held_message_t* msg, char role,
+                       const char* payload, size_t len) {
+    memset(frame, 0, offsetof(protocol_message_t, data));
+    frame->type = MSG_TYPE_HOLD_REQUEST;
+    frame->sender = local_address();
+    strcpy(frame->sender_ip, my_ip);
+    frame->sender_port = my_port;
+    frame->timestamp = time(NULL);
+    snprintf(frame->data, sizeof(frame->data),
+             "hold:%lu role:%c t:%hu.%hu.%u s:%hu.%hu.%u pr:%d ex:%ld ",
+             msg->message_id, role,
+             msg->target_address.realm, msg->target_address.cluster, msg->target_address.node_id,
+             msg->sender_address.realm, msg->sender_address.cluster, msg->sender_address.node_id,
+             msg->priority, msg->expires_at);
+    append_frame_payload(frame, payload, len);
+}
+
+// Another holder hands us a copy. A replica waits for release or for its
+// primary (the sending node) to fail; a primary copy is delivered by us.
+void handle_hold_request(protocol_message_t* msg, const char* from_ip) {
+    uint64_t message_id;
+    char role;
+    othernet_address_t target, sender;
+    int priority, offset = 0;
+    long expires_at;
+    
+    if (sscanf(msg->data, "hold:%lu role:%c t:%hu.%hu.%u s:%hu.%hu.%u pr:%d ex:%ld %n",
+               &message_id, &role, &target.realm, &target.cluster, &target.node_id,
+               &sender.realm, &sender.cluster, &sender.node_id,
+               &priority, &expires_at, &offset) != 10 || offset == 0) {
+        return;
+    }
+    
+    shard_work_t* work = new_shard_work(WORK_HOLD);
+    if (!work) return;
+    // A fragment keeps its binary body after the NUL of its header
+    size_t len = strlen(msg->data + offset);
+    if (msg->body_len) len += 1 + msg->body_len;
+    work->payload = new_shared_payload(msg->data + offset, len, 1);
+    if (!work->payload) {
+        free_shard_work(work);
+        return;
+    }
+    work->message_id = message_id;
+    work->role = role;
+    work->target = target;
+    work->sender = sender;
+    work->priority = priority;
+    work->expires_at = expires_at;
+    strncpy(work->ip, from_ip, sizeof(work->ip) - 1);
+    work->port = msg->sender_port;
+    post_shard_work(shard_for(&target), work);
+}
+
+void apply_hold_request(hold_shard_t* shard, shard_work_t* work) {
+    held_message_t* held = NULL;
+    int created = 0;
+    for (int i = 0; i < shard->message_count; i++) {
+        if (shard->messages[i].message_id == work->message_id &&
+            addresses_equal(&shard->messages[i].sender_address, &work->sender)) {
+            held = &shard->messages[i];
+            break;
+        }
+    }
+    
+    // A copy of a message we delivered and already freed is not taken again
+    for (int i = 0; !held && i < DELIVERED_HOLD_IDS; i++) {
+        if (shard->delivered_ids[i] == work->message_id) return;
+    }
+    
+    if (!held && (held = claim_held_message(shard)) != NULL) {
+        held->message_id = work->message_id;
+        held->target_address = work->target;
+        held->sender_address = work->sender;
+        held->priority = work->priority;
+        held->created_time = time(NULL);
+        held->expires_at = work->expires_at;
+        held->status = MSG_STATUS_HELD;
+        held->role = HOLD_ROLE_REPLICA;
+        for (int r = 0; r < REPLICATION_FACTOR; r++) held->replicas[r] = -1;
+        created = 1;
+    }
+    
+    if (!held || held->status == MSG_STATUS_DELIVERED) return;
+    
+    // New, or an expired copy coming back to life. Without room for the
+    // payload the copy is refused rather than held empty.
+    if (!held->payload) {
+        held->payload = payload_store(shard, work->payload->data, work->payload->len);
+        if (!held->payload) {
+            printf("No room to hold message %lu\n", work->message_id);
+            if (created) free_held_message(shard, held);
+            return;
+        }
+        held->payload_len = work->payload->len;
+    }
+    
+    if (work->role == 'f') {
+        // A fragment is ours to deliver; the target rebuilds the message
+        // and the sending holder hears from us once it has our part
+        held->role = HOLD_ROLE_PRIMARY;
+        held->is_fragment = 1;
+        held->next_attempt = time(NULL);
+        strcpy(held->holding_node_ip, work->ip);
+        held->holding_node_port = work->port;
+    } else if (work->role == 'p') {
+        if (held->role == HOLD_ROLE_REPLICA) {
+            held->role = HOLD_ROLE_PRIMARY;
+            held->status = MSG_STATUS_HELD;
+            held->next_attempt = time(NULL);
+            held->seq = 0;
+            standby_note(shard, held, 1);
+        }
+    } else if (held->role == HOLD_ROLE_REPLICA) {
+        strcpy(held->holding_node_ip, work->ip);
+        held->holding_node_port = work->port;
+    }
+}
+
+// The primary delivered or expired the message; drop our replica or
+// fragment. Older nodes leave out the target, and then every shard has to
+// look. A fragment holder reports the fragment it delivered the same way.
+void handle_hold_response(protocol_message_t* msg) {
+    shard_work_t* work = new_shard_work(WORK_RELEASE);
+    if (!work) return;
+    
+    if (strncmp(msg->data, "fragdone:", 9) == 0) {
+        work->kind = WORK_FRAGMENT_DONE;
+        if (sscanf(msg->data, "fragdone:%lu t:%hu.%hu.%u", &work->message_id, &work->target.realm,
+                   &work->target.cluster, &work->target.node_id) == 4) {
+            post_shard_work(shard_for(&work->target), work);
+        } else {
+            free(work);
+        }
+        return;
+    }
+    
+    int parsed = sscanf(msg->data, "release:%lu t:%hu.%hu.%u", &work->message_id,
+                        &work->target.realm, &work->target.cluster, &work->target.node_id);
+    if (parsed == 4) {
+        post_shard_work(shard_for(&work->target), work);
+    } else if (parsed == 1) {
+        post_all_shards(work);
+    } else {
+        free(work);
+    }
+}
+
+void apply_hold_release(hold_shard_t* shard, shard_work_t* work) {
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* held = &shard->messages[i];
+        if (held->message_id == work->message_id &&
+            (held->role == HOLD_ROLE_REPLICA || held->is_fragment)) {
+            held->status = MSG_STATUS_DELIVERED;
+        }
+    }
+}
+
+// A holder delivered fragment work->message_id. Any k delivered fragments
+// let the target rebuild the message, so then it is delivered.
+void apply_fragment_done(hold_shard_t* shard, shard_work_t* work) {
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* held = &shard->messages[i];
+        if (held->role != HOLD_ROLE_DISPERSED && held->role != HOLD_ROLE_PRIMARY) continue;
+        if (!held->fragments_placed || held->status == MSG_STATUS_DELIVERED ||
+            !addresses_equal(&held->target_address, &work->target)) {
+            continue;
+        }
+        
+        for (int f = 0; f < ERASURE_MAX_SHARDS; f++) {
+            if (!(held->fragments_placed & (1u << f)) ||
+                fragment_message_id(held->message_id, f) != work->message_id) {
+                continue;
+            }
+            held->fragments_delivered |= 1u << f;
+            if (__builtin_popcount(held->fragments_delivered) >= held->erasure_k) {
+                if (held->status == MSG_STATUS_ATTEMPTING) {
+                    delivery_window_t* window = get_delivery_window(shard, &held->target_address);
+                    if (window && window->in_flight > 0) window->in_flight--;
+                }
+                held->status = MSG_STATUS_DELIVERED;
+                held->handoff_flags |= HANDOFF_RELEASE;
+                standby_note(shard, held, 0);
+                printf("Message %lu delivered to ", held->message_id);
+                print_othernet_address(&held->target_address);
+                printf(" as fragments\n");
+            }
             return;
         }
     }
+}
+
+// Runs on the shard thread. Replicas count as placed once their HOLD
+// frame went out; a failed batch is simply retried on a later pass.
+void drain_handoff_completion(hold_shard_t* shard, delivery_job_t* job) {
+    for (int f = 0; f < job->frame_count; f++) {
+        batch_entry_t* entry = &job->entries[f];
+        if (entry->slot < 0 || entry->peer_index < 0) continue;
+        
+        held_message_t* msg = &shard->messages[entry->slot];
+        if (msg->message_id != entry->message_id) continue;
+        if (msg->replication_pending > 0) msg->replication_pending--;
+        if (job->result != 0 ||
+            (msg->role != HOLD_ROLE_PRIMARY && msg->role != HOLD_ROLE_DISPERSED)) {
+            continue;
+        }
+        
+        if (entry->fragment >= 0) {
+            // Once every fragment is out the holders deliver; we wait for
+            // them to report and no longer need our copy
+            msg->fragments_placed |= 1u << entry->fragment;
+            msg->fragment_holders[entry->fragment] = entry->peer_index;
+            if (msg->fragments_placed == (1u << (msg->erasure_k + msg->erasure_m)) - 1) {
+                msg->role = HOLD_ROLE_DISPERSED;
+                payload_release(shard, msg->payload);
+                msg->payload = 0;
+            }
+            continue;
+        }
+        
+        for (int r = 0; r < REPLICATION_FACTOR; r++) {
+            if (msg->replicas[r] == entry->peer_index) break;
+            if (msg->replicas[r] < 0) {
+                msg->replicas[r] = entry->peer_index;
+                break;
+            }
+        }
+    }
+}
+
+// Sends to every active peer. The list is copied out first, so a peer
+// that is slow to connect does not hold up everything else on peers_mutex.
+void broadcast_protocol_message(protocol_message_t* msg) {
+    char ips[MAX_PEERS][16];
+    int ports[MAX_PEERS];
+    int count = 0;
     
-    // Add new peer
-    if (peer_count < MAX_PEERS) {
-        peer_t* peer = &peers[peer_count++];
-        strcpy(peer->ip, ip);
-        peer->port = port;
-        peer->address = *addr;
-        peer->capabilities = capabilities;
-        peer->load_factor = 0.0;
-        peer->last_seen = time(NULL);
-        peer->active = 1;
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].active) {
+            strcpy(ips[count], peers[i].ip);
+            ports[count] = peers[i].port;
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    for (int i = 0; i < count; i++) {
+        send_protocol_message(ips[i], ports[i], msg);
+    }
+}
+
+// Floods a HELLO through the given realm and cluster (0 = all). Receivers
+// in scope learn us, forward it with one hop less and remember its id.
+void announce_presence(uint16_t realm, uint16_t cluster, uint8_t hops) {
+    protocol_message_t* announcement = malloc(sizeof(protocol_message_t));
+    if (!announcement) return;
+    memset(announcement, 0, offsetof(protocol_message_t, data));
+    announcement->type = MSG_TYPE_HELLO;
+    announcement->sender = local_address();
+    strcpy(announcement->sender_ip, my_ip);
+    announcement->sender_port = my_port;
+    announcement->scope.realm = realm;
+    announcement->scope.cluster = cluster;
+    announcement->scope.max_hops = hops;
+    announcement->ttl = hops;
+    announcement->timestamp = time(NULL);
+    
+    struct { othernet_address_t addr; uint32_t epoch; uint32_t seq; } key;
+    memset(&key, 0, sizeof(key));
+    key.addr = local_address();
+    key.epoch = my_epoch;
+    key.seq = ++announce_seq;
+    uint64_t id = hash_bytes(&key, sizeof(key), 0) | 1;
+    announcement_seen(id);
+    
+    char topics[TOPIC_FILTER_HEX];
+    format_topic_filter(topics);
+    snprintf(announcement->data, sizeof(announcement->data), 
+             "capabilities:%u load:%.2f ann:%llx topics:%s", my_capabilities, 
+             (float)atomic_load(&held_message_count) / MAX_HELD_MESSAGES, (unsigned long long)id,
+             topics);
+    
+    // The first hop honors the scope like every later one
+    send_to_scope(announcement, NULL);
+    free(announcement);
+}
+
+void send_capability_update() {
+    protocol_message_t* update = malloc(sizeof(protocol_message_t));
+    if (!update) return;
+    memset(update, 0, offsetof(protocol_message_t, data));
+    update->type = MSG_TYPE_CAPABILITY_UPDATE;
+    update->sender = local_address();
+    strcpy(update->sender_ip, my_ip);
+    update->sender_port = my_port;
+    update->timestamp = time(NULL);
+    
+    float load = (float)atomic_load(&held_message_count) / MAX_HELD_MESSAGES;
+    char topics[TOPIC_FILTER_HEX];
+    format_topic_filter(topics);
+    snprintf(update->data, sizeof(update->data), 
+             "capabilities:%u load:%.3f uptime:%ld topics:%s", 
+             my_capabilities, load, (long)(time(NULL) - node_start_time), topics);
+    
+    broadcast_protocol_message(update);
+    free(update);
+}
+
+// Caller holds peers_mutex. Finds the heap for one scope of addr, creating
+// it when asked to. Heaps are never freed, like peer slots.
+holding_heap_t* get_holding_heap(int level, othernet_address_t* addr, int create) {
+    uint16_t realm = (level == 2) ? HOLDING_SCOPE_ANY : addr->realm;
+    uint16_t cluster = (level == 0) ? addr->cluster : HOLDING_SCOPE_ANY;
+    
+    for (int i = 0; i < holding_heap_count; i++) {
+        holding_heap_t* heap = &holding_heaps[i];
+        if (heap->level == level && heap->realm == realm && heap->cluster == cluster) {
+            return heap;
+        }
+    }
+    
+    if (!create || holding_heap_count >= MAX_HOLDING_HEAPS) return NULL;
+    
+    holding_heap_t* heap = &holding_heaps[holding_heap_count++];
+    heap->realm = realm;
+    heap->cluster = cluster;
+    heap->level = level;
+    heap->size = 0;
+    return heap;
+}
+
+static void holding_heap_swap(holding_heap_t* heap, int a, int b) {
+    int16_t peer = heap->peer[a];
+    heap->peer[a] = heap->peer[b];
+    heap->peer[b] = peer;
+    peers[heap->peer[a]].heap_pos[heap->level] = a;
+    peers[heap->peer[b]].heap_pos[heap->level] = b;
+}
+
+static void holding_heap_sift_up(holding_heap_t* heap, int pos) {
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (peers[heap->peer[parent]].load_factor <= peers[heap->peer[pos]].load_factor) break;
+        holding_heap_swap(heap, pos, parent);
+        pos = parent;
+    }
+}
+
+static void holding_heap_sift_down(holding_heap_t* heap, int pos) {
+    for (;;) {
+        int smallest = pos;
+        int left = 2 * pos + 1;
+        int right = left + 1;
+        if (left < heap->size &&
+            peers[heap->peer[left]].load_factor < peers[heap->peer[smallest]].load_factor) {
+            smallest = left;
+        }
+        if (right < heap->size &&
+            peers[heap->peer[right]].load_factor < peers[heap->peer[smallest]].load_factor) {
+            smallest = right;
+        }
+        if (smallest == pos) break;
+        holding_heap_swap(heap, pos, smallest);
+        pos = smallest;
+    }
+}
+
+// Caller holds peers_mutex. Brings peer index into, out of or to its new
+// place in its heaps after its state, capabilities or load changed.
+void update_holding_candidate(int index) {
+    peer_t* peer = &peers[index];
+    int eligible = peer->active && (peer->capabilities & CAPABILITY_HOLDING);
+    
+    for (int level = 0; level < HOLDING_HEAP_LEVELS; level++) {
+        if (peer->heap_index[level] < 0) {
+            if (!eligible) continue;
+            holding_heap_t* heap = get_holding_heap(level, &peer->address, 1);
+            if (!heap) continue;
+    
+            peer->heap_index[level] = heap - holding_heaps;
+            peer->heap_pos[level] = heap->size;
+            heap->peer[heap->size++] = index;
+            holding_heap_sift_up(heap, peer->heap_pos[level]);
+            continue;
+        }
+    
+        holding_heap_t* heap = &holding_heaps[peer->heap_index[level]];
+        int pos = peer->heap_pos[level];
+    
+        if (!eligible) {
+            // Move the last entry into the hole and restore the order
+            int last = --heap->size;
+            if (pos != last) {
+                holding_heap_swap(heap, pos, last);
+                int moved = heap->peer[pos];
+                holding_heap_sift_up(heap, pos);
+                holding_heap_sift_down(heap, peers[moved].heap_pos[level]);
+            }
+            peer->heap_index[level] = -1;
+            peer->heap_pos[level] = -1;
+            continue;
+        }
+    
+        holding_heap_sift_up(heap, pos);
+        holding_heap_sift_down(heap, peer->heap_pos[level]);
+    }
+}
+
+static float holding_score(peer_t* peer, othernet_address_t* target) {
+    float score = peer->load_factor;
+    if (peer->address.realm != target->realm) score += 0.5;
+    if (peer->address.cluster != target->cluster) score += 0.2;
+    return score;
+}
+
+// Picks a holder for target. The heap roots give the least loaded holder
+// in the target's cluster, realm and overall; the scope whose root scores
+// best (load plus distance) wins. Within it we take the better of two
+// random picks from the top of the heap, so nodes working from the same
+// stale loads do not all pile onto one holder.
+peer_t* find_best_holding_node(othernet_address_t* target) {
+    peer_t* best = NULL;
+    holding_heap_t* best_heap = NULL;
+    float best_score = 1000.0;  // Lower is better
+    
+    pthread_mutex_lock(&peers_mutex);
+    
+    for (int level = 0; level < HOLDING_HEAP_LEVELS; level++) {
+        holding_heap_t* heap = get_holding_heap(level, target, 0);
+        if (!heap) continue;
+    
+        // The target cannot hold for itself; its children stand in for it
+        for (int pos = 0; pos < heap->size && pos < 3; pos++) {
+            peer_t* peer = &peers[heap->peer[pos]];
+            if (addresses_equal(&peer->address, target)) continue;
+            float score = holding_score(peer, target);
+            if (score < best_score) {
+                best_score = score;
+                best_heap = heap;
+            }
+        }
+    }
+    
+    if (best_heap) {
+        int top = best_heap->size < HOLDING_HEAP_TOP ? best_heap->size : HOLDING_HEAP_TOP;
+        int a = rand_r(&holding_choice_seed) % top;
+        int b = (top > 1) ? (a + 1 + rand_r(&holding_choice_seed) % (top - 1)) % top : a;
+        peer_t* pa = &peers[best_heap->peer[a]];
+        peer_t* pb = &peers[best_heap->peer[b]];
+    
+        if (addresses_equal(&pa->address, target)) pa = NULL;
+        if (addresses_equal(&pb->address, target)) pb = NULL;
+        if (pa && pb) best = holding_score(pa, target) <= holding_score(pb, target) ? pa : pb;
+        else best = pa ? pa : pb;
+    
+        // Both picks were the target: fall back to the best non-target entry
+        for (int pos = 0; !best && pos < best_heap->size && pos < 3; pos++) {
+            peer_t* peer = &peers[best_heap->peer[pos]];
+            if (!addresses_equal(&peer->address, target)) best = peer;
+        }
+    }
+    
+    if (best) {
+        // Count the message against the holder until its next update
+        // replaces our estimate, so a burst spreads across holders
+        best->load_factor += 1.0f / MAX_HELD_MESSAGES;
+        update_holding_candidate(best - peers);
+    }
+    
+    pthread_mutex_unlock(&peers_mutex);
+    return best;
+}
+
+void handle_capability_update(protocol_message_t* msg, const char* from_ip) {
+    uint32_t capabilities = 0;
+    float load = 0.0;
+    long uptime = 0;
+    
+    if (sscanf(msg->data, "capabilities:%u load:%f uptime:%ld",
+               &capabilities, &load, &uptime) < 2) {
+        return;
+    }
+    if (load < 0.0) load = 0.0;
+    
+    // An update can be the first we hear of a peer, or bring back one the
+    // failure detector dropped
+    if (add_peer(from_ip, msg->sender_port, &msg->sender, capabilities)) {
+        wake_held_messages_for(&msg->sender);
+    }
+    
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < peer_count; i++) {
+        peer_t* peer = &peers[i];
+        if (peer->port != msg->sender_port || strcmp(peer->ip, from_ip) != 0) continue;
+    
+        // Start over from the sample on the first update and after a restart
+        if (peer->uptime == 0 || uptime < peer->uptime) {
+            peer->load_factor = load;
+        } else {
+            peer->load_factor += LOAD_EWMA_ALPHA * (load - peer->load_factor);
+        }
+        peer->uptime = uptime > 0 ? uptime : 1;
+        update_holding_candidate(i);
+        break;
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    // Parsed on its own and stored only if valid, like a HELLO's
+    update_peer_topics(from_ip, msg->sender_port, msg->data);
+}
+
+// GF(2^8) with the 0x11d polynomial, as used by most Reed-Solomon codes
+static void gf_mul_region_xor_scalar(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    if (c == 0) return;
+    int log_c = gf_log[c];
+    for (size_t i = 0; i < len; i++) {
+        if (src[i]) dst[i] ^= gf_exp[log_c + gf_log[src[i]]];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// dst ^= c * src, 16 bytes at a time: the product of c with the low and
+// high nibble of each byte comes from two 16-entry tables via pshufb
+__attribute__((target("ssse3")))
+static void gf_mul_region_xor_ssse3(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul(c, x);
+        hi[x] = gf_mul(c, x << 4);
+    }
+    __m128i table_lo = _mm_loadu_si128((const __m128i*)lo);
+    __m128i table_hi = _mm_loadu_si128((const __m128i*)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i l = _mm_shuffle_epi8(table_lo, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(table_hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    gf_mul_region_xor_scalar(dst + i, src + i, c, len - i);
+}
+
+// Same as the SSSE3 kernel, 32 bytes at a time
+__attribute__((target("avx2")))
+static void gf_mul_region_xor_avx2(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul(c, x);
+        hi[x] = gf_mul(c, x << 4);
+    }
+    __m256i table_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+    __m256i table_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i l = _mm256_shuffle_epi8(table_lo, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(table_hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    gf_mul_region_xor_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+void gf_init() {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    
+    gf_mul_region_xor = gf_mul_region_xor_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        gf_mul_region_xor = gf_mul_region_xor_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        gf_mul_region_xor = gf_mul_region_xor_ssse3;
+    }
+#endif
+}
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+// Systematic code: rows below k are the identity, parity rows come from a
+// Cauchy matrix, so any k of the k+m rows form an invertible matrix
+uint8_t rs_coefficient(int row, int col, int k) {
+    if (row < k) return row == col;
+    return gf_inv((uint8_t)(row ^ col));
+}
+
+void rs_encode(const uint8_t* data, size_t len, int k, int m,
+               uint8_t shards[][ERASURE_MAX_SHARD], size_t shard_size) {
+    for (int i = 0; i < k; i++) {
+        size_t start = i * shard_size;
+        size_t n = start < len ? len - start : 0;
+        if (n > shard_size) n = shard_size;
+        memcpy(shards[i], data + start, n);
+        memset(shards[i] + n, 0, shard_size - n);
+    }
+    
+    for (int p = k; p < k + m; p++) {
+        memset(shards[p], 0, shard_size);
+        for (int i = 0; i < k; i++) {
+            gf_mul_region_xor(shards[p], shards[i], rs_coefficient(p, i, k), shard_size);
+        }
+    }
+}
+
+// Rebuilds the data from the first k shards marked in present.
+// Returns 0 on success, -1 if fewer than k shards are available.
+int rs_decode(uint8_t shards[][ERASURE_MAX_SHARD], uint32_t present, int k, int m,
+              size_t shard_size, uint8_t* out, size_t len) {
+    int rows[ERASURE_MAX_SHARDS];
+    int n = 0;
+    for (int r = 0; r < k + m && n < k; r++) {
+        if (present & (1u << r)) rows[n++] = r;
+    }
+    if (n < k) return -1;
+    
+    // Invert the k x k matrix of the rows we have (Gauss-Jordan)
+    uint8_t a[ERASURE_MAX_SHARDS][ERASURE_MAX_SHARDS];
+    uint8_t inv[ERASURE_MAX_SHARDS][ERASURE_MAX_SHARDS];
+    for (int r = 0; r < k; r++) {
+        for (int c = 0; c < k; c++) {
+            a[r][c] = rs_coefficient(rows[r], c, k);
+            inv[r][c] = (r == c);
+        }
+    }
+    
+    for (int c = 0; c < k; c++) {
+        int pivot = c;
+        while (pivot < k && a[pivot][c] == 0) pivot++;
+        if (pivot == k) return -1;
+        if (pivot != c) {
+            for (int j = 0; j < k; j++) {
+                uint8_t t = a[c][j]; a[c][j] = a[pivot][j]; a[pivot][j] = t;
+                t = inv[c][j]; inv[c][j] = inv[pivot][j]; inv[pivot][j] = t;
+            }
+        }
         
-        printf("Added peer: ");
-        print_othernet_address(addr);
-        printf(" at %s:%d\n", ip, port);
+        uint8_t scale = gf_inv(a[c][c]);
+        for (int j = 0; j < k; j++) {
+            a[c][j] = gf_mul(a[c][j], scale);
+            inv[c][j] = gf_mul(inv[c][j], scale);
+        }
+        
+        for (int r = 0; r < k; r++) {
+            uint8_t factor = a[r][c];
+            if (r == c || factor == 0) continue;
+            for (int j = 0; j < k; j++) {
+                a[r][j] ^= gf_mul(factor, a[c][j]);
+                inv[r][j] ^= gf_mul(factor, inv[c][j]);
+            }
+        }
+    }
+    
+    uint8_t* data_shard = malloc(shard_size);
+    if (!data_shard) return -1;
+    for (int i = 0; i < k; i++) {
+        memset(data_shard, 0, shard_size);
+        for (int j = 0; j < k; j++) {
+            gf_mul_region_xor(data_shard, shards[rows[j]], inv[i][j], shard_size);
+        }
+        
+        size_t start = i * shard_size;
+        if (start >= len) break;
+        size_t count = len - start < shard_size ? len - start : shard_size;
+        memcpy(out + start, data_shard, count);
+    }
+    
+    free(data_shard);
+    return 0;
+}
+
+// Fragment size for this message, or 0 if it should be replicated instead:
+// coding is off, the payload is small, or a fragment would not fit in a
+// held payload. The message takes the current coding until one of its
+// fragments is out; from then on it keeps its own k and m.
+int erasure_shard_size(held_message_t* msg) {
+    if (!msg->fragments_placed && !msg->fragments_delivered) {
+        int code = atomic_load(&erasure_code);
+        msg->erasure_k = code >> 8;
+        msg->erasure_m = code & 0xff;
+    }
+    if (msg->erasure_k == 0) return 0;
+    
+    size_t len = msg->payload_len;
+    if (len < ERASURE_MIN_PAYLOAD) return 0;
+    
+    size_t shard_size = (len + msg->erasure_k - 1) / msg->erasure_k;
+    if (shard_size > ERASURE_MAX_SHARD) return 0;
+    return shard_size;
+}
+
+uint64_t fragment_message_id(uint64_t message_id, int index) {
+    uint64_t key[2] = { message_id, (uint64_t)index };
+    return hash_bytes(key, sizeof(key), 0x66726167);
+}
+
+// A fragment travels as its own held message so holders dedupe re-sends.
+// Its payload is a text header, a NUL and the shard bytes, which go out as
+// the frame body and are held as they are.
+int format_fragment_frame(protocol_message_t* frame, held_message_t* msg, int index,
+                           const uint8_t* shard, size_t shard_size) {
+    held_message_t fragment = *msg;
+    fragment.message_id = fragment_message_id(msg->message_id, index);
+    
+    size_t size = shard_size + 128;
+    char* payload = malloc(size);
+    if (!payload) return -1;
+    int len = snprintf(payload, size, "frag:%lu:%d:%d:%d:%u",
+                       msg->message_id, index, msg->erasure_k, msg->erasure_m, msg->payload_len);
+    memcpy(payload + len + 1, shard, shard_size);
+    
+    format_hold_frame(frame, &fragment, 'f', payload, len + 1 + shard_size);
+    free(payload);
+    return 0;
+}
+
+// Target side, caller holds receive_mutex. Returns 1 and fills out once k
+// distinct fragments of a message have arrived. Fragments that arrive after
+// that are dropped rather than starting an assembly that would push out
+// messages still being rebuilt.
+int assemble_fragment(protocol_message_t* msg, const char* header, char* out, size_t out_size,
+                      uint64_t* message_id) {
+    int index, k, m;
+    size_t len;
+    
+    if (sscanf(header, "frag:%lu:%d:%d:%d:%zu", message_id, &index, &k, &m, &len) != 5 ||
+        k < 2 || m < 1 || k + m > ERASURE_MAX_SHARDS || index < 0 || index >= k + m ||
+        len >= out_size) {
+        return 0;
+    }
+    
+    for (int i = 0; i < COMPLETED_ASSEMBLIES; i++) {
+        if (completed_assemblies[i] == *message_id) return 0;
+    }
+    
+    const uint8_t* shard = (const uint8_t*)frame_body(msg);
+    size_t shard_size = msg->body_len;
+    if (shard_size == 0 || shard_size > ERASURE_MAX_SHARD || shard_size * k < len) {
+        return 0;
+    }
+    
+    fragment_assembly_t* fa = NULL;
+    fragment_assembly_t* oldest = &fragment_assemblies[0];
+    for (int i = 0; i < FRAGMENT_ASSEMBLIES; i++) {
+        fragment_assembly_t* a = &fragment_assemblies[i];
+        if (a->active && a->message_id == *message_id &&
+            addresses_equal(&a->sender, &msg->sender)) {
+            fa = a;
+            break;
+        }
+        if (!a->active || (oldest->active && a->started < oldest->started)) {
+            oldest = a;
+        }
+    }
+    
+    if (!fa) {
+        // Only the header: the shards are written before they are read
+        fa = oldest;
+        fa->present = 0;
+        fa->message_id = *message_id;
+        fa->sender = msg->sender;
+        fa->k = k;
+        fa->m = m;
+        fa->len = len;
+        fa->shard_size = shard_size;
+        fa->started = time(NULL);
+        fa->active = 1;
+    }
+    if (fa->k != k || fa->m != m || fa->shard_size != shard_size) {
+        return 0;
+    }
+    
+    memcpy(fa->shards[index], shard, shard_size);
+    fa->present |= 1u << index;
+    
+    if (__builtin_popcount(fa->present) < k) {
+        return 0;
+    }
+    
+    int ok = rs_decode(fa->shards, fa->present, k, m, shard_size, (uint8_t*)out, len) == 0;
+    out[len] = '\0';
+    
+    // Later fragments of this message will just be acknowledged
+    fa->active = 0;
+    completed_assemblies[completed_assembly_pos] = *message_id;
+    completed_assembly_pos = (completed_assembly_pos + 1) % COMPLETED_ASSEMBLIES;
+    return ok;
+}
+
+// CRASH fast lane. With "fastlane on", CRASH messages to a direct peer
+// skip the hold shards: the fast lane thread keeps a connection open to
+// every active peer (TCP_NODELAY, busy polling where the kernel allows
+// it) and writes the message straight out. The target answers with a
+// fack on the same connection, which gives us the round trip. Anything
+// that cannot go this way, or is not facked in time, falls back to the
+// store under the same message id so the target never shows it twice.
+void send_crash_message(othernet_address_t* target, const char* payload) {
+    size_t len = strlen(payload);
+    
+    if (!atomic_load(&fastlane_enabled) || route_lookup(target, NULL, NULL) < 0 || len > MAX_PAYLOAD) {
+        queue_message_for_holding(target, payload, PRIORITY_CRASH);
+        return;
+    }
+    
+    fast_send_t* item = malloc(sizeof(fast_send_t) + len + 1);
+    if (!item) {
+        queue_message_for_holding(target, payload, PRIORITY_CRASH);
+        return;
+    }
+    item->target = *target;
+    memcpy(item->payload, payload, len + 1);
+    
+    fast_send_t* head = atomic_load_explicit(&fastlane_inbox, memory_order_relaxed);
+    do {
+        item->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&fastlane_inbox, &head, item,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    uint64_t one = 1;
+    if (write(fastlane_event_fd, &one, sizeof(one)) < 0) {
+        perror("fast lane wakeup");
+    }
+}
+
+// Hands a message the fast lane could not deliver to its hold shard
+void fastlane_fall_back(othernet_address_t* target, uint64_t message_id, const char* payload) {
+    shard_work_t* work = new_shard_work(WORK_QUEUE);
+    shared_payload_t* shared = new_shared_payload(payload, strlen(payload), 1);
+    
+    if (!work || !shared || !(work->targets = malloc(sizeof(othernet_address_t)))) {
+        printf("No memory to hold message\n");
+        if (work) free_shard_work(work);
+        release_shared_payload(shared);
+        return;
+    }
+    work->message_id = message_id;
+    work->targets[0] = *target;
+    work->count = 1;
+    work->priority = PRIORITY_CRASH;
+    work->payload = shared;
+    post_shard_work(shard_for(target), work);
+    
+    pthread_mutex_lock(&latency_mutex);
+    fastlane_fallbacks++;
+    pthread_mutex_unlock(&latency_mutex);
+}
+
+// With connecting NULL the connect blocks; otherwise it is started
+// without waiting and *connecting says whether it is still in progress.
+// Either way the socket is left blocking once connected.
+static int open_low_latency_connection(const char* ip, int port, int* connecting) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    
+    // Bounded connect, and writes that never stall the caller for long
+    struct timeval timeout = { 0, FASTLANE_ACK_TIMEOUT_US };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_BUSY_POLL
+    int busy_poll = FASTLANE_BUSY_POLL_US;
+    setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+#endif
+    
+    struct sockaddr_in peer_addr;
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &peer_addr.sin_addr);
+    
+    if (connecting) {
+        int flags = fcntl(sock, F_GETFL, 0);
+        fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+        *connecting = 0;
+        if (connect(sock, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) != 0) {
+            if (errno != EINPROGRESS) {
+                close(sock);
+                return -1;
+            }
+            *connecting = 1;
+            return sock;
+        }
+        fcntl(sock, F_SETFL, flags);
+        return sock;
+    }
+    
+    if (connect(sock, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Fast lane thread only
+static void fastlane_connect(int index, const char* ip, int port) {
+    fastlane_fds[index] = open_low_latency_connection(ip, port, &fastlane_connecting[index]);
+    fastlane_buffered[index] = 0;
+}
+
+static void fastlane_disconnect(int index) {
+    close(fastlane_fds[index]);
+    fastlane_fds[index] = -1;
+    fastlane_connecting[index] = 0;
+}
+
+// Fast lane thread only. Called once a connect in progress is writable or
+// failed; a connected socket goes back to blocking writes.
+static void fastlane_finish_connect(int index) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(fastlane_fds[index], SOL_SOCKET, SO_ERROR, &error, &error_len) != 0 || error != 0) {
+        fastlane_disconnect(index);
+        return;
+    }
+    int flags = fcntl(fastlane_fds[index], F_GETFL, 0);
+    fcntl(fastlane_fds[index], F_SETFL, flags & ~O_NONBLOCK);
+    fastlane_connecting[index] = 0;
+}
+
+// Fast lane thread only. Starts a connection to every active peer and
+// closes those to peers that are gone, or all of them when the lane is off.
+// Connects do not block; the poll loop finishes them.
+void fastlane_sync_connections() {
+    char ips[MAX_PEERS][16];
+    int ports[MAX_PEERS];
+    int active[MAX_PEERS];
+    int count;
+    
+    pthread_mutex_lock(&peers_mutex);
+    count = peer_count;
+    for (int i = 0; i < count; i++) {
+        strcpy(ips[i], peers[i].ip);
+        ports[i] = peers[i].port;
+        active[i] = peers[i].active;
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    
+    int enabled = atomic_load(&fastlane_enabled);
+    for (int i = 0; i < count; i++) {
+        if (enabled && active[i] && fastlane_fds[i] < 0) {
+            fastlane_connect(i, ips[i], ports[i]);
+        } else if ((!enabled || !active[i]) && fastlane_fds[i] >= 0) {
+            fastlane_disconnect(i);
+        }
+    }
+}
+
+// Fast lane thread only. Writes one CRASH message to its target's
+// connection and remembers it until the fack comes back.
+static void fastlane_send(fast_send_t* item) {
+    static protocol_message_t frame;
+    static char wire[BUFFER_SIZE];
+    uint64_t message_id = generate_message_id();
+    
+    char ip[16];
+    int port = 0;
+    int index = route_lookup(&item->target, ip, &port);
+    
+    fast_pending_t* slot = NULL;
+    for (int i = 0; i < FASTLANE_PENDING && !slot; i++) {
+        if (!fastlane_pending[i].payload) slot = &fastlane_pending[i];
+    }
+    
+    // A peer still connecting gets this one through the store
+    if (index >= 0 && fastlane_fds[index] < 0 && atomic_load(&fastlane_enabled)) {
+        fastlane_connect(index, ip, port);
+    }
+    if (index < 0 || fastlane_fds[index] < 0 || fastlane_connecting[index] || !slot) {
+        fastlane_fall_back(&item->target, message_id, item->payload);
+        return;
+    }
+    
+    long sent_us = current_time_us();
+    memset(&frame, 0, offsetof(protocol_message_t, data));
+    frame.type = MSG_TYPE_OTHERNET_MESSAGE;
+    frame.sender = local_address();
+    strcpy(frame.sender_ip, my_ip);
+    frame.sender_port = my_port;
+    frame.timestamp = time(NULL);
+    snprintf(frame.data, sizeof(frame.data), "fast:%" PRIu64 ":%ld %s", message_id, sent_us,
+             item->payload);
+    
+    int len = format_protocol_message(wire, sizeof(wire), &frame);
+    int sent = 0;
+    while (sent < len) {
+        ssize_t n = send(fastlane_fds[index], wire + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+    }
+    if (sent < len) {
+        fastlane_disconnect(index);
+        fastlane_fall_back(&item->target, message_id, item->payload);
+        return;
+    }
+    
+    // Sent, but with nothing to wait for the fack in; the store makes sure
+    slot->payload = strdup(item->payload);
+    if (!slot->payload) {
+        fastlane_fall_back(&item->target, message_id, item->payload);
+        return;
     }
+    slot->message_id = message_id;
+    slot->target = item->target;
+    slot->sent_us = sent_us;
+}
+
+static void fastlane_record_latency(long us) {
+    pthread_mutex_lock(&latency_mutex);
+    fastlane_latency_us[fastlane_latency_count % LATENCY_SAMPLES] = us;
+    fastlane_latency_count++;
+    pthread_mutex_unlock(&latency_mutex);
+}
+
+// Fast lane thread only. Settles facks in the frames read from peer index.
+static void fastlane_read_acks(int index) {
+    static protocol_message_t msg;
+    char* buffer = fastlane_rx[index];
     
-    pthread_mutex_unlock(&peers_mutex);
+    ssize_t n = recv(fastlane_fds[index], buffer + fastlane_buffered[index],
+                     FASTLANE_RX_SIZE - 1 - fastlane_buffered[index], 0);
+    if (n <= 0) {
+        fastlane_disconnect(index);
+        return;
+    }
+    fastlane_buffered[index] += n;
+    buffer[fastlane_buffered[index]] = '\0';
+    
+    long now_us = current_time_us();
+    char* line = buffer;
+    char* end;
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = '\0';
+        uint64_t message_id;
+        if (parse_protocol_message(line, &msg) && msg.type == MSG_TYPE_DELIVERY_CONFIRM &&
+            sscanf(msg.data, "fack:%" SCNu64, &message_id) == 1) {
+            for (int i = 0; i < FASTLANE_PENDING; i++) {
+                fast_pending_t* pending = &fastlane_pending[i];
+                if (pending->payload && pending->message_id == message_id) {
+                    fastlane_record_latency(now_us - pending->sent_us);
+                    free(pending->payload);
+                    pending->payload = NULL;
+                    break;
+                }
+            }
+        }
+        line = end + 1;
+    }
+    
+    fastlane_buffered[index] = strlen(line);
+    memmove(buffer, line, fastlane_buffered[index]);
+    if (fastlane_buffered[index] >= FASTLANE_RX_SIZE - 1) fastlane_buffered[index] = 0;
 }
 
-peer_t* find_peer_by_address(othernet_address_t* addr) {
-    for (int i = 0; i < peer_count; i++) {
-        if (peers[i].active &&
-            peers[i].address.realm == addr->realm &&
-            peers[i].address.cluster == addr->cluster &&
-            peers[i].address.node_id == addr->node_id) {
-            return &peers[i];
+void* fastlane_thread(void* arg) {
+    (void)arg;
+    struct pollfd fds[MAX_PEERS + 1];
+    int owners[MAX_PEERS + 1];
+    long last_sync = 0;
+    long last_activity = 0;
+    
+    for (int i = 0; i < MAX_PEERS; i++) fastlane_fds[i] = -1;
+    
+    while (running) {
+        long now_us = current_time_us();
+        if (now_us - last_sync >= 1000000) {
+            fastlane_sync_connections();
+            last_sync = now_us;
+        }
+        
+        int nfds = 0;
+        fds[nfds].fd = fastlane_event_fd;
+        fds[nfds].events = POLLIN;
+        owners[nfds++] = -1;
+        for (int i = 0; i < MAX_PEERS; i++) {
+            if (fastlane_fds[i] < 0) continue;
+            fds[nfds].fd = fastlane_fds[i];
+            fds[nfds].events = fastlane_connecting[i] ? POLLOUT : POLLIN;
+            owners[nfds++] = i;
+        }
+        
+        int waiting = 0;
+        for (int i = 0; i < FASTLANE_PENDING; i++) {
+            if (fastlane_pending[i].payload) waiting++;
+        }
+        
+        // Spin briefly while facks are due, then poll in 1 ms steps
+        int timeout = 100;
+        if (waiting) timeout = (now_us - last_activity < FASTLANE_SPIN_US) ? 0 : 1;
+        if (poll(fds, nfds, timeout) > 0) last_activity = current_time_us();
+        
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(fastlane_event_fd, &count, sizeof(count)) < 0) {
+                perror("fast lane wakeup");
+            }
+        }
+        
+        // Send in the order messages were posted
+        fast_send_t* stack = atomic_exchange_explicit(&fastlane_inbox, NULL, memory_order_acquire);
+        fast_send_t* items = NULL;
+        while (stack) {
+            fast_send_t* next = stack->next;
+            stack->next = items;
+            items = stack;
+            stack = next;
+        }
+        while (items) {
+            fast_send_t* next = items->next;
+            fastlane_send(items);
+            free(items);
+            items = next;
+        }
+        
+        for (int f = 1; f < nfds; f++) {
+            int index = owners[f];
+            if (fastlane_fds[index] != fds[f].fd) continue;
+            if (fastlane_connecting[index]) {
+                if (fds[f].revents & (POLLOUT | POLLHUP | POLLERR)) fastlane_finish_connect(index);
+            } else if (fds[f].revents & (POLLIN | POLLHUP | POLLERR)) {
+                fastlane_read_acks(index);
+            }
+        }
+        
+        // No fack in time: the store takes over
+        now_us = current_time_us();
+        for (int i = 0; i < FASTLANE_PENDING; i++) {
+            fast_pending_t* pending = &fastlane_pending[i];
+            if (pending->payload && now_us - pending->sent_us > FASTLANE_ACK_TIMEOUT_US) {
+                fastlane_fall_back(&pending->target, pending->message_id, pending->payload);
+                free(pending->payload);
+                pending->payload = NULL;
+            }
         }
     }
+    
     return NULL;
 }
 
-uint64_t generate_message_id() {
-    static uint64_t counter = 0;
-    return ((uint64_t)time(NULL) << 32) | (++counter);
+// Target side of the fast lane: fack on the same connection first, then
+// show the message unless the store already brought it
+void handle_fast_message(protocol_message_t* msg, int client_socket) {
+    uint64_t message_id;
+    long sent_us;
+    int offset = 0;
+    
+    if (sscanf(msg->data, "fast:%" SCNu64 ":%ld %n", &message_id, &sent_us, &offset) != 2 ||
+        offset == 0) {
+        return;
+    }
+    
+    char wire[256];
+    protocol_message_t* fack = malloc(sizeof(protocol_message_t));
+    if (fack) {
+        memset(fack, 0, offsetof(protocol_message_t, data));
+        fack->type = MSG_TYPE_DELIVERY_CONFIRM;
+        fack->sender = local_address();
+        strcpy(fack->sender_ip, my_ip);
+        fack->sender_port = my_port;
+        fack->timestamp = time(NULL);
+        snprintf(fack->data, sizeof(fack->data), "fack:%" PRIu64 ":%ld", message_id, sent_us);
+        int len = format_protocol_message(wire, sizeof(wire), fack);
+        send(client_socket, wire, len, MSG_NOSIGNAL);
+        free(fack);
+    }
+    
+    int duplicate = 0;
+    pthread_mutex_lock(&receive_mutex);
+    for (int i = 0; i < RECENT_DELIVERY_IDS; i++) {
+        if (recent_delivery_ids[i] == message_id) {
+            duplicate = 1;
+            break;
+        }
+    }
+    if (!duplicate) {
+        recent_delivery_ids[recent_delivery_pos] = message_id;
+        recent_delivery_pos = (recent_delivery_pos + 1) % RECENT_DELIVERY_IDS;
+    }
+    pthread_mutex_unlock(&receive_mutex);
+    
+    if (!duplicate) {
+        printf("\n[MESSAGE from ");
+        print_othernet_address(&msg->sender);
+        printf("] %s\n> ", msg->data + offset);
+        fflush(stdout);
+    }
 }
 
-time_t calculate_next_retry(held_message_t* msg) {
-    // Exponential backoff: 1min, 2min, 4min, 8min, 16min
-    int delay = 60 * (1 << (msg->attempt_count - 1));
-    if (delay > 960) delay = 960; // Cap at 16 minutes
-    return msg->last_attempt + delay;
+static int compare_longs(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
 }
 
-void print_othernet_address(othernet_address_t* addr) {
-    printf("%u.%u.%u", addr->realm, addr->cluster, addr->node_id);
+// Round trips of the last LATENCY_SAMPLES fast lane messages
+void print_fastlane_latency() {
+    static long samples[LATENCY_SAMPLES];
+    
+    pthread_mutex_lock(&latency_mutex);
+    int count = fastlane_latency_count < LATENCY_SAMPLES ? fastlane_latency_count : LATENCY_SAMPLES;
+    memcpy(samples, fastlane_latency_us, count * sizeof(long));
+    int total = fastlane_latency_count;
+    int fallbacks = fastlane_fallbacks;
+    pthread_mutex_unlock(&latency_mutex);
+    
+    printf("CRASH fast lane (%s): %d acknowledged, %d fell back to the store\n",
+           atomic_load(&fastlane_enabled) ? "on" : "off", total, fallbacks);
+    if (count == 0) return;
+    
+    qsort(samples, count, sizeof(long), compare_longs);
+    printf("  Round trip over the last %d: p50 %ld us, p99 %ld us, max %ld us\n",
+           count, samples[count / 2], samples[(count * 99) / 100], samples[count - 1]);
 }
 
-void print_peers() {
-    pthread_mutex_lock(&peers_mutex);
+// Hot standby. A node given a standby with "standby <ip> <port>" streams
+// every change to the messages it is primary for over one connection:
+// q (queued, with payload), a (attempt bookkeeping), d (delivered) and
+// x (expired or failed). A (re)connect starts with a reset and a snapshot
+// from every shard, then the tail follows; the standby applies events in
+// order as upserts and deletes, so an event that races the snapshot is
+// harmless. The standby acks what it applied, which gives the lag. A
+// primary that drops or moves its standby says stop first. A closed or
+// quiet stream alone proves nothing, so the standby takes over the
+// primary's address and messages only once the failure is certain: the
+// primary said bye, refuses connections on its port, or the operator has
+// fenced it with "standby takeover".
+
+// Shard thread only. Queues the current state of msg for the standby;
+// full includes everything needed to recreate it.
+void standby_note(hold_shard_t* shard, held_message_t* msg, int full) {
+    if (!atomic_load_explicit(&standby_streaming, memory_order_acquire)) return;
+    if (msg->role != HOLD_ROLE_PRIMARY || msg->is_fragment) return;
     
-    printf("Connected peers (%d):\n", peer_count);
-    for (int i = 0; i < peer_count; i++) {
-        if (peers[i].active) {
-            printf("  ");
-            print_othernet_address(&peers[i].address);
-            printf(" at %s:%d (capabilities: ", peers[i].ip, peers[i].port);
-            
-            if (peers[i].capabilities & CAPABILITY_HOLDING) printf("H");
-            if (peers[i].capabilities & CAPABILITY_ROUTING) printf("R");
-            if (peers[i].capabilities & CAPABILITY_GATEWAY) printf("G");
-            printf(")\n");
+    const char* payload = (full && msg->payload) ? payload_data(shard, msg->payload) : "";
+    size_t size = 160 + (full ? msg->payload_len : 0);
+    standby_event_t* event = malloc(sizeof(standby_event_t) + size);
+    if (!event) return;
+    
+    if (msg->status == MSG_STATUS_DELIVERED) {
+        snprintf(event->text, size, "d:%lu", msg->message_id);
+    } else if (msg->status == MSG_STATUS_EXPIRED || msg->status == MSG_STATUS_FAILED) {
+        snprintf(event->text, size, "x:%lu", msg->message_id);
+    } else if (full) {
+        snprintf(event->text, size, "q:%lu:%hu.%hu.%u:%hu.%hu.%u:%d:%ld:%u %s", msg->message_id,
+                 msg->target_address.realm, msg->target_address.cluster, msg->target_address.node_id,
+                 msg->sender_address.realm, msg->sender_address.cluster, msg->sender_address.node_id,
+                 msg->priority, (long)msg->expires_at, msg->attempt_count, payload);
+    } else {
+        snprintf(event->text, size, "a:%lu:%u", msg->message_id, msg->attempt_count);
+    }
+    post_standby_event(event);
+}
+
+void post_standby_event(standby_event_t* event) {
+    standby_event_t* head = atomic_load_explicit(&standby_inbox, memory_order_relaxed);
+    do {
+        event->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&standby_inbox, &head, event,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    uint64_t one = 1;
+    if (write(standby_event_fd, &one, sizeof(one)) < 0) {
+        perror("standby wakeup");
+    }
+}
+
+// Shard thread: every live message we are primary for, for a new stream
+void snapshot_shard_messages(hold_shard_t* shard) {
+    for (int i = 0; i < shard->message_count; i++) {
+        held_message_t* msg = &shard->messages[i];
+        if (msg->status == MSG_STATUS_DELIVERED || msg->status == MSG_STATUS_EXPIRED ||
+            msg->status == MSG_STATUS_FAILED || msg->status == MSG_STATUS_FREE) {
+            continue;
         }
+        standby_note(shard, msg, 1);
     }
+}
+
+// Stream thread only. Writes one event with the next sequence number.
+static int standby_write(int sock, const char* text) {
+    static protocol_message_t frame;
+    static char wire[BUFFER_SIZE];
     
-    pthread_mutex_unlock(&peers_mutex);
+    pthread_mutex_lock(&standby_mutex);
+    uint64_t seq = ++standby_seq_sent;
+    pthread_mutex_unlock(&standby_mutex);
+    memset(&frame, 0, offsetof(protocol_message_t, data));
+    frame.type = MSG_TYPE_HOLD_REQUEST;
+    frame.sender = local_address();
+    strcpy(frame.sender_ip, my_ip);
+    frame.sender_port = my_port;
+    frame.timestamp = time(NULL);
+    snprintf(frame.data, sizeof(frame.data), "stb:%lu:%s", seq, text);
+    standby_sent_us[seq % STANDBY_LAG_RING] = current_time_us();
+    
+    int len = format_protocol_message(wire, sizeof(wire), &frame);
+    int sent = 0;
+    while (sent < len) {
+        ssize_t n = send(sock, wire + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        sent += n;
+    }
+    return 0;
 }
 
-void print_held_messages() {
-    pthread_mutex_lock(&messages_mutex);
+// Stream thread only. Acks carry the last sequence number the standby
+// applied; the time since we sent it is the replication lag.
+static int standby_read_acks(int sock, char* buffer, size_t* buffered) {
+    ssize_t n = recv(sock, buffer + *buffered, FASTLANE_RX_SIZE - 1 - *buffered, 0);
+    if (n <= 0) return -1;
+    *buffered += n;
+    buffer[*buffered] = '\0';
     
-    printf("Held messages (%d):\n", held_message_count);
-    for (int i = 0; i < held_message_count; i++) {
-        held_message_t* msg = &held_messages[i];
-        if (msg->status != MSG_STATUS_DELIVERED) {
-            printf("  ID:%lu Target:", msg->message_id);
-            print_othernet_address(&msg->target_address);
-            printf(" Status:");
-            
-            switch (msg->status) {
-                case MSG_STATUS_QUEUED: printf("QUEUED"); break;
-                case MSG_STATUS_ATTEMPTING: printf("ATTEMPTING"); break;
-                case MSG_STATUS_HELD: printf("HELD"); break;
-                case MSG_STATUS_EXPIRED: printf("EXPIRED"); break;
-                case MSG_STATUS_FAILED: printf("FAILED"); break;
-                default: printf("UNKNOWN"); break;
+    long now_us = current_time_us();
+    char* line = buffer;
+    char* end;
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = '\0';
+        char* ack = strstr(line, " stback:");
+        unsigned long seq;
+        if (ack && sscanf(ack, " stback:%lu", &seq) == 1 && seq <= standby_seq_sent) {
+            pthread_mutex_lock(&standby_mutex);
+            if (seq > standby_seq_acked) {
+                standby_seq_acked = seq;
+                if (standby_seq_sent - seq < STANDBY_LAG_RING) {
+                    standby_lag_us = now_us - standby_sent_us[seq % STANDBY_LAG_RING];
+                    if (standby_lag_us > standby_lag_max_us) standby_lag_max_us = standby_lag_us;
+                }
             }
-            
-            printf(" Attempts:%d Priority:%d\n", 
-                   msg->attempt_count, msg->priority);
-            printf("    Payload: %.50s%s\n", 
-                   msg->payload, strlen(msg->payload) > 50 ? "..." : "");
+            pthread_mutex_unlock(&standby_mutex);
         }
+        line = end + 1;
     }
-    
-    pthread_mutex_unlock(&messages_mutex);
+    *buffered = strlen(line);
+    memmove(buffer, line, *buffered);
+    if (*buffered >= FASTLANE_RX_SIZE - 1) *buffered = 0;
+    return 0;
 }
 
-void remove_peer(const char* ip, int port) {
-    pthread_mutex_lock(&peers_mutex);
-    
-    for (int i = 0; i < peer_count; i++) {
-        if (strcmp(peers[i].ip, ip) == 0 && peers[i].port == port) {
-            peers[i].active = 0;
-            printf("Peer disconnected: ");
-            print_othernet_address(&peers[i].address);
-            printf(" at %s:%d\n", ip, port);
-            
-            // Redistribute any messages held by this node
-            redistribute_held_messages(ip);
-            break;
-        }
+static void free_standby_events(standby_event_t* events) {
+    while (events) {
+        standby_event_t* next = events->next;
+        free(events);
+        events = next;
     }
-    
-    pthread_mutex_unlock(&peers_mutex);
 }
 
-void cleanup_expired_messages() {
-    pthread_mutex_lock(&messages_mutex);
+void* standby_thread(void* arg) {
+    (void)arg;
+    static char acks[FASTLANE_RX_SIZE];
+    size_t buffered = 0;
+    int sock = -1;
+    long last_write_us = 0;
+    long last_connect_us = 0;
     
-    time_t now = time(NULL);
-    int cleaned = 0;
-    
-    for (int i = 0; i < held_message_count; i++) {
-        held_message_t* msg = &held_messages[i];
-        if (now > msg->expires_at && msg->status != MSG_STATUS_DELIVERED) {
-            msg->status = MSG_STATUS_EXPIRED;
-            cleaned++;
+    while (running) {
+        char ip[16];
+        int port;
+        pthread_mutex_lock(&standby_mutex);
+        strcpy(ip, standby_ip);
+        port = standby_port;
+        pthread_mutex_unlock(&standby_mutex);
+        
+        // Changed or switched off: release the old standby, then drop the stream
+        if (sock >= 0 && (port != standby_connected_port || strcmp(ip, standby_connected_ip) != 0)) {
+            atomic_store(&standby_streaming, 0);
+            free_standby_events(atomic_exchange(&standby_inbox, NULL));
+            standby_write(sock, "stop");
+            printf("Stopped streaming to standby %s:%d\n", standby_connected_ip, standby_connected_port);
+            close(sock);
+            sock = -1;
+        }
+        
+        long now_us = current_time_us();
+        if (sock < 0 && port > 0 && now_us - last_connect_us >= 1000000) {
+            last_connect_us = now_us;
+            sock = open_low_latency_connection(ip, port, NULL);
+            if (sock >= 0) {
+                strcpy(standby_connected_ip, ip);
+                standby_connected_port = port;
+                buffered = 0;
+                
+                // Anything queued before now is covered by the snapshot
+                atomic_store(&standby_streaming, 1);
+                free_standby_events(atomic_exchange(&standby_inbox, NULL));
+                char reset[64];
+                snprintf(reset, sizeof(reset), "reset:%u", my_epoch);
+                if (standby_write(sock, reset) == 0) {
+                    printf("Streaming held messages to standby %s:%d\n", ip, port);
+                    shard_work_t* work = new_shard_work(WORK_SNAPSHOT);
+                    if (work) post_all_shards(work);
+                    last_write_us = current_time_us();
+                } else {
+                    atomic_store(&standby_streaming, 0);
+                    close(sock);
+                    sock = -1;
+                }
+            }
+        }
+        
+        struct pollfd fds[2];
+        int nfds = 0;
+        fds[nfds].fd = standby_event_fd;
+        fds[nfds++].events = POLLIN;
+        if (sock >= 0) {
+            fds[nfds].fd = sock;
+            fds[nfds++].events = POLLIN;
+        }
+        poll(fds, nfds, 200);
+        
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(standby_event_fd, &count, sizeof(count)) < 0) {
+                perror("standby wakeup");
+            }
+        }
+        if (sock >= 0 && nfds > 1 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if (standby_read_acks(sock, acks, &buffered) != 0) {
+                printf("Lost the stream to standby %s:%d\n", standby_connected_ip,
+                       standby_connected_port);
+                atomic_store(&standby_streaming, 0);
+                close(sock);
+                sock = -1;
+            }
+        }
+        
+        // In the order the shards produced them
+        standby_event_t* stack = atomic_exchange_explicit(&standby_inbox, NULL, memory_order_acquire);
+        standby_event_t* events = NULL;
+        while (stack) {
+            standby_event_t* next = stack->next;
+            stack->next = events;
+            events = stack;
+            stack = next;
+        }
+        while (events && sock >= 0) {
+            standby_event_t* next = events->next;
+            if (standby_write(sock, events->text) != 0) {
+                atomic_store(&standby_streaming, 0);
+                close(sock);
+                sock = -1;
+            }
+            last_write_us = current_time_us();
+            free(events);
+            events = next;
+        }
+        free_standby_events(events);
+        
+        // Heartbeats keep the standby from taking over while we are idle
+        if (sock >= 0 && current_time_us() - last_write_us >= 1000000) {
+            if (standby_write(sock, "hb") != 0) {
+                atomic_store(&standby_streaming, 0);
+                close(sock);
+                sock = -1;
+            }
+            last_write_us = current_time_us();
         }
     }
     
-    if (cleaned > 0) {
-        printf("Cleaned up %d expired messages\n", cleaned);
+    // A clean shutdown hands our messages to the standby right away
+    if (sock >= 0) {
+        free_standby_events(atomic_exchange(&standby_inbox, NULL));
+        standby_write(sock, "bye");
+        close(sock);
     }
-    
-    pthread_mutex_unlock(&messages_mutex);
+    return NULL;
 }
 
-void redistribute_held_messages(const char* failed_node_ip) {
-    // In a real implementation, this would move messages from
-    // the failed holding node to other available nodes
-    printf("Redistributing messages from failed node: %s\n", failed_node_ip);
+// Caller holds standby_mutex
+static standby_record_t* find_standby_record(uint64_t message_id) {
+    for (int i = 0; i < standby_record_count; i++) {
+        if (standby_records[i].message_id == message_id) return &standby_records[i];
+    }
+    return NULL;
 }
 
-void broadcast_protocol_message(protocol_message_t* msg) {
-    pthread_mutex_lock(&peers_mutex);
+// Caller holds standby_mutex
+static void drop_standby_records() {
+    for (int i = 0; i < standby_record_count; i++) {
+        free(standby_records[i].payload);
+    }
+    standby_record_count = 0;
+}
+
+// Standby side: applies one event of a primary's stream
+void handle_standby_frame(protocol_message_t* msg, const char* from_ip) {
+    unsigned long seq;
+    int offset = 0;
+    if (sscanf(msg->data, "stb:%lu:%n", &seq, &offset) != 1 || offset == 0) return;
+    const char* event = msg->data + offset;
+    int take_over = 0;
     
-    for (int i = 0; i < peer_count; i++) {
-        if (peers[i].active) {
-            send_protocol_message(peers[i].ip, peers[i].port, msg);
+    pthread_mutex_lock(&standby_mutex);
+    if (strncmp(event, "reset:", 6) == 0) {
+        drop_standby_records();
+        standby_primary = msg->sender;
+        strcpy(standby_primary_ip, from_ip);
+        standby_primary_port = msg->sender_port;
+        standby_following = 1;
+        printf("Standing by for ");
+        print_othernet_address(&msg->sender);
+        printf(" at %s:%d\n", from_ip, msg->sender_port);
+    }
+    
+    if (standby_following && addresses_equal(&msg->sender, &standby_primary)) {
+        standby_last_heard = time(NULL);
+        standby_applied_seq = seq;
+        
+        uint64_t message_id;
+        unsigned int attempts;
+        standby_record_t record;
+        int payload_offset = 0;
+        memset(&record, 0, sizeof(record));
+        
+        if (sscanf(event, "q:%lu:%hu.%hu.%u:%hu.%hu.%u:%d:%ld:%u %n", &record.message_id,
+                   &record.target.realm, &record.target.cluster, &record.target.node_id,
+                   &record.sender.realm, &record.sender.cluster, &record.sender.node_id,
+                   &record.priority, &record.expires_at, &record.attempts, &payload_offset) == 10 &&
+            payload_offset > 0) {
+            standby_record_t* held = find_standby_record(record.message_id);
+            if (!held && standby_record_count < MAX_HELD_MESSAGES) {
+                held = &standby_records[standby_record_count++];
+                held->payload = NULL;
+            }
+            if (held) {
+                char* payload = strdup(event + payload_offset);
+                if (payload) {
+                    free(held->payload);
+                    record.payload = payload;
+                    *held = record;
+                }
+            }
+        } else if (sscanf(event, "a:%lu:%u", &message_id, &attempts) == 2) {
+            standby_record_t* held = find_standby_record(message_id);
+            if (held) held->attempts = attempts;
+        } else if (sscanf(event, "d:%lu", &message_id) == 1 ||
+                   sscanf(event, "x:%lu", &message_id) == 1) {
+            standby_record_t* held = find_standby_record(message_id);
+            if (held) {
+                free(held->payload);
+                *held = standby_records[--standby_record_count];
+            }
+        } else if (strcmp(event, "bye") == 0) {
+            take_over = 1;
+        } else if (strcmp(event, "stop") == 0) {
+            standby_following = 0;
+            drop_standby_records();
+            printf("No longer standing by for ");
+            print_othernet_address(&msg->sender);
+            printf(": it stopped streaming to us\n");
         }
     }
+    pthread_mutex_unlock(&standby_mutex);
     
-    pthread_mutex_unlock(&peers_mutex);
+    if (take_over) standby_take_over("shut down");
 }
 
-void announce_presence() {
-    protocol_message_t announcement;
-    announcement.type = MSG_TYPE_HELLO;
-    announcement.sender = my_address;
-    strcpy(announcement.sender_ip, my_ip);
-    announcement.sender_port = my_port;
-    announcement.scope.realm = 0;  // Announce to all realms
-    announcement.scope.cluster = 0;
-    announcement.scope.max_hops = 8;
-    announcement.ttl = 8;
-    announcement.timestamp = time(NULL);
-    snprintf(announcement.data, sizeof(announcement.data), 
-             "capabilities:%u load:%.2f", my_capabilities, 
-             (float)held_message_count / MAX_HELD_MESSAGES);
+// Standby side, after a batch: tell the primary how far we got
+void send_standby_ack(int client_socket) {
+    char wire[256];
+    protocol_message_t* ack = malloc(sizeof(protocol_message_t));
+    if (!ack) return;
     
-    broadcast_protocol_message(&announcement);
+    memset(ack, 0, offsetof(protocol_message_t, data));
+    ack->type = MSG_TYPE_HOLD_RESPONSE;
+    ack->sender = local_address();
+    strcpy(ack->sender_ip, my_ip);
+    ack->sender_port = my_port;
+    ack->timestamp = time(NULL);
+    pthread_mutex_lock(&standby_mutex);
+    snprintf(ack->data, sizeof(ack->data), "stback:%lu", standby_applied_seq);
+    pthread_mutex_unlock(&standby_mutex);
+    
+    int len = format_protocol_message(wire, sizeof(wire), ack);
+    send(client_socket, wire, len, MSG_NOSIGNAL);
+    free(ack);
 }
 
-void send_capability_update() {
-    protocol_message_t update;
-    update.type = MSG_TYPE_CAPABILITY_UPDATE;
-    update.sender = my_address;
-    strcpy(update.sender_ip, my_ip);
-    update.sender_port = my_port;
-    update.timestamp = time(NULL);
+// Maintenance thread. 1 if the primary refused a connection to its own
+// port, which only happens once its process is gone; 0 if it accepted one,
+// and -1 if we could not reach it, which a partition looks like too.
+static int primary_refuses(const char* ip, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct timeval timeout = { STANDBY_PROBE_TIMEOUT, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
     
-    float load = (float)held_message_count / MAX_HELD_MESSAGES;
-    snprintf(update.data, sizeof(update.data), 
-             "capabilities:%u load:%.2f uptime:%ld", 
-             my_capabilities, load, time(NULL));
+    struct sockaddr_in primary_addr;
+    memset(&primary_addr, 0, sizeof(primary_addr));
+    primary_addr.sin_family = AF_INET;
+    primary_addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &primary_addr.sin_addr);
     
-    broadcast_protocol_message(&update);
+    int result = 0;
+    if (connect(sock, (struct sockaddr*)&primary_addr, sizeof(primary_addr)) != 0) {
+        result = (errno == ECONNREFUSED) ? 1 : -1;
+    }
+    close(sock);
+    return result;
 }
 
-peer_t* find_best_holding_node(othernet_address_t* target) {
-    peer_t* best = NULL;
-    float best_score = 1000.0;  // Lower is better
+// Maintenance thread: a primary silent for STANDBY_TIMEOUT is checked on.
+// Still accepting connections, it is alive and we let it go; it resets us
+// if it still wants us. Unreachable, it may be partitioned from us alone,
+// so we keep waiting for it, a bye, or the operator.
+void check_standby_failover() {
+    static int reported = 0;
+    char ip[16];
+    int port;
+    int silent;
     
-    pthread_mutex_lock(&peers_mutex);
+    pthread_mutex_lock(&standby_mutex);
+    silent = standby_following && time(NULL) - standby_last_heard > STANDBY_TIMEOUT;
+    strcpy(ip, standby_primary_ip);
+    port = standby_primary_port;
+    pthread_mutex_unlock(&standby_mutex);
+    if (!silent) {
+        reported = 0;
+        return;
+    }
     
-    for (int i = 0; i < peer_count; i++) {
-        if (peers[i].active && (peers[i].capabilities & CAPABILITY_HOLDING)) {
-            // Calculate score based on load factor and network distance
-            float score = peers[i].load_factor;
-            
-            // Prefer nodes in same realm/cluster (simplified distance calculation)
-            if (peers[i].address.realm != target->realm) score += 0.5;
-            if (peers[i].address.cluster != target->cluster) score += 0.2;
-            
-            if (score < best_score) {
-                best_score = score;
-                best = &peers[i];
-            }
+    int refused = primary_refuses(ip, port);
+    if (refused > 0) {
+        standby_take_over("refuses connections");
+    } else if (refused == 0) {
+        pthread_mutex_lock(&standby_mutex);
+        if (standby_following && time(NULL) - standby_last_heard > STANDBY_TIMEOUT) {
+            standby_following = 0;
+            drop_standby_records();
+            printf("Primary at %s:%d went quiet but is up: no longer standing by\n", ip, port);
+        }
+        pthread_mutex_unlock(&standby_mutex);
+    } else if (!reported) {
+        reported = 1;
+        printf("Primary at %s:%d went quiet and cannot be reached; "
+               "\"standby takeover\" once it is known to be down\n", ip, port);
+    }
+}
+
+// Becomes the primary: its messages go into our shards as ours to
+// deliver, under their original ids, and we announce ourselves under its
+// address so peers send its traffic here. Peers know one address per
+// endpoint, so ours is given up for good rather than kept alongside.
+void standby_take_over(const char* why) {
+    int taken = 0;
+    othernet_address_t primary;
+    
+    pthread_mutex_lock(&standby_mutex);
+    if (!standby_following) {
+        pthread_mutex_unlock(&standby_mutex);
+        return;
+    }
+    standby_following = 0;
+    primary = standby_primary;
+    
+    for (int i = 0; i < standby_record_count; i++) {
+        standby_record_t* record = &standby_records[i];
+        shard_work_t* work = new_shard_work(WORK_HOLD);
+        shared_payload_t* payload = new_shared_payload(record->payload, strlen(record->payload), 1);
+        if (!work || !payload) {
+            if (work) free_shard_work(work);
+            release_shared_payload(payload);
+            continue;
         }
+        work->message_id = record->message_id;
+        work->target = record->target;
+        work->sender = record->sender;
+        work->priority = record->priority;
+        work->expires_at = record->expires_at;
+        work->role = 'p';
+        strcpy(work->ip, my_ip);
+        work->port = my_port;
+        work->payload = payload;
+        post_shard_work(shard_for(&record->target), work);
+        taken++;
     }
+    drop_standby_records();
+    pthread_mutex_unlock(&standby_mutex);
     
+    printf("Primary ");
+    print_othernet_address(&primary);
+    printf(" %s: taking over its address and %d held messages\n", why, taken);
+    
+    pthread_mutex_lock(&address_mutex);
+    my_address = primary;
+    pthread_mutex_unlock(&address_mutex);
+    pthread_mutex_lock(&peers_mutex);
+    rebuild_holding_ring();
     pthread_mutex_unlock(&peers_mutex);
-    return best;
+    
+    protocol_message_t* hello = malloc(sizeof(protocol_message_t));
+    if (!hello) return;
+    memset(hello, 0, offsetof(protocol_message_t, data));
+    hello->type = MSG_TYPE_HELLO;
+    hello->sender = local_address();
+    strcpy(hello->sender_ip, my_ip);
+    hello->sender_port = my_port;
+    hello->timestamp = time(NULL);
+    char topics[TOPIC_FILTER_HEX];
+    format_topic_filter(topics);
+    snprintf(hello->data, sizeof(hello->data), "capabilities:%u topics:%s", my_capabilities, topics);
+    broadcast_protocol_message(hello);
+    free(hello);
+    
+    announce_presence(primary.realm, primary.cluster, DISCOVERY_HOPS);
+}
+
+void print_standby_status() {
+    pthread_mutex_lock(&standby_mutex);
+    if (standby_port > 0) {
+        printf("Standby %s:%d (%s): %lu events sent, %lu applied, lag %.1f ms (max %.1f ms)\n",
+               standby_ip, standby_port,
+               atomic_load(&standby_streaming) ? "streaming" : "not connected",
+               standby_seq_sent, standby_seq_acked,
+               standby_lag_us / 1000.0, standby_lag_max_us / 1000.0);
+    } else {
+        printf("No standby configured\n");
+    }
+    if (standby_following) {
+        printf("Standing by for ");
+        print_othernet_address(&standby_primary);
+        printf(" at %s:%d: %d messages, last heard %lds ago\n", standby_primary_ip,
+               standby_primary_port, standby_record_count, (long)(time(NULL) - standby_last_heard));
+    }
+    pthread_mutex_unlock(&standby_mutex);
 }
 
 void cleanup() {
@@ -773,8 +6079,9 @@ void cleanup() {
     
     // Send goodbye to all peers
     protocol_message_t goodbye;
+    memset(&goodbye, 0, offsetof(protocol_message_t, data));
     goodbye.type = MSG_TYPE_GOODBYE;
-    goodbye.sender = my_address;
+    goodbye.sender = local_address();
     strcpy(goodbye.sender_ip, my_ip);
     goodbye.sender_port = my_port;
     goodbye.timestamp = time(NULL);
@@ -783,15 +6090,207 @@ void cleanup() {
     broadcast_protocol_message(&goodbye);
     
     if (server_socket >= 0) {
+        shutdown(server_socket, SHUT_RDWR);
         close(server_socket);
     }
     
-    // Clean up any remaining held messages
-    pthread_mutex_lock(&messages_mutex);
-    printf("Had %d held messages at shutdown\n", held_message_count);
-    pthread_mutex_unlock(&messages_mutex);
+    // Wake the delivery workers and shards so they can exit
+    pthread_mutex_lock(&job_queue_mutex);
+    pthread_cond_broadcast(&job_queue_cond);
+    pthread_mutex_unlock(&job_queue_mutex);
+    for (int i = 0; i < hold_shard_count; i++) {
+        kick_shard(&hold_shards[i]);
+    }
+    uint64_t one = 1;
+    if (write(fastlane_event_fd, &one, sizeof(one)) < 0) {
+        perror("fast lane wakeup");
+    }
+    if (write(standby_event_fd, &one, sizeof(one)) < 0) {
+        perror("standby wakeup");
+    }
+    
+    printf("Had %d held messages at shutdown\n", atomic_load(&held_message_count));
 }
 
 void signal_handler(int sig) {
     printf("\nReceived signal %d, shutting down...\n", sig);
-    running = 0;
\ No newline at end of file
+    running = 0;
+}
+
+// Self-check (othernet_node --check): the erasure code, the payload arena,
+// record reuse and the delivery window index, run on scratch shards
+// without starting any threads. Returns the exit status.
+static int check_failures = 0;
+
+static void check(int ok, const char* what) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    if (!ok) check_failures++;
+}
+
+// Every k of the k+m fragments rebuild the data, for every k and m allowed
+static void check_erasure_code() {
+    uint8_t (*coded)[ERASURE_MAX_SHARD] = malloc(ERASURE_MAX_SHARDS * sizeof(*coded));
+    uint8_t (*given)[ERASURE_MAX_SHARD] = malloc(ERASURE_MAX_SHARDS * sizeof(*coded));
+    uint8_t data[ERASURE_MAX_SHARDS * 64], out[sizeof(data)];
+    if (!coded || !given) {
+        check(0, "erasure code scratch");
+        free(coded);
+        free(given);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t)(i * 131 + 7);
+    
+    long subsets = 0;
+    int bad = 0;
+    for (int k = 2; k < ERASURE_MAX_SHARDS; k++) {
+        for (int m = 1; k + m <= ERASURE_MAX_SHARDS; m++) {
+            size_t len = 40 * k + 3;
+            size_t shard_size = (len + k - 1) / k;
+            rs_encode(data, len, k, m, coded, shard_size);
+            
+            for (uint32_t present = 0; present < (1u << (k + m)); present++) {
+                if (__builtin_popcount(present) != k) continue;
+                for (int f = 0; f < k + m; f++) {
+                    if (present & (1u << f)) memcpy(given[f], coded[f], shard_size);
+                    else memset(given[f], 0xA5, shard_size);
+                }
+                memset(out, 0, len);
+                if (rs_decode(given, present, k, m, shard_size, out, len) != 0 ||
+                    memcmp(out, data, len) != 0) {
+                    bad++;
+                }
+                subsets++;
+            }
+            if (rs_decode(coded, (1u << (k - 1)) - 1, k, m, shard_size, out, len) != -1) bad++;
+        }
+    }
+    
+    char what[96];
+    snprintf(what, sizeof(what), "erasure code: %ld k-subsets decoded, %d wrong", subsets, bad);
+    check(bad == 0, what);
+    free(coded);
+    free(given);
+}
+
+// Blocks of every class come back intact, binary bytes included, and a
+// freed block is the next one handed out
+static void check_payload_arena(hold_shard_t* shard) {
+    static char data[MAX_PAYLOAD];
+    size_t sizes[] = { 1, 15, 16, 255, 256, 4000, 40000, MAX_PAYLOAD };
+    int ok = 1;
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (char)(i * 7);
+    
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t len = sizes[i];
+        uint32_t handle = payload_store(shard, data, len);
+        ok &= handle != 0 && memcmp(payload_data(shard, handle), data, len) == 0 &&
+              payload_data(shard, handle)[len] == '\0';
+        
+        // A shared block survives until its last holder lets go
+        payload_retain(shard, handle);
+        payload_release(shard, handle);
+        ok &= memcmp(payload_data(shard, handle), data, len) == 0;
+        payload_release(shard, handle);
+        
+        uint32_t again = payload_store(shard, data, len);
+        ok &= again == handle;
+        payload_release(shard, again);
+    }
+    ok &= payload_store(shard, data, MAX_PAYLOAD + 1) == 0;
+    
+    uint32_t in_use = 0;
+    for (int cls = 0; cls < PAYLOAD_CLASSES; cls++) in_use += shard->payload_classes[cls].in_use;
+    ok &= in_use == 0;
+    check(ok, "payload arena: store, share, release and reuse");
+}
+
+// A shard holds far more messages over its life than it has records, and
+// still refuses a copy of one it delivered
+static void check_held_records(hold_shard_t* shard) {
+    int before = atomic_load(&held_message_count);
+    int held = 0;
+    for (int i = 0; i < 3 * MAX_HELD_MESSAGES; i++) {
+        held_message_t* msg = claim_held_message(shard);
+        if (!msg) break;
+        msg->message_id = i + 1;
+        msg->payload = payload_store(shard, "held", 4);
+        msg->status = MSG_STATUS_DELIVERED;
+        free_held_message(shard, msg);
+        held++;
+    }
+    char what[96];
+    snprintf(what, sizeof(what), "held records: %d messages through %d records", held,
+             shard->message_capacity);
+    check(held == 3 * MAX_HELD_MESSAGES && atomic_load(&held_message_count) == before, what);
+    
+    shard_work_t* work = new_shard_work(WORK_HOLD);
+    work->payload = new_shared_payload("late copy", 9, 1);
+    work->message_id = held;
+    work->role = 'r';
+    apply_hold_request(shard, work);
+    free_shard_work(work);
+    check(atomic_load(&held_message_count) == before, "held records: late copy of a delivered message refused");
+}
+
+// The base is the lowest number still owed, through finished messages,
+// compaction of the pending run and eviction of the window
+static void check_delivery_window(hold_shard_t* shard) {
+    othernet_address_t target = { 1, 1, 77 };
+    delivery_window_t* window = get_delivery_window(shard, &target);
+    held_message_t* first = claim_held_message(shard);
+    int ok = window != NULL && first != NULL;
+    if (!ok) {
+        check(0, "delivery window: scratch window");
+        return;
+    }
+    
+    first->target_address = target;
+    first->status = MSG_STATUS_QUEUED;
+    format_delivery_frame(shard, first, window, 0, shard->frame);
+    uint32_t first_seq = first->seq;
+    
+    // The first message stays owed while many others come and go
+    for (int i = 0; i < 5 * shard->message_capacity; i++) {
+        held_message_t* msg = claim_held_message(shard);
+        msg->target_address = target;
+        msg->status = MSG_STATUS_QUEUED;
+        format_delivery_frame(shard, msg, window, 0, shard->frame);
+        ok &= delivery_window_base(shard, window) == first_seq;
+        msg->status = MSG_STATUS_DELIVERED;
+        free_held_message(shard, msg);
+    }
+    
+    held_message_t* second = claim_held_message(shard);
+    second->target_address = target;
+    second->status = MSG_STATUS_QUEUED;
+    format_delivery_frame(shard, second, window, 0, shard->frame);
+    first->status = MSG_STATUS_DELIVERED;
+    ok &= delivery_window_base(shard, window) == second->seq;
+    
+    // A new window for the target starts from what is still owed
+    window->active = 0;
+    window = get_delivery_window(shard, &target);
+    ok &= window && delivery_window_base(shard, window) == second->seq;
+    
+    second->status = MSG_STATUS_DELIVERED;
+    ok &= window && delivery_window_base(shard, window) == window->next_seq + 1;
+    check(ok, "delivery window: base follows the oldest message still owed");
+}
+
+int run_self_check() {
+    hold_shard_t* shard = calloc(1, sizeof(hold_shard_t));
+    hold_shard_t* small = calloc(1, sizeof(hold_shard_t));
+    if (!shard || !small || init_hold_shard(shard, 0, MAX_HELD_MESSAGES) != 0 ||
+        init_hold_shard(small, 1, 8) != 0) {
+        fprintf(stderr, "No memory for check shards\n");
+        return 1;
+    }
+    
+    check_erasure_code();
+    check_payload_arena(shard);
+    check_held_records(small);
+    check_delivery_window(small);
+    
+    printf("%s\n", check_failures ? "Self-check failed" : "Self-check passed");
+    return check_failures ? 1 : 0;
+}